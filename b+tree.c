@@ -24,13 +24,41 @@
 #include <stdio.h>
 
 #define USE_MMAP_ANON
-#ifdef USE_MMAP_ANON
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * static tracepoints (USDT) at structural changes, so perf or bpftrace can watch splits
+ * and merges live. Compiled to nothing unless the platform provides <sys/sdt.h>, or if
+ * BPLUS_NO_SDT is defined (make SDT=0). Every probe has arguments (depth, key, occupancy):
+ * the depth of the node involved (leaves are at the tree's depth), a key identifying where
+ * in the key space, and the number of keys in the node afterwards.
+ */
+#if !defined(BPLUS_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE(name, depth, key, occupancy) \
+	DTRACE_PROBE3(bplus_tree, name, (unsigned)(depth), (lkey_t)(key), (unsigned)(occupancy))
+#endif
+#endif
+#ifndef TRACE
+#define TRACE(name, depth, key, occupancy) do { } while (0)
+#endif
+
+/* vector kernels are cloned for AVX2 where the compiler can choose between builds at load time */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
 #endif
 
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 #include "b+tree.h"
 
 /* blocks are the size of one page, or 512 64-bit words in memory. */
@@ -67,8 +95,18 @@ static inline void wrdmove(union word *d, union word *s, unsigned nw)
 
 typedef struct block * blkp;
 
-/* layout of block, with max 255 keys, 256 children or 255 values, min keys = 128 */
-static const int ORDER = 256; /* max children of node (max keys is one less) */
+/*
+ * layout of block, with max 255 keys, 256 children or 255 values, min keys = 128. Building with
+ * -DBPLUS_ORDER=8 uses only the start of each half of a block, so that tests reach deep trees
+ * and every case of splits and merges with a few thousand records.
+ */
+#ifndef BPLUS_ORDER
+#define BPLUS_ORDER 256
+#endif
+#if BPLUS_ORDER < 4 || BPLUS_ORDER > 256 || BPLUS_ORDER % 2 != 0
+#error "BPLUS_ORDER must be even, from 4 to 256"
+#endif
+static const int ORDER = BPLUS_ORDER; /* max children of node (max keys is one less) */
 static const unsigned LHALF = ORDER/2;/* after split, left half of node children plus 1 stay put */
 static const unsigned RHALF = ORDER/2; /* after split, right half of node has this many children  */
 
@@ -86,45 +124,66 @@ enum {
 #define PAGESIZE (1UL << PAGE_BITS)
 #define PAGE_ALIGNED_SIZE(n) ((n + (PAGESIZE - 1)) & ~(PAGESIZE - 1))
 
-static inline blkp alloc_page_for_block(void)
+/*
+ * A block is one page, followed by npages - 1 more pages of annotations if the tree keeps
+ * any (see struct bplus). Word i of an annotation page annotates word i of the block.
+ */
+static inline blkp alloc_page_for_block(unsigned npages)
 {
 #ifdef USE_MMAP_ANON
-	return (blkp) mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE,
-			   MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE,
-			   -1, 0);
+	void *p = mmap(NULL, npages * PAGESIZE, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE,
+		       -1, 0);
+	return p != MAP_FAILED ? (blkp) p : NULL;
 #else
-	return (blkp) aligned_alloc(PAGESIZE, PAGE_ALIGNED_SIZE(sizeof(struct block)));
+	return (blkp) aligned_alloc(PAGESIZE, npages * PAGE_ALIGNED_SIZE(sizeof(struct block)));
 #endif
 }
 
-static inline void free_page_for_block(blkp b)
+static inline void free_page_for_block(blkp b, unsigned npages)
 {
 #ifdef USE_MMAP_ANON
-	munmap(b, PAGESIZE);
+	munmap(b, npages * PAGESIZE);
 #else
 	free(b);
 #endif
 }
 
-static inline blkp new_index_block(void)
-{
-	return alloc_page_for_block();
-}
+/*
+ * blocks of a tree in a shared memory segment (see bplus_shared_create()) are carved out
+ * of the segment, and freed ones are kept on a list for reuse, since nothing can be
+ * returned to the system without the segment changing size under other processes.
+ */
+struct bplus_arena {
+	char *base;/* segment start, at the same address in every process mapping it */
+	unsigned long size;/* bytes in the segment */
+	unsigned long used;/* bytes from base handed out */
+	blkp free_blocks;/* blocks freed, linked through their first field */
+	unsigned long num_free;/* blocks on free_blocks */
+};
 
-static inline blkp new_leaf_block(void)
+static blkp arena_alloc(struct bplus_arena *a, unsigned npages)
 {
-	return alloc_page_for_block();
+	blkp blk = a->free_blocks;
+	if (blk != NULL) {
+		a->free_blocks = blk->words[FIELD_0].child;
+		a->num_free -= 1;
+		return blk;
+	}
+	if (a->size - a->used < npages * PAGESIZE)
+		return NULL;
+	blk = (blkp)(a->base + a->used);
+	a->used += npages * PAGESIZE;
+	return blk;
 }
 
-static inline void free_index_block(blkp b)
+static void arena_free(struct bplus_arena *a, blkp blk)
 {
-	free_page_for_block(b);
+	blk->words[FIELD_0].child = a->free_blocks;
+	a->free_blocks = blk;
+	a->num_free += 1;
 }
 
-static inline void free_leaf_block(blkp b)
-{
-	free_page_for_block(b);
-}
 
 
 /* block accessor functions */
@@ -193,7 +252,37 @@ struct path_node {
 	 unsigned pos;/* index of path child to split node after */
 	 blkp split;/* new node allocated to split full node into */
  };
+
+/*
+ * With deferred splits, a node split whose parent is full does not split the parent at
+ * once. Until its separator is posted into the parent, the new right node is reached
+ * from the node it split off from: keys >= key under left are found under right.
+ */
+struct pending_split {
+	unsigned depth;/* depth of the parent the separator is to be posted into */
+	blkp left;/* node that was split */
+	lkey_t key;/* separator, the lowest key under right */
+	blkp right;/* new node holding the upper part of left's keys */
+};
+
+/* most splits that can wait, and how many waiting make each insert finish one */
+#define PENDING_MAX 32
+#define PENDING_DRAIN 8
  
+/* sampled access counters of one leaf */
+struct heat_slot {
+	blkp leaf;/* leaf counted here, or NULL if slot is free */
+	unsigned long reads;
+	unsigned long writes;
+};
+
+/* optional sampled access tracker, a hash table of counters keyed by leaf */
+struct heatmap {
+	unsigned sample_shift;/* one access in 2**sample_shift is counted */
+	unsigned slot_bits;/* table has 2**slot_bits slots */
+	struct heat_slot slots[];
+};
+
 /* b+ tree object */
 struct bplus {
 	blkp root;/* current root of index tree */
@@ -206,6 +295,26 @@ struct bplus {
 	unsigned path_length;/* length of allocated path array, must be >= depth */
 	struct path_node *path;/* holds path traversed to current index depth */
 	blkp new_root;/* to hold a new root block for splitting root */
+	struct heatmap *heat;/* access tracker, if enabled */
+	int tearing_down;/* free_bplus_tree_step() has begun freeing the tree */
+	int td_walking;/* during teardown, emptying the subtree whose top is at td_base */
+	unsigned td_top;/* during teardown, depth of the deepest index node on the path */
+	unsigned td_base;/* during teardown, depth of the top of the subtree being emptied */
+	unsigned flags;/* BPLUS_ options the tree was created with */
+	unsigned npending;/* splits waiting to be posted into their parents */
+	struct pending_split pending[PENDING_MAX];
+	unsigned block_pages;/* pages per block, the block's own and one per kind of annotation */
+	unsigned ttl_page;/* if not 0, annotation page of record expiry times (see bplus_insert_ttl) */
+	unsigned hash_page;/* if not 0, annotation page whose header word holds the block's subtree hash */
+	unsigned zone_page;/* if not 0, annotation page holding bounds on the values under the block */
+	unsigned tag_page;/* if not 0, annotation page of amounts added to children by bplus_range_add() */
+	int tags;/* bplus_range_add() has tagged children, which may not all be pushed down yet */
+	unsigned long tag_epoch;/* counts changes to tags, so cursors know when to add them up again */
+	unsigned long now;/* current time, records expiring at or before it are hidden */
+	blkp reserve;/* blocks set aside by bplus_write_batch() or bplus_split(), taken before allocating */
+	struct bplus_cdc *cdc;/* change feed the tree's writes are published to, if any */
+	struct bplus_index *index;/* secondary index kept in step with the tree's writes, if any */
+	struct bplus_arena *arena;/* if not NULL, the tree is in shared memory and its blocks come from here */
 };
 
 struct bplus_cursor {
@@ -214,8 +323,337 @@ struct bplus_cursor {
 	blkp leaf;/* leaf containing current record */
 	unsigned pos;/* index of current record in leaf */
 	unsigned invalid;/* set if record at cursor was deleted, but next_cursor will still work */
+	blkp delta_leaf;/* leaf whose tags were last added up, or NULL */
+	unsigned long delta_epoch;/* tree's tag_epoch when they were */
+	value_t delta;/* the sum of the tags above delta_leaf */
 };
 
+static inline blkp alloc_block(bplus_t b)
+{
+	if (b->arena != NULL)
+		return arena_alloc(b->arena, b->block_pages);
+	return alloc_page_for_block(b->block_pages);
+}
+
+static inline void free_block(bplus_t b, blkp blk)
+{
+	if (b->arena != NULL)
+		arena_free(b->arena, blk);
+	else
+		free_page_for_block(blk, b->block_pages);
+}
+
+/* a block set aside for the tree, if any, else a newly allocated one */
+static inline blkp take_block(bplus_t b)
+{
+	blkp blk = b->reserve;
+	if (blk == NULL)
+		return alloc_block(b);
+	b->reserve = blk->words[FIELD_0].child;
+	blk->words[FIELD_0].child = NULL;
+	return blk;
+}
+
+/* set blk aside for the tree, to be taken again before anything is allocated */
+static inline void keep_block(bplus_t b, blkp blk)
+{
+	blk->words[FIELD_0].child = b->reserve;
+	b->reserve = blk;
+}
+
+/* set aside n newly allocated blocks for the tree */
+static enum bplus_error reserve_blocks(bplus_t b, unsigned long n)
+{
+	for (unsigned long j = 0; j < n; j++) {
+		blkp blk = alloc_block(b);
+		if (blk == NULL)
+			return NOMEM;
+		keep_block(b, blk);
+	}
+	return OK;
+}
+
+/* free the blocks set aside that were not used */
+static void release_reserve(bplus_t b)
+{
+	while (b->reserve != NULL) {
+		blkp blk = b->reserve;
+		b->reserve = blk->words[FIELD_0].child;
+		free_block(b, blk);
+	}
+}
+
+static inline blkp new_index_block(bplus_t b)
+{
+	return take_block(b);
+}
+
+static inline blkp new_leaf_block(bplus_t b)
+{
+	return take_block(b);
+}
+
+static inline void free_index_block(bplus_t b, blkp blk)
+{
+	free_block(b, blk);
+}
+
+static inline void free_leaf_block(bplus_t b, blkp blk)
+{
+	free_block(b, blk);
+}
+
+/*
+ * move n fields (values in a leaf, children in an index node) from s at si to d at di,
+ * together with their annotations. The ranges may overlap.
+ */
+static inline void fldmove(bplus_t b, blkp d, unsigned di, blkp s, unsigned si, unsigned n)
+{
+	for (unsigned p = 0; p < b->block_pages; p++)
+		wrdmove(d[p].words + FIELD_0 + di, s[p].words + FIELD_0 + si, n);
+}
+
+/* copy the annotations of field si of s to field di of d */
+static inline void fldnote(bplus_t b, blkp d, unsigned di, blkp s, unsigned si)
+{
+	for (unsigned p = 1; p < b->block_pages; p++)
+		d[p].words[FIELD_0 + di] = s[p].words[FIELD_0 + si];
+}
+
+/*
+ * With expiry times, each leaf value is annotated with the time its record expires, and
+ * each index node child with a lower bound on the expiry times in its subtree, so expired
+ * records can be found without looking at every leaf. Bounds are only lowered as records
+ * come and go, and made exact again when the sweeper finds nothing expired under them.
+ */
+#define NEVER (~0UL)
+
+static inline unsigned long get_expiry(bplus_t b, blkp blk, unsigned i)
+{
+	return blk[b->ttl_page].words[FIELD_0 + i].value;
+}
+
+static inline void set_expiry(bplus_t b, blkp blk, unsigned i, unsigned long e)
+{
+	blk[b->ttl_page].words[FIELD_0 + i].value = e;
+}
+
+/* record i of leaf has expired */
+static inline int expired(bplus_t b, blkp leaf, unsigned i)
+{
+	return b->ttl_page != 0 && get_expiry(b, leaf, i) <= b->now;
+}
+
+/* records moved into child to of parent from its child from, so to's bound must cover from's */
+static inline void merge_expiry(bplus_t b, blkp parent, unsigned to, unsigned from)
+{
+	if (b->ttl_page != 0 && get_expiry(b, parent, from) < get_expiry(b, parent, to))
+		set_expiry(b, parent, to, get_expiry(b, parent, from));
+}
+
+/* earliest expiry in node, over its records if a leaf, or its children's bounds if not */
+static unsigned long min_expiry(bplus_t b, blkp node, int leaf)
+{
+	unsigned long e = NEVER;
+	unsigned n = num_keys(node) + (leaf ? 0 : 1);
+	for (unsigned i = 0; i < n; i++)
+		if (get_expiry(b, node, i) < e)
+			e = get_expiry(b, node, i);
+	return e;
+}
+
+/*
+ * With subtree hashes, the header word of a block's hash page holds the sum of the hashes of
+ * the records under it. A sum does not depend on how the records are spread over nodes, so a
+ * changed record adds the difference to each node on its path, a split or rotation recomputes
+ * or adjusts just the nodes it moves records between, and a merge adds one sum to the other.
+ * A node's sum covers the nodes split off its descendants that are still pending, but not
+ * those split off itself.
+ */
+static inline unsigned long mix64(unsigned long x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9UL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBUL;
+	return x ^ (x >> 31);
+}
+
+static inline unsigned long record_hash(lkey_t k, value_t v)
+{
+	return mix64(mix64(k + 0x9E3779B97F4A7C15UL) + v);
+}
+
+static inline unsigned long get_hash(bplus_t b, blkp blk)
+{
+	return blk[b->hash_page].words[HEADER].value;
+}
+
+static inline void set_hash(bplus_t b, blkp blk, unsigned long h)
+{
+	blk[b->hash_page].words[HEADER].value = h;
+}
+
+/* hash h moved from node from to its peer to */
+static inline void move_hash(bplus_t b, blkp to, blkp from, unsigned long h)
+{
+	if (b->hash_page != 0) {
+		set_hash(b, to, get_hash(b, to) + h);
+		set_hash(b, from, get_hash(b, from) - h);
+	}
+}
+
+/* sum of hashes of the records n, and of those in nodes split off it still pending */
+static unsigned long subtree_hash(bplus_t b, blkp n)
+{
+	unsigned long h = get_hash(b, n);
+	for (unsigned i = 0; i < b->npending; i++)
+		if (b->pending[i].left == n)
+			h += subtree_hash(b, b->pending[i].right);
+	return h;
+}
+
+/* recompute the hash of node, from its records if a leaf, or its children's if not */
+static void rehash(bplus_t b, blkp node, int leaf)
+{
+	unsigned long h = 0;
+	if (b->hash_page == 0)
+		return;
+	if (leaf)
+		for (unsigned i = 0; i < num_keys(node); i++)
+			h += record_hash(get_key(node, i), get_value(node, i));
+	else
+		for (unsigned i = 0; i <= num_keys(node); i++)
+			h += subtree_hash(b, get_child(node, i));
+	set_hash(b, node, h);
+}
+
+/* add delta to the hashes of leaf and the path to it, as recorded by find_leaf() */
+static void hash_path(bplus_t b, blkp leaf, unsigned long delta)
+{
+	if (b->hash_page == 0)
+		return;
+	for (unsigned d = 0; d < b->depth; d++)
+		set_hash(b, b->path[d].node, get_hash(b, b->path[d].node) + delta);
+	set_hash(b, leaf, get_hash(b, leaf) + delta);
+}
+
+/* the n records of leaf from i, on the path recorded by find_leaf(), are being removed */
+static void hash_removed(bplus_t b, blkp leaf, unsigned i, unsigned n)
+{
+	unsigned long h = 0;
+	if (b->hash_page == 0)
+		return;
+	for (unsigned j = i; j < i + n; j++)
+		h += record_hash(get_key(leaf, j), get_value(leaf, j));
+	hash_path(b, leaf, -h);
+}
+
+/*
+ * With zone maps, words KEY_0 and KEY_0 + 1 of a block's zone page hold bounds on the values
+ * under it. Like a hash, a node's bounds cover the nodes split off its descendants that are
+ * still pending, but not those split off itself. Bounds are widened as values are written
+ * and left wide when they are deleted, and made exact again for the nodes a split, merge or
+ * rotation moves records between. An empty node has min above max.
+ */
+static inline value_t get_zone_min(bplus_t b, blkp blk)
+{
+	return blk[b->zone_page].words[KEY_0].value;
+}
+
+static inline value_t get_zone_max(bplus_t b, blkp blk)
+{
+	return blk[b->zone_page].words[KEY_0 + 1].value;
+}
+
+static inline void set_zone(bplus_t b, blkp blk, value_t min, value_t max)
+{
+	blk[b->zone_page].words[KEY_0].value = min;
+	blk[b->zone_page].words[KEY_0 + 1].value = max;
+}
+
+/* widen the bounds of blk to cover min..max */
+static inline void widen_zone(bplus_t b, blkp blk, value_t min, value_t max)
+{
+	if (b->zone_page != 0) {
+		if (min < get_zone_min(b, blk))
+			blk[b->zone_page].words[KEY_0].value = min;
+		if (max > get_zone_max(b, blk))
+			blk[b->zone_page].words[KEY_0 + 1].value = max;
+	}
+}
+
+/* widen the bounds of to to cover those of n, and of the nodes split off n still pending */
+static void cover_zone(bplus_t b, blkp to, blkp n)
+{
+	widen_zone(b, to, get_zone_min(b, n), get_zone_max(b, n));
+	for (unsigned i = 0; i < b->npending; i++)
+		if (b->pending[i].left == n)
+			cover_zone(b, to, b->pending[i].right);
+}
+
+/* recompute the bounds of node, from its records if a leaf, or its children's if not */
+static void rezone(bplus_t b, blkp node, int leaf)
+{
+	if (b->zone_page == 0)
+		return;
+	set_zone(b, node, ~0UL, 0);
+	if (leaf)
+		for (unsigned i = 0; i < num_keys(node); i++)
+			widen_zone(b, node, get_value(node, i), get_value(node, i));
+	else
+		for (unsigned i = 0; i <= num_keys(node); i++)
+			cover_zone(b, node, get_child(node, i));
+}
+
+/* widen the bounds of leaf and the path to it, as recorded by find_leaf(), to cover v */
+static void zone_path(bplus_t b, blkp leaf, value_t v)
+{
+	if (b->zone_page == 0)
+		return;
+	for (unsigned d = 0; d < b->depth; d++)
+		widen_zone(b, b->path[d].node, v, v);
+	widen_zone(b, leaf, v, v);
+}
+
+/*
+ * With range add tags, bplus_range_add() adds to the values of a whole subtree by adding to
+ * a tag on the index node child at its top, in the FIELD words of the tag page, and the
+ * header word of a node's tag page is set while any of its children may have one. The value
+ * of a record is the value in its leaf plus the tags on its path, and nodes split off a child
+ * still pending share its tag. Tags move with their children, and a write pushes the tags on
+ * its path down into the nodes below, so records are only changed, and only moved between
+ * nodes, under children whose tags are all 0.
+ */
+static inline value_t get_tag(bplus_t b, blkp blk, unsigned i)
+{
+	return blk[b->tag_page].words[FIELD_0 + i].value;
+}
+
+static inline void set_tag(bplus_t b, blkp blk, unsigned i, value_t t)
+{
+	blk[b->tag_page].words[FIELD_0 + i].value = t;
+}
+
+/* some child of index node blk may have a tag */
+static inline int has_tags(bplus_t b, blkp blk)
+{
+	return b->tag_page != 0 && blk[b->tag_page].words[HEADER].value != 0;
+}
+
+static inline void mark_tags(bplus_t b, blkp blk, int tagged)
+{
+	if (b->tag_page != 0)
+		blk[b->tag_page].words[HEADER].value = tagged;
+}
+
+/* children were moved into index node to from from, with their tags */
+static inline void move_tags(bplus_t b, blkp to, blkp from)
+{
+	if (has_tags(b, from))
+		mark_tags(b, to, 1);
+}
+
 /* make a cursor for tree and thread into tree's list of cursors */
 static bplus_cursor_t make_bplus_cursor(bplus_t b, blkp leaf, unsigned pos)
 {
@@ -228,6 +666,7 @@ static bplus_cursor_t make_bplus_cursor(bplus_t b, blkp leaf, unsigned pos)
 		c->leaf = leaf;
 		c->pos = pos;
 		c->invalid = 0;
+		c->delta_leaf = NULL;
 	}
 	return c;
 }
@@ -236,53 +675,102 @@ static bplus_cursor_t make_bplus_cursor(bplus_t b, blkp leaf, unsigned pos)
 /* make a new bplus tree */
 bplus_t new_bplus_tree(void)
 {
-	bplus_t b = malloc(sizeof(struct bplus));
-	if (b != NULL) {
-		/* create initial root as an empty leaf */
-		b->root = new_leaf_block();
-		if (b->root == NULL) {
-			free(b);
-			return NULL;
-		}
-		b->leaves = b->root;
-		b->root->words[HEADER].header.num_keys = 0;
-		set_next_leaf(b->root, NULL);
-		b->num_blks = 1;
+	return new_bplus_tree_opts(0);
+}
+
+/* make the empty leaf the whole of b */
+static void set_empty_root(bplus_t b, blkp leaf)
+{
+	leaf->words[HEADER].header.num_keys = 0;
+	if (b->hash_page != 0)
+		set_hash(b, leaf, 0);
+	rezone(b, leaf, 1);
+	set_next_leaf(leaf, NULL);
+	b->root = b->leaves = leaf;
+	b->depth = 0;
+}
+
+/* make b an empty tree, taking its blocks from arena if not NULL. Returns 0 if out of memory. */
+static int init_bplus_tree(bplus_t b, unsigned flags, struct bplus_arena *arena)
+{
+	blkp root;
+	/* annotation pages follow the block's own page, in this order */
+	b->block_pages = 1;
+	b->ttl_page = (flags & BPLUS_TTL) ? b->block_pages++ : 0;
+	/* the hash takes one word, so it shares the expiry page if there is one */
+	b->hash_page = !(flags & BPLUS_MERKLE) ? 0 : b->ttl_page != 0 ? b->ttl_page : b->block_pages++;
+	/* value bounds take two key words, which no other annotation uses */
+	b->zone_page = !(flags & BPLUS_ZONEMAP) ? 0 : b->ttl_page != 0 ? b->ttl_page :
+		b->hash_page != 0 ? b->hash_page : b->block_pages++;
+	/* tags are kept per child like expiry times, so they need a page of their own */
+	b->tag_page = !(flags & BPLUS_RANGE_ADD) || (flags & (BPLUS_MERKLE | BPLUS_ZONEMAP)) ? 0 : b->block_pages++;
+	b->tags = 0;
+	b->tag_epoch = 0;
+	b->now = 0;
+	b->reserve = NULL;
+	b->arena = arena;
+	/* create initial root as an empty leaf */
+	root = new_leaf_block(b);
+	if (root == NULL)
+		return 0;
+	set_empty_root(b, root);
+	b->num_blks = 1;
+
+	b->num_recs = b->num_crsrs = 0;
 
-		b->num_recs = b->num_crsrs = 0;
+	b->path = NULL;
+	b->path_length = 0;
+	b->new_root = NULL;
+	b->cursor_list = NULL;
+	b->heat = NULL;
+	b->tearing_down = 0;
+	b->flags = flags;
+	b->npending = 0;
+	b->cdc = NULL;
+	b->index = NULL;
+	return 1;
+}
 
-		b->path = NULL;
-		b->depth = 0;
-		b->path_length = 0;
-		b->new_root = NULL;
-		b->cursor_list = NULL;
+bplus_t new_bplus_tree_opts(unsigned flags)
+{
+	bplus_t b = malloc(sizeof(struct bplus));
+	if (b != NULL && !init_bplus_tree(b, flags, NULL)) {
+		free(b);
+		b = NULL;
 	}
 	return b;
 }
 
-/* reserve a path record sufficient for current depth of index */
-static enum bplus_error path_reserved(bplus_t b)
+/* reserve a path record of at least length nodes */
+static enum bplus_error path_reserve(bplus_t b, unsigned length)
 {
-	if (b->path_length < b->depth) {
-		if (b->path != NULL)
-			free(b->path);
-		b->path_length = b->depth;
-		b->path = malloc(b->path_length * sizeof(struct path_node));
-		if (b->path == NULL)
+	if (b->path_length < length) {
+		/* the old record stays if there is no room for a new one, to keep what was reserved */
+		struct path_node *path = malloc(length * sizeof(struct path_node));
+		if (path == NULL)
 			return NOMEM;
+		free(b->path);
+		b->path = path;
+		b->path_length = length;
 	}
 	return OK;
 }
 
+/* reserve a path record sufficient for current depth of index */
+static enum bplus_error path_reserved(bplus_t b)
+{
+	return path_reserve(b, b->depth);
+}
+
 static void free_index_subtree(bplus_t b, unsigned d, blkp blk)
 {
 	if (d < b->depth) {
 		for (unsigned i = 0; i <= num_keys(blk); i++)
 			free_index_subtree(b, d + 1, blk->words[FIELD_0 + i].child);
-		free_index_block(blk);
+		free_index_block(b, blk);
 		b->num_blks -= 1;
 	} else {
-		free_leaf_block(blk);
+		free_leaf_block(b, blk);
 		b->num_blks -= 1;
 	}
 }
@@ -293,638 +781,4333 @@ void free_bplus_tree(bplus_t b)
 	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next)
 		bc->tree = NULL;
 	free_index_subtree(b, 0, b->root);
+	/* new nodes of splits not yet posted are reachable only from the pending table */
+	for (unsigned i = 0; i < b->npending; i++)
+		free_index_subtree(b, b->pending[i].depth + 1, b->pending[i].right);
+	release_reserve(b);
+	free(b->path);
+	free(b->heat);
+	free(b);
+}
+
+/*
+ * Incremental teardown walks the tree depth first, using the path array as its stack:
+ * path[d].node is the index node being emptied at depth d and path[d].pos the next child
+ * of it to free. Each node is freed after its children, so at most budget blocks are
+ * freed per call. The new nodes of splits still pending are emptied after the tree
+ * under the root, one subtree at a time.
+ */
+enum bplus_error free_bplus_tree_step(bplus_t b, unsigned long budget)
+{
+	if (!b->tearing_down) {
+		if (path_reserved(b) != OK)
+			return NOMEM;
+		for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next)
+			bc->tree = NULL;
+		free(b->heat);
+		b->heat = NULL;
+		b->tearing_down = 1;
+		b->td_walking = b->depth != 0;
+		b->td_top = b->td_base = 0;
+		if (b->depth != 0) {
+			b->path[0].node = b->root;
+			b->path[0].pos = 0;
+		}
+	}
+	while (b->td_walking || b->npending != 0) {
+		unsigned d;
+		blkp node;
+		if (budget == 0)
+			return INCOMPLETE;
+		budget -= 1;
+		if (!b->td_walking) {
+			/* start on the subtree under the next pending split */
+			struct pending_split *p = &b->pending[--b->npending];
+			if (p->depth + 1 == b->depth) {
+				free_leaf_block(b, p->right);
+				b->num_blks -= 1;
+			} else {
+				b->td_walking = 1;
+				b->td_top = b->td_base = p->depth + 1;
+				b->path[b->td_top].node = p->right;
+				b->path[b->td_top].pos = 0;
+			}
+			continue;
+		}
+		d = b->td_top;
+		node = b->path[d].node;
+		if (b->path[d].pos <= num_keys(node)) {
+			blkp child = get_child(node, b->path[d].pos++);
+			if (d + 1 < b->depth) {
+				/* descend to empty the child index node first */
+				b->td_top = d + 1;
+				b->path[d + 1].node = child;
+				b->path[d + 1].pos = 0;
+			} else {
+				free_leaf_block(b, child);
+				b->num_blks -= 1;
+			}
+		} else {
+			/* all children freed, free node and pop back to its parent */
+			free_index_block(b, node);
+			b->num_blks -= 1;
+			if (d == b->td_base)
+				b->td_walking = 0;
+			else
+				b->td_top = d - 1;
+		}
+	}
+	if (b->depth == 0)
+		free_leaf_block(b, b->root);
+	release_reserve(b);
 	free(b->path);
+	free(b);
+	return OK;
+}
+
+/* background teardown thread, freeing a little at a time so it doesn't hog the allocator */
+static void *teardown_thread(void *arg)
+{
+	bplus_t b = arg;
+	while (free_bplus_tree_step(b, 64) == INCOMPLETE)
+		sched_yield();
+	return NULL;
+}
+
+enum bplus_error free_bplus_tree_background(bplus_t b)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int err;
+	/* detach the tree from its cursors now, so the caller is done with it on return */
+	if (!b->tearing_down) {
+		enum bplus_error ok = free_bplus_tree_step(b, 0);
+		if (ok != INCOMPLETE)
+			return ok;/* out of memory, or a tree without index nodes was freed at once */
+	}
+	if (pthread_attr_init(&attr) != 0)
+		return NOMEM;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, teardown_thread, b);
+	pthread_attr_destroy(&attr);
+	return err == 0 ? OK : NOMEM;
 }
 
 /* undo preallocations if incomplete */
 static void free_preallocated_splits(bplus_t b, unsigned d)
 {
 	if (d == 0 && b->new_root != NULL)
-		free_index_block(b->new_root);
+		free_index_block(b, b->new_root);
 	for (; d < b->depth; d++)
-		free_index_block(b->path[d].split);
+		free_index_block(b, b->path[d].split);
 }
 
 /* To avoid need to allocate (which can fail) do all allocation for splitting leaf and index nodes */
-static blkp preallocate_splits(bplus_t b)
+static blkp preallocate_splits(bplus_t b, lkey_t k)
 {
 	blkp split_leaf = NULL;
 	unsigned d;
 	unsigned n_allocs = 0;
 	b->new_root = NULL;
-	/* preallocate all index nodes that will need to be used in split */
-	for (d = b->depth; d != 0 && b->path[--d].num_keys == ORDER - 1;) {
-		b->path[d].split = new_index_block();
-		if (b->path[d].split == NULL) {
-			free_preallocated_splits(b, d + 1);
+	/* preallocate all index nodes that will need to be used in split, path[d..depth-1] */
+	for (d = b->depth; d != 0 && b->path[d - 1].num_keys == ORDER - 1; d--) {
+		b->path[d - 1].split = new_index_block(b);
+		if (b->path[d - 1].split == NULL) {
+			free_preallocated_splits(b, d);
 			return split_leaf;
 		}
 		n_allocs += 1;
 	}
-	/* if either no index or reacjed top node which is full */
-	if (b->depth == 0 || (d == 0 && b->path[d].num_keys == ORDER - 1)) {
-		if (b->depth != 0) {
-			b->path[d].split = new_index_block();
-			if (b->path[d].split == NULL) {
-				free_preallocated_splits(b, d + 1);
-				return split_leaf;
-			}
-			n_allocs += 1;
-		}
-		b->new_root = new_index_block();
+	/* if either no index or reached top node which is full */
+	if (d == 0) {
+		b->new_root = new_index_block(b);
 		if (b->new_root == NULL) {
 			free_preallocated_splits(b, d);
 			return split_leaf;
 		}
 		n_allocs += 1;
 	}
-	split_leaf = new_leaf_block();
+	split_leaf = new_leaf_block(b);
 	if (split_leaf == NULL)
 		free_preallocated_splits(b, d);
-	else b->num_blks += n_allocs + 1;
+	else {
+		b->num_blks += n_allocs + 1;
+		TRACE(alloc, b->depth, k, n_allocs + 1);
+	}
 	return split_leaf;
 }
 
-/* ***** B+ Tree operations ***** */
+/* ***** sampled leaf access tracking ***** */
 
-void get_active_storage(bplus_t b, unsigned long *num_records, unsigned long *num_blocks, unsigned long *num_cursors)
+/*
+ * The heatmap is written by readers too, which may run in parallel under a shared lock, so
+ * every access to a slot is atomic. A slot changes hands by a compare and swap of its leaf,
+ * and its counters are bumped with relaxed loads and stores: no locked instructions on the
+ * lookup path, at the cost of an occasional lost count.
+ */
+
+/* maximum slots probed for a leaf before evicting the coldest one */
+#define HEAT_PROBES 8
+
+/* accesses this thread has made to trees with heatmaps, for sampling without a shared counter */
+static __thread unsigned long heat_ticks;
+
+/* first slot to probe for leaf */
+static inline unsigned heat_home(const struct heatmap *h, blkp leaf)
 {
-	*num_records = b->num_recs;
-	*num_blocks = b->num_blks;
-	*num_cursors = b->num_crsrs;
+	return (((unsigned long)leaf >> PAGE_BITS) * 0x9E3779B97F4A7C15UL) >> (64 - h->slot_bits);
 }
 
- 
-/* find leaf which should contain key and position that should contain key */
-static blkp find_leaf(bplus_t b, lkey_t k)
+/* find the counters of leaf, or NULL if it has none */
+static struct heat_slot *heat_lookup(struct heatmap *h, blkp leaf)
 {
-	blkp node = b->root;
-	/* scan through index nodes above leaves, recording path */
-	for (unsigned d = 0; d < b->depth; d++) {
-		unsigned i = scan_index_keys(node, k); /* i is index of first key larger than or equal to k */
-		
-		b->path[d].node = node;
-		b->path[d].pos = i;/* where a new split child key would be inserted */
-		b->path[d].num_keys = num_keys(node);
-		node = get_child(node, i); /* the i'th child is the child containing keys < k */
-	}
-	return node;
+	unsigned mask = (1U << h->slot_bits) - 1;
+	unsigned i = heat_home(h, leaf);
+	for (unsigned n = 0; n < HEAT_PROBES; n++, i = (i + 1) & mask)
+		if (__atomic_load_n(&h->slots[i].leaf, __ATOMIC_RELAXED) == leaf)
+			return &h->slots[i];
+	return NULL;
 }
 
-/* find leaf node and value corresponding to key or fail with not found */
-enum bplus_error find(bplus_t b, lkey_t k, value_t *v)
+static inline unsigned long heat_of(const struct heat_slot *s)
 {
-	if (b->root != NULL) {
-		enum bplus_error ok = path_reserved(b);
-		if (ok != OK) return ok;
-		{
-			blkp leaf = find_leaf(b, k);
-			/* scan leaf keys for match */
-			unsigned i = scan_leaf_keys(leaf, k);
-			/* i is the first key >= k */
-			if (k == get_key(leaf, i)) {
-				*v = get_value(leaf, i);
-				return OK;
-			}
-			/* key isn't in leaf, if key at i is != k */
-		}
-	}
-	return NOTFOUND;
+	return __atomic_load_n(&s->reads, __ATOMIC_RELAXED) + __atomic_load_n(&s->writes, __ATOMIC_RELAXED);
 }
 
-/* insert key and value into leaf at insertion point i, moving remaining keys */
-static inline blkp insert_into_leaf(bplus_t b, blkp leaf, unsigned i, lkey_t key, value_t v)
+/*
+ * find the counters of leaf, claiming a free slot or evicting the coldest probed slot if
+ * needed. Returns NULL if another thread took the slot first for some other leaf.
+ */
+static struct heat_slot *heat_slot_of(struct heatmap *h, blkp leaf)
 {
-	unsigned nk = num_keys(leaf);
-	if (nk - i != 0) {
-		wrdmove(leaf->words + KEY_0 + i + 1, leaf->words + KEY_0 + i, nk - i);
-		wrdmove(leaf->words + FIELD_0 + i + 1, leaf->words + FIELD_0 + i, nk - i);
+	unsigned mask = (1U << h->slot_bits) - 1;
+	unsigned i = heat_home(h, leaf);
+	struct heat_slot *coldest = NULL;
+	blkp seen = NULL;
+	unsigned long heat = ~0UL;
+	for (unsigned n = 0; n < HEAT_PROBES; n++, i = (i + 1) & mask) {
+		struct heat_slot *s = &h->slots[i];
+		blkp l = __atomic_load_n(&s->leaf, __ATOMIC_RELAXED);
+		unsigned long t;
+		if (l == leaf)
+			return s;
+		if (l == NULL) {
+			coldest = s;
+			seen = NULL;
+			break;
+		}
+		t = heat_of(s);
+		if (t < heat) {
+			coldest = s;
+			seen = l;
+			heat = t;
+		}
 	}
-	leaf->words[KEY_0 + i].key = key;
-	leaf->words[FIELD_0 + i].value = v;
-	leaf->words[HEADER].header.num_keys = nk + 1;
-	/* adjust cursors pointing after this */
-	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next)
-		if (bc->leaf == leaf && bc->pos >= i) bc->pos += 1;
-	return leaf;
+	if (!__atomic_compare_exchange_n(&coldest->leaf, &seen, leaf, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return seen == leaf ? coldest : NULL;
+	__atomic_store_n(&coldest->reads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coldest->writes, 0, __ATOMIC_RELAXED);
+	return coldest;
 }
 
-/* insert splitting key and child node into node AFTER split child's key at i - 1, moving remaining keys */
-static blkp insert_split_into_index(blkp node, unsigned i, lkey_t key, blkp child)
+/* count an access to leaf, if tracking and this access is sampled */
+static inline void heat_touch(bplus_t b, blkp leaf, int write)
 {
-	unsigned nk = num_keys(node);
-	if (nk - i != 0) {
-		wrdmove(node->words + KEY_0 + i + 1, node->words + KEY_0 + i, nk - i);
-		wrdmove(node->words + FIELD_0 + i + 2, node->words + FIELD_0 + i + 1, nk - i);
+	struct heatmap *h = b->heat;
+	if (h != NULL && (++heat_ticks & ((1UL << h->sample_shift) - 1)) == 0) {
+		struct heat_slot *s = heat_slot_of(h, leaf);
+		if (s != NULL) {
+			unsigned long *c = write ? &s->writes : &s->reads;
+			__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+		}
 	}
-	node->words[KEY_0 + i].key = key;
-	node->words[FIELD_0 + i + 1].child = child;
-	node->words[HEADER].header.num_keys = nk + 1;
-	return node;
 }
 
-static blkp split_index(bplus_t b, blkp parent, blkp newp, unsigned pos, lkey_t *k, blkp new)
+/* a leaf is being freed, so its slot must not be credited to a later leaf at the same address */
+static inline void heat_forget(bplus_t b, blkp leaf)
 {
-	/* 
-	 * Splits index node parent adding peer newp, Initially,
-	 * parent has ORDER - 1 keys, ORDER children, adding one key *k and one child new 
-	 * with new key at position pos and new child at pos+1 in overall sequence.
-	 * On return *k will contains new splitting key for new index block newp.
-	 *
-	 * parent and newp will then have LHALF + 1 and RHALF children, LHALF and RHALF-1 keys.
-	 * The new splitting key will be the key numbered LHALF in the combined sequence of ORDER
-	 * keys, and will be left in parent at key[LHALF].
-	 */
-	/* First setup new node sizes: */
-	parent->words[HEADER].header.num_keys = LHALF;
-	newp->words[HEADER].header.num_keys = RHALF - 1;
-#define CAREFUL // carefully coded version of split and insert
-#ifdef CAREFUL
-	/* careful copy of children to right node, with insert at pos */
-	unsigned j = RHALF - 1; /* j is target position (starting in new child) */
-	blkp dnode = newp;
-	if (pos == ORDER - 1) {
-		dnode->words[FIELD_0 + RHALF - 1].child = new;
-		j -= 1;
-	}
-	for (unsigned i = ORDER; i-- > 0;) {/* i is the source position in parent */
-		if (i < pos && i < LHALF + 1) break; /* insertion and split are complete */
-		dnode->words[FIELD_0 + j] = parent->words[FIELD_0 + i]; 
-		if (j-- == 0) {
-			dnode = parent;
-			j = LHALF;
-		}
-		if (i == pos + 1) { /* inserting new child before this child */
-			dnode->words[FIELD_0 + j].child = new;
-			if (j-- == 0) {
-				dnode = parent;
-				j = LHALF;
-			}
-		}
-	}
-	/* careful copy of keys to right node, with insert at pos */
-	j = RHALF - 2; /* j is the target position (starting in new child) */
-	dnode = newp;
-	if (pos == ORDER - 1) {
-		dnode->words[KEY_0 + RHALF - 2].key = *k;
-		j -= 1;
-	}
-	for (unsigned i = ORDER - 1; i-- > 0; ) {/* i is the source position in parent */
-		if (i < pos && i < LHALF) break; /* insertions and split are complete */
-		dnode->words[KEY_0 + j] = parent->words[KEY_0 + i];
-		if (j-- == 0) {
-			dnode = parent;
-			j = LHALF;
-		}
-		if (i == pos) {/* inserting new key before this key */
-			dnode->words[KEY_0 + j].key = *k;
-			if (j-- == 0) {
-				dnode = parent;
-				j = LHALF;
-			}
-		}
-	}
-#else // optimized version of careful code using fast memory copy/move
-	/* Now move the keys and children into the new node, and insert new key and child */
-	if (pos < LHALF) { /* inserting new child into left part of split node */
-		/* copy rightmost RHALF-1  keys to newp, and RHALF children to newp */
-		wrdcpy(newp->words + KEY_0, parent->words + KEY_0 + LHALF, RHALF - 1);
-		wrdcpy(newp->words + FIELD_0, parent->words + FIELD_0 + LHALF, RHALF);
-		/* Now there are ORDER -1 - (RHALF - 1) == LHALF keys in parent, and ORDER - RHALF == LHALF children  */
-		/* then insert *k into parent keys at pos i, and new after at field pos i + 1 */
-		/* open up space for new key and child, moving at least one key to the right */
-		wrdmove(parent->words + KEY_0 + pos + 1, parent->words + KEY_0 + pos, LHALF - pos);
-		if (LHALF - pos - 1 != 0)
-			wrdmove(parent->words + FIELD_0 + pos + 2, parent->words + FIELD_0 + pos + 1, LHALF - pos - 1);
-		/* insert new key and child */
-		parent->words[KEY_0 + pos].key = *k;
-		parent->words[FIELD_0 + pos + 1].child = new;
-	} else if (pos == LHALF) {
-		/* inserting new child just at right of split, promoting *k again, and putting new first in right node */
-		wrdcpy(newp->words + KEY_0, parent->words + KEY_0 + LHALF, RHALF - 1);
-		wrdcpy(newp->words + FIELD_0 + 1, parent->words + FIELD_0 + LHALF + 1, RHALF - 1);
-		parent->words[KEY_0 + LHALF] = *k;
-	} else /* LHALF < i < ORDER */ {	/*  both inserted key and new child will be into right part of split node */
-		/* copy keys and children prior to new key and child, leaving behind key to be promoted */
-		wrdcpy(newp->words + KEY_0, parent->words + KEY_0 + LHALF + 1, pos - (LHALF + 1));
-		wrdcpy(newp->words + FIELD_0, parent->words + FIELD_0 + LHALF + 1, pos + 1 - (LHALF + 1));
-		/* insert new key and child */
-		newp->words[KEY_0 + pos - (LHALF + 1)].key = *k;
-		newp->words[FIELD_0 + pos - LHALF].child = new;
-		/* copy the rest, after new key */
-		if (ORDER - 1 - pos != 0) {
-			wrdcpy(newp->words + KEY_0 + pos - LHALF, parent->words + KEY_0 + pos + 2, ORDER - 1 - pos);
-			wrdcpy(newp->words + FIELD_0 + pos + 1 - LHALF, parent->words + FIELD_0 + pos + 2, ORDER - 1 - pos);
+	if (b->heat != NULL) {
+		struct heat_slot *s = heat_lookup(b->heat, leaf);
+		if (s != NULL) {
+			__atomic_store_n(&s->reads, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&s->writes, 0, __ATOMIC_RELAXED);
 		}
 	}
-#endif
-	/*
-	 * return newly created node and the leftmost key in its subtree, by promoting
-	 * the last key to the right left in parent.
-	 */
-	*k = parent->words[KEY_0 + LHALF].key;
-	return newp;
+}
 
+enum bplus_error bplus_heatmap_enable(bplus_t b, unsigned sample_shift, unsigned slot_bits)
+{
+	struct heatmap *h;
+	/* the counters would be in one process's memory, but the tree is in every process's */
+	if (b->arena != NULL)
+		return NOMEM;
+	if (slot_bits < 4) slot_bits = 4;
+	if (slot_bits > 28) slot_bits = 28;
+	if (sample_shift > 63) sample_shift = 63;
+	h = calloc(1, sizeof(struct heatmap) + (sizeof(struct heat_slot) << slot_bits));
+	if (h == NULL)
+		return NOMEM;
+	h->sample_shift = sample_shift;
+	h->slot_bits = slot_bits;
+	free(b->heat);
+	b->heat = h;
+	return OK;
 }
- 
-static blkp split_leaf(bplus_t b, blkp leaf, blkp new, unsigned i, lkey_t *k, value_t v)
+
+void bplus_heatmap_disable(bplus_t b)
 {
-	/* full leaf: has ORDER-1 keys, ORDER-1 values; two new leaves will have ORDER/2 keys and values */
-	/* Note: i < ORDER on entry */
-	leaf->words[HEADER].header.num_keys = LHALF;
-	new->words[HEADER].header.num_keys = RHALF;
-	/* add new linked leaf node via NEXT pointer */
-	set_next_leaf(new, next_leaf(leaf));
-	set_next_leaf(leaf, new);
-	/* insert new key and value into old or new leaf based on where it should have been inserted */
-	if (i < LHALF) {/* key will be inserted in left result node */
-		wrdcpy(new->words + KEY_0, leaf->words + KEY_0 + LHALF - 1, RHALF);
-		wrdcpy(new->words + FIELD_0, leaf->words + FIELD_0 + LHALF - 1, RHALF);
-		if (LHALF - 1 - i != 0) {
-			wrdmove(leaf->words + KEY_0 + i + 1, leaf->words + KEY_0 + i, LHALF - 1 - i);
-			wrdmove(leaf->words + FIELD_0 + i + 1, leaf->words + FIELD_0 + i, LHALF - 1 - i);
+	free(b->heat);
+	b->heat = NULL;
+}
+
+void bplus_heatmap_export(bplus_t b, unsigned nranges,
+			  void (*f)(lkey_t lo, lkey_t hi, unsigned long reads, unsigned long writes, void *ctx),
+			  void *ctx)
+{
+	struct heatmap *h = b->heat;
+	unsigned long nleaves = 0, per_range, in_range = 0;
+	unsigned long reads = 0, writes = 0;
+	lkey_t lo = 0, hi = 0;
+	int empty = 1;
+	if (h == NULL)
+		return;
+	for (blkp leaf = b->leaves; leaf != NULL; leaf = next_leaf(leaf))
+		nleaves += 1;
+	/* group consecutive leaves into nranges ranges of about the same number of leaves */
+	per_range = (nranges == 0 || nranges >= nleaves) ? 1 : (nleaves + nranges - 1) / nranges;
+	for (blkp leaf = b->leaves; leaf != NULL; leaf = next_leaf(leaf)) {
+		struct heat_slot *s = heat_lookup(h, leaf);
+		if (s != NULL) {
+			reads += __atomic_load_n(&s->reads, __ATOMIC_RELAXED);
+			writes += __atomic_load_n(&s->writes, __ATOMIC_RELAXED);
 		}
-		leaf->words[KEY_0 + i].key = *k;
-		leaf->words[FIELD_0 + i].value = v;
-	} else {/* key will be inserted into right result node */
-		if (i > LHALF) {
-			wrdcpy(new->words + KEY_0, leaf->words + KEY_0 + LHALF, i - LHALF);
-			wrdcpy(new->words + FIELD_0, leaf->words + FIELD_0 + LHALF, i - LHALF);
+		if (num_keys(leaf) != 0) {
+			if (empty)
+				lo = get_key(leaf, 0);
+			hi = get_key(leaf, num_keys(leaf) - 1);
+			empty = 0;
 		}
-		new->words[KEY_0 + i - LHALF].key = *k;
-		new->words[FIELD_0 + i - LHALF].value = v;
-		if (ORDER - 1 - i != 0) {
-			wrdcpy(new->words + KEY_0 + i + 1 - LHALF, leaf->words + KEY_0 + i, ORDER - 1 - i);
-			wrdcpy(new->words + FIELD_0 + i + 1 - LHALF, leaf->words + FIELD_0 + i, ORDER - 1 - i);
+		if (++in_range == per_range || next_leaf(leaf) == NULL) {
+			/* scale sampled counts back up to estimated accesses */
+			if (!empty)
+				f(lo, hi, reads << h->sample_shift, writes << h->sample_shift, ctx);
+			in_range = 0;
+			reads = writes = 0;
+			empty = 1;
 		}
 	}
-	/* promote leftmost key in new leaf to parent */
-	*k = get_key(new, 0);
-	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
-		if (bc->leaf == leaf) {
-			if (bc->pos >= i) bc->pos += 1;
-			if (bc->pos >= LHALF) bc->pos -= LHALF;
+}
+
+/* ***** change feed ***** */
+
+/*
+ * The feed is a ring of changes written by the one thread writing the tree and read by
+ * any number of consumers without locks. Each slot holds the sequence number of the change
+ * in it, cleared while the slot is being rewritten, so a consumer that finds the number it
+ * expected both before and after copying the slot has an intact change. The writer never
+ * waits, so a consumer that falls more than a ring behind loses the oldest changes.
+ */
+struct cdc_slot {
+	unsigned long seq;/* sequence number of the change here, 0 while being written */
+	unsigned long op;
+	lkey_t key;
+	value_t old_value;
+	value_t new_value;
+};
+
+struct bplus_cdc {
+	unsigned long head;/* sequence number of the last change published */
+	unsigned long mask;/* ring has mask + 1 slots */
+	struct cdc_slot slots[];
+};
+
+bplus_cdc_t bplus_cdc_new(unsigned capacity_bits)
+{
+	struct bplus_cdc *f;
+	if (capacity_bits < 4) capacity_bits = 4;
+	if (capacity_bits > 28) capacity_bits = 28;
+	f = calloc(1, sizeof(struct bplus_cdc) + (sizeof(struct cdc_slot) << capacity_bits));
+	if (f != NULL)
+		f->mask = (1UL << capacity_bits) - 1;
+	return f;
+}
+
+void bplus_cdc_free(bplus_cdc_t f)
+{
+	free(f);
+}
+
+enum bplus_error bplus_cdc_attach(bplus_t b, bplus_cdc_t f)
+{
+	/* the feed would be in one process's memory, but the tree is in every process's */
+	if (b->arena != NULL && f != NULL)
+		return NOMEM;
+	b->cdc = f;
+	return OK;
+}
+
+unsigned long bplus_cdc_last(bplus_cdc_t f)
+{
+	return __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+}
+
+/* publish a change of the tree to its feed */
+static void cdc_publish(struct bplus_cdc *f, enum bplus_change_op op, lkey_t k, value_t old, value_t v)
+{
+	unsigned long seq = f->head + 1;
+	struct cdc_slot *slot = &f->slots[seq & f->mask];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->op, op, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->key, k, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->old_value, old, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->new_value, v, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&f->head, seq, __ATOMIC_RELEASE);
+}
+
+static inline void cdc_note(bplus_t b, enum bplus_change_op op, lkey_t k, value_t old, value_t v)
+{
+	if (b->cdc != NULL)
+		cdc_publish(b->cdc, op, k, old, v);
+}
+
+/* records i .. i + n - 1 of leaf are about to be deleted */
+static inline void cdc_note_removed(bplus_t b, blkp leaf, unsigned i, unsigned n)
+{
+	if (b->cdc != NULL)
+		for (unsigned j = i; j < i + n; j++)
+			cdc_publish(b->cdc, BPLUS_CHANGE_DELETE, get_key(leaf, j), get_value(leaf, j), 0);
+}
+
+unsigned long bplus_cdc_read(bplus_cdc_t f, unsigned long *next, struct bplus_change *out, unsigned long max)
+{
+	unsigned long head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+	unsigned long seq = *next != 0 ? *next : 1;
+	unsigned long n = 0;
+	while (n < max) {
+		struct cdc_slot *slot = &f->slots[seq & f->mask];
+		struct bplus_change c;
+		/* skip what has been overwritten, resuming at the oldest change still in the ring */
+		if (head > f->mask && seq < head - f->mask)
+			seq = head - f->mask;
+		if (seq > head)
+			break;
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq) {
+			c.seq = seq;
+			c.op = __atomic_load_n(&slot->op, __ATOMIC_RELAXED);
+			c.key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+			c.old_value = __atomic_load_n(&slot->old_value, __ATOMIC_RELAXED);
+			c.new_value = __atomic_load_n(&slot->new_value, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+				out[n++] = c;
+				seq += 1;
+				continue;
+			}
 		}
+		/* the writer lapped us while we read, see how far */
+		head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+		seq += 1;
 	}
-	return new;
+	*next = seq;
+	return n;
 }
 
-static void add_root_block(bplus_t b, blkp left_child, lkey_t k, blkp right_child)
+/* ***** secondary index ***** */
+
+/*
+ * A secondary index maps each value of a tree to the keys that have it, in a second tree
+ * keyed by value whose values point to postings: the keys in order, in an array, or in a
+ * tree of their own once there are more than POSTING_MAX of them. Each write of the tree
+ * adds its new (value, key) pair to the index before it changes anything, so that if the
+ * index runs out of memory the write fails with nothing changed, and removes the old pair
+ * once it is done, which needs no memory. Expired records stay in the index until swept.
+ */
+#define POSTING_MAX 64
+
+struct posting {
+	unsigned long n;/* keys with the value */
+	unsigned cap;/* room in keys, if they are not in tree */
+	bplus_t tree;/* the keys, once there are more than POSTING_MAX */
+	lkey_t keys[];
+};
+
+struct bplus_index {
+	bplus_t tree;/* tree indexed */
+	bplus_t values;/* value -> struct posting of its keys */
+	unsigned long entries;
+};
+
+static blkp descend_to_leaf(bplus_t b, lkey_t k);
+static void push_range(bplus_t b, lkey_t lo, lkey_t hi);
+static struct bplus_write *sort_batch(struct bplus_write *w, struct bplus_write *tmp, unsigned long n);
+
+static inline struct posting *posting_of(value_t v)
 {
-	blkp new = b->new_root;
-	new->words[HEADER].header.num_keys = 1;
-	new->words[KEY_0].key = k;
-	new->words[FIELD_0].child = left_child;
-	new->words[FIELD_0 + 1].child = right_child;
-	b->root = new;
-	b->depth += 1;
+	return (struct posting *)v;
 }
 
+/* index in the array of p of the first key >= k */
+static unsigned long posting_pos(struct posting *p, lkey_t k)
+{
+	unsigned long lo = 0, hi = p->n;
+	while (lo < hi) {
+		unsigned long mid = (lo + hi) / 2;
+		if (p->keys[mid] < k)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-static void insert_new_leaf(bplus_t b, blkp new, lkey_t *k)
+static void free_posting(struct posting *p)
 {
-		/* insert new into parent chain, splitting nodes as needed */
-	for (unsigned d = b->depth; d != 0;) {
-		blkp parent = b->path[--d].node;
-		unsigned i = b->path[d].pos;
-		if (num_keys(parent) < ORDER - 1) {
-			/* insert new block into this ancestor, and done */
-			insert_split_into_index(parent, i, *k, new);
-			return;
+	if (p->tree != NULL)
+		free_bplus_tree(p->tree);
+	free(p);
+}
+
+/* insert the n keys into t, or none of them if out of memory */
+static enum bplus_error insert_keys(bplus_t t, const lkey_t *ks, unsigned long n)
+{
+	for (unsigned long j = 0; j < n; j++) {
+		if (insert(t, ks[j], 0) != OK) {
+			while (j-- > 0)
+				delete(t, ks[j]);
+			return NOMEM;
 		}
-		/* full, split this parent, inserting key and getting new block and promoted key */
-		new = split_index(b, parent, b->path[d].split, i, k, new);
-		/* continue, inserting new and promoted key into its parent */
 	}
-	/* having split root, must add a node above the current root to hold new and current root */
-	add_root_block(b, b->root, *k, new);
+	return OK;
 }
 
-/* insert new key value pair into B+ tree, returning 0 if insert failed */
-enum bplus_error insert(bplus_t b, lkey_t k, value_t v)
+/* a posting of the n keys, in order, or NULL if out of memory */
+static struct posting *new_posting(const lkey_t *ks, unsigned long n)
 {
-	/* insure that we don't need to allocate memory during insert */
-	enum bplus_error ok = path_reserved(b);
-	if (ok == OK) {
-		blkp leaf = find_leaf(b, k);
-		unsigned nk = num_keys(leaf);
-		unsigned i = scan_leaf_keys(leaf, k);
-		if (i < nk && get_key(leaf, i) == k)/* key is already present */
-			set_value(leaf, i, v);/* update value */
-		else if (nk < ORDER-1) {/* has room for new k,v pair */
-			insert_into_leaf(b, leaf, i, k, v);
-			b->num_recs += 1;
-		} else {
-			/* must split leaf, preallocate all needed memory */
-			blkp split = preallocate_splits(b);
-			if (split == NULL) ok = NOMEM;
-			else {
-				insert_new_leaf(b, split_leaf(b, leaf, split, i, &k, v), &k);
-				b->num_recs += 1;
-			}
-		}
+	unsigned cap = n > POSTING_MAX ? 0 : n;
+	struct posting *p = malloc(sizeof(struct posting) + cap * sizeof(lkey_t));
+	if (p == NULL)
+		return NULL;
+	p->n = n;
+	p->cap = cap;
+	p->tree = NULL;
+	if (cap != 0 || n == 0) {
+		memcpy(p->keys, ks, n * sizeof(lkey_t));
+	} else if ((p->tree = new_bplus_tree()) == NULL || insert_keys(p->tree, ks, n) != OK) {
+		free_posting(p);
+		return NULL;
 	}
-	return ok;
+	return p;
 }
-/* fix cursors after rotating one item from right peer to leaf */
-static void fix_cursor_rotate_left(bplus_t b, blkp leaf, blkp rpeer)
+
+/*
+ * add the n keys, in order and none of them there already, to the posting p of value v.
+ * Returns OK, or NOMEM with the posting as it was.
+ */
+static enum bplus_error posting_add(struct bplus_index *ix, value_t v, struct posting *p,
+				    const lkey_t *ks, unsigned long n)
 {
-	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
-		if (bc->leaf == rpeer) {
-			if (bc->pos == 0) {
-				bc->leaf = leaf;
-				bc->pos = num_keys(leaf) - 1;
-			} else {
-				bc->pos -= 1;
-			}
+	struct posting *q;
+	unsigned long i, j, d;
+	if (p->tree != NULL) {
+		if (insert_keys(p->tree, ks, n) != OK)
+			return NOMEM;
+		p->n += n;
+		return OK;
+	}
+	if (p->n + n > POSTING_MAX) {
+		bplus_t t = new_bplus_tree();
+		if (t == NULL || insert_keys(t, p->keys, p->n) != OK || insert_keys(t, ks, n) != OK) {
+			if (t != NULL)
+				free_bplus_tree(t);
+			return NOMEM;
+		}
+		p->tree = t;
+		p->n += n;
+		return OK;
+	}
+	q = p;
+	if (p->n + n > p->cap) {
+		/* a bigger posting replaces p under v, which as an update of v needs no memory */
+		unsigned cap = 2 * p->cap > p->n + n ? 2 * p->cap : p->n + n;
+		q = malloc(sizeof(struct posting) + cap * sizeof(lkey_t));
+		if (q == NULL)
+			return NOMEM;
+		*q = *p;
+		q->cap = cap;
+		if (insert(ix->values, v, (value_t)q) != OK) {
+			free(q);
+			return NOMEM;
 		}
 	}
+	/* merge from the top down, so the keys can move up in place */
+	i = p->n;
+	j = n;
+	for (d = p->n + n; d-- > 0;)
+		q->keys[d] = j == 0 || (i != 0 && p->keys[i - 1] > ks[j - 1]) ? p->keys[--i] : ks[--j];
+	q->n += n;
+	if (q != p)
+		free(p);
+	return OK;
 }
 
-/* fix cursors after rotating one item from left peer to leaf */
-static void fix_cursor_rotate_right(bplus_t b, blkp lpeer, blkp leaf)
+/* add (v, k), which is not in the index, returning OK or NOMEM with nothing changed */
+static enum bplus_error index_add(struct bplus_index *ix, value_t v, lkey_t k)
 {
-	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+	value_t pv;
+	struct posting *p;
+	if (find(ix->values, v, &pv) == OK) {
+		if (posting_add(ix, v, posting_of(pv), &k, 1) != OK)
+			return NOMEM;
+	} else {
+		p = new_posting(&k, 1);
+		if (p == NULL)
+			return NOMEM;
+		if (insert(ix->values, v, (value_t)p) != OK) {
+			free_posting(p);
+			return NOMEM;
+		}
+	}
+	ix->entries += 1;
+	return OK;
+}
+
+/* remove (v, k), which is in the index. It needs no memory, so it cannot fail. */
+static void index_remove(struct bplus_index *ix, value_t v, lkey_t k)
+{
+	value_t pv;
+	struct posting *p;
+	if (find(ix->values, v, &pv) != OK)
+		return;
+	p = posting_of(pv);
+	if (p->tree != NULL) {
+		delete(p->tree, k);
+	} else {
+		unsigned long i = posting_pos(p, k);
+		memmove(p->keys + i, p->keys + i + 1, (p->n - i - 1) * sizeof(lkey_t));
+	}
+	p->n -= 1;
+	ix->entries -= 1;
+	if (p->n == 0) {
+		delete(ix->values, v);
+		free_posting(p);
+	}
+}
+
+/* records i .. i + n - 1 of leaf are about to be deleted */
+static inline void index_removed(bplus_t b, blkp leaf, unsigned i, unsigned n)
+{
+	if (b->index != NULL)
+		for (unsigned j = i; j < i + n; j++)
+			index_remove(b->index, get_value(leaf, j), get_key(leaf, j));
+}
+
+/*
+ * add the n pairs of w, each with the value as key and the key as value, sorted by value
+ * and then key and none of them in the index. The values new to the index go into it in one
+ * write batch. Returns OK, or NOMEM with nothing changed.
+ */
+static enum bplus_error index_add_sorted(struct bplus_index *ix, const struct bplus_write *w, unsigned long n)
+{
+	struct bplus_write *fresh = malloc(n * sizeof(struct bplus_write));
+	lkey_t *ks = malloc(n * sizeof(lkey_t));
+	unsigned long nfresh = 0, j, run, added = 0;
+	enum bplus_error ok = fresh != NULL && ks != NULL ? OK : NOMEM;
+	if (n == 0) {
+		free(fresh);
+		free(ks);
+		return OK;
+	}
+	for (j = 0; ok == OK && j < n; j = run) {
+		value_t pv;
+		for (run = j; run < n && w[run].key == w[j].key; run++)
+			ks[run - j] = w[run].value;
+		if (find(ix->values, w[j].key, &pv) == OK) {
+			ok = posting_add(ix, w[j].key, posting_of(pv), ks, run - j);
+			if (ok == OK)
+				added = run;
+		} else {
+			struct posting *p = new_posting(ks, run - j);
+			if (p == NULL)
+				ok = NOMEM;
+			else
+				fresh[nfresh++] = (struct bplus_write){ w[j].key, (value_t)p, 0 };
+		}
+	}
+	if (ok == OK && nfresh != 0)
+		ok = bplus_write_batch(ix->values, fresh, nfresh);
+	if (ok == OK) {
+		ix->entries += n;
+	} else {
+		/* take back what was added to postings already there, and free the new ones */
+		for (j = 0; j < nfresh; j++)
+			free_posting(posting_of(fresh[j].value));
+		for (j = 0; j < added; j++) {
+			value_t pv;
+			if (find(ix->values, w[j].key, &pv) == OK) {
+				ix->entries += 1;
+				index_remove(ix, w[j].key, w[j].value);
+			}
+		}
+	}
+	free(fresh);
+	free(ks);
+	return ok;
+}
+
+/*
+ * The writes of a batch change the index in two steps around the batch: before it, the pairs
+ * it adds are added, so that it fails with nothing changed if they cannot be, and after it,
+ * the pairs it replaces or deletes are removed, or if it failed, those it added.
+ */
+struct index_batch {
+	struct bplus_write *adds;/* value -> key */
+	struct bplus_write *removes;
+	unsigned long nadds, nremoves;
+};
+
+/* add the pairs of the n writes of w, sorted by key with one write per key */
+static enum bplus_error index_batch_begin(bplus_t b, struct index_batch *x, const struct bplus_write *w,
+					  unsigned long n)
+{
+	struct bplus_write *tmp = malloc(n * sizeof(struct bplus_write)), *sorted;
+	enum bplus_error ok;
+	x->adds = malloc(n * sizeof(struct bplus_write));
+	x->removes = malloc(n * sizeof(struct bplus_write));
+	x->nadds = x->nremoves = 0;
+	if (tmp == NULL || x->adds == NULL || x->removes == NULL) {
+		free(tmp);
+		free(x->adds);
+		free(x->removes);
+		return NOMEM;
+	}
+	for (unsigned long j = 0; j < n; j++) {
+		/* expired records are still in the index, so look for them too */
+		blkp leaf = descend_to_leaf(b, w[j].key);
+		unsigned i = scan_leaf_keys(leaf, w[j].key);
+		int present = i < num_keys(leaf) && get_key(leaf, i) == w[j].key;
+		value_t old = present ? get_value(leaf, i) : 0;
+		if (present && (w[j].del || old != w[j].value))
+			x->removes[x->nremoves++] = (struct bplus_write){ old, w[j].key, 0 };
+		if (!w[j].del && (!present || old != w[j].value))
+			x->adds[x->nadds++] = (struct bplus_write){ w[j].value, w[j].key, 0 };
+	}
+	/* the sort is stable, so the keys of each value stay in order */
+	sorted = x->nadds != 0 ? sort_batch(x->adds, tmp, x->nadds) : x->adds;
+	ok = index_add_sorted(b->index, sorted, x->nadds);
+	if (sorted != x->adds)
+		memcpy(x->adds, sorted, x->nadds * sizeof(struct bplus_write));
+	free(tmp);
+	if (ok != OK) {
+		free(x->adds);
+		free(x->removes);
+	}
+	return ok;
+}
+
+static void index_batch_end(bplus_t b, struct index_batch *x, enum bplus_error ok)
+{
+	if (ok == OK)
+		for (unsigned long j = 0; j < x->nremoves; j++)
+			index_remove(b->index, x->removes[j].key, x->removes[j].value);
+	else
+		for (unsigned long j = 0; j < x->nadds; j++)
+			index_remove(b->index, x->adds[j].key, x->adds[j].value);
+	free(x->adds);
+	free(x->removes);
+}
+
+bplus_index_t bplus_index_new(bplus_t b)
+{
+	struct bplus_index *ix;
+	struct bplus_write *w, *tmp, *sorted;
+	unsigned long n = 0;
+	/* as for a change feed, the index would be in one process's memory only */
+	if (b->index != NULL || b->arena != NULL)
+		return NULL;
+	ix = calloc(1, sizeof(struct bplus_index));
+	w = malloc((b->num_recs + 1) * sizeof(struct bplus_write));
+	tmp = malloc((b->num_recs + 1) * sizeof(struct bplus_write));
+	if (ix != NULL)
+		ix->values = new_bplus_tree();
+	if (ix == NULL || ix->values == NULL || w == NULL || tmp == NULL)
+		goto fail;
+	ix->tree = b;
+	/* the index holds the records' values, so the tags above them are pushed down first */
+	push_range(b, 0, ~0UL);
+	/* the records in key order, sorted by value, are the pairs in (value, key) order */
+	for (blkp leaf = b->leaves; leaf != NULL; leaf = next_leaf(leaf))
+		for (unsigned i = 0; i < num_keys(leaf); i++)
+			w[n++] = (struct bplus_write){ get_value(leaf, i), get_key(leaf, i), 0 };
+	sorted = n != 0 ? sort_batch(w, tmp, n) : w;
+	if (index_add_sorted(ix, sorted, n) != OK)
+		goto fail;
+	free(w);
+	free(tmp);
+	b->index = ix;
+	return ix;
+fail:
+	if (ix != NULL && ix->values != NULL)
+		free_bplus_tree(ix->values);
+	free(ix);
+	free(w);
+	free(tmp);
+	return NULL;
+}
+
+void bplus_index_free(bplus_index_t ix)
+{
+	ix->tree->index = NULL;
+	for (blkp leaf = ix->values->leaves; leaf != NULL; leaf = next_leaf(leaf))
+		for (unsigned i = 0; i < num_keys(leaf); i++)
+			free_posting(posting_of(get_value(leaf, i)));
+	free_bplus_tree(ix->values);
+	free(ix);
+}
+
+/* call f on the keys of posting p of value v in order, until it returns non-zero */
+static int posting_scan(struct posting *p, value_t v, int (*f)(value_t v, lkey_t k, void *ctx), void *ctx)
+{
+	if (p->tree == NULL) {
+		for (unsigned long i = 0; i < p->n; i++)
+			if (f(v, p->keys[i], ctx))
+				return 1;
+		return 0;
+	}
+	for (blkp leaf = p->tree->leaves; leaf != NULL; leaf = next_leaf(leaf))
+		for (unsigned i = 0; i < num_keys(leaf); i++)
+			if (f(v, get_key(leaf, i), ctx))
+				return 1;
+	return 0;
+}
+
+struct index_keys {
+	lkey_t *keys;
+	unsigned long n, max;
+};
+
+static int collect_key(value_t v, lkey_t k, void *ctx)
+{
+	struct index_keys *c = ctx;
+	(void)v;
+	c->keys[c->n++] = k;
+	return c->n == c->max;
+}
+
+unsigned long bplus_index_find(bplus_index_t ix, value_t v, lkey_t *keys, unsigned long max)
+{
+	struct index_keys c = { keys, 0, max };
+	value_t pv;
+	if (find(ix->values, v, &pv) != OK)
+		return 0;
+	if (max != 0)
+		posting_scan(posting_of(pv), v, collect_key, &c);
+	return posting_of(pv)->n;
+}
+
+enum bplus_error bplus_index_scan(bplus_index_t ix, value_t lo, value_t hi,
+				  int (*f)(value_t v, lkey_t k, void *ctx), void *ctx)
+{
+	blkp leaf;
+	unsigned i;
+	if (lo > hi)
+		return OK;
+	leaf = descend_to_leaf(ix->values, lo);
+	for (i = scan_leaf_keys(leaf, lo); leaf != NULL; leaf = next_leaf(leaf), i = 0) {
+		for (; i < num_keys(leaf); i++) {
+			value_t v = get_key(leaf, i);
+			if (v > hi)
+				return OK;
+			if (posting_scan(posting_of(get_value(leaf, i)), v, f, ctx))
+				return INCOMPLETE;
+		}
+	}
+	return OK;
+}
+
+void bplus_index_stats(bplus_index_t ix, unsigned long *num_values, unsigned long *num_entries)
+{
+	*num_values = ix->values->num_recs;
+	*num_entries = ix->entries;
+}
+
+/* ***** B+ Tree operations ***** */
+
+void get_active_storage(bplus_t b, unsigned long *num_records, unsigned long *num_blocks, unsigned long *num_cursors)
+{
+	*num_records = b->num_recs;
+	*num_blocks = b->num_blks;
+	*num_cursors = b->num_crsrs;
+}
+
+unsigned long get_leaf_fill(bplus_t b, unsigned long *hist, unsigned nbuckets)
+{
+	unsigned long nleaves = 0;
+	memset(hist, 0, nbuckets * sizeof(hist[0]));
+	for (blkp leaf = b->leaves; leaf != NULL; leaf = next_leaf(leaf)) {
+		unsigned i = num_keys(leaf) * nbuckets / (ORDER - 1);
+		hist[i < nbuckets ? i : nbuckets - 1] += 1;
+		nleaves += 1;
+	}
+	return nleaves;
+}
+
+ 
+/*
+ * given the child an index node routes k to, the node that really holds k, following
+ * splits of the child that have not been posted into the index node yet
+ */
+static inline blkp follow_pending(bplus_t b, blkp child, lkey_t k)
+{
+	while (b->npending != 0) {
+		struct pending_split *right = NULL;
+		/* of the splits off child, the one with the highest separator <= k */
+		for (unsigned i = 0; i < b->npending; i++) {
+			struct pending_split *p = &b->pending[i];
+			if (p->left == child && p->key <= k && (right == NULL || p->key > right->key))
+				right = p;
+		}
+		if (right == NULL)
+			break;
+		child = right->right;
+	}
+	return child;
+}
+
+/* add t to the values under n, at height, and under the nodes split off n still pending */
+static void add_below(bplus_t b, blkp n, unsigned height, value_t t)
+{
+	if (height == 0) {
+		for (unsigned i = 0; i < num_keys(n); i++)
+			set_value(n, i, get_value(n, i) + t);
+	} else {
+		for (unsigned i = 0; i <= num_keys(n); i++)
+			set_tag(b, n, i, get_tag(b, n, i) + t);
+		mark_tags(b, n, 1);
+	}
+	for (unsigned j = 0; j < b->npending; j++)
+		if (b->pending[j].left == n)
+			add_below(b, b->pending[j].right, height, t);
+}
+
+/* push the tags of the children of index node, at height, down into them */
+static void push_tags(bplus_t b, blkp node, unsigned height)
+{
+	if (!has_tags(b, node))
+		return;
+	for (unsigned i = 0; i <= num_keys(node); i++) {
+		value_t t = get_tag(b, node, i);
+		if (t != 0) {
+			add_below(b, get_child(node, i), height - 1, t);
+			set_tag(b, node, i, 0);
+		}
+	}
+	mark_tags(b, node, 0);
+	b->tag_epoch += 1;
+}
+
+/* push the tags down the path to k, so the leaf holding it has its records' values */
+static void push_to_leaf(bplus_t b, lkey_t k)
+{
+	blkp node = b->root;
+	for (unsigned d = 0; d < b->depth; d++) {
+		push_tags(b, node, b->depth - d);
+		node = follow_pending(b, get_child(node, scan_index_keys(node, k)), k);
+	}
+}
+
+/* push every tag under node, at height, and under the nodes split off it, whose keys meet lo..hi */
+static void push_range_below(bplus_t b, blkp node, unsigned height, lkey_t lo, lkey_t hi)
+{
+	unsigned end;
+	if (height == 0)
+		return;
+	push_tags(b, node, height);
+	end = hi == ~0UL ? num_keys(node) : scan_index_keys(node, hi);
+	for (unsigned i = scan_index_keys(node, lo); i <= end; i++)
+		push_range_below(b, get_child(node, i), height - 1, lo, hi);
+	for (unsigned j = 0; j < b->npending; j++)
+		if (b->pending[j].left == node)
+			push_range_below(b, b->pending[j].right, height, lo, hi);
+}
+
+/* push the tags above the records with keys in lo..hi down into their leaves */
+static void push_range(bplus_t b, lkey_t lo, lkey_t hi)
+{
+	if (b->tags && b->root != NULL)
+		push_range_below(b, b->root, b->depth, lo, hi);
+	if (lo == 0 && hi == ~0UL)
+		b->tags = 0;
+}
+
+/*
+ * find leaf which should contain key, as descend_to_leaf() does, setting *t to the sum of the
+ * tags on the way, which is added to the values in the leaf
+ */
+static blkp descend_adding_tags(bplus_t b, lkey_t k, value_t *t)
+{
+	blkp node = b->root;
+	*t = 0;
+	for (unsigned d = 0; d < b->depth; d++) {
+		unsigned i = scan_index_keys(node, k);
+		if (has_tags(b, node))
+			*t += get_tag(b, node, i);
+		node = follow_pending(b, get_child(node, i), k);
+	}
+	return node;
+}
+
+/* the sum of the tags on the path to k */
+static value_t path_delta(bplus_t b, lkey_t k)
+{
+	value_t t;
+	descend_adding_tags(b, k, &t);
+	return t;
+}
+
+/* the value of record i of leaf, with the tags above it */
+static inline value_t leaf_value(bplus_t b, blkp leaf, unsigned i)
+{
+	return get_value(leaf, i) + (b->tags ? path_delta(b, get_key(leaf, i)) : 0);
+}
+
+/* find leaf which should contain key and position that should contain key */
+static blkp find_leaf(bplus_t b, lkey_t k)
+{
+	blkp node = b->root;
+	/* scan through index nodes above leaves, recording path */
+	for (unsigned d = 0; d < b->depth; d++) {
+		unsigned i = scan_index_keys(node, k); /* i is index of first key larger than or equal to k */
+		
+		b->path[d].node = node;
+		b->path[d].pos = i;/* where a new split child key would be inserted */
+		b->path[d].num_keys = num_keys(node);
+		if (b->tags)
+			push_tags(b, node, b->depth - d);
+		node = follow_pending(b, get_child(node, i), k); /* the i'th child is the child containing keys < k */
+	}
+	return node;
+}
+
+/*
+ * find leaf which should contain key, without recording the path. Since it writes nothing
+ * into the tree, any number of threads may descend at once while no thread modifies the tree.
+ */
+static blkp descend_to_leaf(bplus_t b, lkey_t k)
+{
+	blkp node = b->root;
+	for (unsigned d = 0; d < b->depth; d++)
+		node = follow_pending(b, get_child(node, scan_index_keys(node, k)), k);
+	return node;
+}
+
+/* find leaf node and value corresponding to key or fail with not found */
+enum bplus_error find(bplus_t b, lkey_t k, value_t *v)
+{
+	if (b->root != NULL) {
+		value_t t = 0;
+		blkp leaf = b->tags ? descend_adding_tags(b, k, &t) : descend_to_leaf(b, k);
+		/* scan leaf keys for match */
+		unsigned i = scan_leaf_keys(leaf, k);
+		heat_touch(b, leaf, 0);
+		/* i is the first key >= k, key isn't in leaf if there is none or key at i is != k */
+		if (i < num_keys(leaf) && k == get_key(leaf, i) && !expired(b, leaf, i)) {
+			*v = get_value(leaf, i) + t;
+			return OK;
+		}
+	}
+	return NOTFOUND;
+}
+
+/* insert key and value into leaf at insertion point i, moving remaining keys */
+static inline blkp insert_into_leaf(bplus_t b, blkp leaf, unsigned i, lkey_t key, value_t v)
+{
+	unsigned nk = num_keys(leaf);
+	if (nk - i != 0) {
+		wrdmove(leaf->words + KEY_0 + i + 1, leaf->words + KEY_0 + i, nk - i);
+		fldmove(b, leaf, i + 1, leaf, i, nk - i);
+	}
+	leaf->words[KEY_0 + i].key = key;
+	leaf->words[FIELD_0 + i].value = v;
+	leaf->words[HEADER].header.num_keys = nk + 1;
+	/* adjust cursors pointing after this */
+	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next)
+		if (bc->leaf == leaf && bc->pos >= i) bc->pos += 1;
+	return leaf;
+}
+
+/*
+ * insert splitting key and child node into node AFTER split child's key at i - 1, moving remaining keys.
+ * The new child's annotations are copied from the split child, since it holds part of its records.
+ */
+static blkp insert_split_into_index(bplus_t b, blkp node, unsigned i, lkey_t key, blkp child)
+{
+	unsigned nk = num_keys(node);
+	if (nk - i != 0) {
+		wrdmove(node->words + KEY_0 + i + 1, node->words + KEY_0 + i, nk - i);
+		fldmove(b, node, i + 2, node, i + 1, nk - i);
+	}
+	node->words[KEY_0 + i].key = key;
+	node->words[FIELD_0 + i + 1].child = child;
+	fldnote(b, node, i + 1, node, i);
+	node->words[HEADER].header.num_keys = nk + 1;
+	return node;
+}
+
+/* node split off new, its upper part, so pending splits off node are now to the right of new */
+static inline void move_pending_splits(bplus_t b, blkp node, blkp new)
+{
+	for (unsigned i = 0; i < b->npending; i++)
+		if (b->pending[i].left == node)
+			b->pending[i].left = new;
+}
+
+static blkp split_index(bplus_t b, blkp parent, blkp newp, unsigned pos, lkey_t *k, blkp new)
+{
+	/* 
+	 * Splits index node parent adding peer newp, Initially,
+	 * parent has ORDER - 1 keys, ORDER children, adding one key *k and one child new 
+	 * with new key at position pos and new child at pos+1 in overall sequence.
+	 * On return *k will contains new splitting key for new index block newp.
+	 *
+	 * parent and newp will then have LHALF + 1 and RHALF children, LHALF and RHALF-1 keys.
+	 * The new splitting key will be the key numbered LHALF in the combined sequence of ORDER
+	 * keys, and will be left in parent at key[LHALF].
+	 */
+	/* First setup new node sizes: */
+	parent->words[HEADER].header.num_keys = LHALF;
+	newp->words[HEADER].header.num_keys = RHALF - 1;
+	mark_tags(b, newp, has_tags(b, parent));
+#define CAREFUL // carefully coded version of split and insert
+#ifdef CAREFUL
+	/* careful copy of children to right node, with insert at pos */
+	unsigned j = RHALF - 1; /* j is target position (starting in new child) */
+	blkp dnode = newp;
+	/* the new child is annotated like the child it split from, at pos, which is moved after it */
+	if (pos == ORDER - 1) {
+		dnode->words[FIELD_0 + RHALF - 1].child = new;
+		fldnote(b, dnode, RHALF - 1, parent, pos);
+		j -= 1;
+	}
+	for (unsigned i = ORDER; i-- > 0;) {/* i is the source position in parent */
+		if (i < pos && i < LHALF + 1) break; /* insertion and split are complete */
+		fldmove(b, dnode, j, parent, i, 1);
+		if (j-- == 0) {
+			dnode = parent;
+			j = LHALF;
+		}
+		if (i == pos + 1) { /* inserting new child before this child */
+			dnode->words[FIELD_0 + j].child = new;
+			fldnote(b, dnode, j, parent, pos);
+			if (j-- == 0) {
+				dnode = parent;
+				j = LHALF;
+			}
+		}
+	}
+	/* careful copy of keys to right node, with insert at pos */
+	j = RHALF - 2; /* j is the target position (starting in new child) */
+	dnode = newp;
+	if (pos == ORDER - 1) {
+		dnode->words[KEY_0 + RHALF - 2].key = *k;
+		j -= 1;
+	}
+	for (unsigned i = ORDER - 1; i-- > 0; ) {/* i is the source position in parent */
+		if (i < pos && i < LHALF) break; /* insertions and split are complete */
+		dnode->words[KEY_0 + j] = parent->words[KEY_0 + i];
+		if (j-- == 0) {
+			dnode = parent;
+			j = LHALF;
+		}
+		if (i == pos) {/* inserting new key before this key */
+			dnode->words[KEY_0 + j].key = *k;
+			if (j-- == 0) {
+				dnode = parent;
+				j = LHALF;
+			}
+		}
+	}
+#else // optimized version of careful code using fast memory copy/move
+	/* Now move the keys and children into the new node, and insert new key and child */
+	if (pos < LHALF) { /* inserting new child into left part of split node */
+		/* copy rightmost RHALF-1  keys to newp, and RHALF children to newp */
+		wrdcpy(newp->words + KEY_0, parent->words + KEY_0 + LHALF, RHALF - 1);
+		fldmove(b, newp, 0, parent, LHALF, RHALF);
+		/* Now there are ORDER -1 - (RHALF - 1) == LHALF keys in parent, and ORDER - RHALF == LHALF children  */
+		/* then insert *k into parent keys at pos i, and new after at field pos i + 1 */
+		/* open up space for new key and child, moving at least one key to the right */
+		wrdmove(parent->words + KEY_0 + pos + 1, parent->words + KEY_0 + pos, LHALF - pos);
+		if (LHALF - pos - 1 != 0)
+			fldmove(b, parent, pos + 2, parent, pos + 1, LHALF - pos - 1);
+		/* insert new key and child */
+		parent->words[KEY_0 + pos].key = *k;
+		parent->words[FIELD_0 + pos + 1].child = new;
+		fldnote(b, parent, pos + 1, parent, pos);
+	} else if (pos == LHALF) {
+		/* inserting new child just at right of split, promoting *k again, and putting new first in right node */
+		wrdcpy(newp->words + KEY_0, parent->words + KEY_0 + LHALF, RHALF - 1);
+		fldmove(b, newp, 1, parent, LHALF + 1, RHALF - 1);
+		parent->words[KEY_0 + LHALF] = *k;
+	} else /* LHALF < i < ORDER */ {	/*  both inserted key and new child will be into right part of split node */
+		/* copy keys and children prior to new key and child, leaving behind key to be promoted */
+		wrdcpy(newp->words + KEY_0, parent->words + KEY_0 + LHALF + 1, pos - (LHALF + 1));
+		fldmove(b, newp, 0, parent, LHALF + 1, pos + 1 - (LHALF + 1));
+		/* insert new key and child */
+		newp->words[KEY_0 + pos - (LHALF + 1)].key = *k;
+		newp->words[FIELD_0 + pos - LHALF].child = new;
+		fldnote(b, newp, pos - LHALF, parent, pos);
+		/* copy the rest, after new key */
+		if (ORDER - 1 - pos != 0) {
+			wrdcpy(newp->words + KEY_0 + pos - LHALF, parent->words + KEY_0 + pos + 2, ORDER - 1 - pos);
+			fldmove(b, newp, pos + 1 - LHALF, parent, pos + 2, ORDER - 1 - pos);
+		}
+	}
+#endif
+	/*
+	 * return newly created node and the leftmost key in its subtree, by promoting
+	 * the last key to the right left in parent.
+	 */
+	*k = parent->words[KEY_0 + LHALF].key;
+	move_pending_splits(b, parent, newp);
+	rehash(b, parent, 0);
+	rehash(b, newp, 0);
+	rezone(b, parent, 0);
+	rezone(b, newp, 0);
+	return newp;
+
+}
+ 
+static blkp split_leaf(bplus_t b, blkp leaf, blkp new, unsigned i, lkey_t *k, value_t v)
+{
+	/* full leaf: has ORDER-1 keys, ORDER-1 values; two new leaves will have ORDER/2 keys and values */
+	/* Note: i < ORDER on entry */
+	leaf->words[HEADER].header.num_keys = LHALF;
+	new->words[HEADER].header.num_keys = RHALF;
+	/* add new linked leaf node via NEXT pointer */
+	set_next_leaf(new, next_leaf(leaf));
+	set_next_leaf(leaf, new);
+	/* insert new key and value into old or new leaf based on where it should have been inserted */
+	if (i < LHALF) {/* key will be inserted in left result node */
+		wrdcpy(new->words + KEY_0, leaf->words + KEY_0 + LHALF - 1, RHALF);
+		fldmove(b, new, 0, leaf, LHALF - 1, RHALF);
+		if (LHALF - 1 - i != 0) {
+			wrdmove(leaf->words + KEY_0 + i + 1, leaf->words + KEY_0 + i, LHALF - 1 - i);
+			fldmove(b, leaf, i + 1, leaf, i, LHALF - 1 - i);
+		}
+		leaf->words[KEY_0 + i].key = *k;
+		leaf->words[FIELD_0 + i].value = v;
+	} else {/* key will be inserted into right result node */
+		if (i > LHALF) {
+			wrdcpy(new->words + KEY_0, leaf->words + KEY_0 + LHALF, i - LHALF);
+			fldmove(b, new, 0, leaf, LHALF, i - LHALF);
+		}
+		new->words[KEY_0 + i - LHALF].key = *k;
+		new->words[FIELD_0 + i - LHALF].value = v;
+		if (ORDER - 1 - i != 0) {
+			wrdcpy(new->words + KEY_0 + i + 1 - LHALF, leaf->words + KEY_0 + i, ORDER - 1 - i);
+			fldmove(b, new, i + 1 - LHALF, leaf, i, ORDER - 1 - i);
+		}
+	}
+	/* promote leftmost key in new leaf to parent */
+	*k = get_key(new, 0);
+	TRACE(split_leaf, b->depth, *k, LHALF);
+	move_pending_splits(b, leaf, new);
+	rehash(b, leaf, 1);
+	rehash(b, new, 1);
+	rezone(b, leaf, 1);
+	rezone(b, new, 1);
+	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+		if (bc->leaf == leaf) {
+			if (bc->pos >= i) bc->pos += 1;
+			if (bc->pos >= LHALF) {
+				bc->leaf = new;
+				bc->pos -= LHALF;
+			}
+		}
+	}
+	return new;
+}
+
+static void add_root_block(bplus_t b, blkp left_child, lkey_t k, blkp right_child)
+{
+	blkp new = b->new_root;
+	new->words[HEADER].header.num_keys = 1;
+	new->words[KEY_0].key = k;
+	new->words[FIELD_0].child = left_child;
+	new->words[FIELD_0 + 1].child = right_child;
+	if (b->ttl_page != 0) {
+		set_expiry(b, new, 0, min_expiry(b, left_child, b->depth == 0));
+		set_expiry(b, new, 1, min_expiry(b, right_child, b->depth == 0));
+	}
+	if (b->tag_page != 0) {
+		set_tag(b, new, 0, 0);
+		set_tag(b, new, 1, 0);
+		mark_tags(b, new, 0);
+	}
+	rehash(b, new, 0);
+	rezone(b, new, 0);
+	b->root = new;
+	b->depth += 1;
+	TRACE(root_grow, 0, k, 1);
+}
+
+/* insert new, split off the node at depth d of the path, into its parent chain */
+static void insert_new_block(bplus_t b, unsigned d, blkp new, lkey_t *k)
+{
+		/* insert new into parent chain, splitting nodes as needed */
+	while (d != 0) {
+		blkp parent = b->path[--d].node;
+		unsigned i = b->path[d].pos;
+		if (num_keys(parent) < ORDER - 1) {
+			/* insert new block into this ancestor, and done */
+			insert_split_into_index(b, parent, i, *k, new);
+			return;
+		}
+		/* full, split this parent, inserting key and getting new block and promoted key */
+		new = split_index(b, parent, b->path[d].split, i, k, new);
+		TRACE(split_index, d, *k, LHALF);
+		/* continue, inserting new and promoted key into its parent */
+	}
+	/* having split root, must add a node above the current root to hold new and current root */
+	add_root_block(b, b->root, *k, new);
+}
+
+/* take pending split i out of the table */
+static void remove_pending(bplus_t b, unsigned i)
+{
+	b->pending[i] = b->pending[--b->npending];
+}
+
+/*
+ * post the separator of the pending split nearest the root into its parent. If the parent
+ * is full it is split instead, and its own new node is posted into the grandparent, or
+ * left pending if that is full too. So it splits at most one index node.
+ */
+static enum bplus_error finish_pending_split(bplus_t b)
+{
+	unsigned j = 0;
+	unsigned d;
+	struct pending_split p;
+	blkp node, newp, new_root = NULL;
+	lkey_t k;
+	if (path_reserved(b) != OK)
+		return NOMEM;
+	for (unsigned i = 1; i < b->npending; i++)
+		if (b->pending[i].depth < b->pending[j].depth)
+			j = i;
+	p = b->pending[j];
+	d = p.depth;
+	/* the parent is the node at depth d whose key range holds the separator */
+	node = b->root;
+	for (unsigned e = 0; e < d; e++) {
+		b->path[e].node = node;
+		node = follow_pending(b, get_child(node, scan_index_keys(node, p.key)), p.key);
+	}
+	if (num_keys(node) < ORDER - 1) {
+		insert_split_into_index(b, node, scan_index_keys(node, p.key), p.key, p.right);
+		remove_pending(b, j);
+		return OK;
+	}
+	/* parent is full, allocate before changing anything */
+	newp = new_index_block(b);
+	if (newp == NULL)
+		return NOMEM;
+	if (d == 0) {
+		new_root = new_index_block(b);
+		if (new_root == NULL) {
+			free_index_block(b, newp);
+			return NOMEM;
+		}
+	}
+	b->num_blks += d == 0 ? 2 : 1;
+	TRACE(alloc, d, p.key, d == 0 ? 2 : 1);
+	/* p.right becomes a child of node or newp, so it must not be pending when they are hashed */
+	remove_pending(b, j);
+	k = p.key;
+	newp = split_index(b, node, newp, scan_index_keys(node, k), &k, p.right);
+	TRACE(split_index, d, k, LHALF);
+	if (d == 0) {
+		b->new_root = new_root;
+		add_root_block(b, node, k, newp);
+		/* every node waiting for a parent is one level deeper now */
+		for (unsigned i = 0; i < b->npending; i++)
+			b->pending[i].depth += 1;
+	} else if (num_keys(b->path[d - 1].node) < ORDER - 1) {
+		blkp parent = b->path[d - 1].node;
+		insert_split_into_index(b, parent, scan_index_keys(parent, k), k, newp);
+	} else {
+		b->pending[b->npending++] = (struct pending_split){ d - 1, node, k, newp };
+		TRACE(defer_split, d - 1, k, b->npending);
+	}
+	return OK;
+}
+
+enum bplus_error bplus_maintain(bplus_t b, unsigned long budget)
+{
+	for (; budget != 0 && b->npending != 0; budget--)
+		if (finish_pending_split(b) != OK)
+			return NOMEM;
+	return b->npending != 0 ? INCOMPLETE : OK;
+}
+
+/* split full leaf, leaving the new leaf pending since its parent is full too */
+static enum bplus_error defer_leaf_split(bplus_t b, blkp leaf, unsigned i, lkey_t k, value_t v)
+{
+	blkp new = new_leaf_block(b);
+	if (new == NULL)
+		return NOMEM;
+	b->num_blks += 1;
+	TRACE(alloc, b->depth, k, 1);
+	new = split_leaf(b, leaf, new, i, &k, v);
+	b->pending[b->npending++] = (struct pending_split){ b->depth - 1, leaf, k, new };
+	TRACE(defer_split, b->depth - 1, k, b->npending);
+	return OK;
+}
+
+/* insert key value pair, expiring at time e, into leaf, just found by find_leaf() */
+static enum bplus_error insert_at(bplus_t b, blkp leaf, lkey_t k, value_t v, unsigned long e)
+{
+	enum bplus_error ok = OK;
+	unsigned nk = num_keys(leaf), depth = b->depth;
+	unsigned i = scan_leaf_keys(leaf, k);
+	int present = i < nk && get_key(leaf, i) == k;
+	/* the feed sees expired records as present until swept, so this is an update of one */
+	enum bplus_change_op op = present ? BPLUS_CHANGE_UPDATE : BPLUS_CHANGE_INSERT;
+	value_t old = present ? get_value(leaf, i) : 0;
+	unsigned long delta = b->hash_page == 0 ? 0 :
+		record_hash(k, v) - (present ? record_hash(k, old) : 0);
+	/* the index takes the new pair first, so running out of memory there changes nothing */
+	int indexed = b->index != NULL && !(present && old == v);
+	if (indexed && index_add(b->index, v, k) != OK)
+		return NOMEM;
+	heat_touch(b, leaf, 1);
+	/* bounds on the way down must cover the new expiry, before any split copies them */
+	if (b->ttl_page != 0)
+		for (unsigned d = 0; d < b->depth; d++)
+			if (e < get_expiry(b, b->path[d].node, b->path[d].pos))
+				set_expiry(b, b->path[d].node, b->path[d].pos, e);
+	/* so are hashes and value bounds, since a split recomputes those of the nodes it splits */
+	hash_path(b, leaf, delta);
+	zone_path(b, leaf, v);
+	if (present)/* key is already present */
+		set_value(leaf, i, v);/* update value */
+	else if (nk < ORDER-1) {/* has room for new k,v pair */
+		insert_into_leaf(b, leaf, i, k, v);
+		b->num_recs += 1;
+	} else if ((b->flags & BPLUS_DEFERRED_SPLITS) && b->depth != 0 &&
+		   b->path[b->depth - 1].num_keys == ORDER - 1) {
+		ok = defer_leaf_split(b, leaf, i, k, v);
+		if (ok == OK)
+			b->num_recs += 1;
+	} else {
+		/* must split leaf, preallocate all needed memory */
+		blkp split = preallocate_splits(b, k);
+		if (split == NULL) ok = NOMEM;
+		else {
+			/* the split turns its key into the separator to post, so give it a copy */
+			lkey_t sep = k;
+			insert_new_block(b, b->depth, split_leaf(b, leaf, split, i, &sep, v), &sep);
+			b->num_recs += 1;
+		}
+	}
+	if (ok == OK && b->ttl_page != 0) {
+		/* if the leaf was split, the record went into the new leaf after it unless i < LHALF */
+		if (!present && nk == ORDER - 1 && i >= LHALF)
+			set_expiry(b, next_leaf(leaf), i - LHALF, e);
+		else
+			set_expiry(b, leaf, i, e);
+		/* a root put over a lone leaf took its bounds from the halves before the record had one */
+		if (depth == 0 && b->depth == 1 && e < get_expiry(b, b->root, i >= LHALF))
+			set_expiry(b, b->root, i >= LHALF, e);
+	}
+	if (ok == OK)
+		cdc_note(b, op, k, old, v);
+	else
+		hash_path(b, leaf, -delta);
+	if (indexed && (ok != OK || present))
+		index_remove(b->index, ok == OK ? old : v, k);
+	return ok;
+}
+
+/* insert new key value pair, expiring at time e, into B+ tree */
+static enum bplus_error insert_record(bplus_t b, lkey_t k, value_t v, unsigned long e)
+{
+	enum bplus_error ok = OK;
+	/* with deferred splits, finish one when several are waiting, and always leave room for one more */
+	if (b->npending >= PENDING_DRAIN)
+		ok = finish_pending_split(b);
+	while (ok == OK && b->npending == PENDING_MAX)
+		ok = finish_pending_split(b);
+	/* insure that we don't need to allocate memory during insert, or to delete after it grows the tree */
+	if (ok == OK)
+		ok = path_reserve(b, b->depth + 1);
+	if (ok == OK)
+		ok = insert_at(b, find_leaf(b, k), k, v, e);
+	return ok;
+}
+
+enum bplus_error insert(bplus_t b, lkey_t k, value_t v)
+{
+	return insert_record(b, k, v, NEVER);
+}
+
+enum bplus_error bplus_insert_ttl(bplus_t b, lkey_t k, value_t v, unsigned long expires)
+{
+	return insert_record(b, k, v, expires);
+}
+/* fix cursors after rotating one item from right peer to leaf */
+static void fix_cursor_rotate_left(bplus_t b, blkp leaf, blkp rpeer)
+{
+	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+		if (bc->leaf == rpeer) {
+			if (bc->pos == 0) {
+				bc->leaf = leaf;
+				bc->pos = num_keys(leaf) - 1;
+			} else {
+				bc->pos -= 1;
+			}
+		}
+	}
+}
+
+/* fix cursors after rotating one item from left peer to leaf */
+static void fix_cursor_rotate_right(bplus_t b, blkp lpeer, blkp leaf)
+{
+	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
 		if (bc->leaf == leaf) {
 			bc->pos += 1;
 		} else if (bc->leaf == lpeer && bc->pos == num_keys(lpeer)) {
 			bc->leaf = leaf;
-			bc->pos = 0;
+			bc->pos = 0;
+		}
+	}
+}
+
+/* merging leaf and rightward peer deletes peer, so correct cursors to peer */
+static void fix_cursor_merge(bplus_t b, blkp leaf, blkp peer, unsigned nkl)
+{
+	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+		if (bc->leaf == peer) {
+			/* leaf had nkl key,value pairs */
+			bc->leaf = leaf;
+			bc->pos += nkl;
+		}
+	}
+}
+
+static void merge_index_nodes(bplus_t b, blkp l, blkp r, lkey_t s)
+{
+	unsigned nkl = num_keys(l);
+	unsigned nkr = num_keys(r);
+#ifdef CHECK_INVARIANTS
+	/* merge overflow should not happen */
+	if (nkl + nkr > ORDER - 2) {
+		printf("Index node too big to merge, %u %u\n", nkl, nkr);
+		exit(EXIT_FAILURE);
+	}
+#endif
+	l->words[KEY_0 + nkl].key = s;
+	wrdmove(l->words + KEY_0 + nkl + 1, r->words + KEY_0, nkr);
+	fldmove(b, l, nkl + 1, r, 0, nkr + 1);
+	move_tags(b, l, r);
+	l->words[HEADER].header.num_keys += nkr + 1;
+	move_hash(b, l, r, get_hash(b, r));
+	if (b->zone_page != 0)
+		cover_zone(b, l, r);
+#ifdef CHECK_INVARIANTS
+	if (l->words[KEY_0 + nkl - 1].key >= l->words[KEY_0 + nkl].key ||
+	    l->words[KEY_0 + nkl].key >= l->words[KEY_0 + nkl + 1].key) {
+		    printf("index merge destroyed ordering of keys in node.\n");
+		    exit(EXIT_FAILURE);
+	    }
+#endif	
+	free_index_block(b, r);
+	b->num_blks -= 1;
+}
+
+static int index_underflow(bplus_t b, unsigned d, blkp inode, unsigned *posp)
+{
+	/* time to restore invariant so all layers have >= ORDER/2 keys by combining nodes? */
+	/* inode is not root, number of keys in inode < LHALF */
+	blkp parent = b->path[d].node;
+	unsigned pos = b->path[d].pos;
+	unsigned nkp = b->path[d].num_keys;
+	blkp rpeer = NULL;
+	unsigned nkr;
+	unsigned nki = num_keys(inode);
+	TRACE(index_underflow, d + 1, parent->words[KEY_0 + (pos < nkp ? pos : pos - 1)].key, nki);
+	if (pos < nkp) {
+		rpeer = parent->words[FIELD_0 + pos + 1].child;
+		nkr = num_keys(rpeer);
+		/* if right peer has more keys than can be merged, rotate from right through parent */
+		if (nki + nkr > ORDER - 2) {
+			/* rotate rpeer key through its splitting key in parent */
+			inode->words[KEY_0 + nki].key = parent->words[KEY_0 + pos].key;
+			parent->words[KEY_0 + pos].key = rpeer->words[KEY_0].key;
+			move_hash(b, inode, rpeer, subtree_hash(b, get_child(rpeer, 0)));
+			if (b->zone_page != 0)
+				cover_zone(b, inode, get_child(rpeer, 0));
+			fldmove(b, inode, nki + 1, rpeer, 0, 1);
+			move_tags(b, inode, rpeer);
+			wrdmove(rpeer->words + KEY_0, rpeer->words + KEY_0 + 1, nkr - 1);
+			fldmove(b, rpeer, 0, rpeer, 1, nkr);
+			inode->words[HEADER].header.num_keys += 1;
+			rpeer->words[HEADER].header.num_keys -= 1;
+			merge_expiry(b, parent, pos, pos + 1);
+			TRACE(rotate_index_left, d + 1, parent->words[KEY_0 + pos].key, nki + 1);
+			return 0;
+		}
+		/* right peer can be merged */
+	}
+	if (pos > 0) {
+		blkp lpeer = parent->words[FIELD_0 + pos - 1].child;
+		unsigned nkl = num_keys(lpeer);
+		/* else if left peer has more keys than can be merged, rotate from left through parent */
+		if (nkl + nki > ORDER - 2) {
+			wrdmove(inode->words + KEY_0 + 1, inode->words + KEY_0, nki);
+			fldmove(b, inode, 1, inode, 0, nki + 1);
+			inode->words[KEY_0].key = parent->words[KEY_0 + pos - 1].key;
+			parent->words[KEY_0 + pos - 1].key = lpeer->words[KEY_0 + nkl - 1].key;
+			move_hash(b, inode, lpeer, subtree_hash(b, get_child(lpeer, nkl)));
+			if (b->zone_page != 0)
+				cover_zone(b, inode, get_child(lpeer, nkl));
+			fldmove(b, inode, 0, lpeer, nkl, 1);
+			move_tags(b, inode, lpeer);
+			inode->words[HEADER].header.num_keys += 1;
+			lpeer->words[HEADER].header.num_keys -= 1;
+			merge_expiry(b, parent, pos, pos - 1);
+			TRACE(rotate_index_right, d + 1, parent->words[KEY_0 + pos - 1].key, nki + 1);
+			return 0;
+		}
+		/* merge into the left peer and delete inode */
+		merge_expiry(b, parent, pos - 1, pos);
+		merge_index_nodes(b, lpeer, inode, parent->words[KEY_0 + pos - 1].key);
+		TRACE(merge_index, d + 1, parent->words[KEY_0 + pos - 1].key, num_keys(lpeer));
+		/* parent[pos] to be removed recursively */
+		*posp = pos;
+	} else {
+		/* else pos == 0, so merge right peer into inode. */
+		merge_expiry(b, parent, pos, pos + 1);
+		merge_index_nodes(b, inode, rpeer, parent->words[KEY_0 + pos].key);
+		TRACE(merge_index, d + 1, parent->words[KEY_0 + pos].key, num_keys(inode));
+		/* parent[pos + 1] to be removed recursively */
+		*posp = pos + 1;
+	}
+	return 1;
+}
+
+#ifdef CHECK_INVARIANTS
+/* find rightmost key under inode at depth d */
+static lkey_t rightmost_key(bplus_t b, blkp inode, unsigned d)
+{
+	return (d == b->depth) ? /* leaf node */
+		inode->words[KEY_0 + num_keys(inode) - 1].key :
+		rightmost_key(b, inode->words[FIELD_0 + num_keys(inode)].child, d + 1);
+}
+static lkey_t leftmost_key(bplus_t b, blkp inode, unsigned d)
+{
+	return (d == b->depth) ? /* leaf node */
+		inode->words[KEY_0].key :
+		leftmost_key(b, inode->words[FIELD_0].child, d + 1);
+}
+#endif
+
+/* recurse over path removing node at pos */
+static void shrink_index_ancestors(bplus_t b, unsigned d, unsigned pos)
+{
+	/* remove child from index node layer d at pos */
+	/*
+	 * NOTE: we never are called to delete the leftmost child of any index node
+	 * from below. Only merges of index nodes manage splitting keys and their children.
+	 */
+	blkp inode = b->path[d].node;
+	unsigned nk = b->path[d].num_keys;
+	if (nk - pos > 0) { /* slide down key,child pairs after pos */
+		wrdmove(inode->words + KEY_0 + pos - 1, inode->words + KEY_0 + pos, nk - pos);
+		fldmove(b, inode, pos, inode, pos + 1, nk - pos);
+	}
+	nk -= 1;
+	inode->words[HEADER].header.num_keys = nk;
+#ifdef CHECK_INVARIANTS /* after deleting child at key[pos-1]*/
+	{
+		for (unsigned i = pos - 1; i < nk; i++) {
+			lkey_t key = inode->words[KEY_0 + i].key;
+			blkp prev_child = inode->words[FIELD_0 + i].child;
+			blkp child = inode->words[FIELD_0 + i + 1].child;
+			lkey_t key_below = rightmost_key(b, prev_child, d + 1);
+			lkey_t key_above = leftmost_key(b, child, d + 1);
+			if (key_below >= key || key > key_above) {
+				printf("Ordering failed at depth %u of %u: %lu ^< %lu ~<= %lu\n",
+					d, b->depth, key_below, key, key_above);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+#endif
+	if (d == 0) {
+		/* this is the root, whose minimum size is 2 keys, if only one is left, delete root */
+		if (nk == 0) {
+			/*  delete this root here, promote the remaining child to root. */
+			b->root = inode->words[FIELD_0].child;
+			b->depth -= 1;
+			TRACE(root_shrink, 0, get_key(b->root, 0), num_keys(b->root));
+			free_index_block(b, inode);
+			b->num_blks -= 1;
+			if (b->depth == 0 && b->arena == NULL && b->reserve == NULL) {
+				/* when tree has no index nodes, optionally clean up path, unless set aside with blocks */
+				b->path_length = 0;
+				free(b->path);
+				b->path = NULL;
+			}
+		} else {
+			/* root node has more than 1 remaining child, done */
+		}
+	} else if (nk < LHALF) {
+		/* handle underflow by rotation or merge of inode and either peer */
+		int merged = index_underflow(b, d - 1, inode, &pos);
+		/* and recurse to parent (if merge, not rotate)*/
+		if (merged)
+			shrink_index_ancestors(b, d - 1, pos);
+	} else {
+		/* if non-root index node doesn't underflow, return */
+	}
+}
+
+static void merge_leaf_nodes(bplus_t b, blkp l, blkp r)
+{
+	unsigned nkl = num_keys(l);
+	unsigned nkr = num_keys(r);
+	wrdmove(l->words + KEY_0 + nkl, r->words + KEY_0, nkr);
+	fldmove(b, l, nkl, r, 0, nkr);
+	l->words[HEADER].header.num_keys += nkr;
+	l->words[NEXT].leaf = r->words[NEXT].leaf;
+	move_hash(b, l, r, get_hash(b, r));
+	widen_zone(b, l, get_zone_min(b, r), get_zone_max(b, r));
+	TRACE(merge_leaf, b->depth, get_key(l, 0), nkl + nkr);
+	fix_cursor_merge(b, l, r, nkl);
+	heat_forget(b, r);
+	free_leaf_block(b, r);
+	b->num_blks -= 1;
+}
+
+static void leaf_underflow(bplus_t b, blkp leaf)
+{
+	/* time to restore invariant so all layers have >= ORDER/2 keys by combining nodes? */
+	/* leaf is not root, number of keys in leaf < LHALF, usually LHALF - 1 after a delete */
+	unsigned d = b->depth - 1;
+	blkp parent = b->path[d].node;
+	unsigned pos = b->path[d].pos;
+	unsigned nk = b->path[d].num_keys;
+	unsigned nkl = num_keys(leaf);
+	blkp rpeer = NULL;
+	TRACE(leaf_underflow, b->depth, get_key(leaf, 0), nkl);
+	if (pos < nk) {
+		rpeer = parent->words[FIELD_0 + pos + 1].child;
+		/* if right peer has nkey > LHALF, rotate from right and fix split in parent */
+		if (num_keys(rpeer) > LHALF) {
+			leaf->words[KEY_0 + nkl].key = rpeer->words[KEY_0].key;
+			move_hash(b, leaf, rpeer, record_hash(get_key(rpeer, 0), get_value(rpeer, 0)));
+			widen_zone(b, leaf, get_value(rpeer, 0), get_value(rpeer, 0));
+			fldmove(b, leaf, nkl, rpeer, 0, 1);
+			wrdmove(rpeer->words + KEY_0, rpeer->words + KEY_0 + 1, num_keys(rpeer) - 1);
+			fldmove(b, rpeer, 0, rpeer, 1, num_keys(rpeer) - 1);
+			leaf->words[HEADER].header.num_keys += 1;
+			rpeer->words[HEADER].header.num_keys -= 1;
+			parent->words[KEY_0 + pos].key = rpeer->words[KEY_0].key;
+			merge_expiry(b, parent, pos, pos + 1);
+			TRACE(rotate_leaf_left, b->depth, parent->words[KEY_0 + pos].key, nkl + 1);
+			fix_cursor_rotate_left(b, leaf, rpeer);
+			return;
+		}
+	}
+	if (pos > 0) {
+		blkp lpeer = parent->words[FIELD_0 + pos - 1].child;
+		/* else if left peer has nkey > LHALF, rotate from left, fixing split key in parent */
+		if (num_keys(lpeer) > LHALF) {
+			wrdmove(leaf->words + KEY_0 + 1, leaf->words + KEY_0, num_keys(leaf));
+			fldmove(b, leaf, 1, leaf, 0, num_keys(leaf));
+			leaf->words[KEY_0].key = lpeer->words[KEY_0 + num_keys(lpeer) - 1].key;
+			move_hash(b, leaf, lpeer, record_hash(get_key(lpeer, num_keys(lpeer) - 1),
+							     get_value(lpeer, num_keys(lpeer) - 1)));
+			widen_zone(b, leaf, get_value(lpeer, num_keys(lpeer) - 1),
+				   get_value(lpeer, num_keys(lpeer) - 1));
+			fldmove(b, leaf, 0, lpeer, num_keys(lpeer) - 1, 1);
+			leaf->words[HEADER].header.num_keys += 1;
+			lpeer->words[HEADER].header.num_keys -= 1;
+			parent->words[KEY_0 + pos - 1].key = leaf->words[KEY_0].key;
+			merge_expiry(b, parent, pos, pos - 1);
+			TRACE(rotate_leaf_right, b->depth, leaf->words[KEY_0].key, num_keys(leaf));
+			fix_cursor_rotate_right(b, lpeer, leaf);
+			return;
+		}
+		/* merge with the left peer and delete leaf */
+		merge_expiry(b, parent, pos - 1, pos);
+		merge_leaf_nodes(b, lpeer, leaf);
+		shrink_index_ancestors(b, b->depth - 1, pos);
+	} else {
+		/* else pos == 0, so merge with right peer, which exists and was too small to borrow from */
+		merge_expiry(b, parent, pos, pos + 1);
+		merge_leaf_nodes(b, leaf, rpeer);
+		shrink_index_ancestors(b, b->depth - 1, pos + 1);
+	}
+}
+
+
+
+/* remove the n records starting at i from leaf, without fixing any underflow */
+static void remove_from_leaf(bplus_t b, blkp leaf, unsigned i, unsigned n)
+{
+	unsigned nk = num_keys(leaf);
+	unsigned sfx_count = nk - i - n;
+	if (sfx_count != 0) {
+		wrdmove(leaf->words + KEY_0 + i, leaf->words + KEY_0 + i + n, sfx_count);
+		fldmove(b, leaf, i, leaf, i + n, sfx_count);
+	}
+	leaf->words[HEADER].header.num_keys = nk - n;
+	b->num_recs -= n;
+	/* cursors on removed records become invalid at the record after them, later ones slide down */
+	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+		if (bc->leaf == leaf) {
+			if (bc->pos >= i + n)
+				bc->pos -= n;
+			else if (bc->pos >= i) {
+				bc->pos = i;
+				bc->invalid = 1;
+			}
+		}
+	}
+}
+
+/* delete key k from leaf, just found by find_leaf() with no splits pending */
+static enum bplus_error delete_at(bplus_t b, blkp leaf, lkey_t k)
+{
+	unsigned nk = num_keys(leaf);
+	unsigned i = scan_leaf_keys(leaf, k);
+	heat_touch(b, leaf, 1);
+	if (i < nk && get_key(leaf, i) == k) {
+		/* key k was found in leaf, remove record (key, value) */
+		cdc_note_removed(b, leaf, i, 1);
+		index_removed(b, leaf, i, 1);
+		hash_removed(b, leaf, i, 1);
+		remove_from_leaf(b, leaf, i, 1);
+		/* if new leaf size (nk - 1) < min size, handle this underflow */
+		if (b->depth > 0 && nk <= LHALF)
+			leaf_underflow(b, leaf);
+		return OK;
+	}
+	return NOTFOUND;
+}
+
+enum bplus_error delete(bplus_t b, lkey_t k)
+{
+	/* merges and rotations only know about posted children, so finish pending splits first */
+	enum bplus_error ok = bplus_maintain(b, ~0UL);
+	if (ok == OK)
+		ok = path_reserved(b);
+	if (ok == OK)
+		ok = delete_at(b, find_leaf(b, k), k);
+	return ok;
+}
+
+enum bplus_error delete_range_step(bplus_t b, lkey_t lo, lkey_t hi, unsigned long budget)
+{
+	enum bplus_error ok = bplus_maintain(b, ~0UL);
+	if (ok == OK)
+		ok = path_reserved(b);
+	while (ok == OK) {
+		blkp leaf = find_leaf(b, lo);
+		unsigned nk = num_keys(leaf);
+		unsigned i = scan_leaf_keys(leaf, lo);
+		unsigned j, n;
+		if (i == nk) {
+			/* nothing at or after lo in this leaf, the range may go on in the next one */
+			blkp next = next_leaf(leaf);
+			if (next == NULL || num_keys(next) == 0 || get_key(next, 0) > hi)
+				break;
+			lo = get_key(next, 0);
+			continue;
+		}
+		if (get_key(leaf, i) > hi)
+			break;
+		if (budget == 0) {
+			ok = INCOMPLETE;
+			break;
+		}
+		/* remove the run of keys <= hi, but only as far as one record short of the leaf minimum */
+		for (j = i; j < nk && get_key(leaf, j) <= hi; j++);
+		n = j - i;
+		if (n > budget)
+			n = budget;
+		if (b->depth > 0 && nk - n < LHALF - 1)
+			n = nk >= LHALF ? nk - (LHALF - 1) : 1;
+		heat_touch(b, leaf, 1);
+		cdc_note_removed(b, leaf, i, n);
+		index_removed(b, leaf, i, n);
+		hash_removed(b, leaf, i, n);
+		remove_from_leaf(b, leaf, i, n);
+		budget -= n;
+		if (b->depth > 0 && nk - n < LHALF)
+			leaf_underflow(b, leaf);
+		/* search again from lo, since underflow may have moved records between leaves */
+		ok = path_reserved(b);
+	}
+	return ok;
+}
+
+/* ***** atomic write batches ***** */
+
+/*
+ * A batch is sorted by key and applied in leaf order, in two passes: first its new keys and
+ * updates, then its deletes. Only the inserts can need blocks, so before changing anything
+ * the batch counts the most blocks they can split off, level by level, and sets that many
+ * aside in the tree's reserve, where preallocate_splits() takes them from. After that no
+ * step of the batch can run out of memory.
+ */
+
+/*
+ * sort w[0..n) by key with a radix sort a byte at a time, moving the writes between w and tmp,
+ * and return the one they end up in. It is stable, so the writes of a key stay in batch order.
+ */
+static struct bplus_write *sort_batch(struct bplus_write *w, struct bplus_write *tmp, unsigned long n)
+{
+	static const unsigned digits = sizeof(lkey_t);
+	unsigned long count[sizeof(lkey_t)][256];
+	memset(count, 0, sizeof(count));
+	for (unsigned long j = 0; j < n; j++)
+		for (unsigned d = 0; d < digits; d++)
+			count[d][(w[j].key >> (8 * d)) & 0xFF] += 1;
+	for (unsigned d = 0; d < digits; d++) {
+		unsigned long pos = 0;
+		struct bplus_write *t;
+		/* nothing to do if every key has the same byte here */
+		if (count[d][(w[0].key >> (8 * d)) & 0xFF] == n)
+			continue;
+		for (unsigned i = 0; i < 256; i++) {
+			unsigned long c = count[d][i];
+			count[d][i] = pos;
+			pos += c;
+		}
+		for (unsigned long j = 0; j < n; j++)
+			tmp[count[d][(w[j].key >> (8 * d)) & 0xFF]++] = w[j];
+		t = w;
+		w = tmp;
+		tmp = t;
+	}
+	return w;
+}
+
+/* the leaf found last, whose path is still in b->path, and the key it ends before */
+struct finger {
+	blkp leaf;
+	int bounded;/* if 0, leaf is the last leaf and holds every key above */
+	lkey_t limit;
+};
+
+/* leaf for key k, no lower than the last, reusing the finger's leaf and path if k is in it */
+static blkp finger_leaf(bplus_t b, struct finger *f, lkey_t k)
+{
+	if (f->leaf == NULL || (f->bounded && k >= f->limit)) {
+		f->leaf = find_leaf(b, k);
+		f->bounded = 0;
+		/* the leaf ends before the lowest separator to the right of the path */
+		for (unsigned d = 0; d < b->depth; d++) {
+			blkp node = b->path[d].node;
+			unsigned pos = b->path[d].pos;
+			if (pos < num_keys(node) && (!f->bounded || get_key(node, pos) < f->limit)) {
+				f->limit = get_key(node, pos);
+				f->bounded = 1;
+			}
+		}
+	}
+	return f->leaf;
+}
+
+/*
+ * most nodes split off a node of n keys (children, for an index node) given add more. Each
+ * split leaves both halves with at least LHALF, so the node and its splits hold at least
+ * LHALF apiece.
+ */
+static inline unsigned long splits_of(unsigned long n, unsigned long add, unsigned long cap)
+{
+	return n + add > cap ? (n + add) / LHALF - 1 : 0;
+}
+
+/*
+ * most blocks that inserting the new keys of batch w[0..n), sorted and without repeated keys,
+ * can allocate, and how many levels the tree can grow by. New keys are counted per leaf and
+ * the leaf's splits per parent, a node at a time, since nodes are met in key order.
+ * node and add have room for depth + 1 levels.
+ */
+static unsigned long batch_blocks(bplus_t b, const struct bplus_write *w, unsigned long n,
+				  blkp *node, unsigned long *add, unsigned *levels)
+{
+	struct finger f = { NULL, 0, 0 };
+	unsigned depth = b->depth;
+	unsigned long blocks = 0, top = 0, c;
+
+	for (unsigned d = 0; d <= depth; d++) {
+		node[d] = NULL;
+		add[d] = 0;
+	}
+	for (unsigned long j = 0; j <= n; j++) {
+		blkp leaf = NULL;
+		unsigned from = 0;
+		if (j < n) {
+			unsigned i;
+			if (w[j].del)
+				continue;
+			leaf = finger_leaf(b, &f, w[j].key);
+			i = scan_leaf_keys(leaf, w[j].key);
+			if (i < num_keys(leaf) && get_key(leaf, i) == w[j].key)
+				continue;/* an update */
+			if (leaf == node[depth]) {
+				add[depth] += 1;
+				continue;
+			}
+			/* the levels from here down are on to new nodes */
+			while (from < depth && b->path[from].node == node[from])
+				from++;
+		}
+		/* count the splits of the nodes being left, leaf first, into their parents */
+		for (unsigned d = depth + 1; d-- > from;) {
+			if (node[d] != NULL) {
+				unsigned long s = d == depth ? splits_of(num_keys(node[d]), add[d], ORDER - 1)
+							     : splits_of(num_keys(node[d]) + 1, add[d], ORDER);
+				blocks += s;
+				if (d != 0)
+					add[d - 1] += s;
+				else
+					top += s;
+			}
+			node[d] = j == n ? NULL : d == depth ? leaf : b->path[d].node;
+			add[d] = 0;
+		}
+		add[depth] = 1;
+	}
+	/* a root that splits gets a new root above, which can split in turn */
+	*levels = 0;
+	for (c = top + 1; top != 0; c = (c + LHALF - 1) / LHALF) {
+		blocks += c / LHALF > 1 ? c / LHALF : 1;
+		*levels += 1;
+		if (c / LHALF <= 1)
+			break;
+	}
+	return blocks;
+}
+
+enum bplus_error bplus_write_batch(bplus_t b, const struct bplus_write *writes, unsigned long n)
+{
+	struct bplus_write *w, *buf;
+	struct finger f = { NULL, 0, 0 };
+	blkp *node;
+	unsigned long *add;
+	unsigned long m = 0, blocks;
+	unsigned levels, flags = b->flags;
+	struct bplus_index *index = NULL;
+	struct index_batch x = { NULL, NULL, 0, 0 };
+	enum bplus_error ok;
+
+	if (n == 0)
+		return OK;
+	/* pending splits need blocks of their own, and deletes finish them anyway */
+	ok = bplus_maintain(b, ~0UL);
+	if (ok == OK)
+		ok = path_reserved(b);
+	if (ok != OK)
+		return ok;
+	buf = malloc(2 * n * sizeof(struct bplus_write));
+	node = malloc((b->depth + 1) * sizeof(blkp));
+	add = malloc((b->depth + 1) * sizeof(unsigned long));
+	if (buf == NULL || node == NULL || add == NULL) {
+		free(buf);
+		free(node);
+		free(add);
+		return NOMEM;
+	}
+	memcpy(buf, writes, n * sizeof(struct bplus_write));
+	w = sort_batch(buf, buf + n, n);
+	for (unsigned long j = 0; j < n; j++)
+		if (j + 1 == n || w[j + 1].key != w[j].key)
+			w[m++] = w[j];
+	blocks = batch_blocks(b, w, m, node, add, &levels);
+	free(node);
+	free(add);
+	/* the index takes the batch's new pairs first, and is left out of the writes themselves */
+	if (b->index != NULL) {
+		ok = index_batch_begin(b, &x, w, m);
+		if (ok != OK) {
+			free(buf);
+			return ok;
+		}
+		index = b->index;
+		b->index = NULL;
+	}
+
+	/* set aside everything the batch could need, so nothing after this can fail */
+	ok = path_reserve(b, b->depth + levels);
+	if (ok == OK)
+		ok = reserve_blocks(b, blocks);
+	if (ok == OK) {
+		/* splits are done at once, so the reserve is all they use */
+		b->flags &= ~BPLUS_DEFERRED_SPLITS;
+		for (unsigned long j = 0; j < m; j++) {
+			if (!w[j].del) {
+				blkp leaf = finger_leaf(b, &f, w[j].key);
+				/* a split moves keys out of the leaf and changes the path */
+				if (num_keys(leaf) == ORDER - 1)
+					f.leaf = NULL;
+				insert_at(b, leaf, w[j].key, w[j].value, NEVER);
+			}
+		}
+		f.leaf = NULL;
+		for (unsigned long j = 0; j < m; j++) {
+			if (w[j].del) {
+				blkp leaf = finger_leaf(b, &f, w[j].key);
+				/* an underflow moves keys between leaves, or merges them */
+				if (num_keys(leaf) <= LHALF)
+					f.leaf = NULL;
+				delete_at(b, leaf, w[j].key);
+			}
+		}
+		b->flags = flags;
+	}
+	if (index != NULL) {
+		b->index = index;
+		index_batch_end(b, &x, ok);
+	}
+	release_reserve(b);
+	free(buf);
+	return ok;
+}
+
+/* move records between leaves l and r, next to each other, so each has about half of them */
+static void even_leaves(bplus_t b, blkp l, blkp r)
+{
+	unsigned nkl = num_keys(l), nkr = num_keys(r);
+	unsigned half = (nkl + nkr) / 2;
+	unsigned m;
+	if (nkl < half) {
+		/* move the first m records of r to the end of l */
+		m = half - nkl;
+		wrdcpy(l->words + KEY_0 + nkl, r->words + KEY_0, m);
+		fldmove(b, l, nkl, r, 0, m);
+		wrdmove(r->words + KEY_0, r->words + KEY_0 + m, nkr - m);
+		fldmove(b, r, 0, r, m, nkr - m);
+		for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+			if (bc->leaf == r) {
+				if (bc->pos < m) {
+					bc->leaf = l;
+					bc->pos += nkl;
+				} else
+					bc->pos -= m;
+			}
+		}
+		nkl += m;
+		nkr -= m;
+	} else {
+		/* move the last m records of l to the front of r */
+		m = nkl - half;
+		wrdmove(r->words + KEY_0 + m, r->words + KEY_0, nkr);
+		fldmove(b, r, m, r, 0, nkr);
+		wrdcpy(r->words + KEY_0, l->words + KEY_0 + nkl - m, m);
+		fldmove(b, r, 0, l, nkl - m, m);
+		for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+			if (bc->leaf == r)
+				bc->pos += m;
+			else if (bc->leaf == l && bc->pos >= nkl - m) {
+				bc->leaf = r;
+				bc->pos -= nkl - m;
+			}
+		}
+		nkl -= m;
+		nkr += m;
+	}
+	l->words[HEADER].header.num_keys = nkl;
+	r->words[HEADER].header.num_keys = nkr;
+	rehash(b, l, 1);
+	rehash(b, r, 1);
+	rezone(b, l, 1);
+	rezone(b, r, 1);
+}
+
+/*
+ * fewest keys a node at depth d below the root is left with by repair_edge(). A split leaves
+ * an index node LHALF - 1 keys, and one with that many can neither merge with a peer of LHALF
+ * nor take a key from it, so it is not short.
+ */
+static inline unsigned min_keys(bplus_t b, unsigned d)
+{
+	return d == b->depth ? LHALF : LHALF - 1;
+}
+
+/*
+ * even out children pos and pos + 1 of parent, one of which has too few keys: merge them if
+ * they fit in one node, or else move keys across so each has about half. leaf says whether
+ * they are leaves. Returns 1 if they were merged, removing key pos and child pos + 1 from parent.
+ */
+static int rebalance_children(bplus_t b, blkp parent, unsigned pos, int leaf)
+{
+	blkp l = get_child(parent, pos);
+	blkp r = get_child(parent, pos + 1);
+	unsigned nkl = num_keys(l), nkr = num_keys(r), nkp = num_keys(parent);
+	unsigned half = (nkl + nkr) / 2;
+	unsigned m;
+	/* a pair that cannot merge and is as even as it gets has nothing to move */
+	if (nkl + nkr > (leaf ? ORDER - 1 : ORDER - 2) && nkl == half)
+		return 0;
+	/* either may end up with keys from the other */
+	merge_expiry(b, parent, pos, pos + 1);
+	merge_expiry(b, parent, pos + 1, pos);
+	if (nkl + nkr <= (leaf ? ORDER - 1 : ORDER - 2)) {
+		if (leaf)
+			merge_leaf_nodes(b, l, r);
+		else
+			merge_index_nodes(b, l, r, get_key(parent, pos));
+		wrdmove(parent->words + KEY_0 + pos, parent->words + KEY_0 + pos + 1, nkp - pos - 1);
+		fldmove(b, parent, pos + 1, parent, pos + 2, nkp - pos - 1);
+		parent->words[HEADER].header.num_keys = nkp - 1;
+		return 1;
+	}
+	if (leaf) {
+		even_leaves(b, l, r);
+		parent->words[KEY_0 + pos].key = get_key(r, 0);
+		TRACE(rebalance, b->depth, get_key(parent, pos), num_keys(l));
+		return 0;
+	}
+	if (nkl < half) {
+		/* rotate m children of r through the splitting key into l */
+		m = half - nkl;
+		l->words[KEY_0 + nkl].key = get_key(parent, pos);
+		wrdcpy(l->words + KEY_0 + nkl + 1, r->words + KEY_0, m - 1);
+		fldmove(b, l, nkl + 1, r, 0, m);
+		move_tags(b, l, r);
+		parent->words[KEY_0 + pos].key = get_key(r, m - 1);
+		wrdmove(r->words + KEY_0, r->words + KEY_0 + m, nkr - m);
+		fldmove(b, r, 0, r, m, nkr - m + 1);
+		nkl += m;
+		nkr -= m;
+	} else {
+		/* rotate the last m children of l through the splitting key into r */
+		m = nkl - half;
+		wrdmove(r->words + KEY_0 + m, r->words + KEY_0, nkr);
+		fldmove(b, r, m, r, 0, nkr + 1);
+		r->words[KEY_0 + m - 1].key = get_key(parent, pos);
+		wrdcpy(r->words + KEY_0, l->words + KEY_0 + nkl - m + 1, m - 1);
+		fldmove(b, r, 0, l, nkl - m + 1, m);
+		move_tags(b, r, l);
+		parent->words[KEY_0 + pos].key = get_key(l, nkl - m);
+		nkl -= m;
+		nkr += m;
+	}
+	l->words[HEADER].header.num_keys = nkl;
+	r->words[HEADER].header.num_keys = nkr;
+	rehash(b, l, 0);
+	rehash(b, r, 0);
+	rezone(b, l, 0);
+	rezone(b, r, 0);
+	TRACE(rebalance, 0, get_key(parent, pos), nkl);
+	return 0;
+}
+
+/*
+ * after keys were removed from the left edge, or the right edge if right, only nodes down that
+ * spine can be short of keys. Fix them bottom up against their peers. A node whose parent was
+ * left with a single child has no peer, so it is fixed by another pass once its parent has been.
+ */
+static void repair_edge(bplus_t b, int right)
+{
+	int again = 1;
+	while (again) {
+		blkp node;
+		again = 0;
+		/* a root with a single child is not needed */
+		while (b->depth > 0 && num_keys(b->root) == 0) {
+			blkp root = b->root;
+			b->root = get_child(root, 0);
+			b->depth -= 1;
+			TRACE(root_shrink, 0, num_keys(b->root) ? get_key(b->root, 0) : 0, num_keys(b->root));
+			free_index_block(b, root);
+			b->num_blks -= 1;
+		}
+		node = b->root;
+		for (unsigned d = 0; d < b->depth; d++) {
+			b->path[d].node = node;
+			node = get_child(node, right ? num_keys(node) : 0);
+		}
+		for (unsigned d = b->depth; d-- > 0;) {
+			blkp parent = b->path[d].node;
+			if (num_keys(get_child(parent, right ? num_keys(parent) : 0)) >= min_keys(b, d + 1))
+				continue;
+			if (num_keys(parent) == 0)
+				again = 1;
+			else {
+				/* off the path the spine was cut along, children may still have tags */
+				push_tags(b, parent, b->depth - d);
+				rebalance_children(b, parent, right ? num_keys(parent) - 1 : 0, d + 1 == b->depth);
+			}
+		}
+		if (b->depth > 0 && num_keys(b->root) == 0)
+			again = 1;
+	}
+}
+
+/* free the subtree at depth d wholly below the truncation cutoff, moving cursors to boundary */
+static void free_truncated(bplus_t b, unsigned d, blkp blk, blkp boundary)
+{
+	if (d < b->depth) {
+		for (unsigned i = 0; i <= num_keys(blk); i++)
+			free_truncated(b, d + 1, get_child(blk, i), boundary);
+		free_index_block(b, blk);
+	} else {
+		/* cursors on freed records behave as on deleted ones, landing on the next record left */
+		for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+			if (bc->leaf == blk) {
+				bc->leaf = boundary;
+				bc->pos = 0;
+				bc->invalid = 1;
+			}
+		}
+		b->num_recs -= num_keys(blk);
+		heat_forget(b, blk);
+		free_leaf_block(b, blk);
+	}
+	b->num_blks -= 1;
+}
+
+enum bplus_error bplus_truncate_before(bplus_t b, lkey_t cutoff)
+{
+	/* the spine repair only knows posted children, so finish pending splits first */
+	enum bplus_error ok = bplus_maintain(b, ~0UL);
+	blkp boundary, node;
+	unsigned i;
+	if (ok == OK)
+		ok = path_reserved(b);
+	if (ok != OK)
+		return ok;
+	/* the nodes left on the path to cutoff are rebalanced, so they must hold no tags */
+	if (b->tags)
+		push_to_leaf(b, cutoff);
+	/* the index has to be told of every record dropped, so with one the leaves are read */
+	if (b->index != NULL)
+		for (blkp leaf = b->leaves; leaf != NULL && num_keys(leaf) != 0 && get_key(leaf, 0) < cutoff;
+		     leaf = next_leaf(leaf))
+			index_removed(b, leaf, 0, scan_leaf_keys(leaf, cutoff));
+	boundary = descend_to_leaf(b, cutoff);
+	/* down the path to cutoff, drop the children left of it, which hold only keys below it */
+	node = b->root;
+	for (unsigned d = 0; d < b->depth; d++) {
+		unsigned nk = num_keys(node);
+		b->path[d].node = node;
+		i = scan_index_keys(node, cutoff);
+		if (i != 0) {
+			for (unsigned j = 0; j < i; j++)
+				free_truncated(b, d + 1, get_child(node, j), boundary);
+			wrdmove(node->words + KEY_0, node->words + KEY_0 + i, nk - i);
+			fldmove(b, node, 0, node, i, nk - i + 1);
+			node->words[HEADER].header.num_keys = nk - i;
+		}
+		node = get_child(node, 0);
+	}
+	/* trim the boundary leaf, which is now the first */
+	i = scan_leaf_keys(boundary, cutoff);
+	if (i != 0)
+		remove_from_leaf(b, boundary, 0, i);
+	/* every node left that lost records is on the path, which is now the left spine */
+	rehash(b, boundary, 1);
+	rezone(b, boundary, 1);
+	for (unsigned d = b->depth; d-- > 0;) {
+		rehash(b, b->path[d].node, 0);
+		rezone(b, b->path[d].node, 0);
+	}
+	b->leaves = boundary;
+	repair_edge(b, 0);
+	cdc_note(b, BPLUS_CHANGE_TRUNCATE, cutoff, 0, 0);
+	return OK;
+}
+
+/*
+ * find a leaf holding expired records, recording the path to it. Only children whose bound
+ * has passed are visited, and the bounds of those found to hold nothing expired are made
+ * exact, so the same ones are not visited again. path[d].pos is the next child to try.
+ */
+static blkp find_expired_leaf(bplus_t b)
+{
+	unsigned d = 0;
+	if (b->depth == 0)
+		return min_expiry(b, b->root, 1) <= b->now ? b->root : NULL;
+	b->path[0].node = b->root;
+	b->path[0].pos = 0;
+	for (;;) {
+		blkp node = b->path[d].node;
+		unsigned nk = num_keys(node);
+		unsigned i = b->path[d].pos;
+		while (i <= nk && get_expiry(b, node, i) > b->now)
+			i++;
+		if (i <= nk) {
+			blkp child = get_child(node, i);
+			b->path[d].pos = i;
+			b->path[d].num_keys = nk;
+			if (d + 1 < b->depth) {
+				d += 1;
+				b->path[d].node = child;
+				b->path[d].pos = 0;
+			} else {
+				unsigned long e = min_expiry(b, child, 1);
+				if (e <= b->now)
+					return child;
+				set_expiry(b, node, i, e);
+				b->path[d].pos = i + 1;
+			}
+		} else {
+			/* nothing under node has expired */
+			if (d == 0)
+				return NULL;
+			d -= 1;
+			set_expiry(b, b->path[d].node, b->path[d].pos, min_expiry(b, node, 0));
+			b->path[d].pos += 1;
+		}
+	}
+}
+
+void bplus_set_time(bplus_t b, unsigned long now)
+{
+	b->now = now;
+}
+
+enum bplus_error bplus_expire_step(bplus_t b, unsigned long now, unsigned long budget)
+{
+	enum bplus_error ok = OK;
+	b->now = now;
+	if (b->ttl_page == 0)
+		return OK;
+	/* the sweep only sees posted children, so finish pending splits first */
+	ok = bplus_maintain(b, ~0UL);
+	if (ok == OK)
+		ok = path_reserved(b);
+	while (ok == OK) {
+		blkp leaf = find_expired_leaf(b);
+		unsigned nk, limit;
+		if (leaf == NULL)
+			break;
+		if (budget == 0) {
+			ok = INCOMPLETE;
+			break;
+		}
+		if (b->tags)
+			for (unsigned d = 0; d < b->depth; d++)
+				push_tags(b, b->path[d].node, b->depth - d);
+		/* remove runs of expired records from the right, as far as one short of the leaf minimum */
+		nk = num_keys(leaf);
+		limit = b->depth == 0 ? nk : nk >= LHALF ? nk - (LHALF - 1) : 1;
+		if (limit > budget)
+			limit = budget;
+		heat_touch(b, leaf, 1);
+		for (unsigned j = nk; j-- > 0 && limit != 0;) {
+			unsigned i = j + 1;
+			while (i > 0 && j + 1 - i < limit && expired(b, leaf, i - 1))
+				i--;
+			if (i <= j) {
+				cdc_note_removed(b, leaf, i, j + 1 - i);
+				index_removed(b, leaf, i, j + 1 - i);
+				hash_removed(b, leaf, i, j + 1 - i);
+				remove_from_leaf(b, leaf, i, j + 1 - i);
+				limit -= j + 1 - i;
+				budget -= j + 1 - i;
+				j = i;
+			}
+		}
+		if (b->depth > 0 && num_keys(leaf) < LHALF)
+			leaf_underflow(b, leaf);
+		/* search again, since underflow may have moved records between leaves */
+		ok = path_reserved(b);
+	}
+	return ok;
+}
+
+/* ***** bulk filters ***** */
+
+/*
+ * bplus_retain_if() sweeps the leaves of its range once, sliding the records it keeps down
+ * into as few leaves as hold them, and frees the leaves left over. Rather than fix the index
+ * node by node as leaves go, it lists the leaves from the index before the sweep, splices the
+ * new ones into the list, and builds the index nodes again from it, reusing their blocks.
+ */
+
+/* a leaf, the lowest key that can be in it, and a bound on its records' expiry times */
+struct leaf_entry {
+	blkp leaf;
+	lkey_t key;
+	unsigned long expiry;
+};
+
+/* list the leaves under node, whose lowest key is low, and the index nodes it is made of */
+static void list_leaves(bplus_t b, blkp node, unsigned height, lkey_t low,
+			struct leaf_entry *e, unsigned long *ne, blkp *nodes, unsigned long *nnodes)
+{
+	nodes[(*nnodes)++] = node;
+	for (unsigned i = 0; i <= num_keys(node); i++) {
+		lkey_t k = i == 0 ? low : get_key(node, i - 1);
+		if (height > 1) {
+			list_leaves(b, get_child(node, i), height - 1, k, e, ne, nodes, nnodes);
+		} else {
+			e[*ne].leaf = get_child(node, i);
+			e[*ne].key = k;
+			e[*ne].expiry = b->ttl_page != 0 ? get_expiry(b, node, i) : NEVER;
+			*ne += 1;
+		}
+	}
+}
+
+/* build the index over the n leaves of e level by level, taking blocks from nodes */
+static void build_index(bplus_t b, struct leaf_entry *e, unsigned long n, blkp *nodes, unsigned long nnodes)
+{
+	unsigned long used = 0;
+	unsigned depth = 0;
+	while (n > 1) {
+		/* the fewest nodes that hold the children, sharing them out evenly */
+		unsigned long count = (n + ORDER - 1) / ORDER, j = 0;
+		for (unsigned long k = 0; k < count; k++) {
+			unsigned long c = n / count + (k < n % count);
+			unsigned long e_min = NEVER;
+			lkey_t low = e[j].key;
+			blkp node = nodes[used++];
+			for (unsigned i = 0; i < c; i++) {
+				node->words[FIELD_0 + i].child = e[j + i].leaf;
+				if (i > 0)
+					node->words[KEY_0 + i - 1].key = e[j + i].key;
+				if (b->ttl_page != 0)
+					set_expiry(b, node, i, e[j + i].expiry);
+				if (b->tag_page != 0)
+					set_tag(b, node, i, 0);
+				if (e[j + i].expiry < e_min)
+					e_min = e[j + i].expiry;
+			}
+			node->words[HEADER].header.num_keys = c - 1;
+			mark_tags(b, node, 0);
+			rehash(b, node, 0);
+			rezone(b, node, 0);
+			j += c;
+			/* the node's entry for the level above replaces ones already read */
+			e[k].leaf = node;
+			e[k].key = low;
+			e[k].expiry = e_min;
+		}
+		n = count;
+		depth += 1;
+	}
+	b->root = e[0].leaf;
+	b->depth = depth;
+	/* fewer leaves never need more index nodes than before, so some may be left over */
+	for (; used < nnodes; used++) {
+		free_index_block(b, nodes[used]);
+		b->num_blks -= 1;
+	}
+}
+
+/* where each record of a leaf being swept went, for its cursors */
+struct retain_move {
+	blkp leaf;
+	unsigned pos;
+	unsigned dropped;
+};
+
+enum bplus_error bplus_retain_if(bplus_t b, lkey_t lo, lkey_t hi,
+				 int (*pred)(lkey_t k, value_t v, void *ctx), void *ctx)
+{
+	/* the index is built from posted children, so finish pending splits first */
+	enum bplus_error ok = bplus_maintain(b, ~0UL);
+	struct retain_move to[ORDER];
+	struct leaf_entry *e;
+	blkp *nodes, w, r;
+	unsigned long ne = 0, nnodes = 0, first, last, out, lo_e, hi_e;
+	unsigned p, q;
+	int done = 0;
+	if (ok != OK)
+		return ok;
+	if (b->root == NULL || lo > hi)
+		return OK;
+	/* every index node is built again, so the tags on them are pushed down first */
+	push_range(b, 0, ~0UL);
+	e = malloc(b->num_blks * sizeof(*e));
+	nodes = malloc(b->num_blks * sizeof(*nodes));
+	if (e == NULL || nodes == NULL) {
+		free(e);
+		free(nodes);
+		return NOMEM;
+	}
+	if (b->depth == 0) {
+		e[0].leaf = b->root;
+		e[0].key = 0;
+		e[0].expiry = NEVER;
+		ne = 1;
+	} else {
+		list_leaves(b, b->root, b->depth, 0, e, &ne, nodes, &nnodes);
+	}
+	/* the leaf holding lo is the last whose lowest key is at or below it */
+	for (lo_e = 0, hi_e = ne; hi_e - lo_e > 1;) {
+		unsigned long mid = lo_e + (hi_e - lo_e) / 2;
+		if (e[mid].key <= lo)
+			lo_e = mid;
+		else
+			hi_e = mid;
+	}
+	first = last = out = lo_e;
+
+	/* read records at r, q and write those kept at w, p, which is never ahead of it */
+	w = r = e[first].leaf;
+	p = q = scan_leaf_keys(w, lo);
+	for (;;) {
+		unsigned nk = num_keys(r);
+		blkp next;
+		/* records of the first leaf below lo stay where they are */
+		for (unsigned i = 0; i < q; i++) {
+			to[i].leaf = r;
+			to[i].pos = i;
+			to[i].dropped = 0;
+		}
+		for (; q < nk; q++) {
+			lkey_t k = get_key(r, q);
+			value_t v = get_value(r, q);
+			if (k > hi)
+				done = 1;
+			/* the rest of the leaf the range ends in is kept, and expired records are the sweeper's */
+			if (!done && !expired(b, r, q) && !pred(k, v, ctx)) {
+				cdc_note_removed(b, r, q, 1);
+				index_removed(b, r, q, 1);
+				b->num_recs -= 1;
+				to[q].leaf = w;
+				to[q].pos = p;
+				to[q].dropped = 1;
+				continue;
+			}
+			if (p == ORDER - 1) {
+				w->words[HEADER].header.num_keys = p;
+				w = next_leaf(w);
+				p = 0;
+				out += 1;
+				e[out].key = k;
+			}
+			if (w != r || p != q) {
+				w->words[KEY_0 + p].key = k;
+				fldmove(b, w, p, r, q, 1);
+			}
+			to[q].leaf = w;
+			to[q].pos = p;
+			to[q].dropped = 0;
+			p += 1;
+		}
+		/* a cursor past the last record of r goes to the next record kept */
+		to[nk].leaf = w;
+		to[nk].pos = p;
+		to[nk].dropped = 0;
+		for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
+			if (bc->leaf == r) {
+				struct retain_move *m = &to[bc->pos < nk ? bc->pos : nk];
+				bc->leaf = m->leaf;
+				bc->pos = m->pos;
+				bc->invalid |= m->dropped;
+			}
+		}
+		next = next_leaf(r);
+		if (done || next == NULL || get_key(next, 0) > hi)
+			break;
+		r = next;
+		q = 0;
+		last += 1;
+	}
+	w->words[HEADER].header.num_keys = p;
+	set_next_leaf(w, next_leaf(r));
+	/* the leaves after w that were read are empty now */
+	for (unsigned long i = out + 1; i <= last; i++) {
+		heat_forget(b, e[i].leaf);
+		free_leaf_block(b, e[i].leaf);
+		b->num_blks -= 1;
+	}
+	for (unsigned long i = first; i <= out; i++) {
+		heat_touch(b, e[i].leaf, 1);
+		rehash(b, e[i].leaf, 1);
+		rezone(b, e[i].leaf, 1);
+		if (b->ttl_page != 0)
+			e[i].expiry = min_expiry(b, e[i].leaf, 1);
+	}
+	memmove(e + out + 1, e + last + 1, (ne - last - 1) * sizeof(*e));
+	ne -= last - out;
+
+	/* only the last leaf written can be short, so even it out with a neighbour */
+	if (ne > 1 && num_keys(w) < LHALF - 1) {
+		unsigned long l = out > 0 ? out - 1 : 0;
+		blkp left = e[l].leaf, right = e[l + 1].leaf;
+		if (num_keys(left) + num_keys(right) <= ORDER - 1) {
+			merge_leaf_nodes(b, left, right);
+			if (e[l + 1].expiry < e[l].expiry)
+				e[l].expiry = e[l + 1].expiry;
+			memmove(e + l + 1, e + l + 2, (ne - l - 2) * sizeof(*e));
+			ne -= 1;
+		} else {
+			even_leaves(b, left, right);
+			e[l + 1].key = get_key(right, 0);
+			if (b->ttl_page != 0) {
+				e[l].expiry = min_expiry(b, left, 1);
+				e[l + 1].expiry = min_expiry(b, right, 1);
+			}
+		}
+	}
+	build_index(b, e, ne, nodes, nnodes);
+	free(e);
+	free(nodes);
+	return OK;
+}
+
+/* ***** splitting and concatenating trees ***** */
+
+/*
+ * A tree is split at a key by cutting each node on the path to it in two: the children left
+ * of the path stay, and those right of it move to a new node of the new tree. Concatenating
+ * hangs the root of the lower tree from the edge of the higher one, at the depth where their
+ * heights meet. Either way whole subtrees move without being read, only the nodes along the
+ * cut or seam are written, and only those down the new edges can be short of keys. The
+ * records and blocks of whichever side of a split is estimated smaller are counted, from the
+ * headers of its leaves.
+ */
+
+/* the first leaf of b, or the last if right */
+static blkp edge_leaf(bplus_t b, int right)
+{
+	blkp node = b->root;
+	for (unsigned d = 0; d < b->depth; d++)
+		node = get_child(node, right ? num_keys(node) : 0);
+	return node;
+}
+
+/* add the records and blocks of the subtree at node, of the given height, to *recs and *blks */
+static void count_subtree(blkp node, unsigned height, unsigned long *recs, unsigned long *blks)
+{
+	*blks += 1;
+	if (height == 0)
+		*recs += num_keys(node);
+	else
+		for (unsigned i = 0; i <= num_keys(node); i++)
+			count_subtree(get_child(node, i), height - 1, recs, blks);
+}
+
+/* insert the records of b with keys from lo on into t, with their values and expiry times */
+static enum bplus_error copy_records(bplus_t t, bplus_t b, lkey_t lo)
+{
+	for (blkp leaf = descend_to_leaf(b, lo); leaf != NULL; leaf = next_leaf(leaf)) {
+		value_t delta = b->tags && num_keys(leaf) != 0 ? path_delta(b, get_key(leaf, 0)) : 0;
+		for (unsigned i = scan_leaf_keys(leaf, lo); i < num_keys(leaf); i++) {
+			enum bplus_error ok = insert_record(t, get_key(leaf, i), get_value(leaf, i) + delta,
+							    b->ttl_page != 0 ? get_expiry(b, leaf, i) : NEVER);
+			if (ok != OK)
+				return ok;
+		}
+	}
+	return OK;
+}
+
+/* hand b's cursors on leaves for which moved() is true to t, or all of them if moved is NULL */
+static void move_cursors(bplus_t b, bplus_t t, int (*moved)(bplus_cursor_t c, blkp leaf, unsigned j, blkp lr),
+			 blkp leaf, unsigned j, blkp lr)
+{
+	bplus_cursor_t *l = &b->cursor_list;
+	while (*l != NULL) {
+		bplus_cursor_t c = *l;
+		if (moved != NULL && !moved(c, leaf, j, lr)) {
+			l = &c->next;
+			continue;
+		}
+		*l = c->next;
+		c->next = t->cursor_list;
+		t->cursor_list = c;
+		c->tree = t;
+		c->delta_leaf = NULL;
+		b->num_crsrs -= 1;
+		t->num_crsrs += 1;
+	}
+}
+
+/*
+ * hand b's cursors on records with keys from lo on to t, which has copies of those records,
+ * putting each on its record's copy
+ */
+static void move_cursors_to_copies(bplus_t b, bplus_t t, lkey_t lo)
+{
+	bplus_cursor_t *l = &b->cursor_list;
+	while (*l != NULL) {
+		bplus_cursor_t c = *l;
+		lkey_t k;
+		if (c->invalid || c->leaf == NULL || c->pos >= num_keys(c->leaf) ||
+		    (k = get_key(c->leaf, c->pos)) < lo) {
+			l = &c->next;
+			continue;
+		}
+		*l = c->next;
+		c->next = t->cursor_list;
+		t->cursor_list = c;
+		c->tree = t;
+		c->leaf = descend_to_leaf(t, k);
+		c->pos = scan_leaf_keys(c->leaf, k);
+		c->delta_leaf = NULL;
+		b->num_crsrs -= 1;
+		t->num_crsrs += 1;
+	}
+}
+
+/*
+ * a cursor is right of a split that left leaf with its first j records, and moved the rest
+ * to lr, if it is on one of those or on a later leaf
+ */
+static int right_of_split(bplus_cursor_t c, blkp leaf, unsigned j, blkp lr)
+{
+	if (c->leaf == NULL)
+		return 0;
+	if (c->leaf != leaf)
+		return num_keys(c->leaf) != 0 && get_key(c->leaf, 0) > get_key(leaf, 0);
+	if (j == 0)
+		return 1;
+	if (lr == NULL || c->pos < j)
+		return 0;
+	c->leaf = lr;
+	c->pos -= j;
+	return 1;
+}
+
+/* move the access counts of the leaves of t from b's heatmap to t's */
+static void move_heat(bplus_t b, bplus_t t)
+{
+	if (b->heat == NULL || t->heat == NULL)
+		return;
+	for (blkp leaf = t->leaves; leaf != NULL; leaf = next_leaf(leaf)) {
+		struct heat_slot *s = heat_lookup(b->heat, leaf), *u;
+		if (s != NULL && s->reads + s->writes != 0) {
+			u = heat_slot_of(t->heat, leaf);
+			if (u != NULL) {
+				u->reads += s->reads;
+				u->writes += s->writes;
+			}
+			s->reads = s->writes = 0;
+		}
+	}
+}
+
+/* exchange the records of b and t, with their cursors and access counts */
+static void swap_trees(bplus_t b, bplus_t t)
+{
+	struct bplus s = *b;
+	struct heatmap *h = b->heat;
+	bplus_cursor_t cb = b->cursor_list, ct = t->cursor_list;
+	b->root = t->root;
+	b->leaves = t->leaves;
+	b->depth = t->depth;
+	b->num_recs = t->num_recs;
+	b->num_blks = t->num_blks;
+	b->tags = t->tags;
+	b->heat = t->heat;
+	t->root = s.root;
+	t->leaves = s.leaves;
+	t->depth = s.depth;
+	t->num_recs = s.num_recs;
+	t->num_blks = s.num_blks;
+	t->tags = s.tags;
+	t->heat = h;
+	b->cursor_list = t->cursor_list = NULL;
+	b->num_crsrs = t->num_crsrs = 0;
+	for (bplus_cursor_t c = cb, next; c != NULL; c = next) {
+		next = c->next;
+		c->next = t->cursor_list;
+		t->cursor_list = c;
+		c->tree = t;
+		c->delta_leaf = NULL;
+		t->num_crsrs += 1;
+	}
+	for (bplus_cursor_t c = ct, next; c != NULL; c = next) {
+		next = c->next;
+		c->next = b->cursor_list;
+		b->cursor_list = c;
+		c->tree = b;
+		c->delta_leaf = NULL;
+		b->num_crsrs += 1;
+	}
+	b->tag_epoch += 1;
+	t->tag_epoch += 1;
+}
+
+/* move n of the blocks set aside for b to t's reserve */
+static void hand_reserve(bplus_t b, bplus_t t, unsigned n)
+{
+	while (n-- > 0 && b->reserve != NULL)
+		keep_block(t, take_block(b));
+}
+
+bplus_t bplus_split(bplus_t b, lkey_t k)
+{
+	bplus_t r;
+	blkp leaf, last, lr, cl, cr;
+	unsigned nk, j, used = 0;
+	unsigned long recs = 0, blks = 0;
+	int count_right;
+
+	if (bplus_maintain(b, ~0UL) != OK || path_reserved(b) != OK)
+		return NULL;
+	r = new_bplus_tree_opts(b->flags);
+	if (r == NULL)
+		return NULL;
+	r->now = b->now;
+	if (path_reserve(r, b->depth + 1) != OK ||
+	    (b->heat != NULL && bplus_heatmap_enable(r, b->heat->sample_shift, b->heat->slot_bits) != OK))
+		goto fail;
+	last = edge_leaf(b, 1);
+	if (b->num_recs == 0 || get_key(last, num_keys(last) - 1) < k)
+		return r;
+	/* records moving between trees have to be seen leaving one and joining the other */
+	if (b->cdc != NULL || b->index != NULL || b->arena != NULL) {
+		if (copy_records(r, b, k) != OK)
+			goto fail;
+		move_cursors_to_copies(b, r, k);
+		/* b was maintained and its path reserved above, so this cannot fail */
+		delete_range_step(b, k, ~0UL, ~0UL);
+		return r;
+	}
+	/*
+	 * set aside what bplus_concat() takes to join the two again: paths one longer than the
+	 * tree is deep, a leaf for r to be left with, and an index block per level and a root
+	 * for the taller tree to take the other in. The split can then always be undone.
+	 */
+	if (path_reserve(b, b->depth + 1) != OK || reserve_blocks(b, b->depth + 2) != OK) {
+		release_reserve(b);
+		goto fail;
+	}
+	if (get_key(b->leaves, 0) >= k) {
+		swap_trees(b, r);
+		hand_reserve(b, r, r->depth == 0 ? 1 : ~0U);
+		return r;
+	}
+	/* the new tree's empty leaf and a block per level are set aside for the cut */
+	for (unsigned d = 0; d < b->depth; d++) {
+		r->path[d].split = new_index_block(r);
+		if (r->path[d].split == NULL) {
+			while (d-- > 0)
+				free_index_block(r, r->path[d].split);
+			goto fail;
+		}
+	}
+	count_right = bplus_estimate_count(b, k, ~0UL, NULL, NULL) <= b->num_recs / 2;
+
+	/* cut the leaf holding k after its first j records, which stay */
+	leaf = find_leaf(b, k);
+	nk = num_keys(leaf);
+	j = scan_leaf_keys(leaf, k);
+	lr = NULL;
+	cl = j != 0 ? leaf : NULL;
+	cr = j == 0 ? leaf : NULL;
+	if (j != 0 && j != nk) {
+		lr = cr = r->root;
+		used += 1;
+		wrdcpy(lr->words + KEY_0, leaf->words + KEY_0 + j, nk - j);
+		fldmove(b, lr, 0, leaf, j, nk - j);
+		lr->words[HEADER].header.num_keys = nk - j;
+		leaf->words[HEADER].header.num_keys = j;
+		set_next_leaf(lr, next_leaf(leaf));
+		rehash(b, leaf, 1);
+		rehash(b, lr, 1);
+		rezone(b, leaf, 1);
+		rezone(b, lr, 1);
+	}
+	move_cursors(b, r, right_of_split, leaf, j, lr);
+
+	/*
+	 * up the path, cl and cr are the left and right parts of the child at pos, either of
+	 * which may be empty. A node keeps its children left of pos and cl, and those right of
+	 * pos go to a new node after cr, unless the node had nothing left of the cut at all.
+	 */
+	for (unsigned d = b->depth; d-- > 0;) {
+		blkp p = b->path[d].node, rn = NULL;
+		unsigned i = b->path[d].pos, n = num_keys(p);
+		if (cl == NULL && i == 0) {
+			cr = p;
+			continue;
+		}
+		if (cr != NULL) {
+			rn = r->path[d].split;
+			rn->words[FIELD_0].child = cr;
+			fldnote(b, rn, 0, p, i);
+			wrdcpy(rn->words + KEY_0, p->words + KEY_0 + i, n - i);
+			fldmove(b, rn, 1, p, i + 1, n - i);
+			rn->words[HEADER].header.num_keys = n - i;
+		} else if (i < n) {
+			rn = r->path[d].split;
+			wrdcpy(rn->words + KEY_0, p->words + KEY_0 + i + 1, n - i - 1);
+			fldmove(b, rn, 0, p, i + 1, n - i);
+			rn->words[HEADER].header.num_keys = n - i - 1;
+		}
+		if (rn != NULL) {
+			r->path[d].split = NULL;
+			used += 1;
+			mark_tags(b, rn, has_tags(b, p));
+			rehash(b, rn, 0);
+			rezone(b, rn, 0);
+		}
+		p->words[HEADER].header.num_keys = cl != NULL ? i : i - 1;
+		rehash(b, p, 0);
+		rezone(b, p, 0);
+		cl = p;
+		cr = rn;
+	}
+	for (unsigned d = 0; d < b->depth; d++)
+		if (r->path[d].split != NULL)
+			free_index_block(r, r->path[d].split);
+	if (lr == NULL)
+		free_leaf_block(r, r->root);
+	b->num_blks += used;
+
+	r->root = cr;
+	r->depth = b->depth;
+	r->leaves = edge_leaf(r, 0);
+	set_next_leaf(edge_leaf(b, 1), NULL);
+	r->tags = b->tags;
+	b->tag_epoch += 1;
+	if (count_right) {
+		count_subtree(r->root, r->depth, &recs, &blks);
+		r->num_recs = recs;
+		r->num_blks = blks;
+	} else {
+		count_subtree(b->root, b->depth, &recs, &blks);
+		r->num_recs = b->num_recs - recs;
+		r->num_blks = b->num_blks - blks;
+	}
+	b->num_recs -= r->num_recs;
+	b->num_blks -= r->num_blks;
+	move_heat(b, r);
+	/* r's leaf first, as a tree with blocks set aside keeps its path when it shrinks */
+	hand_reserve(b, r, 1);
+	repair_edge(b, 1);
+	repair_edge(r, 0);
+	if (b->depth < r->depth)
+		hand_reserve(b, r, ~0U);
+	return r;
+
+fail:
+	free_bplus_tree(r);
+	return NULL;
+}
+
+enum bplus_error bplus_concat(bplus_t a, bplus_t b)
+{
+	enum bplus_error ok = bplus_maintain(a, ~0UL);
+	blkp last, spare, node;
+	bplus_t host;
+	int right;
+	unsigned d, e, top, grown;
+	unsigned long m = NEVER, blks;
+	lkey_t sep;
+
+	if (ok == OK)
+		ok = bplus_maintain(b, ~0UL);
+	if (ok != OK || b->num_recs == 0)
+		return ok;
+	last = edge_leaf(a, 1);
+	sep = get_key(b->leaves, 0);
+	if (num_keys(last) != 0 && get_key(last, num_keys(last) - 1) >= sep)
+		return NOTFOUND;
+	if (a->flags != b->flags || a->cdc != NULL || b->cdc != NULL || a->index != NULL || b->index != NULL ||
+	    a->arena != NULL || b->arena != NULL) {
+		unsigned flags = a->flags;
+		ok = path_reserved(b);
+		if (ok != OK)
+			return ok;
+		/*
+		 * with no split left pending in a, and its path as long as the copies made it, a
+		 * delete of them, or of b's records, cannot run out of memory
+		 */
+		a->flags &= ~BPLUS_DEFERRED_SPLITS;
+		ok = copy_records(a, b, 0);
+		a->flags = flags;
+		if (ok != OK) {
+			delete_range_step(a, sep, ~0UL, ~0UL);
+			return ok;
+		}
+		move_cursors_to_copies(b, a, 0);
+		delete_range_step(b, 0, ~0UL, ~0UL);
+		release_reserve(a);
+		release_reserve(b);
+		return OK;
+	}
+
+	/* the lower tree hangs from the right edge of a or the left edge of b, at depth d */
+	right = a->depth >= b->depth;
+	host = right ? a : b;
+	d = right ? a->depth - b->depth : b->depth - a->depth;
+	top = (a->depth > b->depth ? a->depth : b->depth) + 1;
+	if (path_reserve(a, top) != OK || path_reserve(b, top) != OK)
+		return NOMEM;
+	spare = new_leaf_block(b);
+	if (spare == NULL)
+		return NOMEM;
+	node = host->root;
+	for (e = 0; e < d; e++) {
+		if (host->tags)
+			push_tags(host, node, host->depth - e);
+		host->path[e].node = node;
+		host->path[e].pos = right ? num_keys(node) : 0;
+		host->path[e].num_keys = num_keys(node);
+		node = get_child(node, host->path[e].pos);
+	}
+	/* set aside blocks to split the full nodes above the seam, as preallocate_splits() does */
+	host->new_root = NULL;
+	for (e = d; e != 0 && host->path[e - 1].num_keys == ORDER - 1; e--) {
+		host->path[e - 1].split = new_index_block(host);
+		if (host->path[e - 1].split == NULL) {
+			ok = NOMEM;
+			break;
+		}
+	}
+	if (ok == OK && e == 0 && (host->new_root = new_index_block(host)) == NULL)
+		ok = NOMEM;
+	if (ok != OK) {
+		/* back to the reserve, as a split may have set them aside for this */
+		for (unsigned f = e; f < d; f++)
+			keep_block(host, host->path[f].split);
+		keep_block(b, spare);
+		return ok;
+	}
+	blks = a->num_blks + b->num_blks + (d - e) + (e == 0);
+	if (b->ttl_page != 0)
+		m = min_expiry(b, right ? b->root : a->root, (right ? b->depth : a->depth) == 0);
+
+	grown = host->depth;
+	if (right)
+		insert_new_block(a, d, b->root, &sep);
+	else {
+		/* put b's first child at d after itself, then replace the first copy with a's root */
+		blkp parent = b->path[d - 1].node;
+		insert_new_block(b, d, get_child(parent, 0), &sep);
+		parent->words[FIELD_0].child = a->root;
+	}
+	grown = host->depth - grown;
+
+	/* the bounds and tags down the seam cover the lower tree's records, and hashes and zones add them */
+	node = host->root;
+	for (e = 0; e < d + grown; e++) {
+		unsigned i = right ? num_keys(node) : 0;
+		host->path[e].node = node;
+		if (b->ttl_page != 0)
+			set_expiry(b, node, i, e + 1 == d + grown || m < get_expiry(b, node, i) ? m : get_expiry(b, node, i));
+		if (e + 1 == d + grown && b->tag_page != 0)
+			set_tag(b, node, i, 0);
+		node = get_child(node, i);
+	}
+	for (e = d + grown; e-- > 0;) {
+		rehash(b, host->path[e].node, 0);
+		rezone(b, host->path[e].node, 0);
+	}
+
+	if (!right) {
+		a->root = b->root;
+		a->depth = b->depth;
+	}
+	set_next_leaf(last, b->leaves);
+	a->num_recs += b->num_recs;
+	a->num_blks = blks;
+	a->tags |= b->tags;
+	a->tag_epoch += 1;
+	move_cursors(b, a, NULL, NULL, 0, NULL);
+	if (b->heat != NULL) {
+		for (unsigned i = 0; i < 1U << b->heat->slot_bits; i++) {
+			struct heat_slot *s = &b->heat->slots[i], *u;
+			if (a->heat != NULL && s->leaf != NULL && s->reads + s->writes != 0 &&
+			    (u = heat_slot_of(a->heat, s->leaf)) != NULL) {
+				u->reads += s->reads;
+				u->writes += s->writes;
+			}
+			s->reads = s->writes = 0;
+		}
+	}
+	set_empty_root(b, spare);
+	b->num_recs = 0;
+	b->num_blks = 1;
+	b->tags = 0;
+
+	/* two roots side by side under a new one may both be short, else only the seam can be */
+	if (d == 0 && (num_keys(get_child(a->root, 0)) < min_keys(a, 1) ||
+		       num_keys(get_child(a->root, 1)) < min_keys(a, 1)))
+		rebalance_children(a, a->root, 0, a->depth == 1);
+	repair_edge(a, right);
+	release_reserve(a);
+	release_reserve(b);
+	return OK;
+}
+
+/* ***** bulk updates ***** */
+
+/*
+ * An update of a key range rewrites the values of each leaf in the range in place, four at a
+ * time, as no record moves. The nodes above are then brought up to date once, bottom up over
+ * the nodes the range touches, instead of along a path per record. Expiry times, the change
+ * feed and a secondary index need each record looked at, so with any of them the values are
+ * updated one by one.
+ */
+
+/* leaves a thread of a parallel update takes at a time */
+#define UPDATE_CHUNK 16
+
+static inline value_t update_value(enum bplus_update_op op, value_t v, value_t arg)
+{
+	double x, y;
+	switch (op) {
+	case BPLUS_UPDATE_ADD:
+		return v + arg;
+	case BPLUS_UPDATE_MUL:
+		return v * arg;
+	case BPLUS_UPDATE_SET:
+		return arg;
+	case BPLUS_UPDATE_MIN:
+		return v < arg ? v : arg;
+	case BPLUS_UPDATE_MAX:
+		return v > arg ? v : arg;
+	case BPLUS_UPDATE_OR:
+		return v | arg;
+	case BPLUS_UPDATE_AND:
+		return v & arg;
+	case BPLUS_UPDATE_FADD:
+	case BPLUS_UPDATE_FMUL:
+		memcpy(&x, &v, sizeof(x));
+		memcpy(&y, &arg, sizeof(y));
+		x = op == BPLUS_UPDATE_FADD ? x + y : x * y;
+		memcpy(&v, &x, sizeof(v));
+		return v;
+	}
+	return v;
+}
+
+typedef value_t update_values_vec __attribute__((vector_size(4 * sizeof(value_t))));
+typedef double update_doubles_vec __attribute__((vector_size(4 * sizeof(double))));
+
+/* apply op with arg to the n values from w */
+SIMD_CLONES
+static void update_values(union word *w, unsigned n, enum bplus_update_op op, value_t arg)
+{
+	unsigned i = 0;
+	double y;
+	memcpy(&y, &arg, sizeof(y));
+	for (; i + 4 <= n; i += 4) {
+		update_values_vec v, m;
+		update_doubles_vec x;
+		memcpy(&v, w + i, sizeof(v));
+		switch (op) {
+		case BPLUS_UPDATE_ADD:
+			v += arg;
+			break;
+		case BPLUS_UPDATE_MUL:
+			v *= arg;
+			break;
+		case BPLUS_UPDATE_SET:
+			v = (update_values_vec){ arg, arg, arg, arg };
+			break;
+		case BPLUS_UPDATE_MIN:
+			m = (update_values_vec)(v > arg);
+			v = (v & ~m) | (arg & m);
+			break;
+		case BPLUS_UPDATE_MAX:
+			m = (update_values_vec)(v < arg);
+			v = (v & ~m) | (arg & m);
+			break;
+		case BPLUS_UPDATE_OR:
+			v |= arg;
+			break;
+		case BPLUS_UPDATE_AND:
+			v &= arg;
+			break;
+		case BPLUS_UPDATE_FADD:
+		case BPLUS_UPDATE_FMUL:
+			memcpy(&x, &v, sizeof(x));
+			x = op == BPLUS_UPDATE_FADD ? x + y : x * y;
+			memcpy(&v, &x, sizeof(v));
+			break;
+		}
+		memcpy(w + i, &v, sizeof(v));
+	}
+	for (; i < n; i++)
+		w[i].value = update_value(op, w[i].value, arg);
+}
+
+struct update {
+	bplus_t b;
+	lkey_t lo, hi;
+	enum bplus_update_op op;
+	value_t arg;
+	value_t (*f)(lkey_t k, value_t v, void *ctx);	/* if not NULL, used instead of op */
+	void *ctx;
+	pthread_mutex_t lock;	/* for next, when threads share the leaves out */
+	blkp next;	/* next leaf to update, or NULL */
+};
+
+/* the records need updating one by one, to keep their expiry times, feed or index */
+static inline int update_by_record(bplus_t b)
+{
+	return b->ttl_page != 0 || b->cdc != NULL || b->index != NULL;
+}
+
+/* update the records of leaf in the range. Returns NOMEM if the index could not be added to. */
+static enum bplus_error update_leaf(struct update *u, blkp leaf)
+{
+	bplus_t b = u->b;
+	unsigned nk = num_keys(leaf);
+	unsigned i = scan_leaf_keys(leaf, u->lo);
+	unsigned end = get_key(leaf, nk - 1) <= u->hi ? nk : scan_index_keys(leaf, u->hi);
+	enum bplus_error ok = OK;
+	if (u->f == NULL && !update_by_record(b)) {
+		update_values(leaf->words + FIELD_0 + i, end - i, u->op, u->arg);
+	} else {
+		for (; i < end; i++) {
+			lkey_t k = get_key(leaf, i);
+			value_t old = get_value(leaf, i), v;
+			if (expired(b, leaf, i))
+				continue;
+			v = u->f != NULL ? u->f(k, old, u->ctx) : update_value(u->op, old, u->arg);
+			if (v == old)
+				continue;
+			if (b->index != NULL && index_add(b->index, v, k) != OK) {
+				ok = NOMEM;
+				break;
+			}
+			cdc_note(b, BPLUS_CHANGE_UPDATE, k, old, v);
+			set_value(leaf, i, v);
+			if (b->index != NULL)
+				index_remove(b->index, old, k);
+		}
+	}
+	rehash(b, leaf, 1);
+	rezone(b, leaf, 1);
+	return ok;
+}
+
+/* take the next few leaves of the range, returning the first and setting end past the last */
+static blkp take_leaves(struct update *u, blkp *end)
+{
+	blkp first, leaf;
+	pthread_mutex_lock(&u->lock);
+	first = leaf = u->next;
+	for (unsigned n = 0; n < UPDATE_CHUNK && leaf != NULL; n++) {
+		leaf = next_leaf(leaf);
+		if (leaf != NULL && (num_keys(leaf) == 0 || get_key(leaf, 0) > u->hi))
+			leaf = NULL;
+	}
+	u->next = leaf;
+	pthread_mutex_unlock(&u->lock);
+	*end = leaf;
+	return first;
+}
+
+static void *update_thread(void *arg)
+{
+	struct update *u = arg;
+	blkp leaf, end;
+	while ((leaf = take_leaves(u, &end)) != NULL)
+		for (; leaf != end; leaf = next_leaf(leaf))
+			update_leaf(u, leaf);
+	return NULL;
+}
+
+static void refresh_node(bplus_t b, blkp node, unsigned height, lkey_t lo, lkey_t hi);
+
+/* refresh node, then the nodes split off it still pending, which hold the keys after it */
+static void refresh_group(bplus_t b, blkp node, unsigned height, lkey_t lo, lkey_t hi)
+{
+	struct pending_split *p = NULL;
+	refresh_node(b, node, height, lo, hi);
+	for (;;) {
+		struct pending_split *next = NULL;
+		for (unsigned i = 0; i < b->npending; i++) {
+			struct pending_split *q = &b->pending[i];
+			if (q->left == node && (p == NULL || q->key > p->key) && (next == NULL || q->key < next->key))
+				next = q;
+		}
+		if (next == NULL)
+			return;
+		p = next;
+		refresh_group(b, p->right, height, lo, hi);
+	}
+}
+
+/* recompute the hashes and bounds of the index nodes under node whose keys meet lo..hi */
+static void refresh_node(bplus_t b, blkp node, unsigned height, lkey_t lo, lkey_t hi)
+{
+	unsigned end;
+	if (height == 0)
+		return;
+	end = hi == ~0UL ? num_keys(node) : scan_index_keys(node, hi);
+	for (unsigned i = scan_index_keys(node, lo); i <= end; i++)
+		refresh_group(b, get_child(node, i), height - 1, lo, hi);
+	rehash(b, node, 0);
+	rezone(b, node, 0);
+}
+
+static enum bplus_error update_range(struct update *u, unsigned nthreads)
+{
+	bplus_t b = u->b;
+	pthread_t threads[BPLUS_UPDATE_THREADS];
+	unsigned started = 0;
+	enum bplus_error ok = OK;
+	if (b->root == NULL || u->lo > u->hi)
+		return OK;
+	push_range(b, u->lo, u->hi);
+	u->next = descend_to_leaf(b, u->lo);
+	if (num_keys(u->next) == 0)
+		return OK;
+	if (nthreads > 1 && u->f == NULL && !update_by_record(b)) {
+		/* the leaves are shared out a few at a time, with this thread taking them too */
+		if (nthreads > BPLUS_UPDATE_THREADS)
+			nthreads = BPLUS_UPDATE_THREADS;
+		pthread_mutex_init(&u->lock, NULL);
+		while (started < nthreads - 1 && pthread_create(&threads[started], NULL, update_thread, u) == 0)
+			started += 1;
+		update_thread(u);
+		while (started > 0)
+			pthread_join(threads[--started], NULL);
+		pthread_mutex_destroy(&u->lock);
+	} else {
+		for (blkp leaf = u->next; leaf != NULL && ok == OK; leaf = next_leaf(leaf)) {
+			if (num_keys(leaf) == 0 || get_key(leaf, 0) > u->hi)
+				break;
+			heat_touch(b, leaf, 1);
+			ok = update_leaf(u, leaf);
+		}
+	}
+	if (b->hash_page != 0 || b->zone_page != 0)
+		refresh_node(b, b->root, b->depth, u->lo, u->hi);
+	return ok;
+}
+
+enum bplus_error bplus_update_range(bplus_t b, lkey_t lo, lkey_t hi, enum bplus_update_op op, value_t arg)
+{
+	struct update u = { b, lo, hi, op, arg, NULL, NULL };
+	return update_range(&u, 1);
+}
+
+enum bplus_error bplus_update_range_fn(bplus_t b, lkey_t lo, lkey_t hi,
+				       value_t (*f)(lkey_t k, value_t v, void *ctx), void *ctx)
+{
+	struct update u = { b, lo, hi, BPLUS_UPDATE_SET, 0, f, ctx };
+	return update_range(&u, 1);
+}
+
+enum bplus_error bplus_update_range_parallel(bplus_t b, lkey_t lo, lkey_t hi, enum bplus_update_op op,
+					     value_t arg, unsigned nthreads)
+{
+	struct update u = { b, lo, hi, op, arg, NULL, NULL };
+	return update_range(&u, nthreads);
+}
+
+/* ***** lazy range adds ***** */
+
+/*
+ * add delta to the values under node, at height, with keys in lo..hi. in_lo and in_hi are
+ * set if all of node's keys are at least lo, or at most hi. A child wholly in the range is
+ * tagged, and only the children holding lo and hi are descended into, so at most two nodes
+ * of each level are visited.
+ */
+static void add_range(bplus_t b, blkp node, unsigned height, lkey_t lo, lkey_t hi, int in_lo, int in_hi,
+		      value_t delta)
+{
+	unsigned nk = num_keys(node);
+	unsigned first, last;
+	if (height == 0) {
+		first = in_lo ? 0 : scan_leaf_keys(node, lo);
+		last = in_hi ? nk : scan_index_keys(node, hi);
+		for (unsigned i = first; i < last; i++)
+			set_value(node, i, get_value(node, i) + delta);
+		return;
+	}
+	/* child i holds the keys from key i - 1 up to key i */
+	first = in_lo ? 0 : scan_index_keys(node, lo);
+	last = in_hi ? nk : scan_index_keys(node, hi);
+	for (unsigned i = first; i <= last; i++) {
+		int l = in_lo || i > first || (i > 0 && get_key(node, i - 1) == lo);
+		int r = in_hi || i < last;
+		if (l && r) {
+			set_tag(b, node, i, get_tag(b, node, i) + delta);
+			mark_tags(b, node, 1);
+		} else {
+			add_range(b, get_child(node, i), height - 1, lo, hi, l, r, delta);
+		}
+	}
+}
+
+enum bplus_error bplus_range_add(bplus_t b, lkey_t lo, lkey_t hi, value_t delta)
+{
+	/*
+	 * a feed or index has to see each new value, and pending splits would need tags of
+	 * their own, so if they cannot be finished the values are added to at once
+	 */
+	if (b->tag_page == 0 || b->cdc != NULL || b->index != NULL || bplus_maintain(b, ~0UL) != OK)
+		return bplus_update_range(b, lo, hi, BPLUS_UPDATE_ADD, delta);
+	if (b->root == NULL || lo > hi || delta == 0)
+		return OK;
+	add_range(b, b->root, b->depth, lo, hi, lo == 0, hi == ~0UL, delta);
+	b->tags = 1;
+	b->tag_epoch += 1;
+	return OK;
+}
+
+/* ***** subtree hashes and diff ***** */
+
+/* sum of the hashes of the records of b with keys below k */
+static unsigned long hash_below(bplus_t b, lkey_t k)
+{
+	unsigned long h = 0;
+	blkp node = b->root;
+	unsigned nk, i;
+	for (unsigned d = 0; d < b->depth; d++) {
+		blkp child, holder;
+		i = scan_index_keys(node, k);
+		for (unsigned j = 0; j < i; j++)
+			h += subtree_hash(b, get_child(node, j));
+		/* nodes split off child, and left of the one holding k, are below k too */
+		child = get_child(node, i);
+		holder = follow_pending(b, child, k);
+		if (holder != child)
+			h += subtree_hash(b, child) - subtree_hash(b, holder);
+		node = holder;
+	}
+	nk = num_keys(node);
+	for (i = 0; i < nk && get_key(node, i) < k; i++)
+		h += record_hash(get_key(node, i), get_value(node, i));
+	return h;
+}
+
+unsigned long bplus_range_hash(bplus_t b, lkey_t lo, lkey_t hi)
+{
+	if (b->hash_page == 0 || lo > hi)
+		return 0;
+	return (hi == ~0UL ? get_hash(b, b->root) : hash_below(b, hi + 1)) - hash_below(b, lo);
+}
+
+struct diff {
+	bplus_t a, b;
+	int hashed;/* both trees keep hashes, so subtrees that match can be skipped */
+	int (*f)(lkey_t k, const value_t *va, const value_t *vb, void *ctx);
+	void *ctx;
+};
+
+/* compare leaf of a, holding keys from lo up to hi, with the records of b in the same range */
+static int diff_leaf(struct diff *x, blkp leaf, lkey_t lo, lkey_t hi, int bounded)
+{
+	blkp other = descend_to_leaf(x->b, lo);
+	unsigned i = 0, j = scan_leaf_keys(other, lo), na = num_keys(leaf);
+	/* the tags above each leaf, added to its values */
+	value_t da = x->a->tags && na != 0 ? path_delta(x->a, get_key(leaf, 0)) : 0;
+	value_t db = x->b->tags ? path_delta(x->b, lo) : 0;
+	for (;;) {
+		int in_b;
+		lkey_t ka, kb;
+		value_t va, vb;
+		if (other != NULL && j >= num_keys(other)) {
+			other = next_leaf(other);
+			j = 0;
+			if (x->b->tags && other != NULL && num_keys(other) != 0)
+				db = path_delta(x->b, get_key(other, 0));
+			continue;
+		}
+		in_b = other != NULL && (!bounded || get_key(other, j) < hi);
+		if (i == na && !in_b)
+			return 0;
+		ka = i < na ? get_key(leaf, i) : 0;
+		kb = in_b ? get_key(other, j) : 0;
+		if (in_b && (i == na || kb < ka)) {
+			vb = get_value(other, j++) + db;
+			if (x->f(kb, NULL, &vb, x->ctx))
+				return 1;
+		} else if (!in_b || ka < kb) {
+			va = get_value(leaf, i++) + da;
+			if (x->f(ka, &va, NULL, x->ctx))
+				return 1;
+		} else {
+			va = get_value(leaf, i++) + da;
+			vb = get_value(other, j++) + db;
+			if (va != vb && x->f(ka, &va, &vb, x->ctx))
+				return 1;
+		}
+	}
+}
+
+/*
+ * compare node, at depth d of a and holding keys from lo up to hi (or all above lo if not
+ * bounded), with the same range of b, whose hashes below lo and hi are below_lo and below_hi.
+ */
+static int diff_subtree(struct diff *x, unsigned d, blkp node, lkey_t lo, lkey_t hi, int bounded,
+			unsigned long below_lo, unsigned long below_hi)
+{
+	unsigned nk = num_keys(node);
+	if (x->hashed && get_hash(x->a, node) == below_hi - below_lo)
+		return 0;
+	if (d == x->a->depth)
+		return diff_leaf(x, node, lo, hi, bounded);
+	for (unsigned i = 0; i <= nk; i++) {
+		int last = i == nk;
+		lkey_t child_hi = last ? hi : get_key(node, i);
+		unsigned long below = last ? below_hi : x->hashed ? hash_below(x->b, child_hi) : 0;
+		if (diff_subtree(x, d + 1, get_child(node, i), lo, child_hi, last ? bounded : 1, below_lo, below))
+			return 1;
+		lo = child_hi;
+		below_lo = below;
+	}
+	return 0;
+}
+
+enum bplus_error bplus_diff(bplus_t a, bplus_t b,
+			    int (*f)(lkey_t k, const value_t *va, const value_t *vb, void *ctx), void *ctx)
+{
+	struct diff x = { a, b, a->hash_page != 0 && b->hash_page != 0, f, ctx };
+	/* the walk over a only follows posted children */
+	enum bplus_error ok = bplus_maintain(a, ~0UL);
+	if (ok != OK)
+		return ok;
+	if (diff_subtree(&x, 0, a->root, 0, 0, 0, 0, x.hashed ? get_hash(b, b->root) : 0))
+		return INCOMPLETE;
+	return OK;
+}
+
+/* ***** random samples ***** */
+
+/*
+ * A key range is covered by pieces: runs of whole children of an index node, and parts of
+ * the leaves at its two ends. A sample picks a piece in proportion to the most records it
+ * could hold, then walks down from a random child of the run, picking a slot of each node
+ * below at random and starting again if the slot is empty. Every record in the range is
+ * then equally likely to be drawn, and the tree keeps no counts to be able to do so.
+ */
+struct sample_piece {
+	blkp node;
+	unsigned first;/* first child, or record of a leaf, in the piece */
+	unsigned count;
+	unsigned height;/* levels of index nodes below node */
+	double weight;/* most records the pieces up to and including this one could hold */
+};
+
+struct sampler {
+	struct sample_piece *pieces;
+	unsigned npieces;
+	double weight;
+	lkey_t lo, hi;
+};
+
+static void add_piece(struct sampler *s, blkp node, unsigned first, unsigned count, unsigned height)
+{
+	/* a leaf part holds exactly count records, a run of children at most this many */
+	double w = count;
+	if (height != 0)
+		w *= ORDER - 1;
+	for (unsigned h = 1; h < height; h++)
+		w *= ORDER;
+	s->weight += w;
+	s->pieces[s->npieces++] = (struct sample_piece){ node, first, count, height, s->weight };
+}
+
+/*
+ * add the pieces covering the keys from s->lo to s->hi under node, whose keys are from
+ * nlo up to nhi, or all those above nlo if not bounded
+ */
+static void cover_range(struct sampler *s, blkp node, unsigned height, lkey_t nlo, lkey_t nhi, int bounded)
+{
+	unsigned nk = num_keys(node), c0, c1;
+	lkey_t lo0, hi1;
+	if (height == 0) {
+		c0 = scan_leaf_keys(node, s->lo);
+		c1 = s->hi == ~0UL ? nk : scan_leaf_keys(node, s->hi + 1);
+		if (c1 > c0)
+			add_piece(s, node, c0, c1 - c0, 0);
+		return;
+	}
+	/* the children holding lo and hi, and their bounds */
+	c0 = scan_index_keys(node, s->lo);
+	c1 = s->hi == ~0UL ? nk : scan_index_keys(node, s->hi);
+	lo0 = c0 == 0 ? nlo : get_key(node, c0 - 1);
+	hi1 = c1 == nk ? nhi : get_key(node, c1);
+	if (c0 == c1) {
+		cover_range(s, get_child(node, c0), height - 1, lo0, hi1, c1 < nk || bounded);
+		return;
+	}
+	/* whole children between them make one run, with either end child if it is whole too */
+	if (lo0 < s->lo) {
+		cover_range(s, get_child(node, c0), height - 1, lo0, get_key(node, c0), 1);
+		c0 += 1;
+	}
+	if (s->hi == ~0UL || (hi1 <= s->hi + 1 && (c1 < nk || bounded)))
+		c1 += 1;
+	else
+		cover_range(s, get_child(node, c1), height - 1, get_key(node, c1 - 1), hi1, c1 < nk || bounded);
+	if (c1 > c0)
+		add_piece(s, node, c0, c1 - c0, height);
+}
+
+/* xorshift64* */
+static inline unsigned long next_random(unsigned long *state)
+{
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DUL;
+}
+
+/* random number below n */
+static inline unsigned random_below(unsigned long *rng, unsigned n)
+{
+	return ((next_random(rng) >> 32) * n) >> 32;
+}
+
+/* draw one record from the pieces, or return 0 if the walk hit an empty slot */
+static int sample_once(bplus_t b, struct sampler *s, unsigned long *rng, lkey_t *k, value_t *v)
+{
+	double x = (next_random(rng) >> 11) * 0x1.0p-53 * s->weight;
+	unsigned lo = 0, hi = s->npieces - 1, i;
+	struct sample_piece *p;
+	blkp node;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (s->pieces[mid].weight > x)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	p = &s->pieces[lo];
+	i = p->first + random_below(rng, p->count);
+	node = p->node;
+	for (unsigned h = p->height; h != 0; h--) {
+		node = get_child(node, i);
+		/* a slot of each node below, and all of them hold records in the range */
+		i = random_below(rng, h > 1 ? ORDER : ORDER - 1);
+		if (h > 1 ? i > num_keys(node) : i >= num_keys(node))
+			return 0;
+	}
+	if (expired(b, node, i))
+		return 0;
+	*k = get_key(node, i);
+	*v = leaf_value(b, node, i);
+	return 1;
+}
+
+/* give up after this many empty slots in a row, as when every record left has expired */
+#define SAMPLE_TRIES (1UL << 20)
+
+unsigned long bplus_sample_range(bplus_t b, lkey_t lo, lkey_t hi, unsigned long n,
+				 unsigned long *rng, lkey_t *keys, value_t *vals)
+{
+	struct sampler s = { NULL, 0, 0, lo, hi };
+	unsigned long drawn = 0, misses = 0;
+	if (b->root == NULL || lo > hi || n == 0)
+		return 0;
+	/* each root has at most a run or a leaf part at each level for either end of the range */
+	s.pieces = malloc((1 + b->npending) * 2 * (b->depth + 1) * sizeof(*s.pieces));
+	if (s.pieces == NULL)
+		return 0;
+	/* the walks do not follow pending splits, so the nodes split off are roots of their own */
+	cover_range(&s, b->root, b->depth, 0, 0, 0);
+	for (unsigned i = 0; i < b->npending; i++)
+		cover_range(&s, b->pending[i].right, b->depth - b->pending[i].depth - 1, b->pending[i].key, 0, 0);
+	while (s.npieces != 0 && drawn < n && misses < SAMPLE_TRIES) {
+		lkey_t k;
+		value_t v;
+		if (!sample_once(b, &s, rng, &k, &v)) {
+			misses += 1;
+			continue;
+		}
+		if (keys != NULL)
+			keys[drawn] = k;
+		if (vals != NULL)
+			vals[drawn] = v;
+		drawn += 1;
+		misses = 0;
+	}
+	free(s.pieces);
+	return drawn;
+}
+
+unsigned long bplus_sample(bplus_t b, unsigned long n, unsigned long *rng, lkey_t *keys, value_t *vals)
+{
+	return bplus_sample_range(b, 0, ~0UL, n, rng, keys, vals);
+}
+
+/* ***** estimates from the index ***** */
+
+/*
+ * Counts and quantiles estimated from the index nodes on the paths to the ends of a range,
+ * without reading any leaf. Each child of a node is taken to hold an equal share of the
+ * node's records, starting with the tree's record count at the root, and a leaf at the
+ * end of a range an equal share of the keys between its separators. The bounds take every
+ * node as holding from the fewest to the most records a node of its height can.
+ */
+
+/* fewest and most records under a node of the given height, other than the root */
+static double fewest_records(unsigned height)
+{
+	double n = LHALF - 1;
+	for (unsigned h = 0; h < height; h++)
+		n *= LHALF - 1;
+	return n;
+}
+
+static double most_records(unsigned height)
+{
+	double n = ORDER - 1;
+	for (unsigned h = 0; h < height; h++)
+		n *= ORDER;
+	return n;
+}
+
+/* most records in the nodes split off and still pending, which the walks do not see */
+static double pending_records(bplus_t b)
+{
+	double n = 0;
+	for (unsigned i = 0; i < b->npending; i++)
+		n += most_records(b->depth - b->pending[i].depth - 1);
+	return n;
+}
+
+struct estimate {
+	lkey_t lo, hi;
+	double count, min, max;
+};
+
+/* share of the keys from nlo up to nhi that are in lo..hi, if the keys are spread evenly */
+static double key_share(lkey_t lo, lkey_t hi, lkey_t nlo, lkey_t nhi, int bounded)
+{
+	lkey_t a = lo > nlo ? lo : nlo, z;
+	if (!bounded)
+		return lo <= nlo && hi == ~0UL ? 1.0 : 0.5;
+	z = hi < nhi - 1 ? hi : nhi - 1;
+	return z < a ? 0.0 : ((double)(z - a) + 1) / (double)(nhi - nlo);
+}
+
+/* add the records estimated to be in e->lo..e->hi under node, holding about size records */
+static void estimate_range(struct estimate *e, blkp node, unsigned height, lkey_t nlo, lkey_t nhi,
+			   int bounded, double size)
+{
+	unsigned nk, c0, c1;
+	lkey_t lo0, hi1;
+	double child;
+	if (height == 0) {
+		e->count += size * key_share(e->lo, e->hi, nlo, nhi, bounded);
+		e->max += ORDER - 1;
+		return;
+	}
+	nk = num_keys(node);
+	child = size / (nk + 1);
+	c0 = scan_index_keys(node, e->lo);
+	c1 = e->hi == ~0UL ? nk : scan_index_keys(node, e->hi);
+	lo0 = c0 == 0 ? nlo : get_key(node, c0 - 1);
+	hi1 = c1 == nk ? nhi : get_key(node, c1);
+	if (c0 == c1) {
+		estimate_range(e, get_child(node, c0), height - 1, lo0, hi1, c1 < nk || bounded, child);
+		return;
+	}
+	/* as cover_range(): whole children between the ends, and the ends if whole too */
+	if (lo0 < e->lo) {
+		estimate_range(e, get_child(node, c0), height - 1, lo0, get_key(node, c0), 1, child);
+		c0 += 1;
+	}
+	if (e->hi == ~0UL || (hi1 <= e->hi + 1 && (c1 < nk || bounded)))
+		c1 += 1;
+	else
+		estimate_range(e, get_child(node, c1), height - 1, get_key(node, c1 - 1), hi1,
+			       c1 < nk || bounded, child);
+	if (c1 > c0) {
+		e->count += (c1 - c0) * child;
+		e->min += (c1 - c0) * fewest_records(height - 1);
+		e->max += (c1 - c0) * most_records(height - 1);
+	}
+}
+
+unsigned long bplus_estimate_count(bplus_t b, lkey_t lo, lkey_t hi, unsigned long *min, unsigned long *max)
+{
+	struct estimate e = { lo, hi, 0, 0, 0 };
+	if (b->root == NULL || lo > hi) {
+		e.max = 0;
+	} else if (b->depth == 0) {
+		/* the root is the only leaf, so count it */
+		unsigned nk = num_keys(b->root);
+		unsigned c0 = scan_leaf_keys(b->root, lo), c1 = hi == ~0UL ? nk : scan_leaf_keys(b->root, hi + 1);
+		e.count = e.min = e.max = c1 > c0 ? c1 - c0 : 0;
+	} else {
+		estimate_range(&e, b->root, b->depth, 0, 0, 0, b->num_recs);
+		e.max += pending_records(b);
+		if (e.max > b->num_recs)
+			e.max = b->num_recs;
+		if (e.min > e.max)
+			e.min = e.max;
+		e.count = e.count < e.min ? e.min : e.count > e.max ? e.max : e.count;
+	}
+	if (min != NULL)
+		*min = e.min;
+	if (max != NULL)
+		*max = e.max;
+	return e.count + 0.5;
+}
+
+enum bplus_error bplus_estimate_quantile(bplus_t b, double q, lkey_t *k, lkey_t *min, lkey_t *max)
+{
+	blkp node = b->root;
+	double rank, share, size = b->num_recs, below_min = 0, below_max = 0, slack = pending_records(b);
+	lkey_t nlo = 0, nhi = 0, kmin = 0, kmax = ~0UL, width = 0, est;
+	int bounded = 0;
+	if (node == NULL || b->num_recs == 0)
+		return NOTFOUND;
+	q = q < 0 ? 0 : q > 1 ? 1 : q;
+	/* rank of the record wanted, counting from 0 */
+	rank = (unsigned long)(q * (b->num_recs - 1));
+	if (b->depth == 0) {
+		/* the root is the only leaf, so read it */
+		*k = get_key(node, rank < num_keys(node) ? rank : num_keys(node) - 1);
+		if (min != NULL)
+			*min = *k;
+		if (max != NULL)
+			*max = *k;
+		return OK;
+	}
+	share = rank;
+	for (unsigned h = b->depth; h != 0; h--) {
+		unsigned nk = num_keys(node), j;
+		double child = size / (nk + 1), fewest = fewest_records(h - 1), most = most_records(h - 1);
+		/*
+		 * the record wanted is at or above a separator that at most rank records can be
+		 * below, and under one that more than rank records must be below
+		 */
+		for (unsigned i = 0; i < nk; i++) {
+			lkey_t s = get_key(node, i);
+			if (below_max + (i + 1) * most + slack <= rank && s > kmin)
+				kmin = s;
+			if (below_min + (i + 1) * fewest > rank && s - 1 < kmax) {
+				kmax = s - 1;
+				break;
+			}
+		}
+		j = share / child;
+		if (j > nk)
+			j = nk;
+		share -= j * child;
+		below_min += j * fewest;
+		below_max += j * most;
+		if (h == 1 && nk != 0)
+			/* how wide the leaf's keys are, from its neighbour's if it has no upper separator */
+			width = j < nk ? get_key(node, j) - (j > 0 ? get_key(node, j - 1) : nlo) :
+				get_key(node, nk - 1) - (nk > 1 ? get_key(node, nk - 2) : nlo);
+		if (j > 0)
+			nlo = get_key(node, j - 1);
+		if (j < nk) {
+			nhi = get_key(node, j);
+			bounded = 1;
+		}
+		size = child;
+		node = get_child(node, j);
+	}
+	/* the leaf is not read: take its keys to be spread evenly from nlo */
+	share = size > 0 ? share / size : 0;
+	est = nlo + (lkey_t)(share < 1 ? share * width : width);
+	if (bounded && est >= nhi)
+		est = nhi - 1;
+	*k = est < kmin ? kmin : est > kmax ? kmax : est;
+	if (min != NULL)
+		*min = kmin;
+	if (max != NULL)
+		*max = kmax;
+	return OK;
+}
+
+/* ***** filtered scans ***** */
+
+struct scan {
+	bplus_t b;
+	lkey_t lo, hi;
+	value_t vmin, vmax;
+	int (*f)(lkey_t k, value_t v, void *ctx);
+	void *ctx;
+};
+
+static int scan_node(struct scan *s, blkp node, unsigned height, value_t delta);
+
+/*
+ * scan node, then the nodes split off it still pending, which hold the keys after it. delta
+ * is the sum of the tags above them, added to their values.
+ */
+static int scan_group(struct scan *s, blkp node, unsigned height, value_t delta)
+{
+	bplus_t b = s->b;
+	struct pending_split *p = NULL;
+	if (scan_node(s, node, height, delta))
+		return 1;
+	for (;;) {
+		struct pending_split *next = NULL;
+		for (unsigned i = 0; i < b->npending; i++) {
+			struct pending_split *q = &b->pending[i];
+			if (q->left == node && (p == NULL || q->key > p->key) && (next == NULL || q->key < next->key))
+				next = q;
+		}
+		if (next == NULL)
+			return 0;
+		p = next;
+		if (scan_group(s, p->right, height, delta))
+			return 1;
+	}
+}
+
+static int scan_node(struct scan *s, blkp node, unsigned height, value_t delta)
+{
+	bplus_t b = s->b;
+	unsigned nk = num_keys(node), i, end;
+	/* nothing under node can match if its values are all outside vmin..vmax */
+	if (b->zone_page != 0 && (get_zone_max(b, node) < s->vmin || get_zone_min(b, node) > s->vmax))
+		return 0;
+	if (height == 0) {
+		for (i = scan_leaf_keys(node, s->lo); i < nk && get_key(node, i) <= s->hi; i++) {
+			value_t v = get_value(node, i) + delta;
+			if (v >= s->vmin && v <= s->vmax && !expired(b, node, i) && s->f(get_key(node, i), v, s->ctx))
+				return 1;
+		}
+		return 0;
+	}
+	end = s->hi == ~0UL ? nk : scan_index_keys(node, s->hi);
+	for (i = scan_index_keys(node, s->lo); i <= end; i++)
+		if (scan_group(s, get_child(node, i), height - 1, delta + (has_tags(b, node) ? get_tag(b, node, i) : 0)))
+			return 1;
+	return 0;
+}
+
+enum bplus_error bplus_scan_where(bplus_t b, lkey_t lo, lkey_t hi, value_t vmin, value_t vmax,
+				  int (*f)(lkey_t k, value_t v, void *ctx), void *ctx)
+{
+	struct scan s = { b, lo, hi, vmin, vmax, f, ctx };
+	if (b->root == NULL || lo > hi || vmin > vmax)
+		return OK;
+	return scan_node(&s, b->root, b->depth, 0) ? INCOMPLETE : OK;
+}
+
+/* ***** joins ***** */
+
+/*
+ * The keys of n trees are merged by leapfrogging: each tree keeps a position, and one behind
+ * the others seeks straight to the key they are at, in the same leaf or the next if it is
+ * near, else down from the root, with binary searches rather than a walk record by record.
+ * Two trees whose positions are both mid-leaf are intersected four keys by four.
+ */
+
+/* one of the trees being joined, at the record it has reached, or done once past hi */
+struct join_side {
+	bplus_t b;
+	blkp leaf;
+	unsigned i;
+	blkp delta_leaf;/* leaf whose tags were last added up, or NULL */
+	value_t delta;/* the sum of the tags above it */
+};
+
+typedef lkey_t join_keys __attribute__((vector_size(4 * sizeof(lkey_t))));
+
+/*
+ * compare four keys from a with four from b, returning a bit 4 * l + r for each equal pair
+ * a[l] == b[r], so the bits go in order of the keys
+ */
+SIMD_CLONES
+static unsigned match_4x4(const union word *a, const union word *b)
+{
+	join_keys va;
+	unsigned m = 0;
+	memcpy(&va, a, sizeof(va));
+	for (unsigned r = 0; r < 4; r++) {
+		join_keys eq = va == b[r].key;
+		for (unsigned l = 0; l < 4; l++)
+			m |= (eq[l] != 0) << (4 * l + r);
+	}
+	return m;
+}
+
+/* first key from i on in node that is >= k, or > k if strict, galloping out from i */
+static unsigned gallop_keys(blkp node, unsigned i, lkey_t k, int strict)
+{
+	unsigned nk = num_keys(node), lo = i, hi, step = 1;
+	/* widen [lo, hi) until the key at hi is past k */
+	for (hi = i; hi < nk && (strict ? get_key(node, hi) <= k : get_key(node, hi) < k); hi = lo + step, step <<= 1)
+		lo = hi + 1;
+	if (hi > nk)
+		hi = nk;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (strict ? get_key(node, mid) <= k : get_key(node, mid) < k)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* move on from the position of s to the first record that is live, or finish past hi */
+static void side_settle(struct join_side *s, lkey_t hi)
+{
+	while (s->leaf != NULL) {
+		if (s->i >= num_keys(s->leaf)) {
+			s->leaf = next_leaf(s->leaf);
+			s->i = 0;
+		} else if (get_key(s->leaf, s->i) > hi) {
+			s->leaf = NULL;
+		} else if (expired(s->b, s->leaf, s->i)) {
+			s->i += 1;
+		} else {
+			break;
 		}
 	}
 }
 
-/* merging leaf and rightward peer deletes peer, so correct cursors to peer */
-static void fix_cursor_merge(bplus_t b, blkp leaf, blkp peer, unsigned nkl)
+static inline lkey_t side_key(struct join_side *s)
 {
-	for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
-		if (bc->leaf == peer) {
-			/* leaf had nkl key,value pairs */
-			printf("fix cursor leaf %p peer %p nkl %u bc->pos %u",
-			       leaf, peer, nkl, bc->pos);
-			bc->leaf = leaf;
-			bc->pos += nkl;
-		}
-	}
+	return get_key(s->leaf, s->i);
 }
 
-static void merge_index_nodes(bplus_t b, blkp l, blkp r, lkey_t s)
+/* value of record i of leaf, of the tree of s, with the tags above the leaf */
+static inline value_t side_value(struct join_side *s, blkp leaf, unsigned i)
 {
-	unsigned nkl = num_keys(l);
-	unsigned nkr = num_keys(r);
-#ifdef CHECK_INVARIANTS
-	/* merge overflow should not happen */
-	if (nkl + nkr > ORDER - 2) {
-		printf("Index node too big to merge, %u %u\n", nkl, nkr);
-		exit(EXIT_FAILURE);
+	if (!s->b->tags)
+		return get_value(leaf, i);
+	if (s->delta_leaf != leaf) {
+		s->delta_leaf = leaf;
+		s->delta = path_delta(s->b, get_key(leaf, 0));
 	}
-#endif
-	l->words[KEY_0 + nkl].key = s;
-	wrdmove(l->words + KEY_0 + nkl + 1, r->words + KEY_0, nkr);
-	wrdmove(l->words + FIELD_0 + nkl + 1, r->words + FIELD_0, nkr + 1);
-	l->words[HEADER].header.num_keys += nkr + 1;
-#ifdef CHECK_INVARIANTS
-	if (l->words[KEY_0 + nkl - 1].key >= l->words[KEY_0 + nkl].key ||
-	    l->words[KEY_0 + nkl].key >= l->words[KEY_0 + nkl + 1].key) {
-		    printf("index merge destroyed ordering of keys in node.\n");
-		    exit(EXIT_FAILURE);
-	    }
-#endif	
-	free_index_block(r);
-	b->num_blks -= 1;
+	return get_value(leaf, i) + s->delta;
 }
 
-static int index_underflow(bplus_t b, unsigned d, blkp inode, unsigned *posp)
+/* move s to the first record >= k, or finish past hi */
+static void side_seek(struct join_side *s, lkey_t k, lkey_t hi)
 {
-	/* time to restore invariant so all layers have >= ORDER/2 keys by combining nodes? */
-	/* inode is not root, number of keys in inode < LHALF */
-	blkp parent = b->path[d].node;
-	unsigned pos = b->path[d].pos;
-	unsigned nkp = b->path[d].num_keys;
-	blkp rpeer = NULL;
-	unsigned nkr;
-	unsigned nki = num_keys(inode);
-	if (pos < nkp) {
-		rpeer = parent->words[FIELD_0 + pos + 1].child;
-		nkr = num_keys(rpeer);
-		/* if right peer has more keys than can be merged, rotate from right through parent */
-		if (nki + nkr > ORDER - 2) {
-			/* rotate rpeer key through its splitting key in parent */
-			inode->words[KEY_0 + nki].key = parent->words[KEY_0 + pos].key;
-			parent->words[KEY_0 + pos].key = rpeer->words[KEY_0].key;
-			inode->words[FIELD_0 + nki + 1].value = rpeer->words[FIELD_0].value;
-			wrdmove(rpeer->words + KEY_0, rpeer->words + KEY_0 + 1, nkr - 1);
-			wrdmove(rpeer->words + FIELD_0, rpeer->words + FIELD_0 + 1, nkr);
-			inode->words[HEADER].header.num_keys += 1;
-			rpeer->words[HEADER].header.num_keys -= 1;
-			return 0;
-		}
-		/* right peer can be merged */
-	}
-	if (pos > 0) {
-		blkp lpeer = parent->words[FIELD_0 + pos - 1].child;
-		unsigned nkl = num_keys(lpeer);
-		/* else if left peer has more keys than can be merged, rotate from left through parent */
-		if (nkl + nki > ORDER - 2) {
-			wrdmove(inode->words + KEY_0 + 1, inode->words + KEY_0, nki);
-			wrdmove(inode->words + FIELD_0 + 1, inode->words + FIELD_0, nki + 1);
-			inode->words[KEY_0].key = parent->words[KEY_0 + pos - 1].key;
-			parent->words[KEY_0 + pos - 1].key = lpeer->words[KEY_0 + nkl - 1].key;
-			inode->words[FIELD_0].value = lpeer->words[FIELD_0 + nkl].value;
-			inode->words[HEADER].header.num_keys += 1;
-			lpeer->words[HEADER].header.num_keys -= 1;
-			return 0;
-		}
-		/* merge into the left peer and delete inode */
-		merge_index_nodes(b, lpeer, inode, parent->words[KEY_0 + pos - 1].key);
-		/* parent[pos] to be removed recursively */
-		*posp = pos;
+	blkp leaf = s->leaf, next;
+	unsigned nk;
+	if (leaf == NULL || side_key(s) >= k)
+		return;
+	nk = num_keys(leaf);
+	next = next_leaf(leaf);
+	if (get_key(leaf, nk - 1) >= k) {
+		s->i = gallop_keys(leaf, s->i + 1, k, 0);
+	} else if (next != NULL && num_keys(next) != 0 && get_key(next, num_keys(next) - 1) >= k) {
+		s->leaf = next;
+		s->i = gallop_keys(next, 0, k, 0);
+	} else if (k > hi) {
+		s->leaf = NULL;
+		return;
 	} else {
-		/* else pos == 0, so merge right peer into inode. */
-		merge_index_nodes(b, inode, rpeer, parent->words[KEY_0 + pos].key);
-		/* parent[pos + 1] to be removed recursively */
-		*posp = pos + 1;
+		blkp node = s->b->root;
+		for (unsigned d = 0; d < s->b->depth; d++)
+			node = follow_pending(s->b, get_child(node, gallop_keys(node, 0, k, 1)), k);
+		s->leaf = node;
+		s->i = gallop_keys(node, 0, k, 0);
 	}
-	return 1;
+	side_settle(s, hi);
 }
 
-#ifdef CHECK_INVARIANTS
-/* find rightmost key under inode at depth d */
-static lkey_t rightmost_key(bplus_t b, blkp inode, unsigned d)
+/* start each side at the first record >= lo, returning 0 if one of them has none up to hi */
+static int join_start(struct join_side *s, bplus_t *t, unsigned n, lkey_t lo, lkey_t hi, int all)
 {
-	return (d == b->depth) ? /* leaf node */
-		inode->words[KEY_0 + num_keys(inode) - 1].key :
-		rightmost_key(b, inode->words[FIELD_0 + num_keys(inode)].child, d + 1);
+	int any = 0;
+	for (unsigned j = 0; j < n; j++) {
+		s[j].b = t[j];
+		s[j].leaf = t[j]->root != NULL && lo <= hi ? t[j]->leaves : NULL;
+		s[j].i = 0;
+		s[j].delta_leaf = NULL;
+		side_settle(&s[j], hi);
+		side_seek(&s[j], lo, hi);
+		if (s[j].leaf == NULL && all)
+			return 0;
+		any |= s[j].leaf != NULL;
+	}
+	return any;
 }
-static lkey_t leftmost_key(bplus_t b, blkp inode, unsigned d)
+
+/* is record i of leaf, of the tree of s, up to hi and live */
+static inline int join_live(struct join_side *s, blkp leaf, unsigned i, lkey_t hi)
 {
-	return (d == b->depth) ? /* leaf node */
-		inode->words[KEY_0].key :
-		leftmost_key(b, inode->words[FIELD_0].child, d + 1);
+	return get_key(leaf, i) <= hi && !expired(s->b, leaf, i);
 }
-#endif
 
-/* recurse over path removing node at pos */
-static void shrink_index_ancestors(bplus_t b, unsigned d, unsigned pos)
+/*
+ * intersect two sides four keys by four while both have four or more left in their leaves,
+ * calling f on each key in both. Returns 1 if f stopped it.
+ */
+static int intersect_blocks(struct join_side *s, lkey_t hi,
+			    int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx)
 {
-	/* remove child from index node layer d at pos */
-	/*
-	 * NOTE: we never are called to delete the leftmost child of any index node
-	 * from below. Only merges of index nodes manage splitting keys and their children.
-	 */
-	blkp inode = b->path[d].node;
-	unsigned nk = b->path[d].num_keys;
-	if (nk - pos > 0) { /* slide down key,child pairs after pos */
-		wrdmove(inode->words + KEY_0 + pos - 1, inode->words + KEY_0 + pos, nk - pos);
-		wrdmove(inode->words + FIELD_0 + pos, inode->words + FIELD_0 + pos + 1, nk - pos);
-	}
-	nk -= 1;
-	inode->words[HEADER].header.num_keys = nk;
-#ifdef CHECK_INVARIANTS /* after deleting child at key[pos-1]*/
-	{
-		for (unsigned i = pos - 1; i < nk; i++) {
-			lkey_t key = inode->words[KEY_0 + i].key;
-			blkp prev_child = inode->words[FIELD_0 + i].child;
-			blkp child = inode->words[FIELD_0 + i + 1].child;
-			lkey_t key_below = rightmost_key(b, prev_child, d + 1);
-			lkey_t key_above = leftmost_key(b, child, d + 1);
-			if (key_below >= key || key > key_above) {
-				printf("Ordering failed at depth %u of %u: %lu ^< %lu ~<= %lu\n",
-					d, b->depth, key_below, key, key_above);
-				exit(EXIT_FAILURE);
+	blkp a = s[0].leaf, b = s[1].leaf;
+	unsigned i = s[0].i, j = s[1].i, na = num_keys(a), nb = num_keys(b);
+	while (i + 4 <= na && j + 4 <= nb) {
+		unsigned m = match_4x4(a->words + KEY_0 + i, b->words + KEY_0 + j);
+		lkey_t a3 = get_key(a, i + 3), b3 = get_key(b, j + 3);
+		for (; m != 0; m &= m - 1) {
+			unsigned l = __builtin_ctz(m) / 4, r = __builtin_ctz(m) % 4;
+			if (join_live(&s[0], a, i + l, hi) && join_live(&s[1], b, j + r, hi)) {
+				value_t vals[2] = { side_value(&s[0], a, i + l), side_value(&s[1], b, j + r) };
+				if (f(get_key(a, i + l), vals, 3, ctx))
+					return 1;
 			}
 		}
+		if (a3 <= b3)
+			i += 4;
+		if (b3 <= a3)
+			j += 4;
+		if ((a3 < b3 ? a3 : b3) >= hi) {
+			s[0].leaf = NULL;
+			return 0;
+		}
 	}
-#endif
-	if (d == 0) {
-		/* this is the root, whose minimum size is 2 keys, if only one is left, delete root */
-		if (nk == 0) {
-			/*  delete this root here, promote the remaining child to root. */
-			b->root = inode->words[FIELD_0].child;
-			b->depth -= 1;
-			free_index_block(inode);
-			b->num_blks -= 1;
-			if (b->depth == 0) {
-				/* when tree has no index nodes, optionally clean up path */
-				b->path_length = 0;
-				free(b->path);
-				b->path = NULL;
+	/* leave both at records not yet matched, for the seeks to carry on from */
+	s[0].i = i;
+	s[1].i = j;
+	side_settle(&s[0], hi);
+	side_settle(&s[1], hi);
+	return 0;
+}
+
+/* call f on each key in all n trees, leapfrogging each behind the highest key of the others */
+static int leapfrog_intersect(struct join_side *s, unsigned n, lkey_t hi,
+			      int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx)
+{
+	value_t vals[BPLUS_JOIN_MAX];
+	unsigned long all = n == BPLUS_JOIN_MAX ? ~0UL : (1UL << n) - 1;
+	lkey_t k = side_key(&s[0]);
+	for (unsigned j = 1; j < n; j++)
+		if (side_key(&s[j]) > k)
+			k = side_key(&s[j]);
+	for (;;) {
+		unsigned j, agree = 0;
+		if (n == 2 && s[0].leaf != NULL && s[1].leaf != NULL &&
+		    num_keys(s[0].leaf) - s[0].i >= 4 && num_keys(s[1].leaf) - s[1].i >= 4) {
+			if (intersect_blocks(s, hi, f, ctx))
+				return 1;
+			if (s[0].leaf == NULL || s[1].leaf == NULL)
+				return 0;
+			k = side_key(&s[0]) > side_key(&s[1]) ? side_key(&s[0]) : side_key(&s[1]);
+		}
+		/* seek each side to k in turn until all agree on it, raising k as they overshoot */
+		for (j = 0; agree < n; j = j + 1 == n ? 0 : j + 1) {
+			side_seek(&s[j], k, hi);
+			if (s[j].leaf == NULL)
+				return 0;
+			if (side_key(&s[j]) == k) {
+				agree += 1;
+			} else {
+				k = side_key(&s[j]);
+				agree = 1;
 			}
-		} else {
-			/* root node has more than 1 remaining child, done */
 		}
-	} else if (nk < LHALF) {
-		/* handle underflow by rotation or merge of inode and either peer */
-		int merged = index_underflow(b, d - 1, inode, &pos);
-		/* and recurse to parent (if merge, not rotate)*/
-		if (merged)
-			shrink_index_ancestors(b, d - 1, pos);
-	} else {
-		/* if non-root index node doesn't underflow, return */
+		for (j = 0; j < n; j++)
+			vals[j] = side_value(&s[j], s[j].leaf, s[j].i);
+		if (f(k, vals, all, ctx))
+			return 1;
+		s[0].i += 1;
+		side_settle(&s[0], hi);
+		if (s[0].leaf == NULL)
+			return 0;
+		k = side_key(&s[0]);
 	}
 }
 
-static void merge_leaf_nodes(bplus_t b, blkp l, blkp r)
+enum bplus_error bplus_intersect(bplus_t *t, unsigned n, lkey_t lo, lkey_t hi,
+				 int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx)
 {
-	unsigned nkl = num_keys(l);
-	unsigned nkr = num_keys(r);
-	wrdmove(l->words + KEY_0 + nkl, r->words + KEY_0, nkr);
-	wrdmove(l->words + FIELD_0 + nkl, r->words + FIELD_0, nkr);
-	l->words[HEADER].header.num_keys += nkr;
-	l->words[NEXT].leaf = r->words[NEXT].leaf;
-	fix_cursor_merge(b, l, r, nkl);
-	free_leaf_block(r);
-	b->num_blks -= 1;
+	struct join_side s[BPLUS_JOIN_MAX];
+	if (n == 0 || n > BPLUS_JOIN_MAX)
+		return NOTFOUND;
+	if (!join_start(s, t, n, lo, hi, 1))
+		return OK;
+	return leapfrog_intersect(s, n, hi, f, ctx) ? INCOMPLETE : OK;
 }
 
-static void leaf_underflow(bplus_t b, blkp leaf)
+enum bplus_error bplus_union(bplus_t *t, unsigned n, lkey_t lo, lkey_t hi,
+			     int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx)
 {
-	/* time to restore invariant so all layers have >= ORDER/2 keys by combining nodes? */
-	/* leaf is not root, number of keys in leaf = LHALF - 1 */
-	unsigned d = b->depth - 1;
-	blkp parent = b->path[d].node;
-	unsigned pos = b->path[d].pos;
-	unsigned nk = b->path[d].num_keys;
-	blkp rpeer = NULL;
-	if (pos < nk) {
-		rpeer = parent->words[FIELD_0 + pos + 1].child;
-		/* if right peer has nkey > LHALF, rotate from right and fix split in parent */
-		if (num_keys(rpeer) > LHALF) {
-			leaf->words[KEY_0 + LHALF - 1].key = rpeer->words[KEY_0].key;
-			leaf->words[FIELD_0 + LHALF - 1].value = rpeer->words[FIELD_0].value;
-			wrdmove(rpeer->words + KEY_0, rpeer->words + KEY_0 + 1, num_keys(rpeer) - 1);
-			wrdmove(rpeer->words + FIELD_0, rpeer->words + FIELD_0 + 1, num_keys(rpeer) - 1);
-			leaf->words[HEADER].header.num_keys += 1;
-			rpeer->words[HEADER].header.num_keys -= 1;
-			parent->words[KEY_0 + pos].key = rpeer->words[KEY_0].key;
-			fix_cursor_rotate_left(b, leaf, rpeer);
-			return;
+	struct join_side s[BPLUS_JOIN_MAX];
+	value_t vals[BPLUS_JOIN_MAX];
+	if (n == 0 || n > BPLUS_JOIN_MAX)
+		return NOTFOUND;
+	if (!join_start(s, t, n, lo, hi, 0))
+		return OK;
+	/* every key is reported, so there is nothing to skip: merge the sides at the lowest key */
+	for (;;) {
+		unsigned long present = 0;
+		lkey_t k = ~0UL;
+		int any = 0;
+		for (unsigned j = 0; j < n; j++) {
+			if (s[j].leaf != NULL && (!any || side_key(&s[j]) < k)) {
+				k = side_key(&s[j]);
+				any = 1;
+			}
+		}
+		if (!any)
+			return OK;
+		for (unsigned j = 0; j < n; j++) {
+			if (s[j].leaf != NULL && side_key(&s[j]) == k) {
+				present |= 1UL << j;
+				vals[j] = side_value(&s[j], s[j].leaf, s[j].i);
+				s[j].i += 1;
+			}
 		}
+		if (f(k, vals, present, ctx))
+			return INCOMPLETE;
+		for (unsigned j = 0; j < n; j++)
+			if (present >> j & 1)
+				side_settle(&s[j], hi);
 	}
-	if (pos > 0) {
-		blkp lpeer = parent->words[FIELD_0 + pos - 1].child;
-		/* else if left peer has nkey > LHALF, rotate from left, fixing split key in parent */
-		if (num_keys(lpeer) > LHALF) {
-			wrdmove(leaf->words + KEY_0 + 1, leaf->words + KEY_0, num_keys(leaf));
-			wrdmove(leaf->words + FIELD_0 + 1, leaf->words + FIELD_0, num_keys(leaf));
-			leaf->words[KEY_0].key = lpeer->words[KEY_0 + num_keys(lpeer) - 1].key;
-			leaf->words[FIELD_0].value = lpeer->words[FIELD_0 +num_keys(lpeer) - 1].value;
-			leaf->words[HEADER].header.num_keys += 1;
-			lpeer->words[HEADER].header.num_keys -= 1;
-			parent->words[KEY_0 + pos - 1].key = leaf->words[KEY_0].key;
-			fix_cursor_rotate_right(b, lpeer, leaf);
-			return;
+}
+
+enum bplus_error bplus_difference(bplus_t *t, unsigned n, lkey_t lo, lkey_t hi,
+				  int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx)
+{
+	struct join_side s[BPLUS_JOIN_MAX];
+	if (n == 0 || n > BPLUS_JOIN_MAX)
+		return NOTFOUND;
+	join_start(s, t, n, lo, hi, 0);
+	/* the other trees seek to each key of the first, skipping over their keys it does not have */
+	while (s[0].leaf != NULL) {
+		lkey_t k = side_key(&s[0]);
+		unsigned j;
+		for (j = 1; j < n; j++) {
+			side_seek(&s[j], k, hi);
+			if (s[j].leaf != NULL && side_key(&s[j]) == k)
+				break;
 		}
-		/* merge with the left peer and delete leaf */
-		merge_leaf_nodes(b, lpeer, leaf);
-		shrink_index_ancestors(b, b->depth - 1, pos);
-	} else {
-		/* else pos == 0, so merge with right peer, which exists and was too small to borrow from */
-		merge_leaf_nodes(b, leaf, rpeer);
-		shrink_index_ancestors(b, b->depth - 1, pos + 1);
+		if (j == n) {
+			value_t v = side_value(&s[0], s[0].leaf, s[0].i);
+			if (f(k, &v, 1, ctx))
+				return INCOMPLETE;
+		}
+		s[0].i += 1;
+		side_settle(&s[0], hi);
 	}
+	return OK;
 }
 
+struct join {
+	int (*f)(lkey_t k, value_t va, value_t vb, void *ctx);
+	void *ctx;
+};
 
+static int join_pair(lkey_t k, const value_t *vals, unsigned long present, void *ctx)
+{
+	struct join *j = ctx;
+	(void)present;
+	return j->f(k, vals[0], vals[1], j->ctx);
+}
 
-enum bplus_error delete(bplus_t b, lkey_t k)
+enum bplus_error bplus_join(bplus_t a, bplus_t b, lkey_t lo, lkey_t hi,
+			    int (*f)(lkey_t k, value_t va, value_t vb, void *ctx), void *ctx)
 {
-	enum bplus_error ok = path_reserved(b);
-	if (ok == OK) {
-		blkp leaf = find_leaf(b, k);
-		unsigned nk = num_keys(leaf);
-		unsigned i = scan_leaf_keys(leaf, k);
-		if (i < nk && get_key(leaf, i) == k) {
-			/* key k was found in leaf, remove record (key, value) */
-			unsigned sfx_count = nk - i - 1;
-			if (sfx_count != 0) {
-				wrdmove(leaf->words + KEY_0 + i, leaf->words + KEY_0 + i + 1, sfx_count);
-				wrdmove(leaf->words + FIELD_0 + i, leaf->words + FIELD_0 + i + 1, sfx_count);
-			}
-			leaf->words[HEADER].header.num_keys = nk - 1;
-			b->num_recs -= 1;
-			/* adjust all cursors pointing at leaf, at position i or after */
-			for (bplus_cursor_t bc = b->cursor_list; bc != NULL; bc = bc->next) {
-				if (bc->leaf == leaf) {
-					if (bc->pos == i)
-						bc->invalid = 1;
-					else if (bc->pos > i)
-						bc->pos -= 1;
-				}
-			}
-			/* if new leaf size (nk - 1) < min size, handle this underflow */
-			if (b->depth > 0 && nk <= LHALF)
-				leaf_underflow(b, leaf);
-		} else ok = NOTFOUND;
-	}
-	return ok;
+	bplus_t t[2] = { a, b };
+	struct join j = { f, ctx };
+	return bplus_intersect(t, 2, lo, hi, join_pair, &j);
 }
 
 void enumerate(bplus_t b, void (*f)(lkey_t k, value_t v))
 {
 	for (blkp bk = b->leaves; bk != NULL; bk = next_leaf(bk)) {
+		value_t t = b->tags && num_keys(bk) != 0 ? path_delta(b, get_key(bk, 0)) : 0;
 		for (unsigned i = 0; i < bk->words[HEADER].header.num_keys; i++) {
-			f(get_key(bk, i), get_value(bk, i));
+			if (!expired(b, bk, i))
+				f(get_key(bk, i), get_value(bk, i) + t);
 		}
 	}
 }
@@ -955,24 +5138,39 @@ bplus_cursor_t find_record(bplus_t b, lkey_t k)
 {
 	bplus_cursor_t c = NULL;	
 	if (b->root != NULL) {
-		if (path_reserved(b) == OK) {
-			blkp leaf = find_leaf(b, k);
-			/* scan leaf keys for match */
-			unsigned i = scan_leaf_keys(leaf, k);
-			/* i is the first key >= k */
-			c = make_bplus_cursor(b, leaf, i);
-		}
+		blkp leaf = descend_to_leaf(b, k);
+		/* scan leaf keys for match */
+		unsigned i = scan_leaf_keys(leaf, k);
+		/* i is the first key >= k */
+		heat_touch(b, leaf, 0);
+		c = make_bplus_cursor(b, leaf, i);
 	}
 	return c;
 }
 
+/* the sum of the tags above the cursor's leaf, added up again only once they change */
+static value_t cursor_delta(bplus_cursor_t c)
+{
+	bplus_t b = c->tree;
+	if (b == NULL || !b->tags)
+		return 0;
+	if (c->delta_leaf != c->leaf || c->delta_epoch != b->tag_epoch) {
+		c->delta_leaf = c->leaf;
+		c->delta_epoch = b->tag_epoch;
+		c->delta = path_delta(b, get_key(c->leaf, 0));
+	}
+	return c->delta;
+}
+
 enum bplus_error get_record(bplus_cursor_t c, lkey_t *k, value_t *v)
 {
 	blkp l = c->leaf;
 	unsigned p = c->pos;
-	if (!c->invalid && l != NULL && num_keys(l) > p) {
+	if (!c->invalid && l != NULL && num_keys(l) > p && (c->tree == NULL || !expired(c->tree, l, p))) {
+		if (c->tree != NULL)
+			heat_touch(c->tree, l, 0);
 		*k = get_key(l, p);
-		*v = l->words[FIELD_0 + p].value;
+		*v = l->words[FIELD_0 + p].value + cursor_delta(c);
 		return OK;
 	}
 	return NOTFOUND;
@@ -982,7 +5180,34 @@ enum bplus_error update_record(bplus_cursor_t c, value_t v)
 {
 	blkp l = c->leaf;
 	unsigned p = c->pos;
-	if (!c->invalid && l != NULL && num_keys(l) > p) {
+	if (!c->invalid && l != NULL && num_keys(l) > p && (c->tree == NULL || !expired(c->tree, l, p))) {
+		int indexed;
+		/* the new value replaces the value with its tags, so they are pushed into the leaf */
+		if (c->tree != NULL && c->tree->tags)
+			push_to_leaf(c->tree, get_key(l, p));
+		indexed = c->tree != NULL && c->tree->index != NULL && get_value(l, p) != v;
+		if (indexed && index_add(c->tree->index, v, get_key(l, p)) != OK)
+			return NOMEM;
+		if (c->tree != NULL && (c->tree->hash_page != 0 || c->tree->zone_page != 0)) {
+			/* the cursor has no path, so find the nodes above the leaf whose hashes or bounds change */
+			bplus_t b = c->tree;
+			lkey_t k = get_key(l, p);
+			blkp leaf;
+			if (path_reserved(b) != OK) {
+				if (indexed)
+					index_remove(b->index, v, k);
+				return NOMEM;
+			}
+			leaf = find_leaf(b, k);
+			hash_path(b, leaf, record_hash(k, v) - record_hash(k, get_value(l, p)));
+			zone_path(b, leaf, v);
+		}
+		if (c->tree != NULL) {
+			heat_touch(c->tree, l, 1);
+			cdc_note(c->tree, BPLUS_CHANGE_UPDATE, get_key(l, p), l->words[FIELD_0 + p].value, v);
+		}
+		if (indexed)
+			index_remove(c->tree->index, get_value(l, p), get_key(l, p));
 		l->words[FIELD_0 + p].value = v;
 		return OK;
 	}
@@ -1003,12 +5228,125 @@ void free_cursor(bplus_cursor_t c)
 			l = &((*l)->next);
 		}
 		/* *l should NOT be NULL, or an invariant broke */
+		b->num_crsrs -= 1;
 	}
 	free(c);
-	b->num_crsrs -= 1;
 }
 
 bplus_t get_tree(bplus_cursor_t c)
 {
 	return c->tree;
 }
+
+/* ***** shared memory trees ***** */
+
+#define SHARED_MAGIC 0x314D4853554C5042UL	/* "BPLUSHM1" */
+#define SHARED_PATH 16	/* longer than the path of any tree of 64 bit keys */
+
+/*
+ * A shared tree's segment starts with this, and its blocks follow from the next page on.
+ * The tree's links are plain pointers, so every process maps the segment at the address
+ * it was first mapped at, which is recorded here.
+ */
+struct bplus_shared {
+	unsigned long magic;/* set once the segment is ready to be opened */
+	void *base;/* address the segment is mapped at in every process */
+	unsigned long size;
+	pthread_rwlock_t lock;
+	struct bplus_arena arena;
+	struct bplus tree;
+	struct path_node path[SHARED_PATH];/* the tree's path, used by one writer at a time */
+};
+
+bplus_shared_t bplus_shared_create(const char *name, unsigned long size, unsigned flags)
+{
+	unsigned long start = PAGE_ALIGNED_SIZE(sizeof(struct bplus_shared));
+	pthread_rwlockattr_t attr;
+	bplus_shared_t s;
+	int fd;
+
+	size = PAGE_ALIGNED_SIZE(size);
+	if (size <= start)
+		return NULL;
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return NULL;
+	s = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (s == MAP_FAILED) {
+		shm_unlink(name);
+		return NULL;
+	}
+	s->base = s;
+	s->size = size;
+	s->arena = (struct bplus_arena){ (char *)s, size, start, NULL, 0 };
+	if (!init_bplus_tree(&s->tree, flags, &s->arena)) {
+		munmap(s, size);
+		shm_unlink(name);
+		return NULL;
+	}
+	s->tree.path = s->path;
+	s->tree.path_length = SHARED_PATH;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_rwlock_init(&s->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	__atomic_store_n(&s->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+	return s;
+}
+
+bplus_shared_t bplus_shared_open(const char *name)
+{
+	struct bplus_shared head;
+	bplus_shared_t s = MAP_FAILED;
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	/* the header says where the segment has to go */
+	if (pread(fd, &head, sizeof(head), 0) == sizeof(head) && head.magic == SHARED_MAGIC) {
+		s = mmap(head.base, head.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if (s != MAP_FAILED && (void *)s != head.base) {
+			/* something else of this process is in the way */
+			munmap(s, head.size);
+			s = MAP_FAILED;
+		}
+	}
+	close(fd);
+	return s != MAP_FAILED ? s : NULL;
+}
+
+bplus_t bplus_shared_tree(bplus_shared_t s)
+{
+	return &s->tree;
+}
+
+void bplus_shared_lock(bplus_shared_t s, int write)
+{
+	if (write)
+		pthread_rwlock_wrlock(&s->lock);
+	else
+		pthread_rwlock_rdlock(&s->lock);
+}
+
+void bplus_shared_unlock(bplus_shared_t s)
+{
+	pthread_rwlock_unlock(&s->lock);
+}
+
+void bplus_shared_space(bplus_shared_t s, unsigned long *used, unsigned long *size)
+{
+	pthread_rwlock_rdlock(&s->lock);
+	*used = s->arena.used - s->arena.num_free * s->tree.block_pages * PAGESIZE;
+	*size = s->size;
+	pthread_rwlock_unlock(&s->lock);
+}
+
+void bplus_shared_close(bplus_shared_t s)
+{
+	munmap(s, s->size);
+}
+
+enum bplus_error bplus_shared_unlink(const char *name)
+{
+	return shm_unlink(name) == 0 ? OK : NOTFOUND;
+}
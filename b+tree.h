@@ -34,22 +34,85 @@ enum bplus_error {
         OK = 0,
         NOTFOUND,
         NOMEM,
+        INCOMPLETE,     /* an incremental operation has more work to do */
         MAX_BPLUS_ERROR,
 };
 
 /* create new empty bplus tree */
 bplus_t new_bplus_tree(void);
 
+/* options for new_bplus_tree_opts() */
+enum bplus_flags {
+        /*
+         * bound the structural work of one insert: a leaf split whose parent is full
+         * leaves the new leaf reachable from its left neighbour, and the index splits
+         * above it are finished one at a time by later inserts or bplus_maintain().
+         */
+        BPLUS_DEFERRED_SPLITS = 1,
+        /*
+         * keep an expiry time with every record (see bplus_insert_ttl()), in a second
+         * page per block, so each block takes two pages.
+         */
+        BPLUS_TTL = 2,
+        /*
+         * keep a hash of the records under every block, for bplus_range_hash() and
+         * bplus_diff(), in the header word of a second page per block (the expiry page,
+         * with BPLUS_TTL). update_record() has to find the record's path to update them.
+         */
+        BPLUS_MERKLE = 4,
+        /*
+         * keep bounds on the values under every block, so bplus_scan_where() can skip
+         * blocks whose values are all outside the range it looks for, in two words of a
+         * second page per block (the expiry or hash page, with BPLUS_TTL or BPLUS_MERKLE).
+         * update_record() has to find the record's path to widen them.
+         */
+        BPLUS_ZONEMAP = 8,
+        /*
+         * let bplus_range_add() add to whole subtrees at once, keeping the amounts added
+         * as tags on index node children in a page of their own per block. Not kept with
+         * BPLUS_MERKLE or BPLUS_ZONEMAP, whose hashes and bounds have to follow every value.
+         */
+        BPLUS_RANGE_ADD = 16,
+};
+
+/* create new empty bplus tree with the given BPLUS_ flags */
+bplus_t new_bplus_tree_opts(unsigned flags);
+
+/*
+ * finish up to budget deferred index splits. Returns INCOMPLETE if some remain, OK if
+ * none do, or NOMEM. Calling it from an idle loop or timer keeps inserts from doing it.
+ * delete() and delete_range_step() finish all deferred splits before deleting anything.
+ */
+enum bplus_error bplus_maintain(bplus_t b, unsigned long budget);
+
 /*
  * give a valid bplus tree, destroys it and invalidates
  * all associated cursors so using them will cause an error.
  */
 void free_bplus_tree(bplus_t b);
 
+/*
+ * free a tree a bounded amount at a time, so a large tree can be torn down
+ * between other work. Each call frees at most budget blocks, and returns
+ * INCOMPLETE while blocks remain, OK once the tree is gone, or NOMEM if the
+ * teardown could not start. The first call invalidates all cursors, as
+ * free_bplus_tree() does; after it the tree may only be passed to further calls.
+ */
+enum bplus_error free_bplus_tree_step(bplus_t b, unsigned long budget);
+
+/*
+ * hand the tree to a background thread that frees it with free_bplus_tree_step().
+ * Returns OK once the caller is done with the tree. If no thread can be started it
+ * returns NOMEM, and the caller must finish with free_bplus_tree_step().
+ */
+enum bplus_error free_bplus_tree_background(bplus_t b);
+
 /*
  * given a key, find the associated value.
  * returns OK if key present, setting *v to value
  * or NOTFOUND.
+ * find() writes nothing into the tree, so several threads may call it
+ * at once, as long as no thread is modifying the tree meanwhile.
  */
 enum bplus_error find(bplus_t b, lkey_t k, value_t *v);
 
@@ -64,6 +127,27 @@ enum bplus_error find(bplus_t b, lkey_t k, value_t *v);
  */
 enum bplus_error insert(bplus_t b, lkey_t k, value_t v);
 
+/*
+ * insert as insert() does, with the record expiring at time expires. Times are whatever
+ * units the caller likes, compared with the tree's current time, set by bplus_set_time()
+ * or bplus_expire_step(). Once the current time reaches expires, the record is hidden from
+ * find(), enumerate(), get_record() and update_record(), as if deleted, until it is swept
+ * away or inserted again. Records inserted by insert() never expire. Without BPLUS_TTL,
+ * expires is ignored.
+ */
+enum bplus_error bplus_insert_ttl(bplus_t b, lkey_t k, value_t v, unsigned long expires);
+
+/* set the tree's current time, which starts at 0 */
+void bplus_set_time(bplus_t b, unsigned long now);
+
+/*
+ * set the tree's current time to now, and delete up to budget expired records, finding them
+ * by the earliest expiry kept for each subtree rather than by scanning. Returns INCOMPLETE
+ * if expired records remain, OK when none do, or NOMEM. Cursors on deleted records behave
+ * as for delete(). Expired records count in get_active_storage() until deleted.
+ */
+enum bplus_error bplus_expire_step(bplus_t b, unsigned long now, unsigned long budget);
+
 /* 
  * given a key, delete corresponding record, and if there
  * are any cursors pointing at the record, mark the record
@@ -72,6 +156,116 @@ enum bplus_error insert(bplus_t b, lkey_t k, value_t v);
  */
 enum bplus_error delete(bplus_t b, lkey_t k);
 
+/*
+ * delete records with keys in lo..hi inclusive, at most budget of them per call.
+ * Returns INCOMPLETE if records in the range remain, OK when there are none left.
+ * Cursors on deleted records behave as for delete().
+ */
+enum bplus_error delete_range_step(bplus_t b, lkey_t lo, lkey_t hi, unsigned long budget);
+
+/*
+ * delete every record with a key below cutoff, for trees used as a sliding window over
+ * increasing keys. Leaves wholly below cutoff are freed without looking at their records,
+ * only the leaf holding cutoff is trimmed, and only the nodes down the left edge are
+ * rebalanced afterwards. Cursors on deleted records behave as for delete().
+ * Returns OK, or NOMEM if pending deferred splits could not be finished.
+ */
+enum bplus_error bplus_truncate_before(bplus_t b, lkey_t cutoff);
+
+/*
+ * delete the records with keys in lo..hi inclusive for which pred returns 0, calling it once
+ * on each live record in key order. The leaves of the range are swept once, with the records
+ * kept packed into full leaves and the emptied ones freed, and the index nodes are then built
+ * again once, in time proportional to the number of leaves in the tree, rather than fixed up
+ * after each delete. Expired records are left for bplus_expire_step(), and cursors on deleted
+ * records behave as for delete(). Returns OK, or NOMEM with nothing deleted.
+ */
+enum bplus_error bplus_retain_if(bplus_t b, lkey_t lo, lkey_t hi,
+				 int (*pred)(lkey_t k, value_t v, void *ctx), void *ctx);
+
+/*
+ * move the records of b with keys k and above into a new tree with the same flags, returned,
+ * or return NULL if out of memory, leaving b as it was. The path to k is cut in two, so whole
+ * subtrees change trees without being read, and only the nodes down the two new edges are
+ * rebalanced. Cursors on the records moved go with them. With a change feed or secondary
+ * index, or in shared memory, the records are copied over and deleted one at a time instead.
+ * Otherwise the memory to join the trees again is set aside with them, so that until either
+ * is written, bplus_concat(b, r) of the tree r returned cannot fail.
+ */
+bplus_t bplus_split(bplus_t b, lkey_t k);
+
+/*
+ * move every record of b to the end of a, leaving b empty, when all of a's keys are below
+ * all of b's: the lower of the two trees is hung from the edge of the higher one, so it
+ * takes a few descents however many records move. Cursors of b become cursors of a.
+ * Returns OK, NOTFOUND if the keys overlap, or NOMEM with both trees as they were. Trees
+ * with different flags, feeds or indexes, or in shared memory, are merged record by record.
+ */
+enum bplus_error bplus_concat(bplus_t a, bplus_t b);
+
+/* operations bplus_update_range() applies to each value v in its range, with arg */
+enum bplus_update_op {
+        BPLUS_UPDATE_ADD,       /* v + arg */
+        BPLUS_UPDATE_MUL,       /* v * arg */
+        BPLUS_UPDATE_SET,       /* arg */
+        BPLUS_UPDATE_MIN,       /* the smaller of v and arg, clamping v to at most arg */
+        BPLUS_UPDATE_MAX,       /* the larger of v and arg, clamping v to at least arg */
+        BPLUS_UPDATE_OR,        /* v | arg */
+        BPLUS_UPDATE_AND,       /* v & arg */
+        BPLUS_UPDATE_FADD,      /* v + arg, with both holding the bits of doubles */
+        BPLUS_UPDATE_FMUL,      /* v * arg, with both holding the bits of doubles */
+};
+
+/*
+ * apply op with arg to the value of every record with key in lo..hi inclusive. Integer
+ * arithmetic wraps around. The values of each leaf are rewritten in place with vector
+ * instructions, and the hashes and bounds of the index nodes above are recomputed once at the
+ * end. With BPLUS_TTL, a change feed or a secondary index, records are updated one at a time
+ * and expired ones are skipped. Returns OK, or NOMEM if the index runs out of memory, with
+ * the records before the one that failed updated and the rest not.
+ */
+enum bplus_error bplus_update_range(bplus_t b, lkey_t lo, lkey_t hi, enum bplus_update_op op, value_t arg);
+
+/* as bplus_update_range(), setting each value v of key k to f(k, v, ctx) */
+enum bplus_error bplus_update_range_fn(bplus_t b, lkey_t lo, lkey_t hi,
+				       value_t (*f)(lkey_t k, value_t v, void *ctx), void *ctx);
+
+/*
+ * as bplus_update_range(), with the leaves shared out a few at a time between the calling
+ * thread and up to nthreads - 1 more, at most BPLUS_UPDATE_THREADS in all. Trees whose
+ * records have to be updated one at a time are updated by the calling thread alone.
+ */
+#define BPLUS_UPDATE_THREADS 64
+enum bplus_error bplus_update_range_parallel(bplus_t b, lkey_t lo, lkey_t hi, enum bplus_update_op op,
+					     value_t arg, unsigned nthreads);
+
+/*
+ * add delta to the value of every record with key in lo..hi inclusive, wrapping around. In a
+ * tree made with BPLUS_RANGE_ADD this takes time in proportion to the depth of the tree:
+ * children of index nodes wholly in the range are tagged with delta rather than visited, and
+ * the tags are pushed down the path of each later write. find(), cursors, scans and joins
+ * return the values with the tags above them added. Otherwise, or with a change feed or
+ * secondary index attached, it is bplus_update_range() with BPLUS_UPDATE_ADD.
+ * Returns OK, or NOMEM as bplus_update_range() does.
+ */
+enum bplus_error bplus_range_add(bplus_t b, lkey_t lo, lkey_t hi, value_t delta);
+
+/* one write of a batch: set key to value, or delete key if del is not 0 */
+struct bplus_write {
+        lkey_t key;
+        value_t value;
+        int del;
+};
+
+/*
+ * apply the n writes atomically: returns OK with all of them done, or NOMEM with none of
+ * them done. Later writes of a key override earlier ones, and deleting a key that is not
+ * present does nothing. The writes are sorted and applied in key order, which is much
+ * faster than calling insert() and delete() for each. Cursors behave as they would for
+ * the same insert() and delete() calls.
+ */
+enum bplus_error bplus_write_batch(bplus_t b, const struct bplus_write *w, unsigned long n);
+
 /*
  * enumerate all records in tree, in key order, calling the
  * specified function with key and value.
@@ -103,7 +297,11 @@ bplus_cursor_t find_record(bplus_t b, lkey_t k);
  * returns NOTFOUND if deleted */
 enum bplus_error get_record(bplus_cursor_t c, lkey_t *k, value_t *v);
 
-/* set the value of the record at cursor returning OK, returns NOTFOUND if deleted. */
+/*
+ * set the value of the record at cursor returning OK, returns NOTFOUND if deleted.
+ * With BPLUS_MERKLE, BPLUS_ZONEMAP or a secondary index it can return NOMEM, leaving the record
+ * as it was.
+ */
 enum bplus_error update_record(bplus_cursor_t c, value_t v);
 
 /* free the cursor and stop tracking it */
@@ -115,4 +313,242 @@ bplus_t get_tree(bplus_cursor_t c);
 /* Currently active storage statistics */
 void get_active_storage(bplus_t b, unsigned long *num_records, unsigned long *num_blocks, unsigned long *num_cursors);
 
-#endif
\ No newline at end of file
+/*
+ * Histogram of how full the leaves are. hist[i] is set to the number of leaves holding
+ * at least i/nbuckets and less than (i+1)/nbuckets of the most records a leaf can hold,
+ * with full leaves counted in the last bucket. Returns the number of leaves.
+ */
+unsigned long get_leaf_fill(bplus_t b, unsigned long *hist, unsigned nbuckets);
+
+/*
+ * Optional sampled access tracking, to find hot key ranges. Once enabled, one in every
+ * 2**sample_shift reads (find, find_record, get_record) and writes (insert, delete,
+ * update_record) is counted against the leaf it touched, in a table of 2**slot_bits
+ * counters keyed by leaf. When the table is crowded the coldest counters are dropped.
+ * Readers sharing the tree under a lock of their own count as they go: each thread samples
+ * its own accesses, and the counters are updated without locked instructions, so a few
+ * counts may be lost to races. Returns NOMEM if the table cannot be allocated. Enabling
+ * again restarts the counts.
+ */
+enum bplus_error bplus_heatmap_enable(bplus_t b, unsigned sample_shift, unsigned slot_bits);
+
+/* stop tracking and free the counters */
+void bplus_heatmap_disable(bplus_t b);
+
+/*
+ * export the heatmap: split the leaves, in key order, into about nranges runs of
+ * equally many leaves (or one per leaf if nranges is 0), and call f once per run with
+ * its lowest and highest keys and its estimated reads and writes (sampled counts
+ * scaled back up by 2**sample_shift).
+ */
+void bplus_heatmap_export(bplus_t b, unsigned nranges,
+			  void (*f)(lkey_t lo, lkey_t hi, unsigned long reads, unsigned long writes, void *ctx),
+			  void *ctx);
+
+/*
+ * Change feed: a ring buffer of the changes made to a tree, which any number of threads
+ * can read in batches without locks while the tree is being written. The tree never waits
+ * for its readers, so one that falls a whole ring behind misses the oldest changes.
+ */
+typedef struct bplus_cdc *bplus_cdc_t;
+
+enum bplus_change_op {
+        BPLUS_CHANGE_INSERT,    /* key was added with new_value */
+        BPLUS_CHANGE_UPDATE,    /* key's value went from old_value to new_value */
+        BPLUS_CHANGE_DELETE,    /* key, with old_value, was deleted or swept away as expired */
+        BPLUS_CHANGE_TRUNCATE,  /* every key below key was deleted by bplus_truncate_before() */
+};
+
+struct bplus_change {
+        unsigned long seq;      /* sequence number, from 1, one more for each change */
+        enum bplus_change_op op;
+        lkey_t key;
+        value_t old_value;
+        value_t new_value;
+};
+
+/* make a feed holding the last 2**capacity_bits changes, or return NULL if out of memory */
+bplus_cdc_t bplus_cdc_new(unsigned capacity_bits);
+
+/*
+ * publish every insert, update and delete made to the tree from now on to f, or stop
+ * publishing if f is NULL. A feed takes the changes of one tree at a time. Returns OK, or
+ * NOMEM for a shared tree, which cannot have a feed.
+ */
+enum bplus_error bplus_cdc_attach(bplus_t b, bplus_cdc_t f);
+
+/*
+ * copy up to max changes into out, starting at sequence number *next, and advance *next
+ * past them. Returns the number copied, 0 if there are no more yet. Changes overwritten
+ * before they were read are skipped, so a gap in the sequence numbers shows what was lost.
+ * Start with *next at 1 for every change kept, or one past bplus_cdc_last() for new ones.
+ */
+unsigned long bplus_cdc_read(bplus_cdc_t f, unsigned long *next, struct bplus_change *out, unsigned long max);
+
+/* sequence number of the latest change published to f, 0 if none */
+unsigned long bplus_cdc_last(bplus_cdc_t f);
+
+/* free the feed, once it is attached to no tree and no thread is reading it */
+void bplus_cdc_free(bplus_cdc_t f);
+
+/*
+ * Subtree hashes, for trees made with BPLUS_MERKLE. The hash of a set of records is the sum
+ * of a 64 bit hash of each key and value, so trees holding the same records have the same
+ * hash however they were built. Expired records count until they are swept away.
+ */
+
+/* hash of the records with keys in lo..hi inclusive, or 0 without BPLUS_MERKLE */
+unsigned long bplus_range_hash(bplus_t b, lkey_t lo, lkey_t hi);
+
+/*
+ * call f on every key whose record differs between a and b, in key order, with va and vb
+ * pointing to its value in each, or NULL where it is absent. f returns non-zero to stop.
+ * The blocks of a whose hash matches that of the same key range of b are skipped, so with
+ * BPLUS_MERKLE on both it takes time in proportion to the differences, not the records.
+ * Returns OK, INCOMPLETE if f stopped it, or NOMEM if a's pending splits could not be
+ * finished first.
+ */
+enum bplus_error bplus_diff(bplus_t a, bplus_t b,
+			    int (*f)(lkey_t k, const value_t *va, const value_t *vb, void *ctx), void *ctx);
+
+/*
+ * draw n records of b at random, each record equally likely every time, into keys and vals
+ * (either may be NULL). rng is the state of the random number generator, any value but 0
+ * to start with, and is advanced. It reads the tree as find() does and takes time in
+ * proportion to n and the depth of the tree, not its size. Returns how many were drawn,
+ * which is fewer than n only if there are no live records or it is out of memory.
+ */
+unsigned long bplus_sample(bplus_t b, unsigned long n, unsigned long *rng, lkey_t *keys, value_t *vals);
+
+/* as bplus_sample(), from the records with keys in lo..hi inclusive */
+unsigned long bplus_sample_range(bplus_t b, lkey_t lo, lkey_t hi, unsigned long n,
+				 unsigned long *rng, lkey_t *keys, value_t *vals);
+
+/*
+ * Estimates for query planning, from the index nodes on the paths to the ends of a range,
+ * without reading any leaf. They take the records under a node to be spread evenly over its
+ * children and a leaf's keys over the span between its separators. min and max (either may
+ * be NULL) are bounds that always hold, from the fewest and most records each node could
+ * have. Expired records count until they are swept away.
+ */
+
+/* estimated number of records with keys in lo..hi inclusive */
+unsigned long bplus_estimate_count(bplus_t b, lkey_t lo, lkey_t hi, unsigned long *min, unsigned long *max);
+
+/*
+ * estimate into k the key a fraction q, from 0 to 1, of the way through the records, with
+ * bounds on that key in min and max. Returns OK, or NOTFOUND if the tree is empty.
+ */
+enum bplus_error bplus_estimate_quantile(bplus_t b, double q, lkey_t *k, lkey_t *min, lkey_t *max);
+
+/*
+ * call f, in key order, on each record with key in lo..hi and value in vmin..vmax, both
+ * inclusive, until f returns non-zero. Values compare as unsigned. With BPLUS_ZONEMAP, the
+ * blocks whose values are all outside vmin..vmax are skipped without reading them. Bounds
+ * are only widened as values are written, and made exact again when nodes split or merge,
+ * so after many deletes or updates some blocks are read that need not be. Returns OK, or
+ * INCOMPLETE if f stopped it.
+ */
+enum bplus_error bplus_scan_where(bplus_t b, lkey_t lo, lkey_t hi, value_t vmin, value_t vmax,
+				  int (*f)(lkey_t k, value_t v, void *ctx), void *ctx);
+
+/*
+ * Joins of up to BPLUS_JOIN_MAX trees over the keys lo..hi inclusive. Each calls f in key order,
+ * with vals[j] the value of the key in t[j] for each bit j set in present, until f returns
+ * non-zero, and returns OK, INCOMPLETE if f stopped it, or NOTFOUND if n is 0 or too large.
+ * A tree behind the others seeks ahead to their key with binary searches of its leaves and
+ * index nodes, so a join of a small tree with a large one reads few of the large one's leaves.
+ * They write nothing into the trees, so they can run in parallel with each other and finds.
+ */
+#define BPLUS_JOIN_MAX 64
+
+/* call f on each key in all of the trees */
+enum bplus_error bplus_intersect(bplus_t *t, unsigned n, lkey_t lo, lkey_t hi,
+				 int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx);
+
+/* call f on each key in any of the trees, with present telling which */
+enum bplus_error bplus_union(bplus_t *t, unsigned n, lkey_t lo, lkey_t hi,
+			     int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx);
+
+/* call f on each key of t[0] in none of the others */
+enum bplus_error bplus_difference(bplus_t *t, unsigned n, lkey_t lo, lkey_t hi,
+				  int (*f)(lkey_t k, const value_t *vals, unsigned long present, void *ctx), void *ctx);
+
+/* equi-join of two trees on their keys: call f on each key in both, with its values in each */
+enum bplus_error bplus_join(bplus_t a, bplus_t b, lkey_t lo, lkey_t hi,
+			    int (*f)(lkey_t k, value_t va, value_t vb, void *ctx), void *ctx);
+
+/*
+ * Secondary index. An index attached to a tree maps each value to the keys that have it, and
+ * is kept in step with every write of the tree: insert(), update_record(), the deletes,
+ * expiry sweeps, truncation and write batches. A write adds its new (value, key) pair to the
+ * index before changing the tree, so if the index runs out of memory the write returns NOMEM
+ * with neither changed; a batch adds all of its pairs in one batch of the index. Expired
+ * records stay in the index until swept away. A tree has at most one index, which must be
+ * freed before the tree. It allocates with malloc(), so shared trees cannot have one.
+ */
+typedef struct bplus_index *bplus_index_t;
+
+/*
+ * index the records of b, and keep doing so. Returns NULL if out of memory, if b has an index
+ * already, or if b is a shared tree.
+ */
+bplus_index_t bplus_index_new(bplus_t b);
+
+/* detach the index from its tree and free it */
+void bplus_index_free(bplus_index_t ix);
+
+/* number of keys with value v, of which the first max, in order, are put in keys */
+unsigned long bplus_index_find(bplus_index_t ix, value_t v, lkey_t *keys, unsigned long max);
+
+/*
+ * call f on each pair with value in lo..hi inclusive, in order of value and then key, until
+ * f returns non-zero. Returns OK, or INCOMPLETE if f stopped it.
+ */
+enum bplus_error bplus_index_scan(bplus_index_t ix, value_t lo, value_t hi,
+				  int (*f)(value_t v, lkey_t k, void *ctx), void *ctx);
+
+/* number of distinct values and of (value, key) pairs in the index */
+void bplus_index_stats(bplus_index_t ix, unsigned long *num_values, unsigned long *num_entries);
+
+/*
+ * Shared trees live in a POSIX shared memory segment, so several processes can use one
+ * tree: children forked after it is made, or processes that open it by name. Every process
+ * maps the segment at the same address, since the tree's links are pointers. Processes
+ * take the tree's lock around every call on it, shared for find(), enumerate() and other
+ * reads, exclusive for writes. Cursors, change feeds and heatmaps keep pointers to one
+ * process's memory, so none may be used on a shared tree, and free_bplus_tree() must not
+ * be called on it either.
+ */
+typedef struct bplus_shared *bplus_shared_t;
+
+/*
+ * create segment name (as for shm_open(), "/name") of size bytes, holding an empty tree with
+ * the given BPLUS_ flags. The tree can use all but a page of it; inserts return NOMEM when it
+ * is full. Returns NULL if name exists or there is no memory for it.
+ */
+bplus_shared_t bplus_shared_create(const char *name, unsigned long size, unsigned flags);
+
+/*
+ * map segment name, made by bplus_shared_create(). Returns NULL if there is none, or if the
+ * address it must be mapped at is in use in this process.
+ */
+bplus_shared_t bplus_shared_open(const char *name);
+
+/* the tree in the segment, to be used with the lock held */
+bplus_t bplus_shared_tree(bplus_shared_t s);
+
+/* take the tree's lock across processes, exclusively if write, else shared with other readers */
+void bplus_shared_lock(bplus_shared_t s, int write);
+void bplus_shared_unlock(bplus_shared_t s);
+
+/* bytes of the segment in use, and its size */
+void bplus_shared_space(bplus_shared_t s, unsigned long *used, unsigned long *size);
+
+/* unmap the segment from this process. The tree stays for others. */
+void bplus_shared_close(bplus_shared_t s);
+
+/* remove segment name, which goes away once no process has it mapped. Returns OK or NOTFOUND. */
+enum bplus_error bplus_shared_unlink(const char *name);
+
+#endif
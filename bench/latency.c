@@ -0,0 +1,144 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Insert latency benchmark: times every insert of uniformly random keys into a growing tree,
+ * and reports latency percentiles for each window of inserts, so the tail can be watched as
+ * the tree gets deeper. It runs once splitting ancestors at once, once with deferred splits
+ * finished by later inserts, and once with deferred splits finished by a maintenance tick
+ * every 64 inserts, outside the timed operations.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include <locale.h>
+#include <time.h>
+
+#include "b+tree.h"
+
+enum mode { IMMEDIATE, DEFERRED, TICKED, NUM_MODES };
+static const char *mode_names[NUM_MODES] = { "immediate", "deferred", "tick" };
+
+#define TICK_INTERVAL 64	/* inserts between maintenance ticks */
+
+static inline unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static unsigned long next_random(unsigned long *state)
+{
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DUL;
+}
+
+static int ascending(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* the latency at fraction q of the sorted samples */
+static unsigned long percentile(const unsigned long *lat, unsigned long n, double q)
+{
+	unsigned long i = q * n;
+	return lat[i < n ? i : n - 1];
+}
+
+static void run(enum mode m, unsigned long n, unsigned long window)
+{
+	bplus_t b = new_bplus_tree_opts(m == IMMEDIATE ? 0 : BPLUS_DEFERRED_SPLITS);
+	unsigned long *lat = malloc(window * sizeof(unsigned long));
+	unsigned long rng = 0x9E3779B97F4A7C15UL;
+	unsigned long nrecs, nblocks, ncursors;
+
+	if (b == NULL || lat == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned long done = 0; done < n; done += window) {
+		unsigned long w = n - done < window ? n - done : window;
+		for (unsigned long i = 0; i < w; i++) {
+			lkey_t k = next_random(&rng);
+			unsigned long start = now_ns();
+			if (insert(b, k, i) != OK) {
+				fprintf(stderr, "out of memory inserting\n");
+				exit(EXIT_FAILURE);
+			}
+			lat[i] = now_ns() - start;
+			if (m == TICKED && i % TICK_INTERVAL == 0)
+				bplus_maintain(b, 1);
+		}
+		qsort(lat, w, sizeof(unsigned long), ascending);
+		get_active_storage(b, &nrecs, &nblocks, &ncursors);
+		printf("%-10s %'12lu %8lu %8lu %8lu %8lu %10lu\n", mode_names[m], nrecs,
+		       percentile(lat, w, 0.5), percentile(lat, w, 0.99), percentile(lat, w, 0.999),
+		       percentile(lat, w, 0.9999), lat[w - 1]);
+		fflush(stdout);
+	}
+	free(lat);
+	free_bplus_tree(b);
+}
+
+static void usage(const char *cmd_name)
+{
+	fprintf(stderr, "usage: %s [-n inserts] [-w window]\n", cmd_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd_name = basename(argv[0]);
+	unsigned long n = 20000000;
+	unsigned long window = 1000000;
+	int opt;
+
+	setlocale(LC_ALL, "");
+
+	while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(cmd_name);
+		}
+	}
+	if (n == 0 || window == 0)
+		usage(cmd_name);
+
+	printf("%-10s %12s %8s %8s %8s %8s %10s   (insert latency, ns)\n",
+	       "mode", "records", "p50", "p99", "p99.9", "p99.99", "max");
+	for (unsigned m = 0; m < NUM_MODES; m++)
+		run(m, n, window);
+	return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Memory efficiency benchmark: builds trees with keys inserted in sequential, reverse,
+ * uniform random, clustered and Zipf distributed order, then deletes records from each at
+ * random, as one contiguous key range, or by draining the whole tree in key order.
+ * After the build and after each quarter of the deletes it reports bytes per record,
+ * the leaf fill histogram and the process's resident set size from /proc/self/statm,
+ * which show split waste and post-delete sparsity that a block count does not.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include <locale.h>
+#include <math.h>
+
+#include "b+tree.h"
+
+#define FILL_BUCKETS 10
+#define STEPS 4		/* deletes are reported in this many steps */
+
+enum order { SEQUENTIAL, REVERSE, UNIFORM, CLUSTERED, ZIPF, NUM_ORDERS };
+static const char *order_names[NUM_ORDERS] = { "sequential", "reverse", "uniform", "clustered", "zipf" };
+
+enum pattern { RANDOM, RANGE, DRAIN, NUM_PATTERNS };
+static const char *pattern_names[NUM_PATTERNS] = { "random", "range", "drain" };
+
+static unsigned long rng = 0x9E3779B97F4A7C15UL;
+static unsigned heat_ranges = 0;	/* if not 0, report write skew over this many leaf ranges */
+
+/* xorshift64* */
+static unsigned long next_random(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 0x2545F4914F6CDD1DUL;
+}
+
+/* scatter ranks over the key space, so hot Zipf keys are not next to each other */
+static lkey_t scramble(unsigned long x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDUL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* rank in [1, n] with probability about proportional to 1/rank^s, by inverting the continuous CDF */
+static unsigned long zipf_rank(unsigned long n, double s)
+{
+	double u = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+	double t = pow((double)n, 1.0 - s) - 1.0;
+	unsigned long r = (unsigned long)pow(u * t + 1.0, 1.0 / (1.0 - s));
+	return r < 1 ? 1 : r > n ? n : r;
+}
+
+/* resident set size of this process, from /proc/self/statm */
+static unsigned long rss_bytes(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void report(bplus_t b, enum order o, const char *pattern, unsigned step)
+{
+	unsigned long nrecs, nblocks, ncursors;
+	unsigned long hist[FILL_BUCKETS];
+	unsigned long nleaves;
+	char histogram[FILL_BUCKETS * 8 + 1], *h = histogram;
+
+	get_active_storage(b, &nrecs, &nblocks, &ncursors);
+	nleaves = get_leaf_fill(b, hist, FILL_BUCKETS);
+	for (unsigned i = 0; i < FILL_BUCKETS; i++)
+		h += sprintf(h, " %5.1f", nleaves ? 100.0 * hist[i] / nleaves : 0.0);
+	printf("%-10s %-6s %4u %'12lu %10.1f %'10lu %'8lu |%s\n",
+	       order_names[o], pattern, step, nrecs,
+	       nrecs ? (double)(nblocks << 12) / nrecs : 0.0,
+	       nleaves, rss_bytes() >> 20, histogram);
+}
+
+/* collects the write counts of the heatmap ranges */
+struct heat {
+	unsigned long *writes;
+	unsigned n;
+};
+
+static void collect_heat(lkey_t lo, lkey_t hi, unsigned long reads, unsigned long writes, void *ctx)
+{
+	struct heat *h = ctx;
+	if (h->n < heat_ranges)
+		h->writes[h->n++] = writes;
+}
+
+static int descending(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* how concentrated were the inserts of the build, according to the sampled heatmap */
+static void report_skew(bplus_t b, enum order o)
+{
+	struct heat h = { calloc(heat_ranges, sizeof(unsigned long)), 0 };
+	unsigned long total = 0, hottest = 0;
+	if (h.writes == NULL)
+		return;
+	bplus_heatmap_export(b, heat_ranges, collect_heat, &h);
+	qsort(h.writes, h.n, sizeof(unsigned long), descending);
+	for (unsigned i = 0; i < h.n; i++) {
+		total += h.writes[i];
+		if (i < (h.n + 9) / 10)
+			hottest += h.writes[i];
+	}
+	printf("%-10s hottest 10%% of %u leaf ranges took %.1f%% of sampled writes\n",
+	       order_names[o], h.n, total ? 100.0 * hottest / total : 0.0);
+	free(h.writes);
+}
+
+/* insert n records, with keys in the given order */
+static void build(bplus_t b, enum order o, unsigned long n)
+{
+	unsigned long nrecs = 0, nblocks, ncursors;
+	unsigned long draws = 0;
+	enum bplus_error ok = OK;
+
+	switch (o) {
+	case SEQUENTIAL:
+		for (unsigned long i = 0; i < n && ok == OK; i++)
+			ok = insert(b, i, i);
+		break;
+	case REVERSE:
+		for (unsigned long i = n; i-- > 0 && ok == OK;)
+			ok = insert(b, i, i);
+		break;
+	case UNIFORM:
+		while (nrecs < n && ok == OK) {
+			ok = insert(b, next_random(), draws++);
+			get_active_storage(b, &nrecs, &nblocks, &ncursors);
+		}
+		break;
+	case CLUSTERED:
+		/* runs of 64 consecutive keys starting at random places */
+		while (nrecs < n && ok == OK) {
+			lkey_t base = next_random() & ~63UL;
+			for (unsigned i = 0; i < 64 && ok == OK; i++)
+				ok = insert(b, base + i, draws++);
+			get_active_storage(b, &nrecs, &nblocks, &ncursors);
+		}
+		break;
+	case ZIPF:
+		/* hot keys are drawn over and over, so stop after 8n draws if not n distinct keys */
+		while (nrecs < n && draws < 8 * n && ok == OK) {
+			ok = insert(b, scramble(zipf_rank(4 * n, 0.99)), draws++);
+			get_active_storage(b, &nrecs, &nblocks, &ncursors);
+		}
+		break;
+	default:
+		break;
+	}
+	if (ok != OK) {
+		fprintf(stderr, "Error %u building tree\n", ok);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* keys of the tree in order */
+static lkey_t *collect_keys(bplus_t b, unsigned long n)
+{
+	lkey_t *keys = malloc(n * sizeof(lkey_t));
+	bplus_cursor_t c = first_record(b);
+	unsigned long i = 0;
+	value_t v;
+	if (keys == NULL || c == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	while (i < n && get_record(c, &keys[i], &v) == OK) {
+		i += 1;
+		if (next_record(c) != OK)
+			break;
+	}
+	free_cursor(c);
+	return keys;
+}
+
+static void run(enum order o, enum pattern p, unsigned long n)
+{
+	bplus_t b = new_bplus_tree();
+	unsigned long nrecs, nblocks, ncursors;
+	unsigned long first, count;
+	lkey_t *keys;
+
+	if (b == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	/* same keys for each delete pattern */
+	rng = 0x9E3779B97F4A7C15UL;
+	if (heat_ranges != 0 && p == RANDOM)
+		bplus_heatmap_enable(b, 4, 16);
+	build(b, o, n);
+	report(b, o, "built", 0);
+	if (heat_ranges != 0 && p == RANDOM) {
+		report_skew(b, o);
+		bplus_heatmap_disable(b);
+	}
+	get_active_storage(b, &nrecs, &nblocks, &ncursors);
+	keys = collect_keys(b, nrecs);
+
+	/* choose which keys to delete: the list keys[first .. first + count) */
+	switch (p) {
+	case RANDOM:
+		/* shuffle, then delete the first half */
+		for (unsigned long i = nrecs; i > 1; i--) {
+			unsigned long j = next_random() % i;
+			lkey_t t = keys[i - 1];
+			keys[i - 1] = keys[j];
+			keys[j] = t;
+		}
+		first = 0;
+		count = nrecs / 2;
+		break;
+	case RANGE:
+		/* the middle half of the key range */
+		first = nrecs / 4;
+		count = nrecs / 2;
+		break;
+	case DRAIN:
+	default:
+		first = 0;
+		count = nrecs;
+		break;
+	}
+	for (unsigned step = 1; step <= STEPS; step++) {
+		unsigned long end = first + count * step / STEPS;
+		for (unsigned long i = first + count * (step - 1) / STEPS; i < end; i++)
+			if (delete(b, keys[i]) != OK) {
+				fprintf(stderr, "BUG: key %lu not found\n", keys[i]);
+				exit(EXIT_FAILURE);
+			}
+		report(b, o, pattern_names[p], step);
+	}
+	free(keys);
+	free_bplus_tree(b);
+}
+
+static void usage(const char *cmd_name)
+{
+	fprintf(stderr, "usage: %s [-n records] [-H ranges]\n"
+		"  -H  sample inserts with the access heatmap and report their skew over this many key ranges\n",
+		cmd_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd_name = basename(argv[0]);
+	unsigned long n = 1000000;
+	int opt;
+
+	setlocale(LC_ALL, "");
+
+	while ((opt = getopt(argc, argv, "n:H:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			heat_ranges = atoi(optarg);
+			break;
+		default:
+			usage(cmd_name);
+		}
+	}
+	if (n == 0)
+		usage(cmd_name);
+
+	printf("%-10s %-6s %4s %12s %10s %10s %8s | leaf fill histogram, %% of leaves per 10%% of capacity\n",
+	       "order", "delete", "step", "records", "bytes/rec", "leaves", "rss MiB");
+	for (unsigned o = 0; o < NUM_ORDERS; o++)
+		for (unsigned p = 0; p < NUM_PATTERNS; p++)
+			run(o, p, n);
+	return 0;
+}
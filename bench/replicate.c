@@ -0,0 +1,273 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Replication benchmark: a leader process writes random inserts, updates and deletes to its
+ * tree while a shipping thread sends the change log over a Unix socket to a follower child
+ * process, which applies it frame by frame to its own tree. Reports the leader's write rate,
+ * the log's size, the follower's apply rate and how far it lagged, and checks that the two
+ * trees end up with the same records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include <locale.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "b+tree.h"
+#include "replica.h"
+
+/* what the follower reports back, in a page shared with the leader */
+struct follower_result {
+	int status;
+	struct bplus_replica_stats stats;
+	unsigned long records;
+	unsigned long digest;
+	double secs;
+};
+
+struct shipper {
+	bplus_leader_t leader;
+	unsigned long batch;	/* most changes per frame */
+	int stop;
+	int failed;
+};
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift64* */
+static inline unsigned long next_random(unsigned long *state)
+{
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DUL;
+}
+
+static inline unsigned long mix(unsigned long x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDUL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* order independent digest of the records of a tree, and how many there are */
+static unsigned long digest(bplus_t b, unsigned long *records)
+{
+	bplus_cursor_t c = first_record(b);
+	unsigned long d = 0;
+	lkey_t k;
+	value_t v;
+	*records = 0;
+	if (c == NULL)
+		return 0;
+	while (get_record(c, &k, &v) == OK) {
+		d += mix(k ^ mix(v));
+		*records += 1;
+		if (next_record(c) != OK)
+			break;
+	}
+	free_cursor(c);
+	return d;
+}
+
+static void run_follower(int fd, struct follower_result *r)
+{
+	bplus_t b = new_bplus_tree();
+	bplus_follower_t f = b != NULL ? bplus_follower_new(b, fd) : NULL;
+	double start = 0;
+	enum bplus_error ok;
+
+	r->status = 1;
+	if (f == NULL)
+		return;
+	while ((ok = bplus_follower_apply(f)) != NOTFOUND) {
+		if (ok != OK)
+			return;
+		if (start == 0)
+			start = now_secs();
+	}
+	r->secs = start != 0 ? now_secs() - start : 0;
+	bplus_follower_stats(f, &r->stats);
+	r->digest = digest(b, &r->records);
+	bplus_follower_free(f);
+	free_bplus_tree(b);
+	r->status = 0;
+}
+
+/* ship changes as they come until told to stop, then ship the rest */
+static void *ship_thread(void *arg)
+{
+	struct shipper *s = arg;
+	for (;;) {
+		int stopping = __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE);
+		enum bplus_error ok = bplus_leader_ship(s->leader, s->batch);
+		if (ok == NOMEM || ok == NOTFOUND) {
+			s->failed = 1;
+			break;
+		}
+		if (ok == OK) {
+			if (stopping)
+				break;
+			usleep(100);
+		}
+	}
+	return NULL;
+}
+
+static void usage(const char *cmd_name)
+{
+	fprintf(stderr, "usage: %s [-n writes] [-k keys] [-c feed_bits] [-b batch]\n"
+		"  -n  writes made by the leader (default 4000000)\n"
+		"  -k  keys are drawn from [0, keys) (default 1000000)\n"
+		"  -c  the change feed holds 2**feed_bits changes (default 20)\n"
+		"  -b  most changes per frame (default 4096)\n",
+		cmd_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd_name = basename(argv[0]);
+	unsigned long n = 4000000, keys = 1000000, rng = 0x9E3779B97F4A7C15UL;
+	unsigned feed_bits = 20;
+	struct shipper s = { NULL, 4096, 0, 0 };
+	struct follower_result *r;
+	struct bplus_replica_stats ls;
+	unsigned long records, d, snapshots = 0, lost = 0;
+	bplus_t b;
+	pthread_t thread;
+	double start, write_secs, ship_secs;
+	int fds[2], wstatus, opt, same;
+	pid_t pid;
+
+	setlocale(LC_ALL, "");
+
+	while ((opt = getopt(argc, argv, "n:k:c:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			feed_bits = atoi(optarg);
+			break;
+		case 'b':
+			s.batch = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(cmd_name);
+		}
+	}
+	if (keys == 0 || s.batch == 0)
+		usage(cmd_name);
+
+	r = mmap(NULL, sizeof(*r), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror(cmd_name);
+		return EXIT_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror(cmd_name);
+		return EXIT_FAILURE;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		run_follower(fds[1], r);
+		_exit(r->status);
+	}
+	close(fds[1]);
+
+	b = new_bplus_tree();
+	s.leader = b != NULL ? bplus_leader_new(b, fds[0], feed_bits) : NULL;
+	if (s.leader == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	pthread_create(&thread, NULL, ship_thread, &s);
+
+	/* 60% puts, of new or existing keys, and 40% deletes */
+	start = now_secs();
+	for (unsigned long i = 0; i < n && !s.failed; i++) {
+		unsigned long x = next_random(&rng);
+		lkey_t k = (x >> 8) % keys;
+		if (x % 10 < 6)
+			insert(b, k, x >> 20);
+		else
+			delete(b, k);
+		/* if the shipper fell a whole feed behind, the follower needs the whole tree again */
+		if ((i & 0xFFFF) == 0) {
+			bplus_leader_stats(s.leader, &ls);
+			if (ls.lost != lost && bplus_leader_snapshot(s.leader) == OK) {
+				lost = ls.lost;
+				snapshots += 1;
+			}
+		}
+	}
+	write_secs = now_secs() - start;
+	__atomic_store_n(&s.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	bplus_leader_stats(s.leader, &ls);
+	if (ls.lost != lost && bplus_leader_snapshot(s.leader) == OK)
+		snapshots += 1;
+	ship_secs = now_secs() - start;
+	bplus_leader_stats(s.leader, &ls);
+	close(fds[0]);
+	if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0 || s.failed) {
+		fprintf(stderr, "%s: replication failed\n", cmd_name);
+		return EXIT_FAILURE;
+	}
+	d = digest(b, &records);
+	same = records == r->records && d == r->digest;
+
+	printf("leader:   %'lu writes in %.3fs, %'.0f writes/sec, shipped in %.3fs\n",
+	       n, write_secs, write_secs > 0 ? n / write_secs : 0.0, ship_secs);
+	printf("log:      %'lu changes in %'lu frames, %'lu bytes, %.1f bytes/change, %'lu lost, %lu snapshots\n",
+	       ls.changes, ls.frames, ls.bytes, ls.changes ? (double)ls.bytes / ls.changes : 0.0,
+	       ls.lost, snapshots);
+	printf("follower: %'lu changes applied in %.3fs, %'.0f changes/sec, max lag %'lu changes\n",
+	       r->stats.changes, r->secs, r->secs > 0 ? r->stats.changes / r->secs : 0.0, r->stats.max_lag);
+	printf("trees:    leader %'lu records, follower %'lu records, %s\n",
+	       records, r->records, same ? "identical" : "DIFFERENT");
+	bplus_leader_free(s.leader);
+	free_bplus_tree(b);
+	munmap(r, sizeof(*r));
+	return same ? 0 : EXIT_FAILURE;
+}
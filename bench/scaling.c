@@ -0,0 +1,304 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Thread scaling benchmark: runs 1..N pinned threads over read-only, read-mostly and
+ * write-heavy operation mixes, once for each way the library can be shared between threads,
+ * and reports operations per second and scaling efficiency relative to one thread.
+ *
+ * The library itself takes no locks, so the ways of sharing it are:
+ *   mutex   - one tree, every operation under one mutex
+ *   rwlock  - one tree, find() under a shared read lock, insert/delete under the write lock
+ *   sharded - one tree per thread, each owning a slice of the key range, no locks at all
+ * Threads are pinned round robin to the CPUs the process may run on, and only thread counts
+ * and totals are reported, so the numbers mean the same thing with or without NUMA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include <locale.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "b+tree.h"
+
+enum mode { MUTEX, RWLOCK, SHARDED, NUM_MODES };
+static const char *mode_names[NUM_MODES] = { "mutex", "rwlock", "sharded" };
+
+struct mix {
+	const char *name;
+	unsigned write_pct;	/* percentage of operations that are an insert or a delete */
+};
+static const struct mix mixes[] = {
+	{ "read-only", 0 },
+	{ "read-mostly", 5 },
+	{ "write-heavy", 50 },
+};
+#define NUM_MIXES (sizeof(mixes) / sizeof(mixes[0]))
+
+/* state shared by all threads of one run */
+struct run {
+	enum mode mode;
+	const struct mix *mix;
+	unsigned nthreads;
+	lkey_t key_space;	/* keys are drawn uniformly from [0, key_space) */
+	bplus_t *trees;		/* one tree, or one per thread if sharded */
+	pthread_mutex_t mutex;
+	pthread_rwlock_t rwlock;
+	pthread_barrier_t ready;
+	atomic_int phase;	/* WARMUP, MEASURE, then STOP */
+};
+enum { WARMUP, MEASURE, STOP };
+
+struct worker {
+	struct run *run;
+	unsigned id;
+	unsigned long ops;	/* operations done while measuring */
+	pthread_t thread;
+};
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_secs(double secs)
+{
+	struct timespec ts = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) };
+	nanosleep(&ts, NULL);
+}
+
+/* xorshift64*, one per thread */
+static inline unsigned long next_random(unsigned long *state)
+{
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DUL;
+}
+
+static void pin_to_cpu(unsigned id)
+{
+	cpu_set_t allowed, one;
+	int n;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	n = CPU_COUNT(&allowed);
+	for (int cpu = 0, seen = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && seen++ == id % n) {
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+			return;
+		}
+	}
+}
+
+/* one operation on the tree(s), following the run's sharing mode */
+static void do_op(struct run *r, unsigned id, unsigned long *rng)
+{
+	unsigned long x = next_random(rng);
+	int write = x % 100 < r->mix->write_pct;
+	lkey_t key;
+	value_t v;
+	bplus_t b;
+
+	if (r->mode == SHARDED) {
+		/* keep to this thread's slice of the key space */
+		lkey_t slice = r->key_space / r->nthreads;
+		key = id * slice + (x >> 8) % slice;
+		b = r->trees[id];
+	} else {
+		key = (x >> 8) % r->key_space;
+		b = r->trees[0];
+	}
+
+	if (!write) {
+		if (r->mode == MUTEX) pthread_mutex_lock(&r->mutex);
+		else if (r->mode == RWLOCK) pthread_rwlock_rdlock(&r->rwlock);
+		find(b, key, &v);
+		if (r->mode == MUTEX) pthread_mutex_unlock(&r->mutex);
+		else if (r->mode == RWLOCK) pthread_rwlock_unlock(&r->rwlock);
+		return;
+	}
+	/* half the writes insert and half delete, so the tree size stays steady */
+	if (r->mode == MUTEX) pthread_mutex_lock(&r->mutex);
+	else if (r->mode == RWLOCK) pthread_rwlock_wrlock(&r->rwlock);
+	if (x & 0x80)
+		insert(b, key, x);
+	else
+		delete(b, key);
+	if (r->mode == MUTEX) pthread_mutex_unlock(&r->mutex);
+	else if (r->mode == RWLOCK) pthread_rwlock_unlock(&r->rwlock);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct run *r = w->run;
+	unsigned long rng = 0x9E3779B97F4A7C15UL * (w->id + 1);
+	unsigned long ops = 0;
+
+	pin_to_cpu(w->id);
+	pthread_barrier_wait(&r->ready);
+	while (atomic_load_explicit(&r->phase, memory_order_relaxed) == WARMUP)
+		do_op(r, w->id, &rng);
+	while (atomic_load_explicit(&r->phase, memory_order_relaxed) == MEASURE) {
+		do_op(r, w->id, &rng);
+		ops += 1;
+	}
+	w->ops = ops;
+	return NULL;
+}
+
+/* fill tree with every other key in [lo, hi), so lookups hit half the time */
+static void preload(bplus_t b, lkey_t lo, lkey_t hi)
+{
+	for (lkey_t k = lo; k < hi; k += 2)
+		if (insert(b, k, k) != OK) {
+			fprintf(stderr, "out of memory preloading tree\n");
+			exit(EXIT_FAILURE);
+		}
+}
+
+/* one run of nthreads threads, returns total operations per second */
+static double run_threads(enum mode mode, const struct mix *mix, unsigned nthreads,
+			  lkey_t key_space, double warmup, double secs)
+{
+	struct run r;
+	struct worker *workers = calloc(nthreads, sizeof(struct worker));
+	unsigned ntrees = mode == SHARDED ? nthreads : 1;
+	unsigned long total = 0;
+	double start, elapsed;
+
+	r.mode = mode;
+	r.mix = mix;
+	r.nthreads = nthreads;
+	r.key_space = key_space;
+	r.trees = calloc(ntrees, sizeof(bplus_t));
+	if (workers == NULL || r.trees == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned t = 0; t < ntrees; t++) {
+		r.trees[t] = new_bplus_tree();
+		if (r.trees[t] == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		preload(r.trees[t], t * (key_space / ntrees), (t + 1) * (key_space / ntrees));
+	}
+	pthread_mutex_init(&r.mutex, NULL);
+	pthread_rwlock_init(&r.rwlock, NULL);
+	pthread_barrier_init(&r.ready, NULL, nthreads + 1);
+	atomic_init(&r.phase, WARMUP);
+
+	for (unsigned t = 0; t < nthreads; t++) {
+		workers[t].run = &r;
+		workers[t].id = t;
+		pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+	}
+	pthread_barrier_wait(&r.ready);
+	sleep_secs(warmup);
+	start = now_secs();
+	atomic_store(&r.phase, MEASURE);
+	sleep_secs(secs);
+	atomic_store(&r.phase, STOP);
+	elapsed = now_secs() - start;
+	for (unsigned t = 0; t < nthreads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		total += workers[t].ops;
+	}
+
+	for (unsigned t = 0; t < ntrees; t++)
+		free_bplus_tree(r.trees[t]);
+	pthread_barrier_destroy(&r.ready);
+	pthread_rwlock_destroy(&r.rwlock);
+	pthread_mutex_destroy(&r.mutex);
+	free(r.trees);
+	free(workers);
+	return total / elapsed;
+}
+
+static void usage(const char *cmd_name)
+{
+	fprintf(stderr, "usage: %s [-t max_threads] [-n keys] [-s seconds] [-w warmup_seconds]\n",
+		cmd_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd_name = basename(argv[0]);
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	lkey_t key_space = 2000000;
+	double secs = 1.0;
+	double warmup = 0.25;
+	int opt;
+
+	setlocale(LC_ALL, "");
+
+	while ((opt = getopt(argc, argv, "t:n:s:w:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atol(optarg);
+			break;
+		case 'n':
+			key_space = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			secs = atof(optarg);
+			break;
+		case 'w':
+			warmup = atof(optarg);
+			break;
+		default:
+			usage(cmd_name);
+		}
+	}
+	if (max_threads < 1 || key_space < (lkey_t)max_threads || secs <= 0)
+		usage(cmd_name);
+
+	printf("%-8s %-12s %8s %16s %12s\n", "mode", "mix", "threads", "ops/sec", "efficiency");
+	for (unsigned m = 0; m < NUM_MODES; m++) {
+		for (unsigned x = 0; x < NUM_MIXES; x++) {
+			double one_thread = 0;
+			for (unsigned t = 1; t <= max_threads; t++) {
+				double rate = run_threads(m, &mixes[x], t, key_space, warmup, secs);
+				if (t == 1)
+					one_thread = rate;
+				/* efficiency is throughput relative to t times the single thread throughput */
+				printf("%-8s %-12s %8u %'16.0f %11.0f%%\n", mode_names[m], mixes[x].name, t,
+				       rate, one_thread > 0 ? 100.0 * rate / (t * one_thread) : 0.0);
+				fflush(stdout);
+			}
+		}
+	}
+	return 0;
+}
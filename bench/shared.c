@@ -0,0 +1,222 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Shared tree benchmark, as a pre-fork server would use one: the parent fills a tree in a
+ * shared memory segment, then forks workers that all look up and update that one tree under
+ * its lock, instead of each keeping a copy. Reports each worker's operations per second and
+ * the memory one shared tree takes against a copy per worker, and checks that every worker's
+ * writes are in the tree at the end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include <locale.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "b+tree.h"
+
+struct worker_result {
+	int status;
+	unsigned long finds;
+	unsigned long found;
+	unsigned long writes;
+	double secs;
+};
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift64* */
+static inline unsigned long next_random(unsigned long *state)
+{
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DUL;
+}
+
+/*
+ * look up random keys, and every write_every'th operation insert a key of this worker's own,
+ * above the keys the parent filled the tree with and one in nworkers, so the writes can be
+ * checked afterwards
+ */
+static void run_worker(bplus_shared_t s, unsigned id, unsigned nworkers, unsigned long keys,
+		       unsigned long ops, unsigned write_every, struct worker_result *r)
+{
+	bplus_t b = bplus_shared_tree(s);
+	unsigned long rng = 0x9E3779B97F4A7C15UL * (id + 1);
+	double start = now_secs();
+	value_t v;
+
+	r->status = 1;
+	for (unsigned long i = 0; i < ops; i++) {
+		if (write_every != 0 && i % write_every == 0) {
+			enum bplus_error ok;
+			bplus_shared_lock(s, 1);
+			ok = insert(b, keys + r->writes * nworkers + id, id);
+			bplus_shared_unlock(s);
+			if (ok != OK)
+				return;
+			r->writes += 1;
+		} else {
+			lkey_t k = next_random(&rng) % keys;
+			bplus_shared_lock(s, 0);
+			if (find(b, k, &v) == OK)
+				r->found += 1;
+			bplus_shared_unlock(s);
+			r->finds += 1;
+		}
+	}
+	r->secs = now_secs() - start;
+	r->status = 0;
+}
+
+static void usage(const char *cmd_name)
+{
+	fprintf(stderr, "usage: %s [-w workers] [-n keys] [-o ops] [-u write_every] [-m megabytes]\n"
+		"  -w  worker processes sharing the tree (default: online cpus)\n"
+		"  -n  keys the tree is filled with (default 2000000)\n"
+		"  -o  operations per worker (default 2000000)\n"
+		"  -u  one operation in write_every is an insert, 0 for none (default 20)\n"
+		"  -m  size of the shared segment in megabytes (default 1024)\n",
+		cmd_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd_name = basename(argv[0]);
+	char name[64];
+	long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long keys = 2000000, ops = 2000000, megabytes = 1024;
+	unsigned long used, size, total_ops = 0, writes = 0, missing = 0;
+	unsigned write_every = 20;
+	struct worker_result *results;
+	size_t results_size;
+	bplus_shared_t s;
+	bplus_t b;
+	double secs = 0, start;
+	int failed = 0, opt;
+
+	setlocale(LC_ALL, "");
+
+	while ((opt = getopt(argc, argv, "w:n:o:u:m:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nworkers = atol(optarg);
+			break;
+		case 'n':
+			keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			write_every = atoi(optarg);
+			break;
+		case 'm':
+			megabytes = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(cmd_name);
+		}
+	}
+	if (nworkers < 1 || keys == 0)
+		usage(cmd_name);
+
+	snprintf(name, sizeof(name), "/bplus-bench-%d", (int)getpid());
+	s = bplus_shared_create(name, megabytes << 20, 0);
+	if (s == NULL) {
+		perror(cmd_name);
+		return EXIT_FAILURE;
+	}
+	/* workers inherit the mapping, so the name is not needed after this */
+	bplus_shared_unlink(name);
+	b = bplus_shared_tree(s);
+
+	start = now_secs();
+	for (unsigned long k = 0; k < keys; k++) {
+		if (insert(b, k, k) != OK) {
+			fprintf(stderr, "%s: segment full after %'lu keys\n", cmd_name, k);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("filled shared tree with %'lu keys in %.3fs\n", keys, now_secs() - start);
+
+	results_size = (nworkers * sizeof(struct worker_result) + 0xFFFUL) & ~0xFFFUL;
+	results = mmap(NULL, results_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror(cmd_name);
+		return EXIT_FAILURE;
+	}
+	fflush(stdout);
+	for (long id = 0; id < nworkers; id++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror(cmd_name);
+			return EXIT_FAILURE;
+		}
+		if (pid == 0) {
+			run_worker(s, id, nworkers, keys, ops, write_every, &results[id]);
+			_exit(results[id].status);
+		}
+	}
+	for (long id = 0; id < nworkers; id++) {
+		int wstatus;
+		if (wait(&wstatus) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+			failed += 1;
+	}
+
+	for (long id = 0; id < nworkers; id++) {
+		struct worker_result *r = &results[id];
+		value_t v;
+		printf("worker %ld: %'lu finds (%'lu found), %'lu inserts in %.3fs, %'.0f ops/sec%s\n",
+		       id, r->finds, r->found, r->writes, r->secs,
+		       r->secs > 0 ? (r->finds + r->writes) / r->secs : 0.0, r->status ? " FAILED" : "");
+		total_ops += r->finds + r->writes;
+		writes += r->writes;
+		if (r->secs > secs)
+			secs = r->secs;
+		for (unsigned long j = 0; j < r->writes; j++)
+			if (find(b, keys + j * nworkers + id, &v) != OK || v != (value_t)id)
+				missing += 1;
+	}
+	bplus_shared_space(s, &used, &size);
+	printf("%'lu operations by %ld workers, %'.0f ops/sec in all, %'lu of %'lu inserts missing\n",
+	       total_ops, nworkers, secs > 0 ? total_ops / secs : 0.0, missing, writes);
+	printf("one shared tree uses %'lu of %'lu bytes, a copy per worker would take %'lu\n",
+	       used, size, used * nworkers);
+	munmap(results, results_size);
+	bplus_shared_close(s);
+	if (failed)
+		fprintf(stderr, "%s: %d of %ld workers failed\n", cmd_name, failed, nworkers);
+	return failed || missing ? EXIT_FAILURE : 0;
+}
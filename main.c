@@ -1,16 +1,16 @@
 /*
  * Simple implementation of B+ Tree in C.
  * Copyright (c) 2020-2023 David P. Reed
- *  
+ *
  * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
  * and associated documentation files (the "Software"), to deal in the Software without restriction,
- * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
  * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
  * furnished to do so, subject to the following conditions:
- * 
+ *
  * The above copyright notice and this permission notice shall be included in all copies or
  * substantial portions of the Software.
- * 
+ *
  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
  * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
  * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
@@ -19,110 +19,278 @@
  */
 
 /* simple b+ tree implementation to emulate in-memory DBMS behavior */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <string.h>
 #include <locale.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "b+tree.h"
 
-/* build a b+ tree to fill memory simulating sharding of keys across children  */
+/*
+ * build a b+ tree in each of N child processes to fill memory, sharding keys across children
+ * by key range. Each child fills, looks up and empties its own tree in its own address space,
+ * pinned to its own CPU, and reports into a page shared with the parent, which adds it all up.
+ */
 
-int main(int argc, char *argv[])
+/* results of one child, written into the shared results page */
+struct worker_result {
+	int status;	/* 0 if child completed all phases */
+	int cpu;	/* cpu the child was pinned to, or -1 */
+	unsigned long inserted;	/* insert calls, some of which update an existing key */
+	unsigned long records;	/* distinct records in tree when full */
+	unsigned long found;
+	unsigned long notfound;
+	unsigned long removed;
+	unsigned long blocks;	/* blocks in tree when full */
+	unsigned long max_rss;	/* peak resident set, in bytes */
+	double insert_secs;
+	double lookup_secs;
+	double delete_secs;
+};
+
+static double now_secs(void)
 {
-	char *cmd_name = "XX";
-	size_t ngigs = sysconf(_SC_AVPHYS_PAGES) >> 18; // 2**18 pages is 1 GiB
-	size_t nb = ((ngigs - 3) << 30) & ~0xFFFUL; /* Reserve 3 GB for overhead */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* random() yields 31 bits, so key range shard of key is its position among nworkers equal slices */
+static inline unsigned shard_of(lkey_t key, unsigned nworkers)
+{
+	return (key * nworkers) >> 31;
+}
+
+static int pin_to_cpu(unsigned id)
+{
+	cpu_set_t allowed, one;
+	int n = 0;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return -1;
+	n = CPU_COUNT(&allowed);
+	/* pick the (id mod n)'th cpu we are allowed to run on */
+	for (int cpu = 0, seen = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		if (seen++ == id % n) {
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			return sched_setaffinity(0, sizeof(one), &one) == 0 ? cpu : -1;
+		}
+	}
+	return -1;
+}
 
+static void run_worker(const char *cmd_name, unsigned id, unsigned nworkers, size_t share,
+		       struct worker_result *r)
+{
 	bplus_t bpt = new_bplus_tree();
 	unsigned long nrecs = 0;
 	unsigned long nblocks = 0;
 	unsigned long ncursors = 0;
 	unsigned long used = 0;
+	unsigned long generated = 0;
 	lkey_t key;
 	value_t value;
 	bplus_cursor_t cursor;
 	enum bplus_error ok;
 	char randstate[32];
-	unsigned long count = 0;
-	unsigned long found = 0;
-	unsigned long notfound = 0;
-
-	setlocale(LC_ALL, "");
-
+	struct rusage ru;
+	double start;
 
-	cmd_name = basename(argv[0]);
-
-	printf("System has %'ld gigabytes (so filling %'ld bytes) of RAM\n", ngigs, nb);
+	r->status = 1;
+	r->cpu = pin_to_cpu(id);
+	if (bpt == NULL) {
+		fprintf(stderr, "%s: worker %u: cannot create tree\n", cmd_name, id);
+		return;
+	}
 
 	/*
 	 * initialize pseudo-random number generator with same seed
-	 * in each child process. This simulates sharding of the index
+	 * in each child process. Each child keeps only the keys in its
+	 * own slice of the key range. This simulates sharding of the index
 	 * by key value, maximizing concurrency without interlocking.
-         */
+	 */
 	initstate(314159, randstate, sizeof(randstate));
 
 	/* generate key, value pairs */
+	start = now_secs();
 	do {
 		key = random();
 		value = random();
+		generated += 1;
+		if (shard_of(key, nworkers) != id)
+			continue;
 
 		/* insert key value pairs */
 		ok = insert(bpt, key, value);
 		if (ok != OK) {
-			fprintf(stderr, "Error %u\n", ok);
-			return 0;
+			fprintf(stderr, "%s: worker %u: error %u\n", cmd_name, id, ok);
+			return;
 		}
-		count += 1;
+		r->inserted += 1;
 		/* until tree fills this process's share of physical storage */
 		get_active_storage(bpt, &nrecs, &nblocks, &ncursors);
 		used = nblocks << 12; /* each block takes 1 << 12 bytes */
-		if (nrecs % 1000 == 0)
-			printf("%'ld records inserted, %'lu bytes used\n", nrecs, used);
-	} while (used < nb);
-
-	printf("Inserted %'lu records\n", count);
+	} while (used < share);
+	r->insert_secs = now_secs() - start;
+	r->blocks = nblocks;
+	r->records = nrecs;
 
 	initstate(314159, randstate, sizeof(randstate));
 
-	printf("Looking up %'lu records\n", count);
-	for (unsigned long i = 0; i < count; i++) {
+	start = now_secs();
+	for (unsigned long i = 0; i < generated; i++) {
 		key = random();
 		value = random();
+		if (shard_of(key, nworkers) != id)
+			continue;
 		ok = find(bpt, key, &value);
 		switch (ok) {
 		case OK:
-			found += 1;
+			r->found += 1;
 			break;
 		default:
-			notfound += 1;
+			r->notfound += 1;
 		}
 	}
-	printf("Found %'lu records, didn't find %'lu\n",
-	       found, notfound);
-
+	r->lookup_secs = now_secs() - start;
 
-	count = 0;
+	start = now_secs();
 	cursor = first_record(bpt);
 	if (cursor != NULL) {
 		while (get_record(cursor, &key, &value) == OK) {
 			if (delete(bpt, key) != OK) {
 				fprintf(stderr,
 					"%s: BUG: Key %lu not found\n", cmd_name, key);
-				break;
+				free_cursor(cursor);
+				return;
 			}
-			count += 1;
+			r->removed += 1;
 			if (next_record(cursor) != OK)
 				break;
 		}
 		free_cursor(cursor);
 	}
-	
-	printf("Removed %'lu records in order using cursor\n",
-	       count);
-	
+	r->delete_secs = now_secs() - start;
+
+	getrusage(RUSAGE_SELF, &ru);
+	r->max_rss = ru.ru_maxrss * 1024UL;
 	free_bplus_tree(bpt);
-	return 0;
+	r->status = 0;
+}
+
+static void usage(const char *cmd_name)
+{
+	fprintf(stderr, "usage: %s [-w workers] [-m megabytes]\n"
+		"  -w  number of child processes, each building one key range shard (default: online cpus)\n"
+		"  -m  total megabytes of tree blocks to fill across all children (default: free RAM less 3 GB)\n",
+		cmd_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd_name = "XX";
+	size_t ngigs = sysconf(_SC_AVPHYS_PAGES) >> 18; // 2**18 pages is 1 GiB
+	size_t nb = ngigs > 3 ? ((ngigs - 3) << 30) & ~0xFFFUL : 0; /* Reserve 3 GB for overhead */
+	long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	struct worker_result *results;
+	struct worker_result total = { 0 };
+	size_t results_size;
+	double insert_secs = 0, lookup_secs = 0, delete_secs = 0;
+	int failed = 0;
+	int opt;
+
+	setlocale(LC_ALL, "");
+
+	cmd_name = basename(argv[0]);
+
+	while ((opt = getopt(argc, argv, "w:m:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nworkers = atol(optarg);
+			break;
+		case 'm':
+			nb = (strtoul(optarg, NULL, 0) << 20) & ~0xFFFUL;
+			break;
+		default:
+			usage(cmd_name);
+		}
+	}
+	if (nworkers < 1 || nb == 0)
+		usage(cmd_name);
+
+	printf("System has %'ld gigabytes (so filling %'ld bytes) of RAM with %ld shards\n",
+	       ngigs, nb, nworkers);
+
+	/* children report into pages shared with the parent */
+	results_size = (nworkers * sizeof(struct worker_result) + 0xFFFUL) & ~0xFFFUL;
+	results = mmap(NULL, results_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror(cmd_name);
+		return EXIT_FAILURE;
+	}
+
+	fflush(stdout);
+	for (long id = 0; id < nworkers; id++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror(cmd_name);
+			return EXIT_FAILURE;
+		}
+		if (pid == 0) {
+			run_worker(cmd_name, id, nworkers, nb / nworkers, &results[id]);
+			_exit(results[id].status);
+		}
+	}
+	for (long id = 0; id < nworkers; id++) {
+		int wstatus;
+		if (wait(&wstatus) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+			failed += 1;
+	}
+
+	for (long id = 0; id < nworkers; id++) {
+		struct worker_result *r = &results[id];
+		printf("shard %ld (cpu %d): %'lu inserted in %.3fs, %'lu found in %.3fs, %'lu removed in %.3fs, %'lu KiB peak RSS%s\n",
+		       id, r->cpu, r->inserted, r->insert_secs, r->found, r->lookup_secs,
+		       r->removed, r->delete_secs, r->max_rss >> 10, r->status ? " FAILED" : "");
+		total.inserted += r->inserted;
+		total.records += r->records;
+		total.found += r->found;
+		total.notfound += r->notfound;
+		total.removed += r->removed;
+		total.blocks += r->blocks;
+		total.max_rss += r->max_rss;
+		/* shards run in parallel, so each phase takes as long as its slowest shard */
+		if (r->insert_secs > insert_secs) insert_secs = r->insert_secs;
+		if (r->lookup_secs > lookup_secs) lookup_secs = r->lookup_secs;
+		if (r->delete_secs > delete_secs) delete_secs = r->delete_secs;
+	}
+
+	printf("Inserted %'lu records (%'lu distinct), %'.0f inserts/sec\n",
+	       total.inserted, total.records,
+	       insert_secs > 0 ? total.inserted / insert_secs : 0.0);
+	printf("Found %'lu records, didn't find %'lu, %'.0f lookups/sec\n",
+	       total.found, total.notfound,
+	       lookup_secs > 0 ? (total.found + total.notfound) / lookup_secs : 0.0);
+	printf("Removed %'lu records in order using cursor, %'.0f deletes/sec\n",
+	       total.removed, delete_secs > 0 ? total.removed / delete_secs : 0.0);
+	printf("Trees used %'lu bytes in blocks (%.1f bytes per record), %'lu bytes peak RSS in all\n",
+	       total.blocks << 12,
+	       total.records ? (double)(total.blocks << 12) / total.records : 0.0,
+	       total.max_rss);
+	if (failed)
+		fprintf(stderr, "%s: %d of %ld shards failed\n", cmd_name, failed, nworkers);
+
+	munmap(results, results_size);
+	return failed ? EXIT_FAILURE : 0;
 }
@@ -0,0 +1,352 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Multi-version store. The value of each key in the tree points to its chain of versions,
+ * newest first. Writers add a version to the front of the chain and never change one that
+ * is there, so a reader only has to skip the versions committed after its read timestamp.
+ *
+ * The active reads are kept in a second tree, read timestamp -> number of reads, whose first
+ * key is the oldest active read. Every version older than the newest one that read can see
+ * is hidden from all reads, present and future, so it can be freed.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "mvcc.h"
+
+#define SCAN_CHUNK 64	/* records a scan copies out under the lock at a time */
+#define NO_READS (~0UL)	/* oldest when there are no active reads */
+
+struct version {
+	unsigned long ts;	/* commit timestamp */
+	int deleted;		/* the key was deleted by this commit */
+	value_t value;
+	struct version *older;
+};
+
+struct bplus_mvcc {
+	pthread_mutex_t lock;
+	bplus_t tree;		/* key -> newest struct version */
+	bplus_t reads;		/* read timestamp -> count of active reads */
+	unsigned long clock;	/* timestamp of the last commit */
+	unsigned long oldest;	/* timestamp of the oldest active read, or NO_READS */
+	unsigned long num_versions;
+	lkey_t gc_next;		/* where bplus_mvcc_gc() carries on */
+};
+
+static inline struct version *chain_of(value_t v)
+{
+	return (struct version *)v;
+}
+
+/* versions newer than this are visible to some read, and so is the newest one not newer */
+static inline unsigned long horizon(bplus_mvcc_t m)
+{
+	return m->oldest < m->clock ? m->oldest : m->clock;
+}
+
+static inline struct version *visible(struct version *v, unsigned long read_ts)
+{
+	while (v != NULL && v->ts > read_ts)
+		v = v->older;
+	return v;
+}
+
+static void free_versions(bplus_mvcc_t m, struct version *v)
+{
+	while (v != NULL) {
+		struct version *older = v->older;
+		free(v);
+		m->num_versions -= 1;
+		v = older;
+	}
+}
+
+/*
+ * free the versions of chain that no read can see. Returns 1 if nothing is left that any
+ * read can see, meaning the key should be removed from the tree (and the chain is freed).
+ */
+static int prune(bplus_mvcc_t m, struct version *chain)
+{
+	struct version *keep = visible(chain, horizon(m));
+	if (keep == NULL)
+		return 0;
+	free_versions(m, keep->older);
+	keep->older = NULL;
+	if (!keep->deleted)
+		return 0;
+	if (keep == chain) {
+		free_versions(m, chain);
+		return 1;
+	}
+	/* a read that gets as far as the deletion finds nothing either way */
+	for (struct version *v = chain; v != NULL; v = v->older)
+		if (v->older == keep) {
+			v->older = NULL;
+			free_versions(m, keep);
+			break;
+		}
+	return 0;
+}
+
+bplus_mvcc_t bplus_mvcc_new(void)
+{
+	bplus_mvcc_t m = calloc(1, sizeof(struct bplus_mvcc));
+	if (m == NULL)
+		return NULL;
+	m->tree = new_bplus_tree();
+	m->reads = new_bplus_tree();
+	if (m->tree == NULL || m->reads == NULL) {
+		if (m->tree != NULL)
+			free_bplus_tree(m->tree);
+		if (m->reads != NULL)
+			free_bplus_tree(m->reads);
+		free(m);
+		return NULL;
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	m->oldest = NO_READS;
+	m->clock = 1;	/* so a read never gets timestamp 0 */
+	return m;
+}
+
+void bplus_mvcc_free(bplus_mvcc_t m)
+{
+	bplus_cursor_t c = first_record(m->tree);
+	lkey_t k;
+	value_t v;
+	if (c != NULL) {
+		while (get_record(c, &k, &v) == OK) {
+			free_versions(m, chain_of(v));
+			if (next_record(c) != OK)
+				break;
+		}
+		free_cursor(c);
+	}
+	free_bplus_tree(m->tree);
+	free_bplus_tree(m->reads);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+/* add a version to the front of k's chain, or remove k if no read can see it any more */
+static enum bplus_error commit(bplus_mvcc_t m, lkey_t k, struct version *head,
+			       int deleted, value_t v, unsigned long *commit_ts)
+{
+	struct version *nv;
+	enum bplus_error ok;
+
+	if (deleted && m->oldest == NO_READS) {
+		/* no read could see the deletion or anything before it */
+		ok = delete(m->tree, k);
+		if (ok == OK) {
+			m->clock += 1;
+			free_versions(m, head);
+		}
+		if (commit_ts != NULL)
+			*commit_ts = m->clock;
+		return ok;
+	}
+	nv = malloc(sizeof(struct version));
+	if (nv == NULL)
+		return NOMEM;
+	nv->ts = m->clock + 1;
+	nv->deleted = deleted;
+	nv->value = v;
+	nv->older = head;
+	ok = insert(m->tree, k, (value_t)nv);
+	if (ok != OK) {
+		free(nv);
+		return ok;
+	}
+	m->clock += 1;
+	m->num_versions += 1;
+	if (commit_ts != NULL)
+		*commit_ts = m->clock;
+	if (prune(m, nv))
+		delete(m->tree, k);
+	return OK;
+}
+
+enum bplus_error bplus_mvcc_put(bplus_mvcc_t m, lkey_t k, value_t v, unsigned long *commit_ts)
+{
+	value_t head = 0;
+	enum bplus_error ok;
+	pthread_mutex_lock(&m->lock);
+	find(m->tree, k, &head);
+	ok = commit(m, k, chain_of(head), 0, v, commit_ts);
+	pthread_mutex_unlock(&m->lock);
+	return ok;
+}
+
+enum bplus_error bplus_mvcc_delete(bplus_mvcc_t m, lkey_t k, unsigned long *commit_ts)
+{
+	value_t head = 0;
+	enum bplus_error ok = NOTFOUND;
+	pthread_mutex_lock(&m->lock);
+	if (find(m->tree, k, &head) == OK && !chain_of(head)->deleted)
+		ok = commit(m, k, chain_of(head), 1, 0, commit_ts);
+	pthread_mutex_unlock(&m->lock);
+	return ok;
+}
+
+unsigned long bplus_mvcc_begin_read(bplus_mvcc_t m)
+{
+	unsigned long ts, count = 0;
+	pthread_mutex_lock(&m->lock);
+	ts = m->clock;
+	find(m->reads, ts, &count);
+	if (insert(m->reads, ts, count + 1) != OK) {
+		ts = 0;
+	} else if (m->oldest == NO_READS) {
+		/* reads start at the newest commit, so an older one is already the oldest */
+		m->oldest = ts;
+	}
+	pthread_mutex_unlock(&m->lock);
+	return ts;
+}
+
+void bplus_mvcc_end_read(bplus_mvcc_t m, unsigned long read_ts)
+{
+	unsigned long count;
+	pthread_mutex_lock(&m->lock);
+	if (find(m->reads, read_ts, &count) == OK) {
+		if (count > 1) {
+			insert(m->reads, read_ts, count - 1);
+		} else {
+			delete(m->reads, read_ts);
+			if (read_ts == m->oldest) {
+				unsigned long nreads, nblocks, ncursors;
+				bplus_cursor_t c;
+				lkey_t ts;
+				get_active_storage(m->reads, &nreads, &nblocks, &ncursors);
+				if (nreads == 0) {
+					m->oldest = NO_READS;
+				} else if ((c = first_record(m->reads)) != NULL) {
+					if (get_record(c, &ts, &count) == OK)
+						m->oldest = ts;
+					free_cursor(c);
+				}
+				/* a cursor that could not be allocated leaves oldest too old, which is safe */
+			}
+		}
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+enum bplus_error bplus_mvcc_get(bplus_mvcc_t m, lkey_t k, unsigned long read_ts, value_t *v)
+{
+	value_t head;
+	struct version *ver = NULL;
+	pthread_mutex_lock(&m->lock);
+	if (find(m->tree, k, &head) == OK)
+		ver = visible(chain_of(head), read_ts);
+	if (ver != NULL && !ver->deleted)
+		*v = ver->value;
+	pthread_mutex_unlock(&m->lock);
+	return ver != NULL && !ver->deleted ? OK : NOTFOUND;
+}
+
+void bplus_mvcc_scan(bplus_mvcc_t m, lkey_t lo, lkey_t hi, unsigned long read_ts,
+		     int (*f)(lkey_t k, value_t v, void *ctx), void *ctx)
+{
+	lkey_t keys[SCAN_CHUNK];
+	value_t vals[SCAN_CHUNK];
+	int more = lo <= hi;
+
+	while (more) {
+		unsigned n = 0;
+		bplus_cursor_t c;
+		lkey_t k;
+		value_t head;
+
+		/* copy out a chunk of visible records, then call f on them without the lock */
+		pthread_mutex_lock(&m->lock);
+		c = find_record(m->tree, lo);
+		more = 0;
+		if (c != NULL) {
+			if (get_record(c, &k, &head) != OK)
+				next_record(c);
+			while (get_record(c, &k, &head) == OK && k <= hi) {
+				struct version *ver = visible(chain_of(head), read_ts);
+				if (ver != NULL && !ver->deleted) {
+					keys[n] = k;
+					vals[n++] = ver->value;
+				}
+				if (k == hi || next_record(c) != OK)
+					break;
+				if (n == SCAN_CHUNK) {
+					/* carry on from the next key next time round */
+					get_record(c, &lo, &head);
+					more = 1;
+					break;
+				}
+			}
+			free_cursor(c);
+		}
+		pthread_mutex_unlock(&m->lock);
+
+		for (unsigned i = 0; i < n; i++)
+			if (f(keys[i], vals[i], ctx))
+				return;
+	}
+}
+
+enum bplus_error bplus_mvcc_gc(bplus_mvcc_t m, unsigned long budget)
+{
+	enum bplus_error ok = OK;
+	bplus_cursor_t c;
+	lkey_t k;
+	value_t head;
+
+	pthread_mutex_lock(&m->lock);
+	c = find_record(m->tree, m->gc_next);
+	if (c != NULL) {
+		if (get_record(c, &k, &head) != OK)
+			next_record(c);
+		while (get_record(c, &k, &head) == OK) {
+			if (budget-- == 0) {
+				m->gc_next = k;
+				ok = INCOMPLETE;
+				break;
+			}
+			/* the cursor moves on to the next record if this one is deleted */
+			if (prune(m, chain_of(head)))
+				delete(m->tree, k);
+			if (next_record(c) != OK)
+				break;
+		}
+		free_cursor(c);
+	}
+	if (ok == OK)
+		m->gc_next = 0;
+	pthread_mutex_unlock(&m->lock);
+	return ok;
+}
+
+void bplus_mvcc_stats(bplus_mvcc_t m, unsigned long *num_keys, unsigned long *num_versions)
+{
+	unsigned long nblocks, ncursors;
+	pthread_mutex_lock(&m->lock);
+	get_active_storage(m->tree, num_keys, &nblocks, &ncursors);
+	*num_versions = m->num_versions;
+	pthread_mutex_unlock(&m->lock);
+}
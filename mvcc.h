@@ -0,0 +1,89 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Multi-version store built on the b+ tree. Every write makes a new version of its record,
+ * tagged with a commit timestamp, and a reader sees the records as of its read timestamp,
+ * however many writes come after. Versions no reader can see any more are freed as records
+ * are written, and by bplus_mvcc_gc().
+ *
+ * Unlike the tree itself, a store may be shared by threads: each call holds the store's
+ * lock only briefly, and scans take it a few records at a time, so long reads do not hold
+ * up writers and writers do not change what a reader sees.
+ */
+
+#ifndef _BPLUS_MVCC_H_
+#define _BPLUS_MVCC_H_
+
+#include "b+tree.h"
+
+typedef struct bplus_mvcc *bplus_mvcc_t;
+
+/* create an empty store, or NULL if out of memory */
+bplus_mvcc_t bplus_mvcc_new(void);
+
+/* free the store and every version in it. No thread may be using it. */
+void bplus_mvcc_free(bplus_mvcc_t m);
+
+/*
+ * set the value of key k, as a new version. If commit_ts is not NULL it is set to the
+ * version's commit timestamp, which is greater than that of every earlier write.
+ * Returns OK, or NOMEM.
+ */
+enum bplus_error bplus_mvcc_put(bplus_mvcc_t m, lkey_t k, value_t v, unsigned long *commit_ts);
+
+/*
+ * delete key k, as a new version that records its absence. Returns NOTFOUND if it
+ * was not present as of now, else OK or NOMEM.
+ */
+enum bplus_error bplus_mvcc_delete(bplus_mvcc_t m, lkey_t k, unsigned long *commit_ts);
+
+/*
+ * start a read, returning a read timestamp that sees every write committed so far. The
+ * versions it sees are kept until bplus_mvcc_end_read() with the same timestamp.
+ * Returns 0 if out of memory (no commit has timestamp 0, so such a read sees nothing).
+ */
+unsigned long bplus_mvcc_begin_read(bplus_mvcc_t m);
+
+/* end a read started by bplus_mvcc_begin_read() */
+void bplus_mvcc_end_read(bplus_mvcc_t m, unsigned long read_ts);
+
+/* get the value of key k as of read_ts, returning OK, or NOTFOUND if it was absent then */
+enum bplus_error bplus_mvcc_get(bplus_mvcc_t m, lkey_t k, unsigned long read_ts, value_t *v);
+
+/*
+ * call f on every record with key in lo..hi inclusive as of read_ts, in key order. f returns
+ * non-zero to stop the scan early. Writers may run between calls of f.
+ */
+void bplus_mvcc_scan(bplus_mvcc_t m, lkey_t lo, lkey_t hi, unsigned long read_ts,
+		     int (*f)(lkey_t k, value_t v, void *ctx), void *ctx);
+
+/*
+ * free versions hidden from every active read, visiting up to budget keys from where the
+ * last call stopped, and dropping keys whose only visible version is a deletion.
+ * Returns INCOMPLETE if it stopped short of the last key, else OK, and the next call
+ * starts again from the first key.
+ */
+enum bplus_error bplus_mvcc_gc(bplus_mvcc_t m, unsigned long budget);
+
+/* number of keys in the store, and number of versions kept for them */
+void bplus_mvcc_stats(bplus_mvcc_t m, unsigned long *num_keys, unsigned long *num_versions);
+
+#endif
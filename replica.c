@@ -0,0 +1,423 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The log is a sequence of frames, each a header followed by its changes. A change is an
+ * op byte and the key as a varint, followed by the new value as a varint if it is a put.
+ * Old values and sequence numbers are not sent: the header gives the sequence numbers of
+ * the first and last changes, which is all the follower needs to notice a gap.
+ *
+ * Both ends are the same build on the same machine, so the header is sent as it is laid
+ * out in memory.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "replica.h"
+
+#define FRAME_MAGIC 0x4C525042U	/* "BPRL" */
+#define SNAPSHOT_CHUNK 4096	/* records per frame of a snapshot */
+#define VARINT_MAX 10	/* bytes of the longest varint */
+
+enum log_op { LOG_PUT, LOG_DELETE, LOG_TRUNCATE, LOG_CLEAR };
+
+struct frame_header {
+	uint32_t magic;
+	uint32_t count;	/* changes in the frame */
+	uint64_t length;	/* bytes of changes after the header */
+	uint64_t first_seq;	/* of the first change, or 0 in a snapshot frame */
+	uint64_t last_seq;	/* of the last change, or that a snapshot brings the follower up to */
+	uint64_t leader_seq;	/* leader's last change when the frame was sent */
+};
+
+struct bplus_leader {
+	bplus_t tree;
+	bplus_cdc_t feed;
+	int fd;
+	pthread_mutex_t lock;	/* one frame at a time, and the fields below */
+	unsigned long next;	/* sequence number of the next change to ship */
+	struct bplus_change *changes;
+	unsigned long max_changes;	/* changes has room for this many */
+	unsigned char *buf;
+	size_t buf_size;
+	struct bplus_replica_stats stats;
+};
+
+struct bplus_follower {
+	bplus_t tree;
+	int fd;
+	struct frame_header header;
+	int have_frame;	/* frame in header and buf was read but not applied */
+	unsigned char *buf;
+	size_t buf_size;
+	struct bplus_write *writes;
+	unsigned long max_writes;
+	struct bplus_replica_stats stats;
+};
+
+static inline unsigned char *put_varint(unsigned char *p, unsigned long x)
+{
+	while (x >= 0x80) {
+		*p++ = (x & 0x7F) | 0x80;
+		x >>= 7;
+	}
+	*p++ = x;
+	return p;
+}
+
+/* decode a varint at p, before end, returning NULL if it runs past end */
+static inline const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned long *x)
+{
+	unsigned long v = 0;
+	for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+		unsigned char c = *p++;
+		v |= (unsigned long)(c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			*x = v;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static int write_all(int fd, const void *p, size_t n)
+{
+	while (n != 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		p = (const char *)p + w;
+		n -= w;
+	}
+	return 0;
+}
+
+/* read n bytes, returning 0, or -1 at end of file or on error */
+static int read_all(int fd, void *p, size_t n)
+{
+	while (n != 0) {
+		ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p = (char *)p + r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* make buf hold at least n bytes */
+static int reserve_buf(unsigned char **buf, size_t *size, size_t n)
+{
+	if (*size < n) {
+		unsigned char *p = realloc(*buf, n);
+		if (p == NULL)
+			return -1;
+		*buf = p;
+		*size = n;
+	}
+	return 0;
+}
+
+/* ***** leader ***** */
+
+bplus_leader_t bplus_leader_new(bplus_t b, int fd, unsigned capacity_bits)
+{
+	bplus_leader_t l = calloc(1, sizeof(struct bplus_leader));
+	if (l == NULL)
+		return NULL;
+	l->feed = bplus_cdc_new(capacity_bits);
+	if (l->feed == NULL) {
+		free(l);
+		return NULL;
+	}
+	if (bplus_cdc_attach(b, l->feed) != OK) {
+		bplus_cdc_free(l->feed);
+		free(l);
+		return NULL;
+	}
+	l->tree = b;
+	l->fd = fd;
+	l->next = bplus_cdc_last(l->feed) + 1;
+	pthread_mutex_init(&l->lock, NULL);
+	return l;
+}
+
+void bplus_leader_free(bplus_leader_t l)
+{
+	bplus_cdc_attach(l->tree, NULL);
+	bplus_cdc_free(l->feed);
+	pthread_mutex_destroy(&l->lock);
+	free(l->changes);
+	free(l->buf);
+	free(l);
+}
+
+/* write the frame of count changes encoded in l->buf after its header. Called with the lock held. */
+static enum bplus_error send_frame(bplus_leader_t l, unsigned char *end, unsigned long count,
+				   unsigned long first_seq, unsigned long last_seq)
+{
+	struct frame_header *h = (struct frame_header *)l->buf;
+	h->magic = FRAME_MAGIC;
+	h->count = count;
+	h->length = end - l->buf - sizeof(struct frame_header);
+	h->first_seq = first_seq;
+	h->last_seq = last_seq;
+	h->leader_seq = bplus_cdc_last(l->feed);
+	if (write_all(l->fd, l->buf, end - l->buf) != 0)
+		return NOTFOUND;
+	l->stats.frames += 1;
+	l->stats.bytes += end - l->buf;
+	l->stats.changes += count;
+	l->stats.leader_seq = h->leader_seq;
+	return OK;
+}
+
+enum bplus_error bplus_leader_ship(bplus_leader_t l, unsigned long max)
+{
+	enum bplus_error ok = OK;
+	unsigned long n, next;
+	unsigned char *p;
+
+	pthread_mutex_lock(&l->lock);
+	if (max > l->max_changes) {
+		struct bplus_change *c = realloc(l->changes, max * sizeof(struct bplus_change));
+		if (c == NULL) {
+			pthread_mutex_unlock(&l->lock);
+			return NOMEM;
+		}
+		l->changes = c;
+		l->max_changes = max;
+	}
+	if (reserve_buf(&l->buf, &l->buf_size, sizeof(struct frame_header) + max * (1 + 2 * VARINT_MAX)) != 0) {
+		pthread_mutex_unlock(&l->lock);
+		return NOMEM;
+	}
+	next = l->next;
+	n = bplus_cdc_read(l->feed, &next, l->changes, max);
+	if (n != 0) {
+		p = l->buf + sizeof(struct frame_header);
+		for (unsigned long i = 0; i < n; i++) {
+			struct bplus_change *c = &l->changes[i];
+			switch (c->op) {
+			case BPLUS_CHANGE_INSERT:
+			case BPLUS_CHANGE_UPDATE:
+				*p++ = LOG_PUT;
+				p = put_varint(p, c->key);
+				p = put_varint(p, c->new_value);
+				break;
+			case BPLUS_CHANGE_DELETE:
+				*p++ = LOG_DELETE;
+				p = put_varint(p, c->key);
+				break;
+			case BPLUS_CHANGE_TRUNCATE:
+				*p++ = LOG_TRUNCATE;
+				p = put_varint(p, c->key);
+				break;
+			}
+		}
+		/* the feed skips what it overwrote before we got to it */
+		l->stats.lost += l->changes[n - 1].seq + 1 - l->next - n;
+		ok = send_frame(l, p, n, l->changes[0].seq, l->changes[n - 1].seq);
+		if (ok == OK) {
+			l->next = next;
+			l->stats.seq = next - 1;
+		}
+	}
+	if (ok == OK && l->next <= bplus_cdc_last(l->feed))
+		ok = INCOMPLETE;
+	pthread_mutex_unlock(&l->lock);
+	return ok;
+}
+
+enum bplus_error bplus_leader_snapshot(bplus_leader_t l)
+{
+	enum bplus_error ok = OK;
+	unsigned long seq, count = 0;
+	bplus_cursor_t c;
+	unsigned char *p;
+	lkey_t k;
+	value_t v;
+
+	pthread_mutex_lock(&l->lock);
+	if (reserve_buf(&l->buf, &l->buf_size, sizeof(struct frame_header) + (SNAPSHOT_CHUNK + 1) * (1 + 2 * VARINT_MAX)) != 0) {
+		pthread_mutex_unlock(&l->lock);
+		return NOMEM;
+	}
+	/* the tree is not being written, so it is as of the last change in the feed */
+	seq = bplus_cdc_last(l->feed);
+	c = first_record(l->tree);
+	p = l->buf + sizeof(struct frame_header);
+	*p++ = LOG_CLEAR;
+	p = put_varint(p, 0);
+	count = 1;
+	if (c != NULL) {
+		while (ok == OK && get_record(c, &k, &v) == OK) {
+			*p++ = LOG_PUT;
+			p = put_varint(p, k);
+			p = put_varint(p, v);
+			if (++count == SNAPSHOT_CHUNK) {
+				ok = send_frame(l, p, count, 0, seq);
+				p = l->buf + sizeof(struct frame_header);
+				count = 0;
+			}
+			if (next_record(c) != OK)
+				break;
+		}
+		free_cursor(c);
+	}
+	if (ok == OK && count != 0)
+		ok = send_frame(l, p, count, 0, seq);
+	if (ok == OK) {
+		l->next = seq + 1;
+		l->stats.seq = seq;
+	}
+	pthread_mutex_unlock(&l->lock);
+	return ok;
+}
+
+void bplus_leader_stats(bplus_leader_t l, struct bplus_replica_stats *s)
+{
+	pthread_mutex_lock(&l->lock);
+	*s = l->stats;
+	pthread_mutex_unlock(&l->lock);
+}
+
+/* ***** follower ***** */
+
+bplus_follower_t bplus_follower_new(bplus_t b, int fd)
+{
+	bplus_follower_t f = calloc(1, sizeof(struct bplus_follower));
+	if (f != NULL) {
+		f->tree = b;
+		f->fd = fd;
+	}
+	return f;
+}
+
+void bplus_follower_free(bplus_follower_t f)
+{
+	free(f->buf);
+	free(f->writes);
+	free(f);
+}
+
+/* apply the writes gathered so far, as one batch */
+static enum bplus_error flush_writes(bplus_follower_t f, unsigned long *n)
+{
+	enum bplus_error ok = bplus_write_batch(f->tree, f->writes, *n);
+	if (ok == OK)
+		*n = 0;
+	return ok;
+}
+
+/* apply the frame read into f. Puts and deletes are batched, up to each truncate or clear. */
+static enum bplus_error apply_frame(bplus_follower_t f)
+{
+	const unsigned char *p = f->buf, *end = f->buf + f->header.length;
+	unsigned long n = 0;
+	enum bplus_error ok = OK;
+
+	if (f->header.count > f->max_writes) {
+		struct bplus_write *w = realloc(f->writes, f->header.count * sizeof(struct bplus_write));
+		if (w == NULL)
+			return NOMEM;
+		f->writes = w;
+		f->max_writes = f->header.count;
+	}
+	for (unsigned long i = 0; ok == OK && i < f->header.count; i++) {
+		unsigned char op;
+		lkey_t k;
+		value_t v = 0;
+		if (p >= end)
+			return NOTFOUND;
+		op = *p++;
+		p = get_varint(p, end, &k);
+		if (p != NULL && op == LOG_PUT)
+			p = get_varint(p, end, &v);
+		if (p == NULL)
+			return NOTFOUND;
+		switch (op) {
+		case LOG_PUT:
+		case LOG_DELETE:
+			f->writes[n++] = (struct bplus_write){ k, v, op == LOG_DELETE };
+			break;
+		case LOG_TRUNCATE:
+			ok = flush_writes(f, &n);
+			if (ok == OK)
+				ok = bplus_truncate_before(f->tree, k);
+			break;
+		case LOG_CLEAR:
+			ok = flush_writes(f, &n);
+			if (ok == OK)
+				ok = bplus_truncate_before(f->tree, ~0UL);
+			if (ok == OK)
+				delete(f->tree, ~0UL);
+			break;
+		default:
+			return NOTFOUND;
+		}
+	}
+	if (ok == OK)
+		ok = flush_writes(f, &n);
+	return ok;
+}
+
+enum bplus_error bplus_follower_apply(bplus_follower_t f)
+{
+	struct frame_header *h = &f->header;
+	enum bplus_error ok;
+
+	if (!f->have_frame) {
+		if (read_all(f->fd, h, sizeof(struct frame_header)) != 0 || h->magic != FRAME_MAGIC)
+			return NOTFOUND;
+		if (reserve_buf(&f->buf, &f->buf_size, h->length) != 0 ||
+		    read_all(f->fd, f->buf, h->length) != 0)
+			return NOTFOUND;
+		f->have_frame = 1;
+		f->stats.frames += 1;
+		f->stats.bytes += sizeof(struct frame_header) + h->length;
+	}
+	ok = apply_frame(f);
+	if (ok != OK)
+		return ok;
+	f->have_frame = 0;
+	/* a snapshot starts over, otherwise a gap is what the leader lost */
+	if (h->first_seq != 0 && h->first_seq > f->stats.seq + 1 && f->stats.seq != 0)
+		f->stats.lost += h->first_seq - f->stats.seq - 1;
+	f->stats.seq = h->last_seq;
+	f->stats.leader_seq = h->leader_seq;
+	f->stats.changes += h->count;
+	if (h->leader_seq - h->last_seq > f->stats.max_lag)
+		f->stats.max_lag = h->leader_seq - h->last_seq;
+	return OK;
+}
+
+void bplus_follower_stats(bplus_follower_t f, struct bplus_replica_stats *s)
+{
+	*s = f->stats;
+}
@@ -0,0 +1,88 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Log shipping replication. A leader takes the changes of its tree from a change feed and
+ * writes them to a file descriptor, a pipe or a socket, as a log of frames. A follower,
+ * usually in another process, reads the frames from the other end and applies each one to
+ * its own tree as a write batch, so the follower's tree follows the leader's a frame behind.
+ */
+
+#ifndef _BPLUS_REPLICA_H_
+#define _BPLUS_REPLICA_H_
+
+#include "b+tree.h"
+
+typedef struct bplus_leader *bplus_leader_t;
+typedef struct bplus_follower *bplus_follower_t;
+
+struct bplus_replica_stats {
+        unsigned long seq;      /* last change shipped (leader) or applied (follower) */
+        unsigned long leader_seq;       /* leader's last change when the last frame was sent */
+        unsigned long changes;  /* changes shipped or applied */
+        unsigned long frames;
+        unsigned long bytes;    /* bytes of frames written or read */
+        unsigned long lost;     /* changes dropped by the feed before they were shipped */
+        unsigned long max_lag;  /* follower: most changes the leader was ahead by when a frame was applied */
+};
+
+/*
+ * start shipping the changes of b to fd, through a feed of 2**capacity_bits changes that
+ * is attached to b. Returns NULL if out of memory, or if b is a shared tree.
+ */
+bplus_leader_t bplus_leader_new(bplus_t b, int fd, unsigned capacity_bits);
+
+/*
+ * ship up to max changes made since the last call, in one frame. It only reads the feed,
+ * so it may run in another thread while b is written. Returns OK if it shipped all there
+ * was, INCOMPLETE if more remain, or NOTFOUND if the write to fd failed. If the feed
+ * overran, the changes are lost and stats.lost counts them: the follower is then out of
+ * step until bplus_leader_snapshot() is called.
+ */
+enum bplus_error bplus_leader_ship(bplus_leader_t l, unsigned long max);
+
+/*
+ * ship the whole of b, telling the follower to clear its tree first, and carry on shipping
+ * from the changes after it. Must be called by the thread writing b, between writes.
+ * Returns OK, NOMEM, or NOTFOUND if the write to fd failed.
+ */
+enum bplus_error bplus_leader_snapshot(bplus_leader_t l);
+
+/* detach the feed from the tree and free the leader. fd is left open. */
+void bplus_leader_free(bplus_leader_t l);
+
+void bplus_leader_stats(bplus_leader_t l, struct bplus_replica_stats *s);
+
+/* apply the frames read from fd to b. Returns NULL if out of memory. */
+bplus_follower_t bplus_follower_new(bplus_t b, int fd);
+
+/*
+ * read one frame, waiting for it if need be, and apply it. Returns OK, NOTFOUND at end of
+ * file or if the stream is broken, or NOMEM. After NOMEM the next call applies the same
+ * frame again from the start, which is harmless for any part of it already applied.
+ */
+enum bplus_error bplus_follower_apply(bplus_follower_t f);
+
+/* free the follower. fd is left open. */
+void bplus_follower_free(bplus_follower_t f);
+
+void bplus_follower_stats(bplus_follower_t f, struct bplus_replica_stats *s);
+
+#endif
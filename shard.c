@@ -0,0 +1,314 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Shard set. lo[i] is the lowest key of shard i, and changes only while shard i and the shard
+ * before it are both locked for writing, so a thread that has locked the shard it looked a key
+ * up in can check that the key is still in it, and look again if not. Only one rebalance runs
+ * at a time, and it takes the locks of the two shards it moves keys between in index order.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "shard.h"
+
+struct shard {
+	pthread_rwlock_t lock;
+	bplus_t tree;
+};
+
+struct bplus_shards {
+	unsigned n;
+	lkey_t *lo;		/* lowest key of each shard, lo[0] being 0 */
+	struct shard *shards;
+	pthread_mutex_t rebalancing;
+};
+
+bplus_shards_t bplus_shards_new(unsigned n, const lkey_t *bounds, unsigned flags)
+{
+	bplus_shards_t s;
+	if (n == 0)
+		return NULL;
+	s = calloc(1, sizeof(struct bplus_shards));
+	if (s == NULL)
+		return NULL;
+	pthread_mutex_init(&s->rebalancing, NULL);
+	s->n = n;
+	s->shards = calloc(n, sizeof(struct shard));
+	if (s->shards != NULL) {
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		/* a stream of readers must not keep a rebalance from its handoff */
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		for (unsigned i = 0; i < n; i++)
+			pthread_rwlock_init(&s->shards[i].lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+	}
+	s->lo = malloc(n * sizeof(lkey_t));
+	if (s->shards == NULL || s->lo == NULL) {
+		bplus_shards_free(s);
+		return NULL;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		s->lo[i] = i == 0 ? 0 : bounds[i - 1];
+		s->shards[i].tree = new_bplus_tree_opts(flags);
+		if (s->shards[i].tree == NULL) {
+			bplus_shards_free(s);
+			return NULL;
+		}
+	}
+	return s;
+}
+
+void bplus_shards_free(bplus_shards_t s)
+{
+	for (unsigned i = 0; s->shards != NULL && i < s->n; i++) {
+		if (s->shards[i].tree != NULL)
+			free_bplus_tree(s->shards[i].tree);
+		pthread_rwlock_destroy(&s->shards[i].lock);
+	}
+	pthread_mutex_destroy(&s->rebalancing);
+	free(s->shards);
+	free(s->lo);
+	free(s);
+}
+
+/* the shard whose range k was in when its bound was read, the last with lo <= k */
+static unsigned shard_of(bplus_shards_t s, lkey_t k)
+{
+	unsigned l = 0, h = s->n;
+	while (h - l > 1) {
+		unsigned m = (l + h) / 2;
+		if (__atomic_load_n(&s->lo[m], __ATOMIC_ACQUIRE) <= k)
+			l = m;
+		else
+			h = m;
+	}
+	return l;
+}
+
+bplus_t bplus_shards_lock(bplus_shards_t s, lkey_t k, int write, unsigned *shard)
+{
+	for (;;) {
+		unsigned i = shard_of(s, k);
+		struct shard *sh = &s->shards[i];
+		if (write)
+			pthread_rwlock_wrlock(&sh->lock);
+		else
+			pthread_rwlock_rdlock(&sh->lock);
+		/* with the lock held, the shard's bounds cannot move */
+		if (s->lo[i] <= k && (i + 1 == s->n || k < s->lo[i + 1])) {
+			*shard = i;
+			return sh->tree;
+		}
+		pthread_rwlock_unlock(&sh->lock);
+	}
+}
+
+void bplus_shards_unlock(bplus_shards_t s, unsigned shard)
+{
+	pthread_rwlock_unlock(&s->shards[shard].lock);
+}
+
+enum bplus_error bplus_shards_find(bplus_shards_t s, lkey_t k, value_t *v)
+{
+	unsigned i;
+	enum bplus_error ok = find(bplus_shards_lock(s, k, 0, &i), k, v);
+	bplus_shards_unlock(s, i);
+	return ok;
+}
+
+enum bplus_error bplus_shards_insert(bplus_shards_t s, lkey_t k, value_t v)
+{
+	unsigned i;
+	enum bplus_error ok = insert(bplus_shards_lock(s, k, 1, &i), k, v);
+	bplus_shards_unlock(s, i);
+	return ok;
+}
+
+enum bplus_error bplus_shards_delete(bplus_shards_t s, lkey_t k)
+{
+	unsigned i;
+	enum bplus_error ok = delete(bplus_shards_lock(s, k, 1, &i), k);
+	bplus_shards_unlock(s, i);
+	return ok;
+}
+
+enum bplus_error bplus_shards_heatmap_enable(bplus_shards_t s, unsigned sample_shift, unsigned slot_bits)
+{
+	enum bplus_error ok = OK;
+	for (unsigned i = 0; i < s->n && ok == OK; i++) {
+		pthread_rwlock_wrlock(&s->shards[i].lock);
+		ok = bplus_heatmap_enable(s->shards[i].tree, sample_shift, slot_bits);
+		pthread_rwlock_unlock(&s->shards[i].lock);
+	}
+	return ok;
+}
+
+/* running total of a heatmap export, and the key at which it first reached target */
+struct heat_sum {
+	double total;
+	double target;
+	lkey_t key;
+	int found;
+};
+
+static void add_heat(lkey_t lo, lkey_t hi, unsigned long reads, unsigned long writes, void *ctx)
+{
+	struct heat_sum *h = ctx;
+	(void)hi;
+	if (!h->found && h->total >= h->target && h->target > 0) {
+		h->key = lo;
+		h->found = 1;
+	}
+	h->total += reads + writes;
+}
+
+/* load of shard i, whose lock is held */
+static double shard_load(bplus_shards_t s, unsigned i, enum bplus_shards_load by)
+{
+	bplus_t b = s->shards[i].tree;
+	unsigned long recs, blks, crsrs;
+	struct heat_sum h = { 0, 0, 0, 0 };
+	if (by == BPLUS_SHARDS_BY_HEAT) {
+		bplus_heatmap_export(b, 1, add_heat, &h);
+		return h.total;
+	}
+	get_active_storage(b, &recs, &blks, &crsrs);
+	return recs;
+}
+
+/*
+ * set *k to a key dividing the records of shard i, whose lock is held, so that those below it
+ * carry about below of its load. Returns 0 if there is none.
+ */
+static int split_key(bplus_shards_t s, unsigned i, enum bplus_shards_load by, double below, lkey_t *k)
+{
+	bplus_t b = s->shards[i].tree;
+	struct heat_sum h = { 0, below, 0, 0 };
+	unsigned long recs, blks, crsrs;
+	if (by == BPLUS_SHARDS_BY_HEAT) {
+		/* one range per leaf, so the key found is the first of a leaf */
+		bplus_heatmap_export(b, 0, add_heat, &h);
+		*k = h.key;
+		return h.found;
+	}
+	get_active_storage(b, &recs, &blks, &crsrs);
+	return recs != 0 && bplus_estimate_quantile(b, below / recs, k, NULL, NULL) == OK;
+}
+
+enum bplus_error bplus_shards_rebalance(bplus_shards_t s, enum bplus_shards_load by, double slack)
+{
+	enum bplus_error ok = NOTFOUND;
+	double *load, total = 0, most = 0, below = 0, move = 0;
+	unsigned n = s->n, hot = 0, to = 1, first;
+	bplus_t r;
+	lkey_t k;
+
+	if (n < 2)
+		return NOTFOUND;
+	load = malloc(n * sizeof(double));
+	if (load == NULL)
+		return NOMEM;
+	pthread_mutex_lock(&s->rebalancing);
+	for (unsigned i = 0; i < n; i++) {
+		pthread_rwlock_rdlock(&s->shards[i].lock);
+		load[i] = shard_load(s, i, by);
+		pthread_rwlock_unlock(&s->shards[i].lock);
+		total += load[i];
+		if (load[i] > most)
+			most = load[i];
+	}
+	if (most <= (1 + slack) * total / n)
+		goto done;
+	/*
+	 * with the load even, the load below the bound of shard i would be i times the average.
+	 * Move the bound furthest from there to there, or as far as half the load of the shard it
+	 * cuts into, so a hot spot is spread in about one move per shard it needs.
+	 */
+	for (unsigned i = 1; i < n; i++) {
+		double off;
+		below += load[i - 1];
+		off = below - i * total / n;
+		if ((off < 0 ? -off : off) > move) {
+			move = off < 0 ? -off : off;
+			hot = off > 0 ? i - 1 : i;
+			to = off > 0 ? i : i - 1;
+		}
+	}
+	if (move > load[hot] / 2)
+		move = load[hot] / 2;
+
+	/* the keys that move are those at the edge of hot next to to, so only its bound changes */
+	pthread_rwlock_rdlock(&s->shards[hot].lock);
+	if (!split_key(s, hot, by, to > hot ? load[hot] - move : move, &k))
+		k = s->lo[hot];
+	pthread_rwlock_unlock(&s->shards[hot].lock);
+	if (k <= s->lo[hot] || (hot + 1 < s->n && k >= s->lo[hot + 1]))
+		goto done;
+
+	/* the handoff: readers of both shards wait for a split and a concatenation */
+	first = hot < to ? hot : to;
+	pthread_rwlock_wrlock(&s->shards[first].lock);
+	pthread_rwlock_wrlock(&s->shards[first + 1].lock);
+	r = bplus_split(s->shards[hot].tree, k);
+	if (r == NULL)
+		ok = NOMEM;
+	else if (to > hot) {
+		/* r is the top of hot, and goes before the records of to */
+		ok = bplus_concat(r, s->shards[to].tree);
+		if (ok == OK) {
+			free_bplus_tree(s->shards[to].tree);
+			s->shards[to].tree = r;
+			__atomic_store_n(&s->lo[to], k, __ATOMIC_RELEASE);
+		}
+	} else {
+		/* hot keeps r, its top, and the rest goes after the records of to */
+		ok = bplus_concat(s->shards[to].tree, s->shards[hot].tree);
+		if (ok == OK) {
+			free_bplus_tree(s->shards[hot].tree);
+			s->shards[hot].tree = r;
+			__atomic_store_n(&s->lo[hot], k, __ATOMIC_RELEASE);
+		}
+	}
+	if (r != NULL && ok != OK) {
+		/* put the top back where it came from, which bplus_split() set aside the memory for */
+		if (bplus_concat(s->shards[hot].tree, r) == OK)
+			free_bplus_tree(r);
+	}
+	pthread_rwlock_unlock(&s->shards[first + 1].lock);
+	pthread_rwlock_unlock(&s->shards[first].lock);
+done:
+	pthread_mutex_unlock(&s->rebalancing);
+	free(load);
+	return ok;
+}
+
+void bplus_shards_stats(bplus_shards_t s, unsigned i, lkey_t *lo, unsigned long *num_records)
+{
+	unsigned long blks, crsrs;
+	pthread_rwlock_rdlock(&s->shards[i].lock);
+	*lo = s->lo[i];
+	get_active_storage(s->shards[i].tree, num_records, &blks, &crsrs);
+	pthread_rwlock_unlock(&s->shards[i].lock);
+}
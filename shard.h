@@ -0,0 +1,87 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Key-range sharding. A shard set divides the keys between several trees by lower bound, each
+ * tree with a reader/writer lock of its own, so threads working in different key ranges never
+ * wait for each other. bplus_shards_rebalance() moves a key range from a shard holding too many
+ * records, or taking too many accesses, to its neighbour by splitting its tree and joining the
+ * part split off onto the neighbour's. Readers only wait for the short handoff that does so.
+ */
+
+#ifndef _BPLUS_SHARD_H_
+#define _BPLUS_SHARD_H_
+
+#include "b+tree.h"
+
+typedef struct bplus_shards *bplus_shards_t;
+
+/*
+ * create n empty shards of trees with the given BPLUS_ flags. Shard 0 holds the keys below
+ * bounds[0], shard i those from bounds[i - 1] up to bounds[i], and the last all the keys
+ * above, so bounds has n - 1 keys in increasing order. Returns NULL if out of memory.
+ */
+bplus_shards_t bplus_shards_new(unsigned n, const lkey_t *bounds, unsigned flags);
+
+/* free the shards and their trees. No thread may be using them. */
+void bplus_shards_free(bplus_shards_t s);
+
+/*
+ * lock the shard holding k, shared with other readers unless write, and return its tree,
+ * setting *shard to pass to bplus_shards_unlock(). Any call may be made on the tree in
+ * between, with keys in the shard's range.
+ */
+bplus_t bplus_shards_lock(bplus_shards_t s, lkey_t k, int write, unsigned *shard);
+void bplus_shards_unlock(bplus_shards_t s, unsigned shard);
+
+/* find(), insert() and delete() on the shard holding k, under its lock */
+enum bplus_error bplus_shards_find(bplus_shards_t s, lkey_t k, value_t *v);
+enum bplus_error bplus_shards_insert(bplus_shards_t s, lkey_t k, value_t v);
+enum bplus_error bplus_shards_delete(bplus_shards_t s, lkey_t k);
+
+/*
+ * enable the heatmap of every shard's tree (see bplus_heatmap_enable()), for rebalancing by
+ * accesses. Returns OK, or NOMEM.
+ */
+enum bplus_error bplus_shards_heatmap_enable(bplus_shards_t s, unsigned sample_shift, unsigned slot_bits);
+
+/* what bplus_shards_rebalance() evens out between shards */
+enum bplus_shards_load {
+        BPLUS_SHARDS_BY_SIZE,   /* records held */
+        BPLUS_SHARDS_BY_HEAT,   /* accesses counted by the heatmaps since they were enabled */
+};
+
+/*
+ * if some shard has more than (1 + slack) times the average load, move the bound between two
+ * shards that is furthest from where it would divide the load evenly, taking keys from the
+ * edge of one shard and giving them to its neighbour. The split key is estimated from the
+ * index, or from the heatmap, under a shared lock; only the handoff, a split of one tree and a
+ * concatenation onto the other, takes both shards' locks exclusively. Called now and then,
+ * from a timer or a thread of its own, it spreads a hot spot over the shards in about a move
+ * per shard. Returns OK if keys were moved, NOTFOUND if the load is even enough or no key can
+ * be moved, or NOMEM with the shards as they were. The last needs the trees to have no change
+ * feed or secondary index, which would have records moved one at a time (see bplus_split()).
+ */
+enum bplus_error bplus_shards_rebalance(bplus_shards_t s, enum bplus_shards_load by, double slack);
+
+/* the lowest key of shard i, and the number of records in it */
+void bplus_shards_stats(bplus_shards_t s, unsigned i, lkey_t *lo, unsigned long *num_records);
+
+#endif
@@ -0,0 +1,1806 @@
+/*
+ * Simple implementation of B+ Tree in C.
+ * Copyright (c) 2020-2023 David P. Reed
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Model check of the tree, run by make check. Random operations are applied both to a tree
+ * and to a plain array of records indexed by key, and after every one the tree is walked from
+ * the root, checking the fill of each node, that its keys lie between the separators above
+ * it, that the leaves are linked in key order, that the expiry bounds, hashes, value bounds
+ * and tags of the index nodes agree with what is under them, and that the tree holds just the
+ * records of the array. It includes b+tree.c to see the nodes, and is built as it ships and
+ * with -DBPLUS_ORDER=8, where a few thousand records make trees deep enough to reach every
+ * kind of split, merge and rotation.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* how many more allocations the tree may make, or -1 for any, to check what NOMEM leaves */
+static long allocs_left = -1;
+
+static int alloc_fails(void)
+{
+	if (allocs_left < 0)
+		return 0;
+	if (allocs_left == 0)
+		return 1;
+	allocs_left -= 1;
+	return 0;
+}
+
+#define malloc(n) (alloc_fails() ? NULL : malloc(n))
+#define calloc(n, m) (alloc_fails() ? NULL : calloc(n, m))
+#define aligned_alloc(a, n) (alloc_fails() ? NULL : aligned_alloc(a, n))
+#define mmap(p, n, prot, f, fd, o) (alloc_fails() ? MAP_FAILED : mmap(p, n, prot, f, fd, o))
+#include "../b+tree.c"
+#undef malloc
+#undef calloc
+#undef aligned_alloc
+#undef mmap
+#include "mvcc.h"
+#include "shard.h"
+#include "replica.h"
+
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static unsigned long seed, rng;
+
+static void failed(const char *what, const char *file, int line)
+{
+	fprintf(stderr, "%s:%d: check failed: %s (seed %lu)\n", file, line, what, seed);
+	abort();
+}
+
+#define CHECK(c) do { if (!(c)) failed(#c, __FILE__, __LINE__); } while (0)
+
+/* random number in [0, n) */
+static unsigned long rnd(unsigned long n)
+{
+	return n == 0 ? 0 : next_random(&rng) % n;
+}
+
+/* the records a tree should hold, by key */
+struct model {
+	unsigned long keys;	/* keys are drawn from [0, keys) */
+	unsigned long count;
+	unsigned char *in;
+	value_t *val;
+	unsigned long *expiry;
+	unsigned long *removed;	/* times each key was removed, to tell cursors their record went */
+};
+
+static void model_init(struct model *m, unsigned long keys)
+{
+	m->keys = keys;
+	m->count = 0;
+	m->in = calloc(keys, 1);
+	m->val = calloc(keys, sizeof(value_t));
+	m->expiry = calloc(keys, sizeof(unsigned long));
+	m->removed = calloc(keys, sizeof(unsigned long));
+	if (m->in == NULL || m->val == NULL || m->expiry == NULL || m->removed == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void model_free(struct model *m)
+{
+	free(m->in);
+	free(m->val);
+	free(m->expiry);
+	free(m->removed);
+}
+
+static void model_put(struct model *m, lkey_t k, value_t v, unsigned long e)
+{
+	m->count += !m->in[k];
+	m->in[k] = 1;
+	m->val[k] = v;
+	m->expiry[k] = e;
+}
+
+static void model_remove(struct model *m, lkey_t k)
+{
+	m->count -= m->in[k];
+	m->removed[k] += m->in[k];
+	m->in[k] = 0;
+}
+
+/* the record of k is there for lookups in b */
+static int model_live(bplus_t b, const struct model *m, lkey_t k)
+{
+	return m->in[k] && (b->ttl_page == 0 || m->expiry[k] > b->now);
+}
+
+/* what a walk found under a node, with the nodes split off it still pending */
+struct under {
+	unsigned long recs;
+	unsigned long blks;
+	unsigned long expiry;	/* earliest expiry of a record */
+	unsigned long hash;	/* sum of the hashes of the records */
+	value_t vmin, vmax;	/* bounds on the values in the leaves, without tags */
+};
+
+struct walk {
+	bplus_t b;
+	const struct model *m;
+	blkp prev;		/* last leaf reached, which must link to the next */
+	unsigned pending;	/* pending splits reached */
+};
+
+static void check_run(struct walk *w, blkp node, unsigned d, lkey_t lo, lkey_t hi, int has_hi,
+		      value_t delta, struct under *u);
+
+/*
+ * check node at depth d, whose keys must be in lo..hi (hi excluded, if has_hi), and whose
+ * records have delta added by the tags above them
+ */
+static void check_node(struct walk *w, blkp node, unsigned d, lkey_t lo, lkey_t hi, int has_hi,
+		       value_t delta, struct under *u)
+{
+	bplus_t b = w->b;
+	unsigned nk = num_keys(node);
+	unsigned long hash = 0;
+
+	CHECK(nk <= ORDER - 1);
+	for (unsigned i = 0; i < nk; i++) {
+		CHECK(get_key(node, i) >= lo && (!has_hi || get_key(node, i) < hi));
+		CHECK(i == 0 || get_key(node, i - 1) < get_key(node, i));
+	}
+	u->blks += 1;
+	if (d == b->depth) {
+		/* a leaf is only left with LHALF - 1 records by a merge short of one */
+		CHECK(d == 0 || nk >= LHALF - 1);
+		CHECK(w->prev == NULL ? b->leaves == node : next_leaf(w->prev) == node);
+		w->prev = node;
+		for (unsigned i = 0; i < nk; i++) {
+			lkey_t k = get_key(node, i);
+			value_t v = get_value(node, i);
+			CHECK(k < w->m->keys && w->m->in[k]);
+			if (model_live(b, w->m, k))
+				CHECK(v + delta == w->m->val[k]);
+			if (b->ttl_page != 0) {
+				CHECK(get_expiry(b, node, i) == w->m->expiry[k]);
+				if (get_expiry(b, node, i) < u->expiry)
+					u->expiry = get_expiry(b, node, i);
+			}
+			if (b->zone_page != 0)
+				CHECK(v >= get_zone_min(b, node) && v <= get_zone_max(b, node));
+			if (v < u->vmin)
+				u->vmin = v;
+			if (v > u->vmax)
+				u->vmax = v;
+			hash += record_hash(k, v);
+		}
+		u->recs += nk;
+	} else {
+		CHECK(d == 0 ? nk >= 1 : nk >= LHALF - 1);
+		for (unsigned i = 0; i <= nk; i++) {
+			struct under c = { 0, 0, NEVER, 0, NEVER, 0 };
+			value_t tag = b->tag_page != 0 ? get_tag(b, node, i) : 0;
+			CHECK(tag == 0 || has_tags(b, node));
+			check_run(w, get_child(node, i), d + 1, i == 0 ? lo : get_key(node, i - 1),
+				  i < nk ? get_key(node, i) : hi, i < nk || has_hi, delta + tag, &c);
+			if (b->ttl_page != 0)
+				CHECK(get_expiry(b, node, i) <= c.expiry);
+			if (b->zone_page != 0 && c.recs != 0)
+				CHECK(get_zone_min(b, node) <= c.vmin && get_zone_max(b, node) >= c.vmax);
+			u->recs += c.recs;
+			u->blks += c.blks;
+			if (c.expiry < u->expiry)
+				u->expiry = c.expiry;
+			if (c.vmin < u->vmin)
+				u->vmin = c.vmin;
+			if (c.vmax > u->vmax)
+				u->vmax = c.vmax;
+			hash += c.hash;
+		}
+	}
+	if (b->hash_page != 0)
+		CHECK(get_hash(b, node) == hash);
+	u->hash += hash;
+}
+
+/* check node and the nodes split off it still waiting to be posted, which share its keys */
+static void check_run(struct walk *w, blkp node, unsigned d, lkey_t lo, lkey_t hi, int has_hi,
+		      value_t delta, struct under *u)
+{
+	bplus_t b = w->b;
+	for (;;) {
+		struct pending_split *p = NULL;
+		for (unsigned i = 0; i < b->npending; i++)
+			if (b->pending[i].left == node)
+				p = &b->pending[i];
+		if (p == NULL)
+			break;
+		CHECK(p->depth + 1 == d);
+		CHECK(p->key > lo && (!has_hi || p->key < hi));
+		check_node(w, node, d, lo, p->key, 1, delta, u);
+		w->pending += 1;
+		node = p->right;
+		lo = p->key;
+	}
+	check_node(w, node, d, lo, hi, has_hi, delta, u);
+}
+
+/* check the structure of b, and that it holds the records of m with keys in lo..hi - 1 */
+static void check_part(bplus_t b, const struct model *m, lkey_t lo, lkey_t hi)
+{
+	struct walk w = { b, m, NULL, 0 };
+	struct under u = { 0, 0, NEVER, 0, NEVER, 0 };
+	unsigned long recs, blks, crsrs, count = m->count;
+
+	if (lo != 0 || hi != m->keys) {
+		count = 0;
+		for (lkey_t k = lo; k < hi; k++)
+			count += m->in[k];
+	}
+	check_node(&w, b->root, 0, lo, hi, 1, 0, &u);
+	CHECK(next_leaf(w.prev) == NULL);
+	CHECK(w.pending == b->npending);
+	get_active_storage(b, &recs, &blks, &crsrs);
+	CHECK(u.recs == recs && recs == count);
+	CHECK(u.blks == blks);
+	/* lookups take the path the walk did not, through pending splits and tags */
+	for (int i = 0; i < 8 && lo < hi; i++) {
+		lkey_t k = lo + rnd(hi - lo);
+		value_t v;
+		enum bplus_error ok = find(b, k, &v);
+		CHECK(ok == (model_live(b, m, k) ? OK : NOTFOUND));
+		CHECK(ok != OK || v == m->val[k]);
+	}
+}
+
+/*
+ * the estimates of the records in a range, mostly a few leaves, and of a quantile key must
+ * have bounds around the exact answer, and lie between them. Both count expired records.
+ */
+static void check_estimates(bplus_t b, const struct model *m)
+{
+	lkey_t lo = rnd(8) == 0 ? 0 : rnd(m->keys), hi = rnd(8) == 0 ? ~0UL : lo + rnd(8 * ORDER);
+	unsigned long exact = 0, est, min, max, rank;
+	lkey_t k, kmin, kmax;
+	double q = rnd(1001) / 1000.0;
+
+	for (lkey_t j = lo; j <= hi && j < m->keys; j++)
+		exact += m->in[j];
+	est = bplus_estimate_count(b, lo, hi, &min, &max);
+	CHECK(min <= exact && exact <= max && min <= est && est <= max);
+	if (m->count == 0) {
+		CHECK(bplus_estimate_quantile(b, q, &k, &kmin, &kmax) == NOTFOUND);
+		return;
+	}
+	/* finding the exact key takes a walk over the model, so only now and then */
+	if (rnd(8) != 0)
+		return;
+	CHECK(bplus_estimate_quantile(b, q, &k, &kmin, &kmax) == OK);
+	/* the key of rank q * (count - 1) in key order, counting from 0 */
+	rank = q * (m->count - 1);
+	for (k = 0; !m->in[k] || rank != 0; k++)
+		rank -= m->in[k];
+	CHECK(kmin <= k && k <= kmax);
+	CHECK(bplus_estimate_quantile(b, q, &k, &kmin, &kmax) == OK && kmin <= k && k <= kmax);
+}
+
+/* most records drawn by one sample */
+#define SAMPLES 64
+
+/*
+ * draw a sample of the records in a range, mostly a few leaves, or of the whole tree. Each
+ * must be a live record in the range, and all that were asked for are drawn if there are any.
+ */
+static void check_samples(bplus_t b, const struct model *m)
+{
+	lkey_t lo = rnd(m->keys), hi = rnd(2) ? lo + rnd(8 * ORDER) : lo - 1, keys[SAMPLES], k;
+	value_t vals[SAMPLES], *v = rnd(8) == 0 ? NULL : vals;
+	unsigned long n = rnd(SAMPLES + 1), state = next_random(&rng) | 1, drawn;
+	int whole = rnd(8) == 0;
+
+	if (whole) {
+		lo = 0;
+		hi = ~0UL;
+	}
+	for (k = lo; k <= hi && k < m->keys && !model_live(b, m, k); k++)
+		;
+	if (whole)
+		drawn = bplus_sample(b, n, &state, keys, v);
+	else
+		drawn = bplus_sample_range(b, lo, hi, n, &state, keys, v);
+	CHECK(drawn == (k <= hi && k < m->keys ? n : 0));
+	for (unsigned long i = 0; i < drawn; i++) {
+		k = keys[i];
+		CHECK(k >= lo && k <= hi && k < m->keys && model_live(b, m, k));
+		CHECK(v == NULL || vals[i] == m->val[k]);
+	}
+}
+
+/* check the structure of b, and that it holds the records of m */
+static void check_tree(bplus_t b, const struct model *m)
+{
+	check_part(b, m, 0, m->keys);
+	check_estimates(b, m);
+	check_samples(b, m);
+}
+
+/*
+ * split b at k, check the two trees hold the records either side of k, then concatenate them
+ * again, which the other way round they refuse to do while both have records
+ */
+static void check_split(bplus_t b, const struct model *m, lkey_t k)
+{
+	bplus_t r = bplus_split(b, k);
+	CHECK(r != NULL);
+	check_part(b, m, 0, k < m->keys ? k : m->keys);
+	check_part(r, m, k < m->keys ? k : m->keys, m->keys);
+	if (b->num_recs != 0 && r->num_recs != 0)
+		CHECK(bplus_concat(r, b) == NOTFOUND);
+	/* the split set aside all that putting the tree back together takes */
+	if (b->cdc == NULL && b->index == NULL)
+		allocs_left = 0;
+	CHECK(bplus_concat(b, r) == OK);
+	allocs_left = -1;
+	CHECK(r->num_recs == 0 && r->root == r->leaves && r->cursor_list == NULL);
+	free_bplus_tree(r);
+	check_tree(b, m);
+}
+
+/* cursors left on records across operations, which must stay on them while they are there */
+#define NCURSORS 8
+
+struct cursors {
+	bplus_cursor_t c[NCURSORS];
+	lkey_t k[NCURSORS];
+	unsigned long removed[NCURSORS];	/* removals of the key when the cursor was put on it */
+};
+
+static void cursors_check(bplus_t b, struct model *m, struct cursors *cs)
+{
+	for (int i = 0; i < NCURSORS; i++) {
+		lkey_t k;
+		value_t v;
+		if (cs->c[i] != NULL && m->in[cs->k[i]] && m->removed[cs->k[i]] == cs->removed[i]) {
+			CHECK(get_tree(cs->c[i]) == b);
+			if (model_live(b, m, cs->k[i])) {
+				CHECK(get_record(cs->c[i], &k, &v) == OK);
+				CHECK(k == cs->k[i] && v == m->val[k]);
+			}
+			continue;
+		}
+		/* the record went, so start again on another */
+		if (cs->c[i] != NULL)
+			free_cursor(cs->c[i]);
+		cs->c[i] = find_record(b, rnd(m->keys));
+		CHECK(cs->c[i] != NULL);
+		if (get_record(cs->c[i], &k, &v) == OK) {
+			cs->k[i] = k;
+			cs->removed[i] = m->removed[k];
+		} else {
+			free_cursor(cs->c[i]);
+			cs->c[i] = NULL;
+		}
+	}
+}
+
+static void cursors_free(struct cursors *cs)
+{
+	for (int i = 0; i < NCURSORS; i++)
+		if (cs->c[i] != NULL)
+			free_cursor(cs->c[i]);
+}
+
+/* lowest key in m, or m->keys if there is none */
+static lkey_t model_first(const struct model *m)
+{
+	lkey_t k = 0;
+	while (k < m->keys && !m->in[k])
+		k++;
+	return k;
+}
+
+static void op_insert(bplus_t b, struct model *m, lkey_t k)
+{
+	value_t v = next_random(&rng);
+	if (b->ttl_page != 0 && rnd(2)) {
+		unsigned long e = b->now + 1 + rnd(2000);
+		CHECK(bplus_insert_ttl(b, k, v, e) == OK);
+		model_put(m, k, v, e);
+	} else {
+		CHECK(insert(b, k, v) == OK);
+		model_put(m, k, v, NEVER);
+	}
+}
+
+static void op_delete(bplus_t b, struct model *m, lkey_t k)
+{
+	CHECK(delete(b, k) == (m->in[k] ? OK : NOTFOUND));
+	model_remove(m, k);
+}
+
+/* what bplus_retain_if() is seen to call its predicate on */
+struct retain {
+	bplus_t b;
+	const struct model *m;
+	unsigned long salt;	/* which keys are kept */
+	unsigned long calls;
+	lkey_t last;
+};
+
+static int retain_keeps(const struct retain *r, lkey_t k)
+{
+	return ((k ^ r->salt) * 0x9E3779B97F4A7C15UL) >> 62 != 0;
+}
+
+/* keep three records in four, checking each is live, seen once and in key order */
+static int retain_pred(lkey_t k, value_t v, void *ctx)
+{
+	struct retain *r = ctx;
+	CHECK(k < r->m->keys && model_live(r->b, r->m, k) && v == r->m->val[k]);
+	CHECK(r->calls == 0 || k > r->last);
+	r->calls += 1;
+	r->last = k;
+	return retain_keeps(r, k);
+}
+
+static void op_retain(bplus_t b, struct model *m, lkey_t lo, lkey_t hi)
+{
+	struct retain r = { b, m, next_random(&rng), 0, 0 };
+	unsigned long live = 0;
+	CHECK(bplus_retain_if(b, lo, hi, retain_pred, &r) == OK);
+	for (lkey_t k = lo; k <= hi && k < m->keys; k++) {
+		if (!model_live(b, m, k))
+			continue;
+		live += 1;
+		if (!retain_keeps(&r, k))
+			model_remove(m, k);
+	}
+	CHECK(r.calls == live);
+}
+
+/* what bplus_update_range_fn() is seen to call its function on */
+struct update_calls {
+	bplus_t b;
+	const struct model *m;
+	unsigned long calls;
+};
+
+static value_t update_fn(lkey_t k, value_t v, void *ctx)
+{
+	struct update_calls *u = ctx;
+	CHECK(k < u->m->keys && model_live(u->b, u->m, k) && v == u->m->val[k]);
+	u->calls += 1;
+	return v * 3 + k;
+}
+
+/* update lo..hi with a random operation, with a function, or in parallel */
+static void op_update(bplus_t b, struct model *m, lkey_t lo, lkey_t hi)
+{
+	enum bplus_update_op op = rnd(BPLUS_UPDATE_FMUL + 1);
+	value_t arg = next_random(&rng);
+	struct update_calls u = { b, m, 0 };
+	unsigned long live = 0;
+	int fn = rnd(4) == 0;
+
+	if (op == BPLUS_UPDATE_FADD || op == BPLUS_UPDATE_FMUL) {
+		/* a double near 1, so values stay numbers */
+		double x = 1 + rnd(1000) / 1e6;
+		memcpy(&arg, &x, sizeof(x));
+	}
+	if (fn)
+		CHECK(bplus_update_range_fn(b, lo, hi, update_fn, &u) == OK);
+	else if (rnd(2))
+		CHECK(bplus_update_range_parallel(b, lo, hi, op, arg, 1 + rnd(4)) == OK);
+	else
+		CHECK(bplus_update_range(b, lo, hi, op, arg) == OK);
+	for (lkey_t k = lo; k <= hi && k < m->keys; k++) {
+		if (!model_live(b, m, k))
+			continue;
+		live += 1;
+		m->val[k] = fn ? m->val[k] * 3 + k : update_value(op, m->val[k], arg);
+	}
+	CHECK(!fn || u.calls == live);
+}
+
+/* a batch of writes around lo, or all over, mostly puts if grow and deletes if not */
+static void op_batch(bplus_t b, struct model *m, lkey_t lo, int grow)
+{
+	unsigned long n = 1 + rnd(8 * ORDER), span = rnd(4) == 0 ? m->keys : 16 * ORDER;
+	struct bplus_write *w = malloc(n * sizeof(*w));
+	CHECK(w != NULL);
+	for (unsigned long i = 0; i < n; i++) {
+		w[i].key = (lo + rnd(span)) % m->keys;
+		w[i].value = next_random(&rng);
+		w[i].del = grow ? rnd(4) == 0 : rnd(4) != 0;
+	}
+	CHECK(bplus_write_batch(b, w, n) == OK);
+	/* as one write after another, later ones of a key overriding earlier ones */
+	for (unsigned long i = 0; i < n; i++) {
+		if (w[i].del)
+			model_remove(m, w[i].key);
+		else
+			model_put(m, w[i].key, w[i].value, NEVER);
+	}
+	free(w);
+}
+
+/*
+ * one random operation on b. Trees grow while they hold fewer than half the keys, and shrink
+ * when they hold more, so they go up and down through the depths their size allows.
+ */
+static void random_op(bplus_t b, struct model *m)
+{
+	int grow = m->count < m->keys / 2 ? rnd(4) != 0 : rnd(4) == 0;
+	lkey_t lo = rnd(m->keys), hi = lo + rnd(4 * ORDER);
+	value_t delta;
+
+	switch (rnd(12)) {
+	case 0:
+		op_insert(b, m, rnd(m->keys));
+		break;
+	case 1:
+		op_delete(b, m, rnd(m->keys));
+		break;
+	case 2:
+	case 3:
+		/* a run of writes around one place, filling or emptying some leaves */
+		for (unsigned long n = rnd(4 * ORDER); n != 0; n--) {
+			lkey_t k = (lo + rnd(8 * ORDER)) % m->keys;
+			if (grow)
+				op_insert(b, m, k);
+			else
+				op_delete(b, m, k);
+		}
+		break;
+	case 4:
+		if (grow)
+			break;
+		while (delete_range_step(b, lo, hi, 1 + rnd(ORDER)) == INCOMPLETE)
+			;
+		for (lkey_t k = lo; k <= hi && k < m->keys; k++)
+			model_remove(m, k);
+		break;
+	case 5:
+		if (grow)
+			break;
+		/* mostly just past the lowest key, as a sliding window drops its oldest records */
+		lo = rnd(8) == 0 ? lo : model_first(m) + rnd(4 * ORDER);
+		CHECK(bplus_truncate_before(b, lo) == OK);
+		for (lkey_t k = 0; k < lo && k < m->keys; k++)
+			model_remove(m, k);
+		break;
+	case 6:
+		if (b->ttl_page == 0)
+			break;
+		/* move the clock on, and sweep what has expired or leave it for reads to pass over */
+		if (rnd(2)) {
+			bplus_set_time(b, b->now + rnd(20));
+			break;
+		}
+		CHECK(bplus_expire_step(b, b->now + rnd(20), ~0UL) == OK);
+		for (lkey_t k = 0; k < m->keys; k++)
+			if (m->in[k] && m->expiry[k] <= b->now)
+				model_remove(m, k);
+		break;
+	case 7:
+		if (b->npending != 0 && rnd(2))
+			CHECK(bplus_maintain(b, rnd(4)) != NOMEM);
+		else if (rnd(4) == 0)
+			/* near the middle, or near either end, where the edges are short afterwards */
+			check_split(b, m, rnd(2) ? lo : rnd(2) ? model_first(m) + rnd(2 * ORDER) :
+				    m->keys - rnd(2 * ORDER));
+		break;
+	case 8:
+		if (grow)
+			break;
+		/* over a few leaves, or a good part of the tree */
+		op_retain(b, m, lo, rnd(2) ? hi : lo + rnd(m->keys / 2));
+		break;
+	case 9:
+		op_update(b, m, lo, rnd(2) ? hi : lo + rnd(m->keys / 2));
+		break;
+	case 10:
+		/* with BPLUS_RANGE_ADD, tags on whole subtrees, up to the root's children */
+		delta = next_random(&rng);
+		if (rnd(4) == 0) {
+			lo = rnd(2) ? 0 : lo;
+			hi = m->keys;
+		} else if (rnd(2))
+			hi = lo + rnd(m->keys / 2);
+		CHECK(bplus_range_add(b, lo, hi, delta) == OK);
+		for (lkey_t k = lo; k <= hi && k < m->keys; k++)
+			if (model_live(b, m, k))
+				m->val[k] += delta;
+		break;
+	case 11:
+		op_batch(b, m, lo, grow);
+		break;
+	}
+}
+
+/* what bplus_index_scan() is seen to call its function on */
+struct index_scan {
+	const struct model *m;
+	value_t lo, hi;
+	value_t v;		/* the last pair seen */
+	lkey_t k;
+	unsigned long calls, stop;
+};
+
+static int index_scanned(value_t v, lkey_t k, void *ctx)
+{
+	struct index_scan *s = ctx;
+	CHECK(k < s->m->keys && s->m->in[k] && s->m->val[k] == v && v >= s->lo && v <= s->hi);
+	CHECK(s->calls == 0 || v > s->v || (v == s->v && k > s->k));
+	s->v = v;
+	s->k = k;
+	return ++s->calls == s->stop;
+}
+
+/*
+ * the index holds a pair for each record of m, expired or not, as only sweeps take those
+ * out. Look up the values of a few records, and scan between the values of two.
+ */
+static void check_index(bplus_index_t ix, const struct model *m)
+{
+	struct index_scan s = { m, 0, 0, 0, 0, 0, rnd(2) ? ~0UL : 1 + rnd(16) };
+	unsigned long values, entries, want = 0;
+	lkey_t a = rnd(m->keys), b = rnd(m->keys);
+	enum bplus_error ok;
+
+	bplus_index_stats(ix, &values, &entries);
+	CHECK(entries == m->count && values <= entries);
+	for (int i = 0; i < 4; i++) {
+		lkey_t k = rnd(m->keys), keys[8];
+		unsigned long n;
+		value_t v = m->in[k] ? m->val[k] : next_random(&rng);
+		n = bplus_index_find(ix, v, keys, 8);
+		for (lkey_t j = 0; j < m->keys; j++) {
+			if (m->in[j] && m->val[j] == v) {
+				CHECK(want >= 8 || keys[want] == j);
+				want += 1;
+			}
+		}
+		CHECK(n == want);
+		want = 0;
+	}
+	s.lo = m->in[a] ? m->val[a] : next_random(&rng);
+	s.hi = m->in[b] ? m->val[b] : next_random(&rng);
+	if (s.lo > s.hi) {
+		value_t t = s.lo;
+		s.lo = s.hi;
+		s.hi = t;
+	}
+	ok = bplus_index_scan(ix, s.lo, s.hi, index_scanned, &s);
+	for (lkey_t j = 0; j < m->keys; j++)
+		want += m->in[j] && m->val[j] >= s.lo && m->val[j] <= s.hi;
+	if (want < s.stop)
+		CHECK(ok == OK && s.calls == want);
+	else
+		CHECK(ok == INCOMPLETE && s.calls == s.stop);
+}
+
+/* what bplus_scan_where() is seen to call its function on */
+struct where_calls {
+	bplus_t b;
+	const struct model *m;
+	lkey_t next, hi;	/* keys below next have been reported */
+	value_t vmin, vmax;
+	unsigned long calls, stop;
+};
+
+/* the next key from c->next on that the scan should report, or past hi or the keys if none */
+static lkey_t where_next(const struct where_calls *c)
+{
+	lkey_t k = c->next;
+	while (k <= c->hi && k < c->m->keys &&
+	       !(model_live(c->b, c->m, k) && c->m->val[k] >= c->vmin && c->m->val[k] <= c->vmax))
+		k++;
+	return k;
+}
+
+static int where_called(lkey_t k, value_t v, void *ctx)
+{
+	struct where_calls *c = ctx;
+	CHECK(k == where_next(c) && k <= c->hi && v == c->m->val[k]);
+	c->next = k + 1;
+	return ++c->calls == c->stop;
+}
+
+/*
+ * scan a range of keys, mostly a few leaves, for values between those of two records, or in
+ * a window around the value of one. The windows run from one value to all of them, so with
+ * BPLUS_ZONEMAP some skip most blocks and some none, and a few are empty.
+ */
+static void check_scan_where(bplus_t b, const struct model *m)
+{
+	lkey_t a = rnd(m->keys), z = rnd(m->keys), lo = rnd(m->keys), hi = rnd(16) == 0 ? ~0UL : lo + rnd(8 * ORDER);
+	value_t v = m->in[a] ? m->val[a] : next_random(&rng), span = ~0UL >> rnd(64);
+	struct where_calls c = { b, m, lo, hi, v - (v < span / 2 ? v : span / 2), 0, 0, rnd(4) ? ~0UL : 1 + rnd(16) };
+	enum bplus_error ok;
+
+	c.vmax = ~0UL - c.vmin < span ? ~0UL : c.vmin + span;
+	if (rnd(2)) {
+		c.vmin = v;
+		c.vmax = m->in[z] ? m->val[z] : next_random(&rng);
+		if (c.vmin > c.vmax) {
+			c.vmin = c.vmax;
+			c.vmax = v;
+		}
+	}
+	if (rnd(16) == 0) {
+		value_t t = c.vmin;
+		c.vmin = c.vmax;
+		c.vmax = t;
+	}
+	ok = bplus_scan_where(b, lo, hi, c.vmin, c.vmax, where_called, &c);
+	if (c.calls == c.stop)
+		CHECK(ok == INCOMPLETE);
+	else
+		CHECK(ok == OK && (lo > hi || c.vmin > c.vmax || where_next(&c) > hi || where_next(&c) == m->keys));
+}
+
+/*
+ * run ops random operations on a tree with the given flags, and a secondary index if indexed,
+ * checking it after each
+ */
+static void check_random(unsigned flags, int indexed, unsigned long keys, unsigned long ops)
+{
+	bplus_t b = new_bplus_tree_opts(flags);
+	bplus_index_t ix = NULL;
+	struct cursors cs = { { NULL }, { 0 }, { 0 } };
+	struct model m;
+	unsigned most = 0;
+
+	CHECK(b != NULL);
+	model_init(&m, keys);
+	/* start from a tree holding about as many records as it will go up and down around */
+	while (m.count < keys / 2)
+		op_insert(b, &m, rnd(keys));
+	check_tree(b, &m);
+	/* an index of the records there, kept up to date from then on */
+	if (indexed) {
+		ix = bplus_index_new(b);
+		CHECK(ix != NULL);
+		check_index(ix, &m);
+	}
+	for (unsigned long i = 0; i < ops; i++) {
+		random_op(b, &m);
+		check_tree(b, &m);
+		check_scan_where(b, &m);
+		if (ix != NULL)
+			check_index(ix, &m);
+		cursors_check(b, &m, &cs);
+		if (b->depth > most)
+			most = b->depth;
+	}
+	cursors_free(&cs);
+	if (ix != NULL)
+		bplus_index_free(ix);
+	free_bplus_tree(b);
+	model_free(&m);
+	printf("flags %2x%s: %lu operations, depth up to %u\n", flags, indexed ? " with an index" : "", ops, most);
+}
+
+/* fill b with keys 0, 1, 2 ... until it is depth deep, and a quarter as many again */
+static void fill_sequential(bplus_t b, struct model *m, unsigned depth)
+{
+	lkey_t k = 0;
+	while (b->depth < depth) {
+		CHECK(k < m->keys);
+		CHECK(insert(b, k, k) == OK);
+		model_put(m, k, k, NEVER);
+		k++;
+	}
+	for (lkey_t n = k + k / 4; k < n && k < m->keys; k++) {
+		CHECK(insert(b, k, k) == OK);
+		model_put(m, k, k, NEVER);
+	}
+}
+
+/*
+ * room for the keys of a sequentially filled tree of the given depth. Its root takes ORDER
+ * children before it splits, and the nodes below are left half full by their splits.
+ */
+static unsigned long sequential_keys(unsigned depth)
+{
+	unsigned long n = ORDER;
+	for (unsigned d = 1; d < depth; d++)
+		n *= d == 1 ? LHALF : LHALF + 1;
+	return 2 * n;
+}
+
+/*
+ * cut points at the left edge of a sequentially filled tree: its first key, the ends of its
+ * first leaf and first index nodes, its middle and its last keys. Along that edge the nodes
+ * are as small as they may be, so truncating there leaves nodes that are short by one.
+ */
+static unsigned long edge_cuts(unsigned long n, lkey_t *cut)
+{
+	unsigned long c = 0;
+	cut[c++] = 1;
+	for (unsigned long w = LHALF; w < n / 2; w *= LHALF) {
+		cut[c++] = w - 1;
+		cut[c++] = w;
+		cut[c++] = w + 1;
+	}
+	cut[c++] = n / 2;
+	cut[c++] = n - 1;
+	cut[c++] = n;
+	return c;
+}
+
+static void check_truncate_edges(unsigned depth)
+{
+	struct model m;
+	lkey_t cut[64];
+	unsigned long n, ncuts;
+	bplus_t b;
+
+	/* each cut on a tree of its own, while the trees are small enough to build for each */
+	model_init(&m, sequential_keys(depth));
+	b = new_bplus_tree();
+	fill_sequential(b, &m, depth);
+	n = m.count;
+	free_bplus_tree(b);
+	ncuts = edge_cuts(n, cut);
+	for (unsigned long i = 0; i < ncuts && n < 1000000; i++) {
+		memset(m.in, 0, m.keys);
+		m.count = 0;
+		b = new_bplus_tree();
+		fill_sequential(b, &m, depth);
+		CHECK(bplus_truncate_before(b, cut[i]) == OK);
+		for (lkey_t k = 0; k < cut[i]; k++)
+			model_remove(&m, k);
+		check_tree(b, &m);
+		free_bplus_tree(b);
+	}
+	/* and one after another on the same tree */
+	memset(m.in, 0, m.keys);
+	m.count = 0;
+	b = new_bplus_tree();
+	fill_sequential(b, &m, depth);
+	for (unsigned long i = 0; i < ncuts; i++) {
+		CHECK(bplus_truncate_before(b, cut[i]) == OK);
+		for (lkey_t k = 0; k < cut[i]; k++)
+			model_remove(&m, k);
+		check_tree(b, &m);
+	}
+	free_bplus_tree(b);
+	model_free(&m);
+	printf("truncate at the edges of a tree of depth %u, %lu records: ok\n", depth, n);
+}
+
+/* first key under node, d levels above the leaves */
+static lkey_t subtree_first(blkp node, unsigned d)
+{
+	for (; d != 0; d--)
+		node = get_child(node, 0);
+	return get_key(node, 0);
+}
+
+/*
+ * cut points at the right edge of b: its last key, and the keys either side of the first key
+ * under the last node at each depth
+ */
+static unsigned long right_edge_cuts(bplus_t b, lkey_t *cut)
+{
+	unsigned long c = 0;
+	blkp node = b->root;
+	for (unsigned d = 0; d < b->depth; d++) {
+		lkey_t k;
+		node = get_child(node, num_keys(node));
+		k = subtree_first(node, b->depth - d - 1);
+		cut[c++] = k - 1;
+		cut[c++] = k;
+		cut[c++] = k + 1;
+	}
+	cut[c++] = get_key(node, num_keys(node) - 1);
+	return c;
+}
+
+/*
+ * split a sequentially filled tree at the cut points of both its edges and put it back
+ * together each time, checking the halves and the whole
+ */
+static void check_split_edges(unsigned depth)
+{
+	struct model m;
+	lkey_t cut[128];
+	unsigned long n, ncuts;
+	bplus_t b;
+
+	model_init(&m, sequential_keys(depth));
+	b = new_bplus_tree();
+	fill_sequential(b, &m, depth);
+	n = m.count;
+	ncuts = edge_cuts(n, cut);
+	ncuts += right_edge_cuts(b, cut + ncuts);
+	cut[ncuts++] = 0;
+	for (unsigned long i = 0; i < ncuts; i++)
+		check_split(b, &m, cut[i]);
+	free_bplus_tree(b);
+	model_free(&m);
+	printf("split and concatenate at the edges of a tree of depth %u, %lu records: ok\n", depth, n);
+}
+
+/*
+ * concatenate trees of different flags, and split and concatenate again a tree with a change
+ * feed, all of which copy the records over one at a time, with more and more allocations
+ * allowed until each succeeds. Each time one runs out, the copies it made must be taken back
+ * out, leaving both trees as they were.
+ */
+static void check_copy_nomem(unsigned depth)
+{
+	struct model m;
+	bplus_t a = new_bplus_tree_opts(BPLUS_DEFERRED_SPLITS), b = new_bplus_tree(), r = NULL;
+	bplus_cdc_t f = bplus_cdc_new(4);
+	unsigned long n, tries = 0;
+	enum bplus_error ok;
+	lkey_t h;
+
+	CHECK(a != NULL && b != NULL && f != NULL);
+	model_init(&m, sequential_keys(depth));
+	fill_sequential(b, &m, depth);
+	n = m.count;
+	h = n / 2;
+	/* a has splits deferred, which the copies must not leave pending */
+	for (long left = 0;; left += 1 + left / 4, tries++) {
+		allocs_left = left;
+		ok = bplus_concat(a, b);
+		allocs_left = -1;
+		if (ok != NOMEM)
+			break;
+		check_part(a, &m, 0, 0);
+		check_tree(b, &m);
+	}
+	CHECK(ok == OK);
+	check_tree(a, &m);
+	CHECK(b->num_recs == 0);
+
+	CHECK(bplus_cdc_attach(a, f) == OK);
+	for (long left = 0; r == NULL; left += 1 + left / 4, tries++) {
+		allocs_left = left;
+		r = bplus_split(a, h);
+		allocs_left = -1;
+		if (r == NULL)
+			check_tree(a, &m);
+	}
+	check_part(a, &m, 0, h);
+	check_part(r, &m, h, m.keys);
+	for (long left = 0;; left += 1 + left / 4, tries++) {
+		allocs_left = left;
+		ok = bplus_concat(a, r);
+		allocs_left = -1;
+		if (ok != NOMEM)
+			break;
+		check_part(a, &m, 0, h);
+		check_part(r, &m, h, m.keys);
+	}
+	CHECK(ok == OK);
+	check_tree(a, &m);
+	CHECK(bplus_cdc_attach(a, NULL) == OK);
+	bplus_cdc_free(f);
+	free_bplus_tree(r);
+	free_bplus_tree(b);
+	free_bplus_tree(a);
+	model_free(&m);
+	printf("copy between trees of depth %u, %lu records, out of memory %lu times: ok\n", depth, n, tries);
+}
+
+/* each of the four shards of s holds the records of m in its range */
+static void check_shards_hold(bplus_shards_t s, const struct model *m)
+{
+	lkey_t lo[5];
+	unsigned long recs;
+	for (unsigned i = 0; i < 4; i++)
+		bplus_shards_stats(s, i, &lo[i], &recs);
+	lo[4] = m->keys;
+	for (unsigned i = 0; i < 4; i++) {
+		unsigned shard;
+		bplus_t b = bplus_shards_lock(s, lo[i], 0, &shard);
+		CHECK(shard == i);
+		check_part(b, m, lo[i] < m->keys ? lo[i] : m->keys, lo[i + 1] < m->keys ? lo[i + 1] : m->keys);
+		bplus_shards_unlock(s, shard);
+	}
+}
+
+/*
+ * fill one shard of four with sequential keys and rebalance them by size until they are even,
+ * each move a split of one shard's tree and a concatenation onto its neighbour's. Each move
+ * is first made to run out of memory at every allocation of the trees, and must then leave
+ * the shards as they were.
+ */
+static void check_shards(void)
+{
+	unsigned long keys = sequential_keys(ORDER < 64 ? 4 : 2);
+	lkey_t bounds[3] = { keys, 2 * keys, 3 * keys };
+	bplus_shards_t s = bplus_shards_new(4, bounds, 0);
+	struct model m;
+	unsigned moves = 0;
+
+	CHECK(s != NULL);
+	model_init(&m, keys);
+	for (lkey_t k = 0; k < keys; k++) {
+		CHECK(bplus_shards_insert(s, k, k) == OK);
+		model_put(&m, k, k, NEVER);
+	}
+	for (;;) {
+		enum bplus_error ok;
+		/* with more and more allocations allowed, so every step of the handoff runs out */
+		for (long left = 0;; left++) {
+			allocs_left = left;
+			ok = bplus_shards_rebalance(s, BPLUS_SHARDS_BY_SIZE, 0.1);
+			allocs_left = -1;
+			if (ok != NOMEM)
+				break;
+			check_shards_hold(s, &m);
+		}
+		if (ok != OK)
+			break;
+		moves += 1;
+		CHECK(moves < 100);
+		check_shards_hold(s, &m);
+	}
+	for (lkey_t k = 0; k < keys; k++) {
+		value_t v;
+		CHECK(bplus_shards_find(s, k, &v) == OK && v == k);
+	}
+	bplus_shards_free(s);
+	model_free(&m);
+	printf("rebalance shards by size, %lu records in %u moves: ok\n", keys, moves);
+}
+
+/* ship what the leader has to the follower, a frame at a time, applying each as it is sent */
+static void replicate(bplus_leader_t l, bplus_follower_t f)
+{
+	struct bplus_replica_stats ls, fs;
+	enum bplus_error ok;
+	do {
+		ok = bplus_leader_ship(l, 1024);
+		CHECK(ok == OK || ok == INCOMPLETE);
+		bplus_leader_stats(l, &ls);
+		for (bplus_follower_stats(f, &fs); fs.frames < ls.frames; bplus_follower_stats(f, &fs))
+			CHECK(bplus_follower_apply(f) == OK);
+	} while (ok == INCOMPLETE);
+	CHECK(ls.lost == 0 && fs.seq == ls.seq);
+}
+
+/*
+ * replicate a sequentially filled tree of the given depth over a socket, and truncate it at
+ * its first key, at the end of its first leaf and in the middle of its keys, with random
+ * writes in between. The follower replays each truncation, and both trees are checked after
+ * each.
+ */
+static void check_replica(unsigned depth)
+{
+	struct model m;
+	bplus_t b = new_bplus_tree(), t = new_bplus_tree();
+	bplus_leader_t l;
+	bplus_follower_t f;
+	lkey_t k = 0;
+	int fds[2];
+
+	CHECK(b != NULL && t != NULL && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	l = bplus_leader_new(b, fds[0], 16);
+	f = bplus_follower_new(t, fds[1]);
+	CHECK(l != NULL && f != NULL);
+	model_init(&m, sequential_keys(depth));
+	/* fill as fill_sequential() does, in steps the feed holds */
+	for (lkey_t end = ~0UL; k < end;) {
+		for (lkey_t n = k + 16 * ORDER; k < n && k < end; k++) {
+			CHECK(k < m.keys && insert(b, k, k) == OK);
+			model_put(&m, k, k, NEVER);
+			if (b->depth == depth && end == ~0UL)
+				end = k + k / 4;
+		}
+		replicate(l, f);
+	}
+	check_tree(t, &m);
+	lkey_t cuts[3] = { 1, LHALF + 1, k / 2 };
+	for (unsigned i = 0; i < 3; i++) {
+		CHECK(bplus_truncate_before(b, cuts[i]) == OK);
+		for (lkey_t r = 0; r < cuts[i]; r++)
+			model_remove(&m, r);
+		for (unsigned j = 0; j < 1000; j++) {
+			lkey_t r = cuts[i] + rnd(k - cuts[i]);
+			if (rnd(2))
+				op_insert(b, &m, r);
+			else
+				op_delete(b, &m, r);
+		}
+		replicate(l, f);
+		check_tree(b, &m);
+		check_tree(t, &m);
+	}
+	bplus_leader_free(l);
+	bplus_follower_free(f);
+	close(fds[0]);
+	close(fds[1]);
+	free_bplus_tree(b);
+	free_bplus_tree(t);
+	model_free(&m);
+	printf("replicate truncations of a tree of depth %u, %lu records: ok\n", depth, k);
+}
+
+#define HEAT_THREADS 4
+#define HEAT_FINDS 200000
+
+struct heat_reader {
+	bplus_t b;
+	unsigned long keys;
+	unsigned long seed;
+	unsigned long found;
+	unsigned long exported;	/* reads seen by the exports of the last thread */
+};
+
+static void sum_reads(lkey_t lo, lkey_t hi, unsigned long reads, unsigned long writes, void *ctx)
+{
+	*(unsigned long *)ctx += reads;
+}
+
+/* look up random keys, as readers sharing a tree under a read lock do, the last thread exporting too */
+static void *heat_read(void *arg)
+{
+	struct heat_reader *r = arg;
+	for (unsigned long i = 0; i < HEAT_FINDS; i++) {
+		value_t v;
+		lkey_t k = next_random(&r->seed) % r->keys;
+		if (find(r->b, k, &v) == OK && v == k)
+			r->found += 1;
+		if (r->exported != ~0UL && i % 10000 == 0) {
+			r->exported = 0;
+			bplus_heatmap_export(r->b, 4, sum_reads, &r->exported);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * count every lookup of threads reading one tree at once into a heatmap far smaller than its
+ * leaves, so that they race to claim and evict slots. Counts may be lost, but none may be
+ * made up, and none may land on a leaf that was not read.
+ */
+static void check_heat_threads(void)
+{
+	struct heat_reader r[HEAT_THREADS];
+	pthread_t t[HEAT_THREADS];
+	unsigned long keys = 64 * ORDER, reads = 0, found = 0;
+	bplus_t b = new_bplus_tree();
+
+	CHECK(b != NULL);
+	for (lkey_t k = 0; k < keys; k++)
+		CHECK(insert(b, k, k) == OK);
+	CHECK(bplus_heatmap_enable(b, 0, 4) == OK);
+	for (int i = 0; i < HEAT_THREADS; i++) {
+		r[i] = (struct heat_reader){ b, keys, seed + i + 1, 0, i == HEAT_THREADS - 1 ? 0 : ~0UL };
+		CHECK(pthread_create(&t[i], NULL, heat_read, &r[i]) == 0);
+	}
+	for (int i = 0; i < HEAT_THREADS; i++) {
+		pthread_join(t[i], NULL);
+		found += r[i].found;
+	}
+	CHECK(found == HEAT_THREADS * HEAT_FINDS);
+	for (unsigned i = 0; i < 1U << b->heat->slot_bits; i++) {
+		struct heat_slot *s = &b->heat->slots[i];
+		blkp leaf = b->leaves;
+		while (leaf != NULL && leaf != s->leaf)
+			leaf = next_leaf(leaf);
+		CHECK(s->leaf == NULL ? s->reads == 0 : leaf != NULL);
+		CHECK(s->writes == 0);
+		reads += s->reads;
+	}
+	CHECK(reads != 0 && reads <= found);
+	printf("count the lookups of %d threads in a heatmap of %u slots, %lu of %lu counted: ok\n",
+	       HEAT_THREADS, 1U << b->heat->slot_bits, reads, found);
+	free_bplus_tree(b);
+}
+
+/* trees joined with each other: with splits deferred, with expiry times, and with tags */
+#define JOIN_TREES 3
+
+enum join_op { JOIN_INTERSECT, JOIN_UNION, JOIN_DIFFERENCE, JOIN_PAIR };
+
+/* what a join is seen to call its function on */
+struct join_calls {
+	bplus_t *t;
+	const struct model **m;
+	unsigned n;
+	enum join_op op;
+	lkey_t next, hi;	/* keys below next have been reported */
+	unsigned long calls, stop;
+};
+
+/* which of the trees of c hold k, as bits */
+static unsigned long join_present(const struct join_calls *c, lkey_t k)
+{
+	unsigned long present = 0;
+	for (unsigned j = 0; j < c->n; j++)
+		if (model_live(c->t[j], c->m[j], k))
+			present |= 1UL << j;
+	return present;
+}
+
+/* what the join of c should report for a key with the given trees holding it, or 0 for nothing */
+static unsigned long join_wants(const struct join_calls *c, unsigned long present)
+{
+	unsigned long all = (1UL << c->n) - 1;
+	switch (c->op) {
+	case JOIN_UNION:
+		return present;
+	case JOIN_DIFFERENCE:
+		return present == 1 ? 1 : 0;
+	default:
+		return present == all ? all : 0;
+	}
+}
+
+/* the next key from c->next on that the join should report, or hi + 1 if there is none */
+static lkey_t join_next(const struct join_calls *c)
+{
+	lkey_t k = c->next;
+	while (k <= c->hi && k < c->m[0]->keys && join_wants(c, join_present(c, k)) == 0)
+		k++;
+	return k < c->m[0]->keys ? k : c->hi + 1;
+}
+
+static int join_called(lkey_t k, const value_t *vals, unsigned long present, void *ctx)
+{
+	struct join_calls *c = ctx;
+	CHECK(k == join_next(c) && k <= c->hi);
+	CHECK(present == join_wants(c, join_present(c, k)));
+	for (unsigned j = 0; j < c->n; j++)
+		CHECK(!(present >> j & 1) || vals[j] == c->m[j]->val[k]);
+	c->next = k + 1;
+	return ++c->calls == c->stop;
+}
+
+static int join_pair_called(lkey_t k, value_t va, value_t vb, void *ctx)
+{
+	value_t vals[2] = { va, vb };
+	return join_called(k, vals, 3, ctx);
+}
+
+/* run op on the n trees t[j] of models m[j] over lo..hi, checking what it reports */
+static void check_join(enum join_op op, bplus_t *t, const struct model **m, unsigned n, lkey_t lo, lkey_t hi)
+{
+	struct join_calls c = { t, m, n, op, lo, hi, 0, rnd(2) ? ~0UL : 1 + rnd(64) };
+	enum bplus_error ok;
+	switch (op) {
+	case JOIN_INTERSECT:
+		ok = bplus_intersect(t, n, lo, hi, join_called, &c);
+		break;
+	case JOIN_UNION:
+		ok = bplus_union(t, n, lo, hi, join_called, &c);
+		break;
+	case JOIN_DIFFERENCE:
+		ok = bplus_difference(t, n, lo, hi, join_called, &c);
+		break;
+	default:
+		ok = bplus_join(t[0], t[1], lo, hi, join_pair_called, &c);
+		break;
+	}
+	if (c.calls == c.stop)
+		CHECK(ok == INCOMPLETE);
+	else
+		CHECK(ok == OK && (lo > hi || join_next(&c) > hi));
+}
+
+/* a write to tree j of the joins: runs of keys into the third, keys far apart into the second */
+static void join_write(bplus_t b, struct model *m, unsigned j)
+{
+	lkey_t lo = rnd(m->keys), hi;
+	value_t delta = next_random(&rng);
+	/* deletes and adds finish pending splits, so mostly insert */
+	switch (rnd(8)) {
+	default:
+		for (unsigned long n = j == 1 ? rnd(8) : rnd(4 * ORDER); n != 0; n--)
+			op_insert(b, m, j == 2 ? (lo + n) % m->keys : rnd(m->keys));
+		break;
+	case 5:
+		for (unsigned long n = rnd(2 * ORDER); n != 0; n--)
+			op_delete(b, m, j == 2 ? (lo + n) % m->keys : rnd(m->keys));
+		break;
+	case 6:
+		if (b->ttl_page != 0)
+			bplus_set_time(b, b->now + rnd(100));
+		break;
+	case 7:
+		if (b->tag_page == 0)
+			break;
+		hi = lo + rnd(m->keys / 4);
+		CHECK(bplus_range_add(b, lo, hi, delta) == OK);
+		for (lkey_t k = lo; k <= hi && k < m->keys; k++)
+			if (model_live(b, m, k))
+				m->val[k] += delta;
+		break;
+	}
+}
+
+/*
+ * intersections, unions, differences and pair joins of up to three trees in every order,
+ * over ranges that mostly start and end inside leaves, between random writes to the trees.
+ * The first tree is dense and the second sparse, so the others seek over long stretches,
+ * and the third holds runs of keys, so four by four matches find some. The first and third
+ * defer their splits, so their seeks go through splits still pending.
+ */
+static void check_joins(unsigned long keys, unsigned long rounds)
+{
+	const unsigned flags[JOIN_TREES] = {
+		BPLUS_DEFERRED_SPLITS, BPLUS_TTL, BPLUS_RANGE_ADD | BPLUS_DEFERRED_SPLITS,
+	};
+	struct model models[JOIN_TREES];
+	bplus_t trees[JOIN_TREES];
+	unsigned long pending = 0;
+
+	for (unsigned j = 0; j < JOIN_TREES; j++) {
+		trees[j] = new_bplus_tree_opts(flags[j]);
+		CHECK(trees[j] != NULL);
+		model_init(&models[j], keys);
+	}
+	while (models[0].count < keys / 2)
+		op_insert(trees[0], &models[0], rnd(keys));
+	while (models[1].count < keys / 32)
+		op_insert(trees[1], &models[1], rnd(keys));
+	while (models[2].count < keys / 4)
+		join_write(trees[2], &models[2], 2);
+	for (unsigned long r = 0; r < rounds; r++) {
+		unsigned j = rnd(JOIN_TREES);
+		join_write(trees[j], &models[j], j);
+		for (int q = 0; q < 8; q++) {
+			bplus_t t[JOIN_TREES];
+			const struct model *m[JOIN_TREES];
+			enum join_op op = rnd(JOIN_PAIR + 1);
+			unsigned n = op == JOIN_PAIR ? 2 : 1 + rnd(JOIN_TREES);
+			lkey_t lo = rnd(keys), hi = rnd(4) == 0 ? keys : lo + rnd(8 * ORDER);
+			/* a random order of a random choice of the trees */
+			for (unsigned i = 0; i < n; i++) {
+				unsigned pick;
+				do {
+					pick = rnd(JOIN_TREES);
+					for (j = 0; j < i && t[j] != trees[pick]; j++);
+				} while (j < i);
+				t[i] = trees[pick];
+				m[i] = &models[pick];
+			}
+			if (rnd(8) == 0)
+				lo = rnd(2) ? 0 : hi + 1;
+			for (unsigned i = 0; i < n; i++)
+				if (t[i]->npending != 0) {
+					pending++;
+					break;
+				}
+			check_join(op, t, m, n, lo, hi);
+		}
+	}
+	CHECK(pending != 0);
+	for (unsigned j = 0; j < JOIN_TREES; j++) {
+		free_bplus_tree(trees[j]);
+		model_free(&models[j]);
+	}
+	printf("joins of up to %d trees, %lu rounds, %lu joins with splits pending: ok\n", JOIN_TREES, rounds, pending);
+}
+
+/* what bplus_diff() is seen to call its function on */
+struct diff_calls {
+	const struct model *ma, *mb;
+	lkey_t next;		/* keys below next have been reported */
+	unsigned long calls, stop;
+};
+
+static int diff_differs(const struct diff_calls *c, lkey_t k)
+{
+	return c->ma->in[k] != c->mb->in[k] || (c->ma->in[k] && c->ma->val[k] != c->mb->val[k]);
+}
+
+/* the next key from c->next on whose records differ, or the number of keys if there is none */
+static lkey_t diff_next(const struct diff_calls *c)
+{
+	lkey_t k = c->next;
+	while (k < c->ma->keys && !diff_differs(c, k))
+		k++;
+	return k;
+}
+
+static int diff_called(lkey_t k, const value_t *va, const value_t *vb, void *ctx)
+{
+	struct diff_calls *c = ctx;
+	CHECK(k == diff_next(c) && k < c->ma->keys);
+	CHECK((va != NULL) == c->ma->in[k] && (vb != NULL) == c->mb->in[k]);
+	CHECK((va == NULL || *va == c->ma->val[k]) && (vb == NULL || *vb == c->mb->val[k]));
+	c->next = k + 1;
+	return ++c->calls == c->stop;
+}
+
+/* put k with value v, expiring at time e if b keeps expiry times, in b and m */
+static void diff_put(bplus_t b, struct model *m, lkey_t k, value_t v, unsigned long e)
+{
+	if (b->ttl_page != 0 && e != NEVER) {
+		CHECK(bplus_insert_ttl(b, k, v, e) == OK);
+	} else {
+		CHECK(insert(b, k, v) == OK);
+		e = NEVER;
+	}
+	model_put(m, k, v, e);
+}
+
+/* a write to b that makes it differ from or agree with the other tree of a diff */
+static void diff_write(bplus_t b, struct model *m, const struct model *other)
+{
+	lkey_t lo = rnd(m->keys), hi = lo + rnd(2 * ORDER);
+	value_t delta = next_random(&rng);
+	switch (rnd(4)) {
+	case 0:
+		diff_put(b, m, lo, next_random(&rng), b->now + 1 + rnd(2000));
+		break;
+	case 1:
+		op_delete(b, m, lo);
+		break;
+	case 2:
+		/* take the other tree's records in lo..hi, the expiry times as well */
+		for (lkey_t k = lo; k <= hi && k < m->keys; k++)
+			if (other->in[k])
+				diff_put(b, m, k, other->val[k], other->expiry[k]);
+			else if (m->in[k])
+				op_delete(b, m, k);
+		break;
+	case 3:
+		if (b->tag_page == 0)
+			break;
+		CHECK(bplus_range_add(b, lo, hi, delta) == OK);
+		for (lkey_t k = lo; k <= hi && k < m->keys; k++)
+			if (m->in[k])
+				m->val[k] += delta;
+		break;
+	}
+}
+
+/* check bplus_range_hash() over lo..hi of a and b against the records of their models */
+static int check_range_hash(bplus_t a, const struct model *ma, bplus_t b, const struct model *mb,
+			    lkey_t lo, lkey_t hi)
+{
+	unsigned long ha = 0, hb = 0;
+	int equal = 1;
+	for (lkey_t k = lo; k <= hi && k < ma->keys; k++) {
+		ha += ma->in[k] ? record_hash(k, ma->val[k]) : 0;
+		hb += mb->in[k] ? record_hash(k, mb->val[k]) : 0;
+		equal &= ma->in[k] == mb->in[k] && (!ma->in[k] || ma->val[k] == mb->val[k]);
+	}
+	CHECK(bplus_range_hash(a, lo, hi) == (a->hash_page != 0 && lo <= hi ? ha : 0));
+	CHECK(bplus_range_hash(b, lo, hi) == (b->hash_page != 0 && lo <= hi ? hb : 0));
+	/* the same records hash the same, in trees shaped by inserts in different orders */
+	if (equal && a->hash_page != 0 && b->hash_page != 0)
+		CHECK(bplus_range_hash(a, lo, hi) == bplus_range_hash(b, lo, hi));
+	return equal && lo <= hi;
+}
+
+/*
+ * diffs and range hashes of pairs of trees holding the same records, one filled in key order
+ * and the other in a random order, then written to apart and brought back together a range at
+ * a time. With hashes on both, diffs skip the subtrees that match, on one they compare every
+ * record. Splits left pending on one tree are finished by the diff, on the other followed.
+ */
+static void check_diff(unsigned long keys, unsigned long rounds, unsigned long steps)
+{
+	const unsigned pairs[][2] = {
+		{ BPLUS_MERKLE, BPLUS_MERKLE },
+		{ BPLUS_MERKLE | BPLUS_TTL | BPLUS_DEFERRED_SPLITS, BPLUS_MERKLE | BPLUS_ZONEMAP | BPLUS_DEFERRED_SPLITS },
+		{ BPLUS_MERKLE, 0 },
+		{ BPLUS_RANGE_ADD, BPLUS_DEFERRED_SPLITS },
+	};
+	const unsigned npairs = sizeof(pairs) / sizeof(pairs[0]);
+	lkey_t *order = malloc(keys * sizeof(*order));
+	unsigned long equal = 0;
+
+	CHECK(order != NULL);
+	for (unsigned long r = 0; r < rounds; r++) {
+		int swap = r / npairs % 2;
+		bplus_t a = new_bplus_tree_opts(pairs[r % npairs][swap]);
+		bplus_t b = new_bplus_tree_opts(pairs[r % npairs][!swap]);
+		struct model ma, mb;
+		unsigned long n = 0;
+
+		CHECK(a != NULL && b != NULL);
+		model_init(&ma, keys);
+		model_init(&mb, keys);
+		for (lkey_t k = 0; k < keys; k++)
+			if (rnd(2))
+				diff_put(a, &ma, order[n++] = k, next_random(&rng), rnd(4) ? NEVER : 1 + rnd(2000));
+		for (unsigned long i = n; i > 1; i--) {
+			unsigned long j = rnd(i);
+			lkey_t k = order[j];
+			order[j] = order[i - 1];
+			order[i - 1] = k;
+		}
+		for (unsigned long i = 0; i < n; i++)
+			diff_put(b, &mb, order[i], ma.val[order[i]], ma.expiry[order[i]]);
+		for (unsigned long i = 0; i < steps; i++) {
+			struct diff_calls c = { &ma, &mb, 0, 0, rnd(4) ? ~0UL : 1 + rnd(16) };
+			enum bplus_error ok;
+			for (unsigned long w = 1 + rnd(8); w != 0; w--) {
+				if (rnd(2))
+					diff_write(a, &ma, &mb);
+				else
+					diff_write(b, &mb, &ma);
+			}
+			ok = bplus_diff(a, b, diff_called, &c);
+			if (c.calls == c.stop)
+				CHECK(ok == INCOMPLETE);
+			else
+				CHECK(ok == OK && diff_next(&c) == keys);
+			for (int q = 0; q < 8; q++) {
+				lkey_t lo = rnd(8) == 0 ? 0 : rnd(keys);
+				lkey_t hi = rnd(8) == 0 ? ~0UL : lo + rnd(8 * ORDER) - 4 * ORDER;
+				equal += check_range_hash(a, &ma, b, &mb, lo, hi);
+			}
+		}
+		check_tree(a, &ma);
+		check_tree(b, &mb);
+		free_bplus_tree(a);
+		free_bplus_tree(b);
+		model_free(&ma);
+		model_free(&mb);
+	}
+	free(order);
+	CHECK(equal != 0);
+	printf("diffs of %lu pairs of trees, %lu steps each, %lu equal ranges: ok\n", rounds, steps, equal);
+}
+
+/* reads of a multi-version store held open at once, each with a copy of what it should see */
+#define MVCC_READS 4
+
+struct mvcc_read {
+	unsigned long ts;	/* 0 if not active */
+	unsigned char *in;
+	value_t *val;
+};
+
+struct mvcc_scan {
+	const struct mvcc_read *r;
+	lkey_t next;		/* key after the last one seen */
+	unsigned long seen, stop;
+};
+
+static int mvcc_scanned(lkey_t k, value_t v, void *ctx)
+{
+	struct mvcc_scan *s = ctx;
+	CHECK(k >= s->next && s->r->in[k] && s->r->val[k] == v);
+	for (lkey_t j = s->next; j < k; j++)
+		CHECK(!s->r->in[j]);
+	s->next = k + 1;
+	return ++s->seen == s->stop;
+}
+
+/* the store holds what r saw at its start, for gets of a few keys and a scan of a range */
+static void mvcc_check_read(bplus_mvcc_t m, const struct mvcc_read *r, unsigned long keys)
+{
+	struct mvcc_scan s = { r, rnd(keys), 0, rnd(2) ? ~0UL : 1 + rnd(100) };
+	lkey_t hi = s.next + rnd(keys - s.next);
+	for (int i = 0; i < 8; i++) {
+		lkey_t k = rnd(keys);
+		value_t v;
+		CHECK(bplus_mvcc_get(m, k, r->ts, &v) == (r->in[k] ? OK : NOTFOUND));
+		CHECK(!r->in[k] || v == r->val[k]);
+	}
+	bplus_mvcc_scan(m, s.next, hi, r->ts, mvcc_scanned, &s);
+	if (s.seen != s.stop)
+		for (lkey_t j = s.next; j <= hi; j++)
+			CHECK(!r->in[j]);
+}
+
+/*
+ * random puts and deletes on a multi-version store, with up to MVCC_READS reads begun and
+ * ended among them, each compared after every write with a copy of the records taken when it
+ * began. The reads keep deleted versions in the chains for pruning to get past, and end in
+ * any order, so the oldest read is worked out again now and then. Versions hidden from every
+ * read are counted against what the oldest can still see, and must all be gone when no read
+ * is left.
+ */
+static void check_mvcc(unsigned long ops)
+{
+	const unsigned long keys = 1000;
+	bplus_mvcc_t m = bplus_mvcc_new();
+	struct mvcc_read cur, reads[MVCC_READS];
+	unsigned long *commit = calloc(ops, sizeof(unsigned long));
+	unsigned long ncommits = 0, nkeys, nversions, live = 0, last = 1;
+
+	CHECK(m != NULL && commit != NULL);
+	cur.in = calloc(keys, 1);
+	cur.val = calloc(keys, sizeof(value_t));
+	CHECK(cur.in != NULL && cur.val != NULL);
+	for (int i = 0; i < MVCC_READS; i++) {
+		reads[i].ts = 0;
+		reads[i].in = malloc(keys);
+		reads[i].val = malloc(keys * sizeof(value_t));
+		CHECK(reads[i].in != NULL && reads[i].val != NULL);
+	}
+	for (unsigned long op = 0; op < ops; op++) {
+		struct mvcc_read *r = &reads[rnd(MVCC_READS)];
+		lkey_t k = rnd(keys);
+		value_t v = next_random(&rng);
+		unsigned long ts, bound, oldest = ~0UL;
+		switch (rnd(8)) {
+		case 0:
+		case 1:
+		case 2:
+			CHECK(bplus_mvcc_put(m, k, v, &ts) == OK);
+			live += !cur.in[k];
+			cur.in[k] = 1;
+			cur.val[k] = v;
+			CHECK(ts > last);
+			last = commit[ncommits++] = ts;
+			break;
+		case 3:
+		case 4:
+			if (!cur.in[k]) {
+				CHECK(bplus_mvcc_delete(m, k, &ts) == NOTFOUND);
+				break;
+			}
+			CHECK(bplus_mvcc_delete(m, k, &ts) == OK);
+			live -= 1;
+			cur.in[k] = 0;
+			CHECK(ts > last);
+			last = commit[ncommits++] = ts;
+			break;
+		case 5:
+			/* reads begun with no commit between them share a timestamp */
+			if (r->ts == 0) {
+				r->ts = bplus_mvcc_begin_read(m);
+				CHECK(r->ts == last);
+				memcpy(r->in, cur.in, keys);
+				memcpy(r->val, cur.val, keys * sizeof(value_t));
+			}
+			break;
+		case 6:
+			if (r->ts != 0) {
+				bplus_mvcc_end_read(m, r->ts);
+				r->ts = 0;
+			}
+			break;
+		case 7:
+			/* once through, so every chain is pruned as far as the oldest read lets it */
+			while (bplus_mvcc_gc(m, 1 + rnd(2 * keys)) == INCOMPLETE);
+			CHECK(bplus_mvcc_gc(m, ~0UL) == OK);
+			for (int i = 0; i < MVCC_READS; i++)
+				if (reads[i].ts != 0 && reads[i].ts < oldest)
+					oldest = reads[i].ts;
+			/* a version per key as of the oldest read, and those committed since */
+			bplus_mvcc_stats(m, &nkeys, &nversions);
+			bound = nkeys;
+			for (unsigned long i = 0; i < ncommits; i++)
+				bound += commit[i] > oldest;
+			CHECK(nkeys >= live && nversions <= bound);
+			break;
+		}
+		for (int i = 0; i < MVCC_READS; i++)
+			if (reads[i].ts != 0)
+				mvcc_check_read(m, &reads[i], keys);
+		cur.ts = last;
+		mvcc_check_read(m, &cur, keys);
+	}
+	for (int i = 0; i < MVCC_READS; i++) {
+		if (reads[i].ts != 0)
+			bplus_mvcc_end_read(m, reads[i].ts);
+		free(reads[i].in);
+		free(reads[i].val);
+	}
+	/* with no read left, only the live records' newest versions stay, and no deletion */
+	CHECK(bplus_mvcc_gc(m, ~0UL) == OK);
+	bplus_mvcc_stats(m, &nkeys, &nversions);
+	CHECK(nkeys == live && nversions == live);
+	mvcc_check_read(m, &cur, keys);
+	bplus_mvcc_free(m);
+	free(cur.in);
+	free(cur.val);
+	free(commit);
+	printf("multi-version store, %lu writes with up to %d reads open: ok\n", ncommits, MVCC_READS);
+}
+
+/*
+ * a shared tree is in every process's memory, so it must refuse what would hang one
+ * process's memory off it
+ */
+static void check_shared_refuses(void)
+{
+	char name[64];
+	bplus_shared_t s;
+	bplus_cdc_t f = bplus_cdc_new(4);
+	bplus_t b;
+
+	snprintf(name, sizeof(name), "/bplus_check_%d", (int)getpid());
+	s = bplus_shared_create(name, 1UL << 20, 0);
+	CHECK(s != NULL && f != NULL);
+	b = bplus_shared_tree(s);
+	bplus_shared_lock(s, 1);
+	CHECK(insert(b, 1, 1) == OK);
+	CHECK(bplus_index_new(b) == NULL);
+	CHECK(bplus_cdc_attach(b, f) == NOMEM && b->cdc == NULL);
+	CHECK(bplus_heatmap_enable(b, 0, 4) == NOMEM);
+	CHECK(bplus_leader_new(b, -1, 4) == NULL);
+	CHECK(insert(b, 2, 2) == OK);
+	bplus_shared_unlock(s);
+	bplus_shared_close(s);
+	CHECK(bplus_shared_unlink(name) == OK);
+	bplus_cdc_free(f);
+	printf("shared trees refuse indexes, feeds and heatmaps: ok\n");
+}
+
+static void usage(const char *cmd_name)
+{
+	fprintf(stderr, "usage: %s [-s seed] [-n operations]\n"
+		"  -s  seed of the random operations (default from the time)\n"
+		"  -n  operations per set of tree flags (default 4000)\n",
+		cmd_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd_name = basename(argv[0]);
+	unsigned flags[] = {
+		0, BPLUS_DEFERRED_SPLITS, BPLUS_TTL, BPLUS_MERKLE, BPLUS_ZONEMAP, BPLUS_RANGE_ADD,
+		BPLUS_TTL | BPLUS_MERKLE | BPLUS_ZONEMAP | BPLUS_DEFERRED_SPLITS,
+		BPLUS_RANGE_ADD | BPLUS_TTL | BPLUS_DEFERRED_SPLITS,
+	};
+	unsigned long ops = 4000;
+	/* enough keys for trees of depth 2 when half of them are in */
+	unsigned long keys = ORDER == 256 ? 200000 : 1000 * ORDER;
+	int opt;
+
+	seed = time(NULL);
+	while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+		switch (opt) {
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(cmd_name);
+		}
+	}
+	rng = seed | 1;
+	printf("ORDER %d, seed %lu\n", ORDER, seed);
+
+	check_truncate_edges(2);
+	check_truncate_edges(3);
+	check_split_edges(2);
+	check_split_edges(3);
+	check_copy_nomem(ORDER < 64 ? 3 : 2);
+	check_shards();
+	check_replica(2);
+	check_replica(3);
+	check_heat_threads();
+	check_shared_refuses();
+	check_mvcc(20 * ops);
+	check_joins(keys, ops / 4);
+	check_diff(keys, 8, ops / 64);
+	for (unsigned i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+		check_random(flags[i], 0, keys, ops);
+	/* an index makes splits, concatenations and range updates go a record at a time */
+	check_random(0, 1, keys, ops);
+	check_random(BPLUS_TTL | BPLUS_MERKLE | BPLUS_ZONEMAP | BPLUS_DEFERRED_SPLITS, 1, keys, ops);
+	check_random(BPLUS_RANGE_ADD | BPLUS_TTL, 1, keys, ops);
+	return 0;
+}